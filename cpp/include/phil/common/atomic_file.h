@@ -0,0 +1,57 @@
+#pragma once
+
+#include <functional>
+#include <ostream>
+#include <string>
+
+namespace phil {
+
+/**
+ * A file that is written under a temporary name next to its final one, and only renamed into place by Commit. A reader
+ * never sees a partial file, and a failed write leaves whatever was already at the final name alone.
+ * The temporary is removed if the AtomicFile is destroyed without being committed.
+ */
+class AtomicFile {
+ public:
+  /**
+   * @param filename where the file ends up. The temporary keeps its extension, since some writers choose the format
+   * from it.
+   */
+  explicit AtomicFile(const std::string &filename);
+
+  ~AtomicFile();
+
+  AtomicFile(const AtomicFile &) = delete;
+
+  AtomicFile &operator=(const AtomicFile &) = delete;
+
+  /**
+   * @return the name to write to until Commit
+   */
+  const std::string &TmpFilename() const;
+
+  /**
+   * Renames the temporary over the final file. Any stream writing to it must already be closed.
+   * @return false if the rename failed, in which case the temporary is removed
+   */
+  bool Commit();
+
+  /**
+   * Removes the temporary and leaves the final file untouched
+   */
+  void Abort();
+
+ private:
+  std::string filename;
+  std::string tmp_filename;
+  bool done;
+};
+
+/**
+ * Writes a whole binary file through an AtomicFile
+ * @param write writes the contents to the stream it's given, and returns false to give up without replacing the file
+ * @return false if the file couldn't be opened, written or renamed, or write returned false
+ */
+bool WriteFileAtomically(const std::string &filename, const std::function<bool(std::ostream &)> &write);
+
+} // end namespace
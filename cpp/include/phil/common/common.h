@@ -1,6 +1,9 @@
 #pragma once
 
+#include <array>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <ostream>
 
 #include <llvm/StringRef.h>
@@ -25,6 +28,73 @@ struct pose_t {
   double theta;
 };
 
+/**
+ * Everything phil_main publishes about its estimate each cycle. It is sent as one number array under kPoseKey,
+ * so a reader never sees fields from two different iterations.
+ */
+struct pose_record_t {
+  double x;
+  double y;
+  double theta;
+  double vx;
+  double vy;
+  double omega;
+  double var_x;
+  double var_y;
+  double var_theta;
+  double stamp_s; // time of the newest sensor data in the estimate, on the co-processor clock
+  double seq; // incremented once per published estimate
+  double query_id; // query_id of the pose_query_t this answers, 0 when published
+};
+
+constexpr size_t kPoseRecordLength = sizeof(pose_record_t) / sizeof(double);
+static_assert(kPoseRecordLength * sizeof(double) == sizeof(pose_record_t), "pose_record_t must only contain doubles");
+
+/**
+ * Request sent to kPoseQueryPort. phil_main answers with a pose_record_t, whose seq is negative if there is no
+ * estimate for that time. The answer to a query that timed out can arrive during the next one, so clients give each
+ * query a new id and skip answers with a different one.
+ */
+struct pose_query_t {
+  double time_s; // on the co-processor clock, 0 means the latest estimate
+  double query_id; // copied into the answer
+};
+
+inline std::array<double, kPoseRecordLength> PackPoseRecord(const pose_record_t &record) {
+  std::array<double, kPoseRecordLength> packed{};
+  std::memcpy(packed.data(), &record, sizeof(record));
+  return packed;
+}
+
+/**
+ * @param data the number array read from network tables
+ * @param size number of elements in data
+ * @param record filled in if data is a complete record
+ * @return false if data is not a complete pose record, in which case record is untouched
+ */
+inline bool UnpackPoseRecord(const double *data, size_t size, pose_record_t *record) {
+  if (size != kPoseRecordLength) {
+    return false;
+  }
+  std::memcpy(record, data, sizeof(*record));
+  return true;
+}
+
+/**
+ * 64 bit FNV-1a hash, for keying on-disk caches. Not cryptographic.
+ * @param data bytes to hash
+ * @param size number of bytes
+ * @param hash pass a previous result to hash several buffers as if they were one
+ */
+inline uint64_t fnv1a(const void *data, size_t size, uint64_t hash = 14695981039346656037ull) {
+  const auto *bytes = static_cast<const uint8_t *>(data);
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
 /**
  * Computes shortest angle between two angles yaw1 - yaw2 safely, such that yaw_diff_rad(0.1,2*M_PI - 0.1) == 0.2.
  *
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <vector>
+
+#include <aruco/aruco.h>
+#include <opencv2/core.hpp>
+
+namespace phil {
+
+struct corner_tracker_config_t {
+  unsigned int max_tracked_frames;  // frames to track between detections while the robot isn't turning
+  double halving_yaw_rate;          // every this many rad/s halves the frames tracked between detections
+  double max_flow_error_px;         // corners that don't track back to where they started are lost
+  double max_reprojection_error_px; // tracked markers whose pose doesn't explain them this well are detected again
+};
+
+const corner_tracker_config_t kDefaultCornerTrackerConfig{8, 0.5, 1.0, 2.0};
+
+/**
+ * Fits the map to camera transform to the markers on their own, without any state carried over from earlier frames
+ * @param markers detected or tracked markers. Ones that aren't in the map are skipped.
+ * @param map marker map in meters
+ * @param rt set to the map to camera transform (4x4, CV_64F)
+ * @return false if none of the markers are in the map or the fit failed
+ */
+bool SolveMapPose(const std::vector<aruco::Marker> &markers,
+                  const aruco::MarkerMap &map,
+                  const aruco::CameraParameters &camera_params,
+                  cv::Mat *rt);
+
+/**
+ * RMS distance between the corners of markers and where their corners in the map project to
+ * @param markers detected or tracked markers. Ones that aren't in the map are skipped.
+ * @param map marker map in meters
+ * @param rt map to camera transform (4x4)
+ * @return the error in pixels, or 0 if none of the markers are in the map
+ */
+double ReprojectionErrorPx(const std::vector<aruco::Marker> &markers,
+                           const aruco::MarkerMap &map,
+                           const aruco::CameraParameters &camera_params,
+                           const cv::Mat &rt);
+
+/**
+ * Follows the corners of detected markers into the next frames with pyramidal Lucas-Kanade, which is much cheaper
+ * than detecting them again. Tracking drifts and can't find markers that come into view, so the markers should be
+ * detected again every few frames, and more often the faster the camera turns.
+ */
+class CornerTracker {
+ public:
+  explicit CornerTracker(const corner_tracker_config_t &config);
+
+  /**
+   * Starts tracking markers from the frame they were detected in
+   * @param frame 8 bit, gray or color
+   */
+  void Reset(const cv::Mat &frame, const std::vector<aruco::Marker> &markers);
+
+  /**
+   * Stops tracking, so the next frame is detected
+   */
+  void Invalidate();
+
+  /**
+   * @param yaw_rate how fast the robot is turning, in rad/s
+   * @return true if the markers should be detected in the next frame instead of tracked
+   */
+  bool NeedsDetection(double yaw_rate) const;
+
+  /**
+   * @param yaw_rate how fast the robot is turning, in rad/s
+   * @return how many frames to track after each detection
+   */
+  unsigned int TrackedFrames(double yaw_rate) const;
+
+  /**
+   * Tracks the markers from the previous frame into this one. Markers with any corner lost are dropped.
+   * @param frame the same size and type as the frame given to Reset
+   * @param markers set to the markers with their corners moved to this frame
+   * @return false if every marker was lost
+   */
+  bool Track(const cv::Mat &frame, std::vector<aruco::Marker> *markers);
+
+ private:
+  corner_tracker_config_t config;
+  unsigned int tracked_frames;
+  cv::Mat previous_frame;
+  std::vector<aruco::Marker> markers;
+  std::vector<cv::Point2f> corners;
+  std::vector<cv::Point2f> tracked;
+  std::vector<cv::Point2f> tracked_back;
+  std::vector<uint8_t> status;
+  std::vector<uint8_t> status_back;
+  std::vector<float> error;
+};
+
+} // end namespace
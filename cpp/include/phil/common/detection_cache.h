@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <aruco/aruco.h>
+#include <opencv2/core.hpp>
+
+namespace phil {
+
+/**
+ * One detected marker as stored in the cache file
+ */
+struct cached_marker_t {
+  int32_t id;
+  int32_t has_pose;  // whether rvec and tvec are set
+  float corners[8];  // x, y of each corner, in aruco's order
+  float rvec[3];
+  float tvec[3];
+};
+
+/**
+ * Identifies a video by its size and the bytes at its start and end, which is enough to tell recordings apart without
+ * reading all of every video
+ * @return 0 if the file can't be read
+ */
+uint64_t VideoFingerprint(const std::string &filename);
+
+/**
+ * Identifies everything else that detection results depend on
+ * @param settings the detector settings, for example the tool, detection mode, dictionary and marker size
+ * @param camera_params the intrinsics the poses were estimated with, after resizing
+ */
+uint64_t DetectionParamsKey(const std::string &settings, const aruco::CameraParameters &camera_params);
+
+/**
+ * @return the cache file for a video and parameters within cache_dir
+ */
+std::string DetectionCacheFilename(const std::string &cache_dir, uint64_t video_fingerprint, uint64_t params_key);
+
+/**
+ * Per-frame detections of a whole video, memory mapped from a cache file so replaying them doesn't parse anything.
+ * The file is a header, the index of each frame's first marker, and then fixed size cached_marker_t records.
+ */
+class DetectionCache {
+ public:
+  /**
+   * Maps the cache file if it exists and was written for this video and these parameters
+   */
+  DetectionCache(const std::string &filename, uint64_t video_fingerprint, uint64_t params_key);
+
+  ~DetectionCache();
+
+  DetectionCache(const DetectionCache &) = delete;
+
+  DetectionCache &operator=(const DetectionCache &) = delete;
+
+  bool IsOpen() const;
+
+  size_t NumFrames() const;
+
+  /**
+   * @return size of the frames the detections were made on
+   */
+  cv::Size FrameSize() const;
+
+  /**
+   * @param frame index of the frame in the video
+   * @param marker_size side of the markers, to set on the returned markers
+   * @return the markers detected in the frame, with their corners and, if it was estimated, their pose
+   */
+  std::vector<aruco::Marker> Markers(size_t frame, float marker_size) const;
+
+ private:
+  int fd;
+  void *data;
+  size_t size;
+  size_t num_frames;
+  cv::Size frame_size;
+  const uint32_t *frame_begins;
+  const cached_marker_t *markers;
+};
+
+/**
+ * Collects the detections of every frame of a video, in order, and writes them as a cache file for DetectionCache
+ */
+class DetectionCacheWriter {
+ public:
+  DetectionCacheWriter(uint64_t video_fingerprint, uint64_t params_key, const cv::Size &frame_size);
+
+  /**
+   * @param markers the detections of the next frame. Their pose is stored too if Rvec and Tvec are set.
+   */
+  void AddFrame(const std::vector<aruco::Marker> &markers);
+
+  size_t NumFrames() const;
+
+  /**
+   * @return false if the file couldn't be written
+   */
+  bool Save(const std::string &filename) const;
+
+ private:
+  uint64_t video_fingerprint;
+  uint64_t params_key;
+  cv::Size frame_size;
+  std::vector<uint32_t> frame_begins;
+  std::vector<cached_marker_t> markers;
+};
+
+} // end namespace
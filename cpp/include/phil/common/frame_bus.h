@@ -0,0 +1,139 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+namespace phil {
+
+struct Frame {
+  cv::Mat image;
+  std::vector<uint8_t> encoded; // the frame as the camera sent it (JPEG or YUYV), if the capture keeps it
+  uint64_t capture_time_us; // as returned by cs::CvSink::GrabFrame
+  uint64_t seq;             // incremented for every published frame, so consumers can tell if they skipped any
+};
+
+/**
+ * Frames are shared between every consumer, so they are read-only. A consumer that wants to draw on a frame must copy
+ * it first.
+ */
+using FramePtr = std::shared_ptr<const Frame>;
+
+class FrameBus;
+
+/**
+ * A consumer's queue of frames. If the consumer falls behind, the oldest frames in its queue are dropped, which
+ * returns them to the pool once no other consumer holds them.
+ */
+class FrameSubscription {
+ public:
+  /**
+   * Waits for the next frame
+   * @param timeout_s how long to wait, 0 to not wait at all
+   * @return the frame, or nullptr if the timeout expired or the bus stopped
+   */
+  FramePtr Next(double timeout_s);
+
+  /**
+   * @return number of frames dropped because this queue was full
+   */
+  size_t Dropped() const;
+
+ private:
+  friend class FrameBus;
+
+  FrameSubscription(FrameBus *bus, size_t depth);
+
+  void Push(const FramePtr &frame);
+
+  FrameBus *bus;
+  size_t depth;
+  std::deque<FramePtr> queue;
+  size_t dropped;
+};
+
+/**
+ * Distributes frames from a single capture to any number of consumers without copying them. Frames live in a fixed
+ * pool of buffers that are recycled once every consumer has released them, so steady state capture doesn't allocate.
+ */
+class FrameBus {
+ public:
+  /**
+   * @param pool_size number of buffers. It should be at least the sum of every subscription's depth plus two, one
+   *        being filled by the capture and one being used by a consumer.
+   */
+  explicit FrameBus(size_t pool_size);
+
+  ~FrameBus();
+
+  /**
+   * Subscriptions should all be made before the capture starts
+   * @param depth the most frames to queue for this consumer
+   */
+  std::shared_ptr<FrameSubscription> Subscribe(size_t depth = 1);
+
+  /**
+   * Starts a thread that repeatedly grabs frames into pooled buffers and publishes them
+   * @param grab fills the given image, reusing its buffer if it is big enough, and returns the capture time in
+   *        microseconds or 0 on failure. For example: [&sink](cv::Mat &image) { return sink.GrabFrame(image); }
+   */
+  void StartCapture(std::function<uint64_t(cv::Mat &)> grab);
+
+  /**
+   * Same as above, but the grab fills in the whole frame, so it can keep the encoded frame alongside the image
+   */
+  void StartCapture(std::function<uint64_t(Frame &)> grab);
+
+  /**
+   * Stops the capture thread and wakes up every consumer
+   */
+  void Stop();
+
+  /**
+   * @return a free buffer, or nullptr if every buffer is in use
+   */
+  std::shared_ptr<Frame> Acquire();
+
+  /**
+   * Stamps the frame with the next seq and hands it to every subscription
+   * @param frame a buffer from Acquire, filled in. It must not be modified after this.
+   */
+  void Publish(std::shared_ptr<Frame> frame);
+
+  /**
+   * @return frames that couldn't be captured because every buffer was in use
+   */
+  size_t Starved() const;
+
+ private:
+  friend class FrameSubscription;
+
+  /**
+   * Shared with the deleters of outstanding frames, so a frame released after the bus is destroyed doesn't touch freed
+   * memory.
+   */
+  struct pool_t {
+    std::mutex lock;
+    std::vector<std::unique_ptr<Frame>> buffers;
+    std::vector<Frame *> free;
+  };
+
+  std::shared_ptr<pool_t> pool;
+  std::mutex lock;
+  std::condition_variable published;
+  std::vector<std::shared_ptr<FrameSubscription>> subscriptions;
+  uint64_t seq;
+  bool stopped;
+  std::atomic<size_t> starved;
+  std::thread capture_thread;
+};
+
+} // end namespace
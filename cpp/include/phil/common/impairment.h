@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <phil/common/udp.h>
+
+namespace phil {
+
+enum class DelayDistribution {
+  kNormal,       // delay_mean_ms plus gaussian jitter with std dev delay_jitter_ms, clamped at zero
+  kExponential,  // delay_mean_ms plus exponential jitter with mean delay_jitter_ms, which has a long tail like wifi
+};
+
+/**
+ * Describes how a simulated network mistreats packets. The default value is a perfect network.
+ */
+struct impairment_config_t {
+  double loss_rate = 0;          // probability of losing a packet while the channel is good
+  double burst_enter_rate = 0;   // probability per packet of switching from good to bad (Gilbert-Elliott model)
+  double burst_exit_rate = 1;    // probability per packet of switching from bad back to good
+  double burst_loss_rate = 1;    // probability of losing a packet while the channel is bad
+  DelayDistribution delay_distribution = DelayDistribution::kNormal;
+  double delay_mean_ms = 0;
+  double delay_jitter_ms = 0;
+  double reorder_rate = 0;       // probability of holding a packet back behind later ones
+  unsigned int reorder_window = 0; // a held packet is released after this many later packets
+  double duplicate_rate = 0;     // probability of delivering a packet twice
+  unsigned int seed = 0;
+};
+
+struct impaired_packet_t {
+  data_t data;
+  size_t index;    // position of the packet in the original stream
+  double delay_ms; // how long to wait before delivering it
+};
+
+struct impairment_stats_t {
+  size_t pushed = 0;
+  size_t delivered = 0;
+  size_t lost = 0;
+  size_t burst_lost = 0;
+  size_t reordered = 0;
+  size_t duplicated = 0;
+  double total_delay_ms = 0;
+};
+
+/**
+ * Deterministically (for a given seed) drops, delays, reorders, and duplicates a stream of packets.
+ * This doesn't send anything itself, so the replay tools stay in control of pacing and transport.
+ */
+class Impairment {
+ public:
+  explicit Impairment(const impairment_config_t &config);
+
+  /**
+   * Pass the next packet of the stream through the network
+   * @param data the packet
+   * @return the packets that come out of the network as a result, in delivery order. May be empty.
+   */
+  std::vector<impaired_packet_t> Push(const data_t &data);
+
+  /**
+   * Releases every packet still held back for reordering. Call this at the end of the stream.
+   */
+  std::vector<impaired_packet_t> Flush();
+
+  const impairment_stats_t &Stats() const;
+
+  /**
+   * @return a one-line summary of the stats, for printing at the end of a run
+   */
+  std::string Summary() const;
+
+ private:
+  struct held_packet_t {
+    impaired_packet_t packet;
+    unsigned int remaining;
+  };
+
+  double SampleDelay();
+
+  void Deliver(const impaired_packet_t &packet, std::vector<impaired_packet_t> *out);
+
+  impairment_config_t config;
+  std::mt19937 generator;
+  std::uniform_real_distribution<double> uniform;
+  bool bad_channel;
+  size_t index;
+  std::deque<held_packet_t> held;
+  impairment_stats_t stats;
+};
+
+/**
+ * @param name "normal" or "exponential"
+ * @param distribution set if the name is valid
+ * @return false if the name is not recognized
+ */
+bool ParseDelayDistribution(const std::string &name, DelayDistribution *distribution);
+
+} // end namespace
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace phil {
+
+struct imu_sample_t {
+  double raw_acc_x; // G
+  double raw_acc_y;
+  double raw_acc_z;
+  double raw_gyro_x; // deg/s
+  double raw_gyro_y;
+  double raw_gyro_z;
+  double sensor_time_s; // on the IMU's own clock
+  double stamp_s;       // sensor_time_s converted to the co-processor clock
+};
+
+/**
+ * The most the IMU's clock is expected to drift from the co-processor's, in seconds per second
+ */
+constexpr double kMaxClockDrift = 200e-6;
+
+/**
+ * Reads IMU samples on a dedicated thread and buffers them until the main loop drains them.
+ * Each sample is stamped with the sensor's own timestamp, mapped onto the co-processor clock by tracking the smallest
+ * observed (arrival time - sensor time). That minimum is the sample that sat in the serial buffer the shortest, so the
+ * mapping doesn't pick up the jitter of the thread or the serial link. The two clocks drift apart, so the minimum is
+ * allowed to creep up by kMaxClockDrift for every second of sensor time, and a later sample pulls it back down.
+ */
+class ImuSource {
+ public:
+  /**
+   * @param capacity the oldest samples are dropped if the main loop falls this far behind
+   */
+  explicit ImuSource(size_t capacity = 400);
+
+  virtual ~ImuSource();
+
+  void Start();
+
+  void Stop();
+
+  /**
+   * Moves every buffered sample into samples, oldest first
+   * @return the number of samples moved
+   */
+  size_t Drain(std::vector<imu_sample_t> *samples);
+
+  /**
+   * @return how many samples were dropped because the buffer was full
+   */
+  size_t Dropped() const;
+
+ protected:
+  /**
+   * Blocks until the next sample is available. Called repeatedly from the reading thread.
+   * @param sample filled in except for stamp_s
+   * @return false when there will be no more samples
+   */
+  virtual bool Next(imu_sample_t *sample) = 0;
+
+  std::atomic<bool> running;
+
+ private:
+  void Run();
+
+  std::thread thread;
+  std::mutex lock;
+  std::deque<imu_sample_t> samples;
+  size_t capacity;
+  std::atomic<size_t> dropped;
+  bool have_offset;
+  double clock_offset_s;
+  double last_sensor_time_s;
+};
+
+/**
+ * Replays a CSV written by record_imu_calibration_data at the pace it was recorded. This stands in for the NavX when
+ * testing on a machine without one.
+ */
+class CsvImuSource : public ImuSource {
+ public:
+  /**
+   * @param filename accl_x,accel_y,accel_z,gyro_x,gyro_y,gyro_z,time with time in milliseconds
+   * @param speed 2 replays twice as fast as recorded, 0 replays without any pauses
+   */
+  explicit CsvImuSource(const std::string &filename, double speed = 1.0);
+
+  ~CsvImuSource() override;
+
+ protected:
+  bool Next(imu_sample_t *sample) override;
+
+ private:
+  struct reader_t;
+
+  std::unique_ptr<reader_t> reader;
+  double speed;
+  bool started;
+  double first_sensor_time_s;
+  double start_time_s;
+};
+
+/**
+ * Creates the source for a NavX connected to this machine, for example on /dev/ttyACM0.
+ * @param rate_hz update rate requested from the NavX, which supports at most 200
+ * @return nullptr if this build doesn't have the NavX driver
+ */
+std::unique_ptr<ImuSource> MakeNavxImuSource(const std::string &device, unsigned int rate_hz = 200);
+
+} // end namespace
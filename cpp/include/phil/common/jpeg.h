@@ -0,0 +1,60 @@
+#pragma once
+
+#include <csetjmp>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include <jpeglib.h>
+#include <opencv2/core.hpp>
+
+namespace phil {
+
+/**
+ * Decodes JPEGs straight to grayscale with libjpeg. Only the luma is decoded, which skips the IDCT, upsampling and
+ * color conversion of both chroma planes, and the image can be scaled down in the DCT domain so most of the IDCT
+ * work is skipped too. Keeps one decompressor for every frame, so it isn't thread safe.
+ */
+class JpegDecoder {
+ public:
+  JpegDecoder();
+
+  ~JpegDecoder();
+
+  JpegDecoder(const JpegDecoder &) = delete;
+
+  JpegDecoder &operator=(const JpegDecoder &) = delete;
+
+  /**
+   * @param scale_denom 1, 2, 4 or 8. The output is the full size divided by this, rounded up.
+   * @param gray the luma, reusing its buffer if it's the right size
+   * @return false if the data isn't a valid JPEG
+   */
+  bool DecodeGray(const uint8_t *data, size_t size, int scale_denom, cv::Mat *gray);
+
+  /**
+   * Decodes part of the luma at full resolution. With libjpeg-turbo, the rows above the region are skipped without
+   * the IDCT and only the blocks around the region's columns are decoded. Otherwise decoding stops after the region.
+   * @param roi in full resolution pixels, clipped to the image
+   * @param gray the region, with (0, 0) corresponding to the clipped roi's top left corner
+   * @return false if the data isn't a valid JPEG or the roi is outside the image
+   */
+  bool DecodeGrayRegion(const uint8_t *data, size_t size, const cv::Rect &roi, cv::Mat *gray);
+
+ private:
+  struct error_manager_t {
+    jpeg_error_mgr pub;
+    std::jmp_buf jump;
+  };
+
+  static void OnError(j_common_ptr cinfo);
+
+  bool Start(const uint8_t *data, size_t size, int scale_denom);
+
+  jpeg_decompress_struct cinfo;
+  error_manager_t error_manager;
+  std::vector<uint8_t> row;
+};
+
+} // end namespace
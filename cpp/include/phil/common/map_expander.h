@@ -0,0 +1,111 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <aruco/aruco.h>
+#include <eigen3/Eigen/Core>
+#include <opencv2/core.hpp>
+
+namespace phil {
+
+struct map_expander_config_t {
+  double marker_size;           // side of the new markers, in meters
+  unsigned int min_observations; // observations of a marker before it can be added
+  double max_corner_std_m;      // largest spread of a corner's observed positions for the marker to be added
+  double min_side_px;           // smaller detections are ignored, since their pose is too ambiguous
+  double outlier_distance_m;    // observations this far from the mean so far are ignored, such as flipped poses
+  size_t max_candidates;        // unmapped markers averaged at once, the least recently seen is dropped beyond this
+};
+
+const map_expander_config_t kDefaultMapExpanderConfig{0.1, 30, 0.01, 40, 0.15, 32};
+
+/**
+ * Grows a marker map while the robot drives. Markers that aren't in the map are located from the camera pose that
+ * the mapped markers give in the same frame, and the position of each corner is averaged over many frames. Once
+ * enough frames agree, the marker is added to the map and the map is saved on a background thread, so detection never
+ * waits on the disk. One expander can be shared by every camera.
+ */
+class MapExpander {
+ public:
+  /**
+   * @param map the starting map, in meters
+   * @param filename where to save the map whenever a marker is added, or empty to not save it
+   */
+  MapExpander(const aruco::MarkerMap &map, const std::string &filename, const map_expander_config_t &config);
+
+  ~MapExpander();
+
+  MapExpander(const MapExpander &) = delete;
+
+  MapExpander &operator=(const MapExpander &) = delete;
+
+  /**
+   * Averages in the unmapped markers of one frame
+   * @param markers every marker detected in the frame. Mapped ones are skipped.
+   * @param rt map to camera transform (4x4) estimated from the mapped markers in the same frame
+   * @param camera_params intrinsics of the camera that made the detections
+   * @return true if a marker was added to the map
+   */
+  bool Observe(const std::vector<aruco::Marker> &markers,
+               const cv::Mat &rt,
+               const aruco::CameraParameters &camera_params);
+
+  /**
+   * @return incremented every time markers are added, so users can tell when their copy of the map is stale
+   */
+  uint64_t Version() const;
+
+  /**
+   * @param version set to the version of the returned map, if not null
+   * @return a copy of the current map
+   */
+  aruco::MarkerMap Map(uint64_t *version = nullptr) const;
+
+ private:
+  /**
+   * Running mean and scatter of the 4 corners of one marker in the map frame, by Welford's method
+   */
+  struct candidate_t {
+    using Corners = Eigen::Matrix<double, 3, 4, Eigen::DontAlign>; // unaligned so it can be stored in a std::map
+    unsigned int n = 0;
+    uint64_t last_seen = 0; // frame the marker was last observed in
+    Corners mean = Corners::Zero();
+    Eigen::Matrix3d scatter[4] = {Eigen::Matrix3d::Zero(), Eigen::Matrix3d::Zero(), Eigen::Matrix3d::Zero(),
+                                  Eigen::Matrix3d::Zero()};
+  };
+
+  bool Converged(const candidate_t &candidate) const;
+
+  /**
+   * Drops the least recently seen candidates until there are at most max_candidates, so markers that were only ever
+   * seen a few times, such as misdetections, don't pile up
+   */
+  void EvictCandidates();
+
+  /**
+   * Replaces the map file through an AtomicFile
+   */
+  void Save(aruco::MarkerMap snapshot) const;
+
+  map_expander_config_t config;
+  std::string filename;
+  mutable std::mutex lock;
+  aruco::MarkerMap map;
+  uint64_t version;
+  std::map<int, candidate_t> candidates;
+  uint64_t frame; // number of calls to Observe
+
+  std::condition_variable save_requested;
+  bool save_pending;
+  bool done;
+  std::thread save_thread;
+};
+
+} // end namespace
@@ -7,11 +7,17 @@
 namespace phil {
 namespace math {
 
-template<size_t rows, size_t cols>
+template<int rows, int cols>
 class Window : public Eigen::Matrix<double, rows, cols> {
  public:
   Window() : head(0), full(false) {}
 
+  /**
+   * For a window with Eigen::Dynamic rows, whose length is only known at runtime
+   * @param num_rows how many of the most recent rows to keep
+   */
+  explicit Window(Eigen::Index num_rows) : Eigen::Matrix<double, rows, cols>(num_rows, cols), head(0), full(false) {}
+
   /**
    * Over-write the oldest element with new_row
    * @param new_row the new data to insert
@@ -19,7 +25,7 @@ class Window : public Eigen::Matrix<double, rows, cols> {
   void push(Eigen::Vector3d new_row) {
     Eigen::Matrix<double, rows, cols>::row(head) = new_row;
     ++head;
-    if (head >= rows) {
+    if (head >= this->rows()) {
       full = true;
       head = 0;
     }
@@ -30,7 +36,7 @@ class Window : public Eigen::Matrix<double, rows, cols> {
   }
 
  private:
-  size_t head;
+  Eigen::Index head;
   bool full;
 };
 
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace phil {
+
+/**
+ * Reads the JPEGs of an MJPEG over HTTP stream, such as mjpg-streamer's ?action=stream, without decoding them. That
+ * leaves the decoding to the consumer, which can decode only as much as it needs.
+ */
+class MjpegStreamReader {
+ public:
+  /**
+   * @param url for example http://localhost:8081/?action=stream
+   */
+  explicit MjpegStreamReader(const std::string &url);
+
+  ~MjpegStreamReader();
+
+  MjpegStreamReader(const MjpegStreamReader &) = delete;
+
+  MjpegStreamReader &operator=(const MjpegStreamReader &) = delete;
+
+  /**
+   * Waits for the next JPEG, connecting first if needed. Reconnects on the next call after an error.
+   * @param jpeg filled with the JPEG, reusing its buffer
+   * @param timeout_s the longest to wait for any data from the server
+   * @return false on a timeout or error
+   */
+  bool Next(std::vector<uint8_t> *jpeg, double timeout_s);
+
+ private:
+  bool Connect(double timeout_s);
+
+  void Disconnect();
+
+  /**
+   * Reads more from the socket into the buffer
+   */
+  bool Fill(double timeout_s);
+
+  bool ReadLine(std::string *line, double timeout_s);
+
+  std::string host;
+  std::string port;
+  std::string path;
+  int fd;
+  std::vector<uint8_t> buffer;
+  size_t buffer_begin;
+};
+
+} // end namespace
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <aruco/markermap.h>
+#include <opencv2/core.hpp>
+
+#include <phil/common/atomic_file.h>
+
+namespace phil {
+
+enum class PcdFormat {
+  BINARY,            // points one after another, in the order they were added
+  BINARY_COMPRESSED, // all of each field before the next one, LZF compressed the way pcl reads it
+};
+
+/**
+ * Writes a point cloud with x y z rgb fields to a PCD file as the points are generated, so long recordings don't keep
+ * every point in memory. The header is written with room for the number of points and patched when the file is
+ * closed. binary_compressed stores each field contiguously, so those points are spilled to a temporary file and
+ * compressed from there on close, a window at a time.
+ */
+class PcdStreamWriter {
+ public:
+  PcdStreamWriter();
+
+  /**
+   * Closes the file if it's still open
+   */
+  ~PcdStreamWriter();
+
+  PcdStreamWriter(const PcdStreamWriter &) = delete;
+
+  PcdStreamWriter &operator=(const PcdStreamWriter &) = delete;
+
+  /**
+   * Starts writing to a temporary file next to filename, which is moved to filename on close
+   * @return false if the file can't be created
+   */
+  bool Open(const std::string &filename, PcdFormat format);
+
+  /**
+   * @param points x y z and the color packed into a float, the way pcl stores rgb
+   */
+  void AddPoints(const std::vector<cv::Vec4f> &points);
+
+  /**
+   * Adds the outline, direction and id of every marker in the map, in red
+   */
+  void AddMarkerMap(const aruco::MarkerMap &map);
+
+  /**
+   * Adds the outline and direction of the camera, in green
+   * @param rt map to camera transform (4x4), as from MarkerMapPoseTracker::getRTMatrix
+   * @param size width of the square drawn for the camera, in meters
+   */
+  void AddCameraPose(const cv::Mat &rt, float size);
+
+  uint64_t NumPoints() const;
+
+  /**
+   * Patches the header with the number of points, compresses them if needed, and moves the file into place
+   * @return false if anything failed to write, in which case nothing is left at filename
+   */
+  bool Close();
+
+ private:
+  bool Abort();
+
+  std::string filename;
+  std::unique_ptr<AtomicFile> output;
+  std::string spill_filename;
+  PcdFormat format;
+  std::ofstream file;
+  std::ofstream spill;
+  uint64_t num_points;
+};
+
+} // end namespace
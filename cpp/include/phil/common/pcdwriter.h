@@ -2,6 +2,22 @@
 
 #include <map>
 #include <string>
+#include <vector>
 #include <aruco/markermap.h>
 
 void savePCDFile(std::string fpath, const aruco::MarkerMap& ms, std::map<int, cv::Mat> frame_pose_map);
+
+/**
+ * Points along the edges of a polygon and a line out of its center along its normal, all in one color
+ */
+std::vector<cv::Vec4f> getPcdPoints(const std::vector<cv::Point3f>& mpoints, cv::Scalar color, int npoints = 100);
+
+/**
+ * The id of a marker rasterized as points onto the marker
+ */
+std::vector<cv::Vec4f> getMarkerIdPcd(aruco::Marker3DInfo& minfo, cv::Scalar color);
+
+/**
+ * Transforms a point by a 4x4 matrix
+ */
+cv::Point3f mult(const cv::Mat& m, cv::Point3f p);
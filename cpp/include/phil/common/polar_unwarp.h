@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace phil {
+
+struct polar_unwarp_config_t {
+  int src_width;
+  int src_height;
+  size_t src_stride;    // bytes between the starts of two rows of the source
+  size_t src_step;      // bytes between two pixels of the source, 1 for grayscale or 2 for the luma of YUYV
+  float center_x;       // center of the fisheye image circle, in source pixels
+  float center_y;
+  float min_radius;     // the band of the image circle to unwarp. Use a min_radius above 0 to skip the middle of the
+  float max_radius;     // circle, which is usually the ceiling or the floor and can't contain markers.
+  float min_angle_rad;  // the range of angles to unwarp, for example 0 to 2pi for the whole circle
+  float max_angle_rad;
+  int out_width;        // samples along the angle
+  int out_height;       // samples along the radius
+};
+
+/**
+ * Unwarps a band of a fisheye or omnidirectional image into a rectangle, with angle along the columns and radius
+ * along the rows. The first row is max_radius, so the image isn't upside down for a camera pointing up. The lookup
+ * table is computed once, and stores each output pixel as the offset of its top left source pixel plus 7 bit
+ * interpolation weights, which is 6 bytes per pixel instead of the 8 of two float maps and needs no float math per
+ * frame. The interpolation runs 8 pixels at a time with SSE2 or NEON when available.
+ */
+class PolarUnwarper {
+ public:
+  explicit PolarUnwarper(const polar_unwarp_config_t &config);
+
+  /**
+   * @param src the source image, laid out as described by the config
+   * @param dst out_width * out_height bytes. Samples that fall outside the source are 0.
+   */
+  void Unwarp(const uint8_t *src, uint8_t *dst) const;
+
+  /**
+   * Same result as Unwarp, without SIMD
+   */
+  void UnwarpScalar(const uint8_t *src, uint8_t *dst) const;
+
+  int Width() const;
+
+  int Height() const;
+
+ private:
+  void Interpolate(const uint8_t *src, size_t begin, size_t end, uint8_t *dst) const;
+
+  polar_unwarp_config_t config;
+  std::vector<uint32_t> offsets;
+  std::vector<uint8_t> weights_x;
+  std::vector<uint8_t> weights_y;
+  std::vector<uint32_t> outside; // output pixels whose samples aren't within the source
+};
+
+} // end namespace
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <aruco/aruco.h>
+#include <opencv2/core.hpp>
+
+namespace phil {
+
+/**
+ * Finds markers on a downscaled copy of the frame, then refines their corners on the full resolution image.
+ * Thresholding and contour extraction are most of the cost of detection and scale with the number of pixels, so each
+ * pyramid level makes them about four times cheaper. Corner accuracy, which is what the pose depends on, comes from the
+ * full resolution refinement.
+ */
+class PyramidMarkerDetector {
+ public:
+  /**
+   * @param dictionary aruco dictionary name
+   * @param min_side_px smallest marker side length, in pixels at the chosen level, that is still reliably detected
+   * @param max_level never downscale by more than 2^max_level
+   */
+  explicit PyramidMarkerDetector(const std::string &dictionary, double min_side_px = 24, int max_level = 2);
+
+  /**
+   * @param frame the full resolution frame
+   * @param expected_min_side_px side length of the smallest marker expected in the frame, from ExpectedMinSidePx, or
+   *        0 if unknown, in which case the full resolution image is searched
+   * @return markers with corners refined at full resolution
+   */
+  std::vector<aruco::Marker> Detect(const cv::Mat &frame, double expected_min_side_px);
+
+  /**
+   * @return the level the last call to Detect searched on, 0 being full resolution
+   */
+  int Level() const;
+
+  /**
+   * @param projected_markers corners of the markers expected in view, as given by ProjectMarkers
+   * @param frame_size markers entirely outside the frame are ignored
+   * @return the shortest side length among markers at least partly in view, or 0 if there are none
+   */
+  static double ExpectedMinSidePx(const std::vector<std::vector<cv::Point2f>> &projected_markers,
+                                  const cv::Size &frame_size);
+
+ private:
+  int ChooseLevel(double expected_min_side_px) const;
+
+  aruco::MarkerDetector detector;
+  double min_side_px;
+  int max_level;
+  int level;
+  cv::Mat gray;
+  cv::Mat scaled;
+};
+
+} // end namespace
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include <aruco/aruco.h>
+#include <opencv2/core.hpp>
+
+namespace phil {
+
+/**
+ * Writes a pair of remap tables to a binary file, so they don't have to be recomputed at the next startup
+ * @param key identifies what the maps were computed from, checked by LoadRemapCache
+ * @return false if the file couldn't be written
+ */
+bool SaveRemapCache(const std::string &filename, uint64_t key, const cv::Mat &map1, const cv::Mat &map2);
+
+/**
+ * @param key must match the key the file was saved with
+ * @return false if the file doesn't exist, is corrupt, or was saved with a different key
+ */
+bool LoadRemapCache(const std::string &filename, uint64_t key, cv::Mat *map1, cv::Mat *map2);
+
+/**
+ * Removes lens distortion from frames. The remap tables are computed once per calibration and resolution, cached on
+ * disk, and stored in OpenCV's fixed point format (CV_16SC2 integer coordinates plus CV_16UC1 interpolation weights),
+ * which cv::remap processes with its vectorized fixed point kernel. That is much faster than the float maps and
+ * takes a third of the memory.
+ */
+class Rectifier {
+ public:
+  /**
+   * @param camera_params intrinsics of the distorted camera, already resized to the frame size
+   * @param cache_dir where to keep the remap tables, or empty to not cache them
+   */
+  Rectifier(const aruco::CameraParameters &camera_params, const std::string &cache_dir);
+
+  /**
+   * @return intrinsics of the rectified image, which has no distortion
+   */
+  aruco::CameraParameters RectifiedParameters() const;
+
+  /**
+   * @param frame the distorted frame
+   * @param rectified the whole rectified frame, reusing its buffer if it's the right size
+   */
+  void Rectify(const cv::Mat &frame, cv::Mat *rectified) const;
+
+  /**
+   * Only computes part of the rectified frame, which is much cheaper than Rectify when markers cover a small area
+   * @param frame the whole distorted frame
+   * @param roi the region of the rectified frame wanted
+   * @param rectified the region, with (0, 0) corresponding to roi.tl()
+   */
+  void RectifyRoi(const cv::Mat &frame, const cv::Rect &roi, cv::Mat *rectified) const;
+
+  /**
+   * @return true if the tables were read from the cache instead of computed
+   */
+  bool LoadedFromCache() const;
+
+ private:
+  aruco::CameraParameters camera_params;
+  cv::Mat rectified_camera_matrix;
+  cv::Mat map1;
+  cv::Mat map2;
+  bool loaded_from_cache;
+};
+
+} // end namespace
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <aruco/aruco.h>
+#include <opencv2/core.hpp>
+
+#include <phil/common/common.h>
+
+namespace phil {
+
+using FullFrameDetector = std::function<std::vector<aruco::Marker>(const cv::Mat &)>;
+
+/**
+ * Returns the pixels of a region of the frame, for example Rectifier::RectifyRoi
+ */
+using RegionExtractor = std::function<cv::Mat(const cv::Mat &, const cv::Rect &)>;
+
+/**
+ * Predicts where the camera is now from where it was when the map was last seen and how the robot has moved since.
+ * The camera is rigidly attached to the robot and the robot only moves in the plane of the map's x and y axes, so the
+ * robot's motion can be applied to the camera directly without knowing where the camera is mounted.
+ * @param last_rt map to camera transform (4x4) from the last pose estimate
+ * @param last_pose the robot's pose when last_rt was measured
+ * @param pose the robot's pose now
+ * @return the predicted map to camera transform (4x4, CV_64F)
+ */
+cv::Mat PredictRT(const cv::Mat &last_rt, const pose_t &last_pose, const pose_t &pose);
+
+/**
+ * Projects the corners of every marker in the map that is in front of the camera
+ * @param predicted_rt map to camera transform (4x4)
+ * @return the image coordinates of each marker's corners. Some may be outside the frame.
+ */
+std::vector<std::vector<cv::Point2f>> ProjectMarkers(const aruco::MarkerMap &map,
+                                                     const aruco::CameraParameters &camera_params,
+                                                     const cv::Mat &predicted_rt);
+
+/**
+ * Detects markers by only searching around where the map says they should appear, given a predicted camera pose.
+ * The full frame is still searched every full_frame_period frames, whenever there is no prediction, and whenever no
+ * markers are found where they were expected.
+ */
+class RoiMarkerDetector {
+ public:
+  /**
+   * @param map marker map in meters
+   * @param camera_params intrinsics, already resized to the frame size
+   * @param dictionary aruco dictionary name
+   * @param full_frame_detector used for full frame searches
+   * @param full_frame_period search the full frame at least this often, in frames
+   * @param padding_px margin added around each predicted marker, on top of a margin proportional to its size
+   */
+  RoiMarkerDetector(const aruco::MarkerMap &map,
+                    const aruco::CameraParameters &camera_params,
+                    const std::string &dictionary,
+                    FullFrameDetector full_frame_detector,
+                    unsigned int full_frame_period = 15,
+                    int padding_px = 16);
+
+  /**
+   * @param frame the whole frame
+   * @param predicted_rt map to camera transform (4x4) expected for this frame, or an empty Mat if there isn't one
+   * @return markers with corners in full frame coordinates
+   */
+  std::vector<aruco::Marker> Detect(const cv::Mat &frame, const cv::Mat &predicted_rt);
+
+  /**
+   * By default regions are plain views into the frame. Use this to transform only the regions that get searched.
+   */
+  void SetRegionExtractor(RegionExtractor extractor);
+
+  /**
+   * @param map replaces the map regions are predicted from, for example after markers were added to it
+   */
+  void SetMap(const aruco::MarkerMap &map);
+
+  /**
+   * @return the regions searched by the last call to Detect, empty if it searched the full frame
+   */
+  const std::vector<cv::Rect> &Rois() const;
+
+  size_t FullFrameCount() const;
+
+  size_t RoiCount() const;
+
+ private:
+  /**
+   * Projects every marker in the map and returns padded, merged boxes around the ones in view
+   */
+  std::vector<cv::Rect> PredictRois(const cv::Mat &predicted_rt, const cv::Size &frame_size) const;
+
+  std::vector<aruco::Marker> DetectFullFrame(const cv::Mat &frame);
+
+  aruco::MarkerMap map;
+  aruco::CameraParameters camera_params;
+  aruco::MarkerDetector roi_detector;
+  FullFrameDetector full_frame_detector;
+  RegionExtractor region_extractor;
+  unsigned int full_frame_period;
+  int padding_px;
+  unsigned int frames_since_full_frame;
+  size_t full_frame_count;
+  size_t roi_count;
+  std::vector<cv::Rect> rois;
+};
+
+} // end namespace
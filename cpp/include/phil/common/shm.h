@@ -0,0 +1,112 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include <phil/common/udp.h>
+
+namespace phil {
+
+const std::string kShmName("/phil_rio_data");
+
+/**
+ * Number of slots in each direction of the ring. Must be a power of two.
+ */
+constexpr uint32_t kShmRingSize = 64;
+
+/**
+ * The layout of the shared memory segment. There is exactly one producer (the client) and one consumer (the server).
+ * head and replied are also used as futex words, so both sides can sleep instead of spinning.
+ */
+struct shm_ring_t {
+  std::atomic<uint32_t> head;     // number of requests published by the client
+  std::atomic<uint32_t> tail;     // number of requests consumed by the server
+  std::atomic<uint32_t> replied;  // number of replies published by the server
+  data_t requests[kShmRingSize];
+  data_t replies[kShmRingSize];
+};
+
+/**
+ * Receives data_t from a producer on the same machine through a ring buffer in /dev/shm.
+ * This is a drop-in replacement for UDPServer, so the client address returned from Read is always empty.
+ */
+class ShmServer : public Server {
+ public:
+  /**
+   * Creates (or re-initializes) the shared memory segment
+   * @param name name of the segment, must start with a '/'
+   */
+  explicit ShmServer(const std::string &name = kShmName);
+
+  ~ShmServer() override;
+
+  std::pair<ssize_t, struct sockaddr_in> Read(phil::data_t *result) override;
+
+  ssize_t Read() override;
+
+  /**
+   * Replies to the request most recently returned by Read
+   */
+  ssize_t Reply(struct sockaddr_in client, phil::data_t reply) override;
+
+  void SetTimeout(timeval timeout) override;
+
+ private:
+  /**
+   * Waits until there is an unread request
+   * @return false if the timeout expired first
+   */
+  bool WaitForRequest();
+
+  std::string name;
+  shm_ring_t *ring;
+  uint32_t last_read_seq;
+  timeval timeout;
+};
+
+/**
+ * Sends data_t to a ShmServer on the same machine. This is a drop-in replacement for UDPClient.
+ */
+class ShmClient : public Client {
+ public:
+  /**
+   * Opens an existing segment. The ShmServer must be started first.
+   * @param name name of the segment, must start with a '/'
+   */
+  explicit ShmClient(const std::string &name = kShmName);
+
+  ~ShmClient() override;
+
+  data_t Transaction(data_t data) override;
+
+  void SetTimeout(timeval timeout) override;
+
+  /**
+   * Get the next free request slot so the caller can fill it in place, avoiding any copies. A request's reply lands
+   * in the slot with the same index, so a slot stays taken until the reply to it, or to a later request, is read.
+   * @return pointer into shared memory, or nullptr if the ring is full or the segment isn't open
+   */
+  data_t *Claim();
+
+  /**
+   * Makes the slot returned by the last call to Claim visible to the server
+   * @return sequence number of the published request
+   */
+  uint32_t Publish();
+
+  /**
+   * Waits for the reply to a published request. Replies to earlier requests that haven't been read are given up on.
+   * @param seq sequence number returned by Publish
+   * @param reply filled with the reply
+   * @return false if the timeout expired first
+   */
+  bool WaitForReply(uint32_t seq, data_t *reply);
+
+ private:
+  shm_ring_t *ring;
+  uint32_t replies_read; // number of replies read, or given up on by reading a later one
+  timeval timeout;
+};
+
+} // end namespace
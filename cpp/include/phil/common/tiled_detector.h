@@ -0,0 +1,54 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <aruco/aruco.h>
+#include <opencv2/core.hpp>
+
+namespace phil {
+
+/**
+ * Splits a frame into overlapping tiles and detects markers in all of them in parallel, which lowers the latency of a
+ * single frame on a multi-core machine. The overlap must be larger than the biggest marker, so that every marker lies
+ * entirely within at least one tile. Markers found in more than one tile are reported once.
+ */
+class TiledMarkerDetector {
+ public:
+  /**
+   * @param dictionary aruco dictionary name
+   * @param cols number of tiles across
+   * @param rows number of tiles down
+   * @param overlap_px how far each tile extends into its neighbors
+   */
+  TiledMarkerDetector(const std::string &dictionary, int cols = 2, int rows = 2, int overlap_px = 96);
+
+  /**
+   * @param frame the whole frame
+   * @return markers with corners in full frame coordinates
+   */
+  std::vector<aruco::Marker> Detect(const cv::Mat &frame);
+
+  /**
+   * @return the tiles used for a frame of the given size
+   */
+  std::vector<cv::Rect> Tiles(const cv::Size &frame_size) const;
+
+  /**
+   * Removes markers that were detected more than once, keeping the largest detection of each
+   * @param markers detections from every tile, in full frame coordinates
+   */
+  static std::vector<aruco::Marker> Deduplicate(std::vector<aruco::Marker> markers);
+
+ private:
+  int cols;
+  int rows;
+  int overlap_px;
+  // aruco::MarkerDetector keeps per-call state, so every tile needs its own
+  std::vector<std::unique_ptr<aruco::MarkerDetector>> detectors;
+  std::vector<std::vector<aruco::Marker>> tile_markers;
+  cv::Mat gray;
+};
+
+} // end namespace
@@ -11,6 +11,13 @@
 namespace phil {
 
 constexpr uint16_t kPort = 6789;
+constexpr uint16_t kPoseQueryPort = 6790;
+
+/**
+ * data_t goes over UDP and shared memory as raw bytes, so this is bumped whenever its layout changes. Version 2 added
+ * seq, which also made the struct 8 bytes longer, so a RIO built before it can't talk to a newer phil_main.
+ */
+constexpr uint32_t kDataVersion = 2;
 
 struct data_t {
   double world_acc_x;
@@ -25,6 +32,8 @@ struct data_t {
   long navx_t;
   double rio_send_time_s;
   double received_time_s;
+  uint32_t seq; // echoed back in the reply so a client with many requests in flight can match them up
+  uint32_t version; // kDataVersion of the sender, set by the transports
 
   std::string to_string() {
     std::stringstream ss;
@@ -62,35 +71,85 @@ inline double timeval_to_sec(struct timeval tv) {
 constexpr size_t data_t_size = sizeof(data_t);
 extern socklen_t sockaddr_size;
 
-class UDPServer {
+/**
+ * The receiving end of a data_t transport, i.e. phil_main. Implemented over UDP and over shared memory.
+ */
+class Server {
  public:
-  explicit UDPServer(int16_t port_num = kPort);
+  virtual ~Server() = default;
 
   /**
    * Blocks until the next packet is received
    * @param result This functions fills the result pointer with data
    * @return pair of the number of bytes actually received and put in data and the address to respond to
    */
-  std::pair<ssize_t, struct sockaddr_in> Read(phil::data_t *result);
+  virtual std::pair<ssize_t, struct sockaddr_in> Read(phil::data_t *result) = 0;
 
   /**
    * Read but just return how much and don't return the data or socket of the client who sent it
    */
-  ssize_t Read();
+  virtual ssize_t Read() = 0;
+
+  virtual ssize_t Reply(struct sockaddr_in client, phil::data_t reply) = 0;
+
+  /**
+   * Sets the timeout for future calls to Read
+   * @param timeout timeout
+   */
+  virtual void SetTimeout(timeval timeout) = 0;
+};
+
+/**
+ * The sending end of a data_t transport, i.e. the RoboRIO or a replay tool.
+ */
+class Client {
+ public:
+  virtual ~Client() = default;
 
-  ssize_t Reply(struct sockaddr_in client, phil::data_t reply);
+  /**
+   * Sends data and waits for the reply
+   * @return The data you send but now with the server's time stamp in it, or an empty data_t on failure
+   */
+  virtual data_t Transaction(data_t data) = 0;
+
+  /**
+   * Sets the timeout for waiting on replies
+   * @param timeout timeout
+   */
+  virtual void SetTimeout(timeval timeout) = 0;
+};
+
+class UDPServer : public Server {
+ public:
+  explicit UDPServer(int16_t port_num = kPort);
+
+  std::pair<ssize_t, struct sockaddr_in> Read(phil::data_t *result) override;
+
+  ssize_t Read() override;
+
+  ssize_t Reply(struct sockaddr_in client, phil::data_t reply) override;
+
+  /**
+   * Blocks until the next packet of any type is received
+   * @param buffer filled with the packet
+   * @param buffer_size size of buffer in bytes
+   * @return pair of the number of bytes actually received and the address to respond to
+   */
+  std::pair<ssize_t, struct sockaddr_in> RawRead(uint8_t *buffer, size_t buffer_size);
+
+  ssize_t RawReply(struct sockaddr_in client, const uint8_t *reply, size_t reply_size);
 
   /**
    * Sets the timeout for future calls to sendto and recvfrom
    * @param timeout timeout
    */
-  void SetTimeout(timeval timeout);
+  void SetTimeout(timeval timeout) override;
 
  private:
   int socket_fd;
 };
 
-class UDPClient {
+class UDPClient : public Client {
  public:
   explicit UDPClient(const std::string &server_hostname, int port_num = kPort);
 
@@ -98,7 +157,7 @@ class UDPClient {
    * Sends data to TK1. This assumes data has been filled and stamped. This function may block for up to 1 second.
    * @return The data you send the TK1 but now with the TK1 time stamp in it
    */
-  data_t Transaction(data_t data);
+  data_t Transaction(data_t data) override;
 
   /**
    * Blocks until the next packet is received
@@ -108,13 +167,30 @@ class UDPClient {
    */
   ssize_t Read(uint8_t *response, size_t response_size);
 
-  void RawTransaction(uint8_t *request, size_t request_size, uint8_t *response, size_t response_size);
+  /**
+   * Sends request and, if response isn't null, waits for the response
+   * @return the number of bytes received into response
+   */
+  ssize_t RawTransaction(uint8_t *request, size_t request_size, uint8_t *response, size_t response_size);
+
+  /**
+   * Sends data without waiting for the reply. Use Poll and Read to collect replies.
+   * @return the number of bytes sent, or -1 on error
+   */
+  ssize_t Send(data_t data);
+
+  /**
+   * Waits until a reply can be read without blocking
+   * @param timeout how long to wait. Unlike SetTimeout, zero means don't wait at all.
+   * @return false if the timeout expired first
+   */
+  bool Poll(timeval timeout);
 
   /**
    * Sets the timeout for future calls to sendto and recvfrom
    * @param timeout timeout
    */
-  void SetTimeout(timeval timeout);
+  void SetTimeout(timeval timeout) override;
 
   void Connect();
 
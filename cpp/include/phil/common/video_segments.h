@@ -0,0 +1,144 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+namespace phil {
+
+/**
+ * Processes a recorded video on several threads, each decoding and processing its own segment of consecutive frames,
+ * and hands the results back in frame order. Each thread opens the video separately and seeks to the start of its
+ * segment. Segment boundaries are multiples of segment_frames, which are keyframes in the MJPEG recordings we make
+ * since every frame is a keyframe. If a seek doesn't land exactly, the thread decodes forward from the beginning
+ * instead, so results never depend on the codec.
+ *
+ * The results only match a serial run if processing a frame doesn't depend on the frames before it, so processors
+ * must not carry state such as DM_VIDEO_FAST thresholds or pose tracker guesses between frames.
+ *
+ * @param filename the video
+ * @param jobs number of threads
+ * @param segment_frames frames per segment. At most 2 * jobs segments of results are held in memory at once.
+ * @param make_processor called once per thread to create that thread's processor, so each has its own detector. The
+ *        processor is given each frame, which is only valid during the call, and its index in the video.
+ * @param consume called on the calling thread with each frame's index and result, in frame order
+ * @return number of frames processed
+ */
+template<typename Result>
+size_t ProcessVideoSegments(const std::string &filename,
+                            unsigned int jobs,
+                            size_t segment_frames,
+                            const std::function<std::function<Result(const cv::Mat &, size_t)>()> &make_processor,
+                            const std::function<void(size_t, Result &)> &consume) {
+  cv::VideoCapture probe(filename);
+  if (!probe.isOpened()) {
+    return 0;
+  }
+
+  // the frame count from the container can be wrong, so the last segment always reads to the end of the video
+  const auto frame_count = static_cast<size_t>(std::max(0.0, probe.get(CV_CAP_PROP_FRAME_COUNT)));
+  const size_t num_segments = std::max<size_t>(1, (frame_count + segment_frames - 1) / segment_frames);
+  probe.release();
+
+  struct segment_t {
+    bool done = false;
+    std::vector<Result> results;
+  };
+  std::vector<segment_t> segments(num_segments);
+  std::mutex lock;
+  std::condition_variable changed;
+  size_t next_segment = 0;
+  size_t consumed_segments = 0;
+  const size_t max_segments_ahead = 2 * std::max(1u, jobs);
+
+  auto worker = [&]() {
+    auto process = make_processor();
+    cv::VideoCapture capture(filename);
+    cv::Mat frame;
+    size_t position = 0;
+    while (true) {
+      size_t segment;
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        changed.wait(guard, [&]() {
+          return next_segment >= num_segments || next_segment < consumed_segments + max_segments_ahead;
+        });
+        if (next_segment >= num_segments) {
+          break;
+        }
+        segment = next_segment++;
+      }
+
+      const size_t begin = segment * segment_frames;
+      const size_t end = segment + 1 == num_segments ? std::numeric_limits<size_t>::max() : begin + segment_frames;
+      if (position != begin) {
+        capture.set(CV_CAP_PROP_POS_FRAMES, static_cast<double>(begin));
+        if (static_cast<size_t>(capture.get(CV_CAP_PROP_POS_FRAMES)) != begin) {
+          capture.open(filename);
+          for (size_t i = 0; i < begin && capture.grab(); ++i) {}
+        }
+        position = begin;
+      }
+
+      std::vector<Result> results;
+      for (size_t i = begin; i < end && capture.read(frame); ++i) {
+        results.push_back(process(frame, i));
+        ++position;
+      }
+
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        segments[segment].results = std::move(results);
+        segments[segment].done = true;
+      }
+      changed.notify_all();
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (unsigned int i = 0; i < std::max(1u, jobs); ++i) {
+    workers.emplace_back(worker);
+  }
+
+  size_t frames = 0;
+  for (size_t segment = 0; segment < num_segments; ++segment) {
+    std::vector<Result> results;
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      changed.wait(guard, [&]() { return segments[segment].done; });
+      results = std::move(segments[segment].results);
+    }
+    for (auto &result : results) {
+      consume(frames++, result);
+    }
+
+    // a short segment before the last means the video ended early or a frame failed to decode, which is where a
+    // serial run stops too
+    const bool stop = segment + 1 < num_segments && results.size() < segment_frames;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      ++consumed_segments;
+      if (stop) {
+        next_segment = num_segments;
+      }
+    }
+    changed.notify_all();
+    if (stop) {
+      break;
+    }
+  }
+
+  for (auto &thread : workers) {
+    thread.join();
+  }
+  return frames;
+}
+
+} // end namespace
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <vector>
+
+#include <aruco/aruco.h>
+#include <opencv2/core.hpp>
+
+namespace phil {
+
+struct visual_odometry_config_t {
+  int max_features;                // most corners to track at once
+  int min_features;                // find more corners once fewer than this are still tracked
+  double min_feature_distance_px;  // between corners found in the same frame
+  int min_inliers;                 // fewer tracked corners that agree on the rotation than this give no measurement
+  double max_dt_s;                 // frames further apart than this restart the tracking instead of being measured
+  double min_yaw_rate_std;         // in rad/s, since parallax from driving forward biases the fit more than its noise
+};
+
+const visual_odometry_config_t kDefaultVisualOdometryConfig{200, 60, 10, 20, 0.2, 0.02};
+
+/**
+ * Estimates how fast the robot turns from the optical flow between consecutive frames of one camera. Corners are
+ * tracked with pyramidal Lucas-Kanade, and the rotation about the robot's vertical axis that best explains where they
+ * moved is fit robustly, so corners on moving objects and the parallax from driving are mostly ignored. A rotation
+ * moves every corner the same way no matter how far away it is, but a translation doesn't, so with one camera the yaw
+ * rate is the only part of the motion that can be measured without knowing the depth of each corner.
+ */
+class VisualOdometry {
+ public:
+  /**
+   * @param camera_params intrinsics. They are scaled to the size of the frames if it's different.
+   * @param camera_to_robot camera to robot transform (4x4), from ExtrinsicsMatrix
+   */
+  VisualOdometry(const aruco::CameraParameters &camera_params,
+                 const cv::Mat &camera_to_robot,
+                 const visual_odometry_config_t &config);
+
+  /**
+   * Tracks corners from the previous frame into this one
+   * @param gray the frame, single channel
+   * @param stamp_s when the frame was captured
+   * @param yaw_rate set to how fast the robot turned since the previous frame, in rad/s counterclockwise
+   * @param yaw_rate_var set to the variance of yaw_rate
+   * @return false if there was no previous frame to measure from, or too few corners agreed on the motion
+   */
+  bool Track(const cv::Mat &gray, double stamp_s, double *yaw_rate, double *yaw_rate_var);
+
+  /**
+   * Fits a rotation about a fixed axis to corners seen from the same camera before and after it rotated
+   * @param before corners in the first frame, undistorted to normalized image coordinates
+   * @param after the same corners in the second frame
+   * @param axis unit vector in the camera frame that the camera rotated about
+   * @param angle set to the counterclockwise rotation of the camera about axis
+   * @param angle_var set to the variance of angle
+   * @param inliers set to the number of corners that agree with the rotation, if not null
+   * @return false if fewer than min_inliers corners agree
+   */
+  static bool FitRotation(const std::vector<cv::Point2f> &before,
+                          const std::vector<cv::Point2f> &after,
+                          const cv::Vec3d &axis,
+                          int min_inliers,
+                          double *angle,
+                          double *angle_var,
+                          int *inliers = nullptr);
+
+ private:
+  void FindCorners(const cv::Mat &gray);
+
+  visual_odometry_config_t config;
+  cv::Mat camera_matrix;
+  cv::Mat distortion;
+  cv::Size camera_size;
+  cv::Vec3d yaw_axis; // the robot's vertical axis in the camera frame
+
+  cv::Mat previous_frame;
+  double previous_stamp_s;
+  std::vector<cv::Point2f> corners;
+  std::vector<cv::Point2f> tracked;
+  std::vector<uint8_t> status;
+  std::vector<float> error;
+};
+
+} // end namespace
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <map>
+#include <memory>
+
+#include <bfl/filter/extendedkalmanfilter.h>
+#include <bfl/model/analyticmeasurementmodel_gaussianuncertainty.h>
+#include <bfl/pdf/analyticconditionalgaussian_additivenoise.h>
+#include <eigen3/Eigen/Core>
+
+#include <phil/common/common.h>
+#include <phil/localization/marker_graph.h>
+
+namespace phil {
+namespace localization {
+
+struct corner_measurement_config_t {
+  double corner_std_px;      // noise on each detected corner
+  double max_prior_error_px; // when the filter predicts the corners worse than this RMS error, measure a pose instead
+  double gate_z;             // normal quantile the chi-square gates on the innovation are set at, 2.33 passes 99%
+};
+
+const corner_measurement_config_t kDefaultCornerMeasurementConfig{1.0, 25, 2.33};
+
+/**
+ * The corners of every mapped marker seen in one frame
+ */
+struct corner_observation_t {
+  Eigen::Matrix3Xd map_points; // where each corner is in the map
+  Eigen::Matrix2Xd normalized; // where it was seen, undistorted to normalized image coordinates
+  Pose3d robot_T_camera;       // camera to robot transform
+  double fx;                   // focal lengths in pixels, so the noise on each corner is in pixels
+  double fy;
+};
+
+/**
+ * Projects every corner of an observation through a robot pose at once
+ * @param robot_pose the robot's pose on the floor of the map
+ * @param projected set to where each corner would be seen, in pixels from the principal point
+ * @param jacobian set to the derivative of projected, u and v of each corner in turn, with respect to x, y and theta,
+ *        if not null
+ * @return false if a corner is behind the camera
+ */
+bool ProjectCorners(const corner_observation_t &observation,
+                    const pose_t &robot_pose,
+                    Eigen::Matrix2Xd *projected,
+                    Eigen::Matrix<double, Eigen::Dynamic, 3> *jacobian);
+
+/**
+ * Where the corners of an observation appear for the robot pose in the filter's state. The projection and its
+ * Jacobian are evaluated together for every corner, and kept until the state changes, since the filter asks for both
+ * at the same state.
+ */
+class CornerMeasurementPdf : public BFL::AnalyticConditionalGaussianAdditiveNoise {
+ public:
+  /**
+   * @param additiveNoise with two dimensions per corner
+   */
+  explicit CornerMeasurementPdf(const BFL::Gaussian &additiveNoise);
+
+  /**
+   * @param observation kept until the next call, so it has to outlive the update
+   * @param motion how far the robot moved since the frame was captured, which is taken out of the state
+   */
+  void SetObservation(const corner_observation_t *observation, const pose_t &motion);
+
+  // redefine virtual functions
+  MatrixWrapper::ColumnVector ExpectedValueGet() const override;
+
+  MatrixWrapper::Matrix dfGet(unsigned int i) const override;
+
+ private:
+  void Linearize() const;
+
+  const corner_observation_t *observation;
+  pose_t motion;
+
+  mutable bool linearized;
+  mutable pose_t linearized_pose;
+  mutable Eigen::Matrix2Xd projected;
+  mutable Eigen::Matrix<double, Eigen::Dynamic, 3> jacobian;
+};
+
+/**
+ * Updates the filter with the pixel coordinates of marker corners instead of a pose solved from them, so a single
+ * marker helps as much as it can and the filter weighs each corner by how much it says about the pose. Corners whose
+ * innovation is unlikely under the filter's covariance are dropped, and the rest are only used if they agree with the
+ * estimate together. The filter's measurement has a fixed size per model, so one model is kept for each number of
+ * corners used.
+ */
+class CornerMeasurementModel {
+ public:
+  explicit CornerMeasurementModel(const corner_measurement_config_t &config);
+
+  /**
+   * @param motion how far the robot moved since the frame was captured, as estimated by the filter
+   * @return false if there are no corners, some would be behind the camera at the filter's estimate, or the corners
+   *         that pass the gate don't agree with the estimate
+   */
+  bool Update(BFL::ExtendedKalmanFilter *filter, const corner_observation_t &observation, const pose_t &motion);
+
+ private:
+  struct model_t {
+    std::unique_ptr<CornerMeasurementPdf> pdf;
+    std::unique_ptr<BFL::AnalyticMeasurementModelGaussianUncertainty> model;
+  };
+
+  corner_measurement_config_t config;
+  std::map<size_t, model_t> models;
+  Eigen::Matrix2Xd projected;
+  Eigen::Matrix<double, Eigen::Dynamic, 3> jacobian;
+  corner_observation_t inliers;
+};
+
+}
+}
@@ -21,14 +21,26 @@ class EKF : public Filter<BFL::ExtendedKalmanFilter> {
   std::unique_ptr<BFL::LinearAnalyticMeasurementModelGaussianUncertainty> acc_measurement_model;
   std::unique_ptr<BFL::LinearAnalyticMeasurementModelGaussianUncertainty> camera_measurement_model;
   std::unique_ptr<BFL::LinearAnalyticMeasurementModelGaussianUncertainty> beacon_measurement_model;
+  std::unique_ptr<BFL::LinearAnalyticMeasurementModelGaussianUncertainty> heading_change_measurement_model;
   std::unique_ptr<localization::EncoderControlModel> system_pdf;
   std::unique_ptr<BFL::Gaussian> prior;
   std::unique_ptr<BFL::LinearAnalyticConditionalGaussian> yaw_measurement_pdf;
   std::unique_ptr<BFL::LinearAnalyticConditionalGaussian> acc_measurement_pdf;
   std::unique_ptr<BFL::LinearAnalyticConditionalGaussian> camera_measurement_pdf;
   std::unique_ptr<BFL::LinearAnalyticConditionalGaussian> beacon_measurement_pdf;
+  std::unique_ptr<BFL::LinearAnalyticConditionalGaussian> heading_change_measurement_pdf; // covariance set per update
 
   void ZeroVelocityUpdate() override;
+
+  /**
+   * Corrects the heading by how much a measured turn over an interval disagrees with the filter's. A yaw rate can't be
+   * measured directly, since every prediction replaces the rate with the one from the encoders.
+   * @param theta_before the filter's heading at the start of the interval
+   * @param theta_after the filter's heading at the end of the interval
+   * @param heading_change measured counterclockwise turn over the interval, in radians
+   * @param variance of heading_change
+   */
+  void HeadingChangeUpdate(double theta_before, double theta_after, double heading_change, double variance);
 };
 
 }
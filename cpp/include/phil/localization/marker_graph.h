@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <unordered_map>
+#include <vector>
+
+#include <eigen3/Eigen/Geometry>
+
+namespace phil {
+namespace localization {
+
+/**
+ * Unaligned so it can be stored in standard containers
+ */
+using Pose3d = Eigen::Transform<double, 3, Eigen::Isometry, Eigen::DontAlign>;
+
+/**
+ * Relative poses of markers that have been seen together, and the pose of every connected marker in the frame of an
+ * origin marker. Edges and adjacency are hashed, and the shortest path from every marker to the origin is kept as a
+ * BFS tree that is only updated around new edges, so looking up a marker's pose doesn't search the graph.
+ * Optimize refines every marker pose jointly as an SE(3) pose graph.
+ */
+class MarkerGraph {
+ public:
+  /**
+   * @param origin_id the marker whose frame every pose is in, or -1 to use the first marker added
+   */
+  explicit MarkerGraph(int origin_id = -1);
+
+  /**
+   * Adds an edge between every pair of markers seen in one frame
+   * @param camera_T_markers pose of each marker in the camera frame, by id
+   */
+  void AddFrame(const std::map<int, Pose3d> &camera_T_markers);
+
+  /**
+   * Adds one measurement of the pose of marker to in the frame of marker from. Repeated measurements of the same pair
+   * are averaged and weigh that edge more.
+   */
+  void AddEdge(int from, int to, const Pose3d &from_T_to);
+
+  /**
+   * @param pose the pose of the marker in the origin frame, optimized if Optimize has run since the marker was added
+   *        and composed along the shortest path otherwise
+   * @return false if the marker isn't connected to the origin
+   */
+  bool Pose(int id, Pose3d *pose) const;
+
+  /**
+   * @return the ids from the marker to the origin, inclusive, or empty if it isn't connected
+   */
+  std::vector<int> Path(int id) const;
+
+  /**
+   * Gauss-Newton on every marker connected to the origin, with the origin held fixed. The normal equations are
+   * solved with a sparse Cholesky factorization, so the cost grows with the number of edges rather than the cube of
+   * the number of markers.
+   * @param max_iterations stops earlier once the update is negligible
+   * @return the final sum of squared residuals
+   */
+  double Optimize(int max_iterations = 10);
+
+  int Origin() const;
+
+  size_t NumMarkers() const;
+
+  size_t NumEdges() const;
+
+ private:
+  struct edge_t {
+    int from;
+    int to;
+    Pose3d from_T_to;
+    unsigned int count;
+  };
+
+  struct node_t {
+    int parent;
+    unsigned int depth;
+  };
+
+  static uint64_t Key(int from, int to);
+
+  const edge_t *FindEdge(int from, int to) const;
+
+  /**
+   * @return from_T_to using the edge between them in either direction
+   */
+  Pose3d EdgeTransform(int from, int to) const;
+
+  bool ChainPose(int id, Pose3d *pose) const;
+
+  /**
+   * BFS from the given nodes, updating any node whose path to the origin got shorter
+   */
+  void Relax(const std::vector<int> &seeds);
+
+  int origin_id;
+  std::unordered_map<uint64_t, edge_t> edges;
+  std::unordered_map<int, std::vector<int>> adjacency;
+  std::unordered_map<int, node_t> tree;
+  std::unordered_map<int, Pose3d> optimized;
+};
+
+}
+}
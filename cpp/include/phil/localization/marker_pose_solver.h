@@ -0,0 +1,116 @@
+#pragma once
+
+#include <vector>
+
+#include <aruco/aruco.h>
+#include <eigen3/Eigen/Geometry>
+#include <opencv2/core.hpp>
+
+#include <phil/common/common.h>
+
+namespace phil {
+namespace localization {
+
+/**
+ * Unaligned so it can be a member of classes that are allocated with new
+ */
+using Matrix6d = Eigen::Matrix<double, 6, 6, Eigen::DontAlign>;
+
+struct marker_pose_solver_config_t {
+  int iterations;              // Levenberg-Marquardt iterations, a fixed number so every frame costs about the same
+  double corner_std_px;        // least noise assumed on each detected corner
+  double max_prior_error_px;   // RMS reprojection error of the predicted pose above which it's too poor to start from
+  double max_error_px;         // RMS reprojection error above which a solved pose is rejected
+  double ransac_threshold_px;  // for the EPnP RANSAC fallback
+};
+
+const marker_pose_solver_config_t kDefaultMarkerPoseSolverConfig{6, 0.5, 25, 3, 3};
+
+/**
+ * Estimates the camera pose from the corners of every detected marker in a marker map. When the filter predicts
+ * where the camera is, that prediction is refined with a few Levenberg-Marquardt iterations on SE(3), which is much
+ * cheaper than solving PnP from scratch. EPnP with RANSAC only runs without a prediction, or when the prediction
+ * doesn't explain where the corners are. The covariance of the pose comes from the same normal equations.
+ *
+ * Poses are perturbed as p' = exp(w) p + v for a point p in the camera frame, with covariances ordered w, v.
+ */
+class MarkerPoseSolver {
+ public:
+  /**
+   * @param camera_params intrinsics of the frames the markers are detected in
+   * @param map marker map in meters
+   */
+  MarkerPoseSolver(const aruco::CameraParameters &camera_params,
+                   const aruco::MarkerMap &map,
+                   const marker_pose_solver_config_t &config);
+
+  void SetMap(const aruco::MarkerMap &map);
+
+  /**
+   * @param markers detected or tracked markers. Ones that aren't in the map are skipped.
+   * @param predicted_rt the predicted map to camera transform (4x4), or empty
+   * @param rt set to the map to camera transform (4x4, CV_64F)
+   * @param covariance set to the covariance of rt
+   * @return false if no pose explains the corners
+   */
+  bool Solve(const std::vector<aruco::Marker> &markers,
+             const cv::Mat &predicted_rt,
+             cv::Mat *rt,
+             Matrix6d *covariance);
+
+  /**
+   * @return whether the last solve had to fall back to EPnP
+   */
+  bool UsedFallback() const;
+
+  /**
+   * @return the RMS reprojection error of the last solved pose, in pixels
+   */
+  double ErrorPx() const;
+
+  /**
+   * Levenberg-Marquardt on the reprojection error of points in the map
+   * @param points in the map frame
+   * @param normalized where each point was seen, undistorted to normalized image coordinates
+   * @param focal_px fx and fy, so the error is measured in pixels
+   * @param camera_T_map the pose to start from, set to the refined pose
+   * @param information set to the normal equations at the refined pose, JtJ in pixels
+   * @return the RMS reprojection error in pixels, or infinity if a point is behind the camera
+   */
+  static double Refine(const std::vector<Eigen::Vector3d> &points,
+                       const std::vector<Eigen::Vector2d> &normalized,
+                       const Eigen::Vector2d &focal_px,
+                       int iterations,
+                       Eigen::Isometry3d *camera_T_map,
+                       Matrix6d *information);
+
+ private:
+  marker_pose_solver_config_t config;
+  cv::Mat camera_matrix;
+  cv::Mat distortion;
+  Eigen::Vector2d focal_px;
+  aruco::MarkerMap map;
+  bool used_fallback;
+  double error_px;
+
+  std::vector<cv::Point3f> object;
+  std::vector<cv::Point2f> image;
+  std::vector<cv::Point2f> undistorted;
+  std::vector<Eigen::Vector3d> points;
+  std::vector<Eigen::Vector2d> normalized;
+};
+
+/**
+ * The robot's pose on the floor of the map, from the pose of one of its cameras
+ * @param camera_T_map map to camera transform
+ * @param covariance of camera_T_map, or zero if it isn't known
+ * @param robot_T_camera camera to robot transform, from ExtrinsicsMatrix
+ * @param pose_covariance set to the covariance of x, y and theta, zero if covariance is
+ */
+pose_t RobotPose(const Eigen::Isometry3d &camera_T_map,
+                 const Matrix6d &covariance,
+                 const Eigen::Isometry3d &robot_T_camera,
+                 Eigen::Matrix3d *pose_covariance);
+
+}
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <array>
+#include <mutex>
+#include <vector>
+
+#include <phil/common/common.h>
+#include <phil/localization/robot_model.h>
+
+namespace phil {
+namespace localization {
+
+/**
+ * Remembers the recent posteriors of the filter so clients can ask for the pose at a specific time. Queries between
+ * two posteriors are interpolated, queries past the latest posterior are forward-predicted with the
+ * EncoderControlModel using the most recent encoder input. Safe to use from multiple threads.
+ */
+class PoseHistory {
+ public:
+  /**
+   * @param capacity number of posteriors to remember
+   * @param W track width in meters, same as given to the EKF
+   * @param alpha kinematics model parameter, same as given to the EKF
+   * @param max_prediction_s queries further than this past the latest posterior fail
+   */
+  PoseHistory(size_t capacity, double W, double alpha, double max_prediction_s = 0.5);
+
+  /**
+   * Record a posterior of the filter
+   * @param stamp_s time of the newest sensor data in the posterior, on the co-processor clock
+   * @param state posterior mean
+   * @param covariance posterior covariance
+   * @param control encoder input (v_l, v_r) most recently given to the filter
+   */
+  void Push(double stamp_s,
+            const MatrixWrapper::ColumnVector &state,
+            const MatrixWrapper::SymmetricMatrix &covariance,
+            const MatrixWrapper::ColumnVector &control);
+
+  /**
+   * @param time_s time on the co-processor clock, or 0 for the latest posterior without any prediction
+   * @param record filled in with the pose at time_s. stamp_s is set to time_s.
+   * @return false if time_s is older than the history or too far in the future
+   */
+  bool Query(double time_s, pose_record_t *record);
+
+ private:
+  struct entry_t {
+    double stamp_s;
+    double seq;
+    std::array<double, N> state;
+    std::array<double, 3> variance;
+    std::array<double, M> control;
+  };
+
+  static void Fill(const entry_t &entry, pose_record_t *record);
+
+  void Predict(const entry_t &from, double horizon_s, pose_record_t *record);
+
+  std::mutex lock;
+  std::vector<entry_t> entries;
+  size_t head;
+  size_t size;
+  double seq;
+  double max_prediction_s;
+  EncoderControlModel model;
+};
+
+}
+}
@@ -27,6 +27,16 @@ class EncoderControlModel : public BFL::AnalyticConditionalGaussianAdditiveNoise
   MatrixWrapper::ColumnVector ExpectedValueGet() const override;
 
   MatrixWrapper::Matrix dfGet(unsigned int i) const override;
+
+  /**
+   * Change the time step used by the next call to ExpectedValueGet or dfGet
+   */
+  void SetDt(double dt_s);
+
+ private:
+  double W;
+  double alpha;
+  double dt_s;
 };
 
 class AccMeasurementModel : public BFL::AnalyticConditionalGaussianAdditiveNoise {
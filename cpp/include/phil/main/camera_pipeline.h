@@ -0,0 +1,251 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <aruco/aruco.h>
+#include <cscore.h>
+#include <eigen3/Eigen/Core>
+#include <opencv2/opencv.hpp>
+
+#include <phil/common/common.h>
+#include <phil/common/corner_tracker.h>
+#include <phil/common/frame_bus.h>
+#include <phil/common/jpeg.h>
+#include <phil/common/map_expander.h>
+#include <phil/common/mjpeg_stream.h>
+#include <phil/common/pyramid_detector.h>
+#include <phil/common/rectifier.h>
+#include <phil/common/roi_detector.h>
+#include <phil/common/visual_odometry.h>
+#include <phil/common/yuyv.h>
+#include <phil/localization/corner_measurement_model.h>
+#include <phil/localization/marker_pose_solver.h>
+
+namespace phil {
+
+struct camera_config_t {
+  std::string name;
+  std::string source_url;
+  std::string device;         // V4L2 device to capture YUYV from directly instead of source_url, or empty
+  std::string params_filename;
+  int w;
+  int h;
+  int fps;
+  // x, y, z, roll, pitch, yaw of the camera in the robot frame, in meters and radians. The rotation is of the optical
+  // frame (x right, y down, z out of the lens), so a camera looking forward has roll -pi/2 and yaw -pi/2.
+  std::vector<double> extrinsics;
+};
+
+struct camera_options_t {
+  std::string dictionary;
+  double marker_size;
+  std::string detector_mode;   // full, roi, pyramid or tiled
+  std::string rectify_dir;     // empty to not rectify
+  int annotated_stream_port;
+  std::string video_filename;  // empty to not record
+  int mjpeg_scale;             // 0 to decode frames with cscore, else read the MJPEG stream and detect at 1/scale size
+  bool full_res_annotations;   // when detecting on luma, still convert frames to full color for the annotated stream
+  std::shared_ptr<MapExpander> map_expander; // shared by every camera, or null to keep the map fixed
+  bool visual_odometry;        // measure the yaw rate from the optical flow of every frame, on its own thread
+  bool track_corners;          // between detections, track the corners of the detected markers with optical flow
+  bool pose_solver;            // refine the filter's predicted pose instead of solving PnP, and measure its covariance
+  bool corner_measurements;    // update the filter with marker corners instead of poses, while it predicts them well
+  bool verbose;
+};
+
+struct camera_measurement_t {
+  size_t camera;     // index of the camera that made the measurement
+  double stamp_s;    // when the frame arrived, on the co-processor clock
+  pose_t robot_pose; // already corrected for where the camera is mounted
+  Eigen::Matrix3d robot_pose_covariance; // of x, y and theta, or zero if the pose came without one
+};
+
+struct corner_measurement_t {
+  size_t camera;             // index of the camera that made the measurement
+  double stamp_s;            // when the frame arrived, on the co-processor clock
+  localization::corner_observation_t corners;
+  bool has_pose;             // whether a pose was solved from the same markers
+  camera_measurement_t pose; // measured instead when the filter rejects the corners
+};
+
+struct odometry_measurement_t {
+  size_t camera;           // index of the camera that made the measurement
+  double stamp_s;          // when the newer of the two frames arrived, on the co-processor clock
+  double previous_stamp_s; // when the older frame arrived
+  double yaw_rate;         // rad/s, counterclockwise, averaged between the two frames
+  double yaw_rate_var;
+};
+
+/**
+ * @param extrinsics x, y, z, roll, pitch, yaw of the camera in the robot frame, applied as Rz(yaw) Ry(pitch) Rx(roll)
+ * @return optical camera frame to robot transform (4x4, CV_64F)
+ */
+cv::Mat ExtrinsicsMatrix(const std::vector<double> &extrinsics);
+
+/**
+ * Capture, detection and pose estimation for one camera, on its own thread. Each camera has its own detector and
+ * tracker, so adding cameras scales across cores until every core is busy. Measurements are queued with the time
+ * their frame arrived, and the main loop applies them in order.
+ */
+class CameraPipeline {
+ public:
+  /**
+   * Looks up the filter's estimate at a given time, for example PoseHistory::Query
+   * @param yaw_rate set to the filter's angular velocity at that time
+   * @return false if there is no estimate for that time
+   */
+  using PriorQuery = std::function<bool(double stamp_s, pose_t *pose, double *yaw_rate)>;
+
+  /**
+   * @param index identifies this camera in its measurements
+   * @param camera_params intrinsics, already resized to the frame size
+   */
+  CameraPipeline(size_t index,
+                 const camera_config_t &config,
+                 const aruco::CameraParameters &camera_params,
+                 const aruco::MarkerMap &map,
+                 const camera_options_t &options);
+
+  ~CameraPipeline();
+
+  /**
+   * Starts capturing and detecting
+   * @param prior used to predict where markers will appear, only needed by the roi and pyramid detectors and corner
+   *        tracking
+   */
+  void Start(PriorQuery prior);
+
+  void Stop();
+
+  /**
+   * @param measurements appended with every measurement made since the last call, oldest first
+   */
+  void Drain(std::vector<camera_measurement_t> *measurements);
+
+  /**
+   * @param measurements appended with every visual odometry measurement made since the last call, oldest first
+   */
+  void DrainOdometry(std::vector<odometry_measurement_t> *measurements);
+
+  /**
+   * @param measurements appended with every corner measurement made since the last call, oldest first
+   */
+  void DrainCorners(std::vector<corner_measurement_t> *measurements);
+
+  const std::string &Name() const;
+
+ private:
+  void Run();
+
+  /**
+   * Measures the yaw rate between every pair of frames, whether or not there are markers in them
+   */
+  void RunOdometry();
+
+  std::vector<aruco::Marker> Detect(const cv::Mat &frame, const cv::Mat &predicted_rt);
+
+  /**
+   * Estimates the camera pose with the pose solver, or aruco's tracker without it, into solved_rt and
+   * solved_covariance
+   * @param predicted_rt where the filter predicts the camera is, or empty
+   */
+  bool EstimatePose(const std::vector<aruco::Marker> &markers, const cv::Mat &predicted_rt);
+
+  /**
+   * Tracks the markers of the last detection into this frame and estimates the pose from them, unless it's time to
+   * detect again
+   * @param yaw_rate the filter's angular velocity, which decides how many frames are tracked between detections
+   * @param predicted_rt where the filter predicts the camera is, or empty
+   * @param markers set to the tracked markers
+   * @return false if the markers should be detected instead, because it's time to or because tracking failed
+   */
+  bool TrackCorners(const cv::Mat &frame,
+                    double yaw_rate,
+                    const cv::Mat &predicted_rt,
+                    std::vector<aruco::Marker> *markers);
+
+  /**
+   * Queues the corners of every mapped marker for the filter, if the filter's pose predicts where they are well enough
+   * to be linearized at. Otherwise the filter needs a pose measurement to catch up.
+   * @param prior_pose the filter's pose when the frame arrived
+   * @param pose solved from the same markers, for the filter to fall back on if its own gate rejects the corners, or
+   * null
+   * @return false if nothing was queued
+   */
+  bool QueueCorners(const std::vector<aruco::Marker> &markers,
+                    double stamp_s,
+                    const pose_t &prior_pose,
+                    const camera_measurement_t *pose);
+
+  /**
+   * Moves markers detected on the scaled luma to full resolution, then refines their corners on a full resolution
+   * decode of just the area around them
+   * @param jpeg the frame they were detected in
+   */
+  void RefineScaledMarkers(const std::vector<uint8_t> &jpeg, std::vector<aruco::Marker> *markers);
+
+  size_t index;
+  camera_config_t config;
+  camera_options_t options;
+  aruco::CameraParameters camera_params;
+  aruco::MarkerMap map;
+  uint64_t map_version;
+  cv::Mat camera_to_robot;
+  localization::Pose3d robot_T_camera; // camera_to_robot, for the corner measurements
+
+  cs::HttpCamera camera;
+  cs::CvSink sink;
+  cs::CvSource annotated_source;
+  cs::MjpegServer annotated_server;
+
+  aruco::MarkerDetector detector;
+  aruco::MarkerMapPoseTracker tracker;
+  std::unique_ptr<localization::MarkerPoseSolver> pose_solver;
+  cv::Mat solved_rt;                        // map to camera transform from the last EstimatePose
+  localization::Matrix6d solved_covariance; // zero when aruco's tracker estimated the pose
+  FullFrameDetector full_frame_detector;
+  std::unique_ptr<Rectifier> rectifier;
+  std::unique_ptr<RoiMarkerDetector> roi_detector;
+  std::unique_ptr<PyramidMarkerDetector> pyramid_detector;
+  std::unique_ptr<CornerTracker> corner_tracker;
+  std::vector<aruco::Marker> mapped_markers;
+  cv::Mat fitted_rt;                        // map to camera transform fit to the tracked corners alone
+  std::vector<cv::Point3f> corner_object;
+  std::vector<cv::Point2f> corner_image;
+  std::vector<cv::Point2f> corner_undistorted;
+  Eigen::Matrix2Xd corner_projected;
+  cv::Mat rectified_frame;
+
+  std::unique_ptr<MjpegStreamReader> mjpeg_reader;
+  std::unique_ptr<V4l2YuyvCamera> yuyv_camera;
+  JpegDecoder jpeg_decoder;
+  cv::Mat scaled_frame;
+  cv::Mat refine_region;
+
+  FrameBus frame_bus;
+  std::shared_ptr<FrameSubscription> detection_frames;
+  std::shared_ptr<FrameSubscription> recording_frames;
+  std::shared_ptr<FrameSubscription> odometry_frames;
+  cv::VideoWriter video;
+
+  PriorQuery prior;
+  std::atomic<bool> done;
+  std::thread detection_thread;
+  std::thread recording_thread;
+  std::mutex lock;
+  std::vector<camera_measurement_t> measurements;
+  std::vector<corner_measurement_t> corner_measurements;
+
+  std::unique_ptr<VisualOdometry> visual_odometry;
+  JpegDecoder odometry_decoder;
+  std::thread odometry_thread;
+  std::vector<odometry_measurement_t> odometry_measurements;
+};
+
+} // end namespace
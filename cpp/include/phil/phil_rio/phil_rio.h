@@ -9,6 +9,7 @@
 #include <Encoder.h>
 #include <SpeedController.h>
 #include <networktables/NetworkTable.h>
+#include <networktables/NetworkTableEntry.h>
 
 #include <phil/common/udp.h>
 #include <phil/common/common.h>
@@ -48,6 +49,23 @@ class Phil {
    */
   pose_t GetPosition();
 
+  /**
+   * Reads the latest pose record published by phil_main without allocating.
+   * stamp_s is on the co-processor clock, subtract tk1_time_offset to get RoboRIO time.
+   * @param record filled in with the latest record
+   * @return false if no complete record has been published yet, in which case record is untouched
+   */
+  bool GetPoseRecord(pose_record_t *record);
+
+  /**
+   * Asks phil_main for the pose at a given time, usually now. Poses after the latest estimate are predicted from the
+   * motion model, so this hides the latency of the localization pipeline. Blocks for up to 20ms.
+   * @param rio_time_s time on the RoboRIO clock (as from gettimeofday)
+   * @param record filled in with the pose at rio_time_s. stamp_s is on the co-processor clock.
+   * @return false if phil_main didn't answer or has no estimate for that time
+   */
+  bool GetPoseAt(double rio_time_s, pose_record_t *record);
+
   /**
    * Send an arbitrary UDP message to any host on the network.
    */
@@ -67,7 +85,12 @@ class Phil {
    * For communicating with the TK1
    */
   UDPClient udp_client;
+  UDPClient pose_query_client;
   double tk1_time_offset;
+
+ private:
+  nt::NetworkTableEntry pose_entry;
+  double last_query_id;
 };
 
 } // end namespace
@@ -0,0 +1,68 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include <phil/common/atomic_file.h>
+
+namespace phil {
+
+static std::string tmp_filename_for(const std::string &filename) {
+  const size_t slash = filename.find_last_of('/');
+  const size_t dot = filename.find_last_of('.');
+  const bool has_extension = dot != std::string::npos && dot > 0 && (slash == std::string::npos || dot > slash + 1);
+  return has_extension ? filename.substr(0, dot) + ".tmp" + filename.substr(dot) : filename + ".tmp";
+}
+
+AtomicFile::AtomicFile(const std::string &filename)
+    : filename(filename), tmp_filename(tmp_filename_for(filename)), done(false) {}
+
+AtomicFile::~AtomicFile() {
+  if (!done) {
+    Abort();
+  }
+}
+
+const std::string &AtomicFile::TmpFilename() const {
+  return tmp_filename;
+}
+
+bool AtomicFile::Commit() {
+  if (done) {
+    return false;
+  }
+  if (std::rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+    std::cerr << "failed to rename [" << tmp_filename << "] to [" << filename << "]: [" << strerror(errno) << "]"
+              << std::endl;
+    Abort();
+    return false;
+  }
+  done = true;
+  return true;
+}
+
+void AtomicFile::Abort() {
+  std::remove(tmp_filename.c_str());
+  done = true;
+}
+
+bool WriteFileAtomically(const std::string &filename, const std::function<bool(std::ostream &)> &write) {
+  AtomicFile atomic_file(filename);
+  std::ofstream file(atomic_file.TmpFilename(), std::ios::binary | std::ios::trunc);
+  if (!file.good()) {
+    std::cerr << "failed to open [" << atomic_file.TmpFilename() << "]: [" << strerror(errno) << "]" << std::endl;
+    return false;
+  }
+  if (!write(file)) {
+    return false;
+  }
+  file.close();
+  if (!file.good()) {
+    std::cerr << "failed to write [" << atomic_file.TmpFilename() << "]" << std::endl;
+    return false;
+  }
+  return atomic_file.Commit();
+}
+
+} // end namespace
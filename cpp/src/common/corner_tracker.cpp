@@ -0,0 +1,142 @@
+#include <cmath>
+
+#include <opencv2/calib3d.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/video/tracking.hpp>
+
+#include <phil/common/corner_tracker.h>
+
+namespace phil {
+
+/**
+ * Pairs the corners of the markers that are in the map with their corners in the map
+ */
+static void map_correspondences(const std::vector<aruco::Marker> &markers,
+                                const aruco::MarkerMap &map,
+                                std::vector<cv::Point3f> *object,
+                                std::vector<cv::Point2f> *image) {
+  for (const auto &marker : markers) {
+    const int idx = map.getIndexOfMarkerId(marker.id);
+    if (idx == -1 || marker.size() != 4 || map[idx].points.size() != 4) {
+      continue;
+    }
+    object->insert(object->end(), map[idx].points.begin(), map[idx].points.end());
+    image->insert(image->end(), marker.begin(), marker.end());
+  }
+}
+
+bool SolveMapPose(const std::vector<aruco::Marker> &markers,
+                  const aruco::MarkerMap &map,
+                  const aruco::CameraParameters &camera_params,
+                  cv::Mat *rt) {
+  std::vector<cv::Point3f> object;
+  std::vector<cv::Point2f> image;
+  map_correspondences(markers, map, &object, &image);
+  cv::Mat rvec, tvec;
+  if (object.empty()
+      || !cv::solvePnP(object, image, camera_params.CameraMatrix, camera_params.Distorsion, rvec, tvec)) {
+    return false;
+  }
+
+  cv::Mat R;
+  cv::Rodrigues(rvec, R);
+  *rt = cv::Mat::eye(4, 4, CV_64F);
+  R.copyTo((*rt)(cv::Rect(0, 0, 3, 3)));
+  tvec.copyTo((*rt)(cv::Rect(3, 0, 1, 3)));
+  return true;
+}
+
+double ReprojectionErrorPx(const std::vector<aruco::Marker> &markers,
+                           const aruco::MarkerMap &map,
+                           const aruco::CameraParameters &camera_params,
+                           const cv::Mat &rt) {
+  std::vector<cv::Point3f> object;
+  std::vector<cv::Point2f> image;
+  map_correspondences(markers, map, &object, &image);
+  if (object.empty()) {
+    return 0;
+  }
+
+  cv::Mat camera_T_map;
+  rt.convertTo(camera_T_map, CV_64F);
+  cv::Mat rvec;
+  cv::Rodrigues(camera_T_map(cv::Rect(0, 0, 3, 3)), rvec);
+  const cv::Mat tvec = camera_T_map(cv::Rect(3, 0, 1, 3)).clone();
+  std::vector<cv::Point2f> projected;
+  cv::projectPoints(object, rvec, tvec, camera_params.CameraMatrix, camera_params.Distorsion, projected);
+
+  double sum_squared_error = 0;
+  for (size_t i = 0; i < image.size(); ++i) {
+    const cv::Point2f error = projected[i] - image[i];
+    sum_squared_error += error.dot(error);
+  }
+  return std::sqrt(sum_squared_error / image.size());
+}
+
+CornerTracker::CornerTracker(const corner_tracker_config_t &config) : config(config), tracked_frames(0) {}
+
+void CornerTracker::Reset(const cv::Mat &frame, const std::vector<aruco::Marker> &markers) {
+  frame.copyTo(previous_frame);
+  this->markers = markers;
+  tracked_frames = 0;
+}
+
+void CornerTracker::Invalidate() {
+  markers.clear();
+}
+
+unsigned int CornerTracker::TrackedFrames(double yaw_rate) const {
+  const double halvings = std::abs(yaw_rate) / config.halving_yaw_rate;
+  return static_cast<unsigned int>(config.max_tracked_frames * std::exp2(-halvings));
+}
+
+bool CornerTracker::NeedsDetection(double yaw_rate) const {
+  return markers.empty() || tracked_frames >= TrackedFrames(yaw_rate);
+}
+
+bool CornerTracker::Track(const cv::Mat &frame, std::vector<aruco::Marker> *tracked_markers) {
+  tracked_markers->clear();
+  if (markers.empty() || frame.size() != previous_frame.size() || frame.type() != previous_frame.type()) {
+    markers.clear();
+    return false;
+  }
+
+  corners.clear();
+  for (const auto &marker : markers) {
+    corners.insert(corners.end(), marker.begin(), marker.end());
+  }
+
+  // markers are small, so a smaller window than for general features, and they are tracked back to catch drift
+  const cv::Size window(15, 15);
+  const cv::TermCriteria criteria(cv::TermCriteria::MAX_ITER | cv::TermCriteria::EPS, 20, 0.03);
+  cv::calcOpticalFlowPyrLK(previous_frame, frame, corners, tracked, status, error, window, 3, criteria);
+  cv::calcOpticalFlowPyrLK(frame, previous_frame, tracked, tracked_back, status_back, error, window, 3, criteria);
+
+  const double max_flow_error_squared = config.max_flow_error_px * config.max_flow_error_px;
+  for (size_t m = 0; m < markers.size(); ++m) {
+    bool lost = false;
+    std::vector<cv::Point2f> moved(4);
+    for (size_t c = 0; c < 4; ++c) {
+      const size_t i = 4 * m + c;
+      const cv::Point2f back_error = tracked_back[i] - corners[i];
+      lost |= !status[i] || !status_back[i] || back_error.dot(back_error) > max_flow_error_squared;
+      moved[c] = tracked[i];
+    }
+    // corners that collapsed onto each other or crossed would give a meaningless pose
+    if (lost || !cv::isContourConvex(moved)) {
+      continue;
+    }
+    aruco::Marker marker = markers[m];
+    for (size_t c = 0; c < 4; ++c) {
+      marker[c] = moved[c];
+    }
+    tracked_markers->push_back(marker);
+  }
+
+  frame.copyTo(previous_frame);
+  markers = *tracked_markers;
+  ++tracked_frames;
+  return !markers.empty();
+}
+
+} // end namespace
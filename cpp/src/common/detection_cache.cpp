@@ -0,0 +1,217 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <phil/common/atomic_file.h>
+#include <phil/common/common.h>
+#include <phil/common/detection_cache.h>
+
+namespace phil {
+
+constexpr char kDetectionCacheMagic[8] = {'P', 'H', 'I', 'L', 'D', 'E', 'T', 'S'};
+constexpr uint32_t kDetectionCacheVersion = 1;
+
+// how much of each end of a video goes into its fingerprint
+constexpr size_t kFingerprintBytes = 1 << 20;
+
+struct detection_cache_header_t {
+  char magic[8];
+  uint32_t version;
+  uint32_t num_frames;
+  uint64_t video_fingerprint;
+  uint64_t params_key;
+  int32_t width;
+  int32_t height;
+  uint64_t num_markers;
+};
+
+uint64_t VideoFingerprint(const std::string &filename) {
+  std::ifstream file(filename, std::ios::binary | std::ios::ate);
+  if (!file.good()) {
+    return 0;
+  }
+  const uint64_t size = static_cast<uint64_t>(file.tellg());
+  uint64_t hash = fnv1a(&size, sizeof(size));
+
+  std::vector<char> bytes(static_cast<size_t>(std::min<uint64_t>(size, kFingerprintBytes)));
+  file.seekg(0);
+  file.read(bytes.data(), bytes.size());
+  hash = fnv1a(bytes.data(), bytes.size(), hash);
+  file.seekg(static_cast<std::streamoff>(size - bytes.size()));
+  file.read(bytes.data(), bytes.size());
+  hash = fnv1a(bytes.data(), bytes.size(), hash);
+  return file.good() ? hash : 0;
+}
+
+uint64_t DetectionParamsKey(const std::string &settings, const aruco::CameraParameters &camera_params) {
+  cv::Mat camera_matrix, distortion;
+  camera_params.CameraMatrix.convertTo(camera_matrix, CV_64F);
+  camera_params.Distorsion.convertTo(distortion, CV_64F);
+  uint64_t key = fnv1a(settings.data(), settings.size());
+  key = fnv1a(camera_matrix.data, camera_matrix.total() * camera_matrix.elemSize(), key);
+  key = fnv1a(distortion.data, distortion.total() * distortion.elemSize(), key);
+  const int32_t size[2] = {camera_params.CamSize.width, camera_params.CamSize.height};
+  return fnv1a(size, sizeof(size), key);
+}
+
+std::string DetectionCacheFilename(const std::string &cache_dir, uint64_t video_fingerprint, uint64_t params_key) {
+  std::stringstream filename;
+  filename << cache_dir << "/detections_" << std::hex << std::setfill('0') << std::setw(16) << video_fingerprint
+           << "_" << std::setw(16) << params_key << ".bin";
+  return filename.str();
+}
+
+DetectionCache::DetectionCache(const std::string &filename, uint64_t video_fingerprint, uint64_t params_key)
+    : fd(-1), data(nullptr), size(0), num_frames(0), frame_begins(nullptr), markers(nullptr) {
+  fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return;
+  }
+  struct stat file_stat{};
+  if (fstat(fd, &file_stat) != 0 || static_cast<size_t>(file_stat.st_size) < sizeof(detection_cache_header_t)) {
+    close(fd);
+    fd = -1;
+    return;
+  }
+  size = static_cast<size_t>(file_stat.st_size);
+  data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    std::cerr << "failed to map [" << filename << "]: [" << strerror(errno) << "]" << std::endl;
+    data = nullptr;
+    close(fd);
+    fd = -1;
+    return;
+  }
+
+  // every count is checked against the file size before it's used, so a corrupt header can't overflow the sums
+  const auto *header = static_cast<const detection_cache_header_t *>(data);
+  const size_t frames_size = (static_cast<size_t>(header->num_frames) + 1) * sizeof(uint32_t);
+  const size_t markers_bytes = size - sizeof(detection_cache_header_t);
+  bool valid = std::memcmp(header->magic, kDetectionCacheMagic, sizeof(header->magic)) == 0
+      && header->version == kDetectionCacheVersion && header->video_fingerprint == video_fingerprint
+      && header->params_key == params_key && frames_size <= markers_bytes
+      && header->num_markers <= (markers_bytes - frames_size) / sizeof(cached_marker_t)
+      && size == sizeof(detection_cache_header_t) + frames_size + header->num_markers * sizeof(cached_marker_t);
+
+  // Markers indexes the records with these, so they must never go backwards or past the end
+  const auto *begins = reinterpret_cast<const uint32_t *>(header + 1);
+  valid = valid && begins[0] == 0 && std::is_sorted(begins, begins + header->num_frames + 1)
+      && begins[header->num_frames] == header->num_markers;
+  if (!valid) {
+    munmap(data, size);
+    data = nullptr;
+    close(fd);
+    fd = -1;
+    return;
+  }
+
+  num_frames = header->num_frames;
+  frame_size = cv::Size(header->width, header->height);
+  frame_begins = begins;
+  markers = reinterpret_cast<const cached_marker_t *>(begins + num_frames + 1);
+}
+
+DetectionCache::~DetectionCache() {
+  if (data) {
+    munmap(data, size);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+bool DetectionCache::IsOpen() const {
+  return data != nullptr;
+}
+
+size_t DetectionCache::NumFrames() const {
+  return num_frames;
+}
+
+cv::Size DetectionCache::FrameSize() const {
+  return frame_size;
+}
+
+std::vector<aruco::Marker> DetectionCache::Markers(size_t frame, float marker_size) const {
+  std::vector<aruco::Marker> result;
+  if (frame >= num_frames) {
+    return result;
+  }
+
+  for (uint32_t i = frame_begins[frame]; i < frame_begins[frame + 1]; ++i) {
+    const cached_marker_t &record = markers[i];
+    std::vector<cv::Point2f> corners(4);
+    for (int c = 0; c < 4; ++c) {
+      corners[c] = cv::Point2f(record.corners[2 * c], record.corners[2 * c + 1]);
+    }
+    aruco::Marker marker(corners, record.id);
+    marker.ssize = marker_size;
+    if (record.has_pose) {
+      marker.Rvec = (cv::Mat_<float>(3, 1) << record.rvec[0], record.rvec[1], record.rvec[2]);
+      marker.Tvec = (cv::Mat_<float>(3, 1) << record.tvec[0], record.tvec[1], record.tvec[2]);
+    }
+    result.push_back(marker);
+  }
+  return result;
+}
+
+DetectionCacheWriter::DetectionCacheWriter(uint64_t video_fingerprint, uint64_t params_key, const cv::Size &frame_size)
+    : video_fingerprint(video_fingerprint), params_key(params_key), frame_size(frame_size) {}
+
+void DetectionCacheWriter::AddFrame(const std::vector<aruco::Marker> &detected) {
+  frame_begins.push_back(static_cast<uint32_t>(markers.size()));
+  for (const auto &marker : detected) {
+    if (marker.size() != 4) {
+      continue;
+    }
+    cached_marker_t record{};
+    record.id = marker.id;
+    for (int c = 0; c < 4; ++c) {
+      record.corners[2 * c] = marker[c].x;
+      record.corners[2 * c + 1] = marker[c].y;
+    }
+    // aruco fills the pose of markers it didn't estimate with -999999
+    if (marker.Rvec.total() == 3 && marker.Tvec.total() == 3 && marker.Tvec.at<float>(0) != -999999) {
+      record.has_pose = 1;
+      for (int i = 0; i < 3; ++i) {
+        record.rvec[i] = marker.Rvec.at<float>(i);
+        record.tvec[i] = marker.Tvec.at<float>(i);
+      }
+    }
+    markers.push_back(record);
+  }
+}
+
+size_t DetectionCacheWriter::NumFrames() const {
+  return frame_begins.size();
+}
+
+bool DetectionCacheWriter::Save(const std::string &filename) const {
+  detection_cache_header_t header{};
+  std::memcpy(header.magic, kDetectionCacheMagic, sizeof(header.magic));
+  header.version = kDetectionCacheVersion;
+  header.num_frames = static_cast<uint32_t>(frame_begins.size());
+  header.video_fingerprint = video_fingerprint;
+  header.params_key = params_key;
+  header.width = frame_size.width;
+  header.height = frame_size.height;
+  header.num_markers = markers.size();
+  const auto end = static_cast<uint32_t>(markers.size());
+  return WriteFileAtomically(filename, [&](std::ostream &file) {
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char *>(frame_begins.data()), frame_begins.size() * sizeof(uint32_t));
+    file.write(reinterpret_cast<const char *>(&end), sizeof(end));
+    file.write(reinterpret_cast<const char *>(markers.data()), markers.size() * sizeof(cached_marker_t));
+    return true;
+  });
+}
+
+} // end namespace
@@ -0,0 +1,129 @@
+#include <chrono>
+
+#include <phil/common/frame_bus.h>
+
+namespace phil {
+
+FrameSubscription::FrameSubscription(FrameBus *bus, size_t depth) : bus(bus), depth(depth), dropped(0) {}
+
+FramePtr FrameSubscription::Next(double timeout_s) {
+  std::unique_lock<std::mutex> guard(bus->lock);
+  bus->published.wait_for(guard, std::chrono::duration<double>(timeout_s), [&]() {
+    return !queue.empty() || bus->stopped;
+  });
+  if (queue.empty()) {
+    return nullptr;
+  }
+  FramePtr frame = std::move(queue.front());
+  queue.pop_front();
+  return frame;
+}
+
+size_t FrameSubscription::Dropped() const {
+  std::lock_guard<std::mutex> guard(bus->lock);
+  return dropped;
+}
+
+void FrameSubscription::Push(const FramePtr &frame) {
+  if (queue.size() >= depth) {
+    queue.pop_front();
+    ++dropped;
+  }
+  queue.push_back(frame);
+}
+
+FrameBus::FrameBus(size_t pool_size) : pool(std::make_shared<pool_t>()), seq(0), stopped(false), starved(0) {
+  for (size_t i = 0; i < pool_size; ++i) {
+    pool->buffers.push_back(std::make_unique<Frame>());
+    pool->free.push_back(pool->buffers.back().get());
+  }
+}
+
+FrameBus::~FrameBus() {
+  Stop();
+}
+
+std::shared_ptr<FrameSubscription> FrameBus::Subscribe(size_t depth) {
+  std::lock_guard<std::mutex> guard(lock);
+  std::shared_ptr<FrameSubscription> subscription(new FrameSubscription(this, depth));
+  subscriptions.push_back(subscription);
+  return subscription;
+}
+
+std::shared_ptr<Frame> FrameBus::Acquire() {
+  std::lock_guard<std::mutex> guard(pool->lock);
+  if (pool->free.empty()) {
+    return nullptr;
+  }
+  Frame *frame = pool->free.back();
+  pool->free.pop_back();
+
+  // the deleter returns the buffer to the pool instead of freeing it, so its pixels get reused
+  auto pool_ref = pool;
+  return std::shared_ptr<Frame>(frame, [pool_ref](Frame *released) {
+    std::lock_guard<std::mutex> guard(pool_ref->lock);
+    pool_ref->free.push_back(released);
+  });
+}
+
+void FrameBus::Publish(std::shared_ptr<Frame> frame) {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    frame->seq = seq++;
+    const FramePtr shared = std::move(frame);
+    for (auto &subscription : subscriptions) {
+      subscription->Push(shared);
+    }
+  }
+  published.notify_all();
+}
+
+void FrameBus::StartCapture(std::function<uint64_t(cv::Mat &)> grab) {
+  StartCapture(std::function<uint64_t(Frame &)>([grab](Frame &frame) { return grab(frame.image); }));
+}
+
+void FrameBus::StartCapture(std::function<uint64_t(Frame &)> grab) {
+  capture_thread = std::thread([this, grab]() {
+    Frame scrap;
+    while (true) {
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        if (stopped) {
+          break;
+        }
+      }
+
+      std::shared_ptr<Frame> frame = Acquire();
+      if (!frame) {
+        // every buffer is held by a consumer, so keep the camera's queue moving but throw the frame away
+        grab(scrap);
+        ++starved;
+        continue;
+      }
+
+      const uint64_t time = grab(*frame);
+      if (time == 0) {
+        continue;
+      }
+      frame->capture_time_us = time;
+      Publish(std::move(frame));
+    }
+  });
+}
+
+void FrameBus::Stop() {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stopped = true;
+  }
+  published.notify_all();
+  if (capture_thread.joinable()) {
+    capture_thread.join();
+  }
+}
+
+size_t FrameBus::Starved() const {
+  return starved;
+}
+
+} // end namespace
@@ -0,0 +1,120 @@
+#include <algorithm>
+#include <sstream>
+
+#include <phil/common/impairment.h>
+
+namespace phil {
+
+Impairment::Impairment(const impairment_config_t &config)
+    : config(config), generator(config.seed), uniform(0.0, 1.0), bad_channel(false), index(0) {}
+
+std::vector<impaired_packet_t> Impairment::Push(const data_t &data) {
+  std::vector<impaired_packet_t> out;
+  ++stats.pushed;
+  const size_t this_index = index++;
+
+  // every packet that arrives ages the held ones, whether or not it makes it through itself
+  for (auto &h : held) {
+    --h.remaining;
+  }
+
+  // the channel state is advanced before deciding the fate of this packet
+  if (bad_channel) {
+    bad_channel = uniform(generator) >= config.burst_exit_rate;
+  } else {
+    bad_channel = uniform(generator) < config.burst_enter_rate;
+  }
+
+  const double loss_rate = bad_channel ? config.burst_loss_rate : config.loss_rate;
+  if (uniform(generator) < loss_rate) {
+    ++stats.lost;
+    if (bad_channel) {
+      ++stats.burst_lost;
+    }
+  } else {
+    impaired_packet_t packet{data, this_index, SampleDelay()};
+    if (config.reorder_window > 0 && uniform(generator) < config.reorder_rate) {
+      ++stats.reordered;
+      held.push_back({packet, config.reorder_window});
+    } else {
+      Deliver(packet, &out);
+    }
+  }
+
+  // held packets come out after the packets that overtook them
+  while (!held.empty() && held.front().remaining == 0) {
+    Deliver(held.front().packet, &out);
+    held.pop_front();
+  }
+
+  return out;
+}
+
+std::vector<impaired_packet_t> Impairment::Flush() {
+  std::vector<impaired_packet_t> out;
+  for (const auto &h : held) {
+    Deliver(h.packet, &out);
+  }
+  held.clear();
+  return out;
+}
+
+void Impairment::Deliver(const impaired_packet_t &packet, std::vector<impaired_packet_t> *out) {
+  out->push_back(packet);
+  ++stats.delivered;
+  stats.total_delay_ms += packet.delay_ms;
+
+  if (uniform(generator) < config.duplicate_rate) {
+    ++stats.duplicated;
+    ++stats.delivered;
+    out->push_back(packet);
+    // the copy took the same path, so it doesn't wait again
+    out->back().delay_ms = 0;
+  }
+}
+
+double Impairment::SampleDelay() {
+  double jitter_ms = 0;
+  if (config.delay_jitter_ms > 0) {
+    switch (config.delay_distribution) {
+      case DelayDistribution::kNormal:
+        jitter_ms = std::normal_distribution<double>(0, config.delay_jitter_ms)(generator);
+        break;
+      case DelayDistribution::kExponential:
+        jitter_ms = std::exponential_distribution<double>(1.0 / config.delay_jitter_ms)(generator);
+        break;
+    }
+  }
+  return std::max(0.0, config.delay_mean_ms + jitter_ms);
+}
+
+const impairment_stats_t &Impairment::Stats() const {
+  return stats;
+}
+
+std::string Impairment::Summary() const {
+  std::stringstream ss;
+  ss << "pushed " << stats.pushed
+     << ", delivered " << stats.delivered
+     << ", lost " << stats.lost << " (" << stats.burst_lost << " in bursts)"
+     << ", reordered " << stats.reordered
+     << ", duplicated " << stats.duplicated;
+  const size_t waited = stats.delivered - stats.duplicated;
+  if (waited > 0) {
+    ss << ", mean delay " << stats.total_delay_ms / waited << "ms";
+  }
+  return ss.str();
+}
+
+bool ParseDelayDistribution(const std::string &name, DelayDistribution *distribution) {
+  if (name == "normal") {
+    *distribution = DelayDistribution::kNormal;
+    return true;
+  } else if (name == "exponential") {
+    *distribution = DelayDistribution::kExponential;
+    return true;
+  }
+  return false;
+}
+
+} // end namespace
@@ -0,0 +1,122 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+#include <phil/common/csv.h>
+#include <phil/common/imu.h>
+
+namespace phil {
+
+static double system_time_s() {
+  return std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+ImuSource::ImuSource(size_t capacity)
+    : running(false), capacity(capacity), dropped(0), have_offset(false), clock_offset_s(0), last_sensor_time_s(0) {}
+
+ImuSource::~ImuSource() {
+  Stop();
+}
+
+void ImuSource::Start() {
+  if (running) {
+    return;
+  }
+  running = true;
+  thread = std::thread(&ImuSource::Run, this);
+}
+
+void ImuSource::Stop() {
+  running = false;
+  if (thread.joinable()) {
+    thread.join();
+  }
+}
+
+size_t ImuSource::Drain(std::vector<imu_sample_t> *out) {
+  std::lock_guard<std::mutex> guard(lock);
+  const size_t n = samples.size();
+  out->insert(out->end(), samples.begin(), samples.end());
+  samples.clear();
+  return n;
+}
+
+size_t ImuSource::Dropped() const {
+  return dropped;
+}
+
+void ImuSource::Run() {
+  imu_sample_t sample{};
+  while (running && Next(&sample)) {
+    const double offset_s = system_time_s() - sample.sensor_time_s;
+    if (!have_offset) {
+      clock_offset_s = offset_s;
+      have_offset = true;
+    } else {
+      const double elapsed_s = std::max(0.0, sample.sensor_time_s - last_sensor_time_s);
+      clock_offset_s = std::min(offset_s, clock_offset_s + kMaxClockDrift * elapsed_s);
+    }
+    last_sensor_time_s = sample.sensor_time_s;
+    sample.stamp_s = sample.sensor_time_s + clock_offset_s;
+
+    std::lock_guard<std::mutex> guard(lock);
+    if (samples.size() >= capacity) {
+      samples.pop_front();
+      ++dropped;
+    }
+    samples.push_back(sample);
+  }
+  running = false;
+}
+
+struct CsvImuSource::reader_t {
+  explicit reader_t(const std::string &filename) : csv(filename) {
+    csv.read_header(io::ignore_extra_column, "accl_x", "accel_y", "accel_z", "gyro_x", "gyro_y", "gyro_z", "time");
+  }
+
+  io::CSVReader<7> csv;
+};
+
+CsvImuSource::CsvImuSource(const std::string &filename, double speed)
+    : reader(std::make_unique<reader_t>(filename)),
+      speed(speed),
+      started(false),
+      first_sensor_time_s(0),
+      start_time_s(0) {}
+
+CsvImuSource::~CsvImuSource() {
+  // the reading thread uses reader, so it has to stop before reader is destroyed
+  Stop();
+}
+
+bool CsvImuSource::Next(imu_sample_t *sample) {
+  double time_ms;
+  if (!reader->csv.read_row(sample->raw_acc_x,
+                            sample->raw_acc_y,
+                            sample->raw_acc_z,
+                            sample->raw_gyro_x,
+                            sample->raw_gyro_y,
+                            sample->raw_gyro_z,
+                            time_ms)) {
+    return false;
+  }
+  sample->sensor_time_s = time_ms / 1e3;
+
+  if (!started) {
+    started = true;
+    first_sensor_time_s = sample->sensor_time_s;
+    start_time_s = system_time_s();
+  }
+
+  if (speed > 0) {
+    const double due_s = start_time_s + (sample->sensor_time_s - first_sensor_time_s) / speed;
+    const double wait_s = due_s - system_time_s();
+    if (wait_s > 0) {
+      std::this_thread::sleep_for(std::chrono::duration<double>(wait_s));
+    }
+  }
+
+  return true;
+}
+
+} // end namespace
@@ -0,0 +1,102 @@
+#include <cstring>
+#include <iostream>
+
+#include <phil/common/jpeg.h>
+
+namespace phil {
+
+JpegDecoder::JpegDecoder() : cinfo{}, error_manager{} {
+  cinfo.err = jpeg_std_error(&error_manager.pub);
+  error_manager.pub.error_exit = &JpegDecoder::OnError;
+  jpeg_create_decompress(&cinfo);
+}
+
+JpegDecoder::~JpegDecoder() {
+  jpeg_destroy_decompress(&cinfo);
+}
+
+void JpegDecoder::OnError(j_common_ptr cinfo) {
+  // libjpeg exits the process by default, so jump back to the decode call instead
+  char message[JMSG_LENGTH_MAX];
+  (*cinfo->err->format_message)(cinfo, message);
+  std::cerr << "failed to decode jpeg: [" << message << "]\n";
+  std::longjmp(reinterpret_cast<error_manager_t *>(cinfo->err)->jump, 1);
+}
+
+bool JpegDecoder::Start(const uint8_t *data, size_t size, int scale_denom) {
+  jpeg_mem_src(&cinfo, const_cast<uint8_t *>(data), static_cast<unsigned long>(size));
+  if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK) {
+    return false;
+  }
+  cinfo.out_color_space = JCS_GRAYSCALE;
+  cinfo.scale_num = 1;
+  cinfo.scale_denom = static_cast<unsigned int>(scale_denom);
+  return jpeg_start_decompress(&cinfo) == TRUE;
+}
+
+bool JpegDecoder::DecodeGray(const uint8_t *data, size_t size, int scale_denom, cv::Mat *gray) {
+  if (setjmp(error_manager.jump)) {
+    jpeg_abort_decompress(&cinfo);
+    return false;
+  }
+  if (!Start(data, size, scale_denom)) {
+    jpeg_abort_decompress(&cinfo);
+    return false;
+  }
+
+  gray->create(cinfo.output_height, cinfo.output_width, CV_8UC1);
+  while (cinfo.output_scanline < cinfo.output_height) {
+    JSAMPROW rows[1] = {gray->ptr(cinfo.output_scanline)};
+    jpeg_read_scanlines(&cinfo, rows, 1);
+  }
+  jpeg_finish_decompress(&cinfo);
+  return true;
+}
+
+bool JpegDecoder::DecodeGrayRegion(const uint8_t *data, size_t size, const cv::Rect &roi, cv::Mat *gray) {
+  if (setjmp(error_manager.jump)) {
+    jpeg_abort_decompress(&cinfo);
+    return false;
+  }
+  if (!Start(data, size, 1)) {
+    jpeg_abort_decompress(&cinfo);
+    return false;
+  }
+
+  const cv::Rect clipped = roi & cv::Rect(0, 0, cinfo.output_width, cinfo.output_height);
+  if (clipped.area() == 0) {
+    jpeg_abort_decompress(&cinfo);
+    return false;
+  }
+  gray->create(clipped.height, clipped.width, CV_8UC1);
+
+#if defined(LIBJPEG_TURBO_VERSION_NUMBER)
+  // the crop is widened to whole blocks, so remember where the region starts within it
+  JDIMENSION x_offset = static_cast<JDIMENSION>(clipped.x);
+  JDIMENSION width = static_cast<JDIMENSION>(clipped.width);
+  jpeg_crop_scanline(&cinfo, &x_offset, &width);
+  const size_t skip = clipped.x - x_offset;
+  jpeg_skip_scanlines(&cinfo, static_cast<JDIMENSION>(clipped.y));
+#else
+  const size_t width = cinfo.output_width;
+  const size_t skip = clipped.x;
+  row.resize(width);
+  while (cinfo.output_scanline < static_cast<JDIMENSION>(clipped.y)) {
+    JSAMPROW rows[1] = {row.data()};
+    jpeg_read_scanlines(&cinfo, rows, 1);
+  }
+#endif
+
+  row.resize(width);
+  for (int r = 0; r < clipped.height; ++r) {
+    JSAMPROW rows[1] = {row.data()};
+    jpeg_read_scanlines(&cinfo, rows, 1);
+    std::memcpy(gray->ptr(r), row.data() + skip, clipped.width);
+  }
+
+  // nothing below the region is needed
+  jpeg_abort_decompress(&cinfo);
+  return true;
+}
+
+} // end namespace
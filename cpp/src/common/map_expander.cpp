@@ -0,0 +1,187 @@
+#include <algorithm>
+#include <iostream>
+
+#include <opencv2/calib3d.hpp>
+
+#include <phil/common/atomic_file.h>
+#include <phil/common/map_expander.h>
+
+namespace phil {
+
+MapExpander::MapExpander(const aruco::MarkerMap &map,
+                         const std::string &filename,
+                         const map_expander_config_t &config)
+    : config(config), filename(filename), map(map), version(0), frame(0), save_pending(false), done(false) {
+  if (filename.empty()) {
+    return;
+  }
+
+  save_thread = std::thread([this]() {
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+      save_requested.wait(guard, [this]() { return save_pending || done; });
+      if (!save_pending) {
+        break;
+      }
+      save_pending = false;
+
+      // markers added while this one is saving just request another save
+      aruco::MarkerMap snapshot = this->map;
+      guard.unlock();
+      Save(std::move(snapshot));
+      guard.lock();
+    }
+  });
+}
+
+MapExpander::~MapExpander() {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    done = true;
+  }
+  save_requested.notify_all();
+  if (save_thread.joinable()) {
+    save_thread.join();
+  }
+}
+
+bool MapExpander::Observe(const std::vector<aruco::Marker> &markers,
+                          const cv::Mat &rt,
+                          const aruco::CameraParameters &camera_params) {
+  cv::Mat camera_T_map;
+  rt.convertTo(camera_T_map, CV_64F);
+  Eigen::Matrix3d R;
+  Eigen::Vector3d t;
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      R(i, j) = camera_T_map.at<double>(i, j);
+    }
+    t(i) = camera_T_map.at<double>(i, 3);
+  }
+  const Eigen::Matrix3d map_R_camera = R.transpose();
+  const Eigen::Vector3d map_t_camera = -R.transpose() * t;
+
+  // the same corner order as aruco::Marker and Marker3DInfo
+  const float half = static_cast<float>(config.marker_size / 2);
+  const std::vector<cv::Point3f> object{{-half, half, 0}, {half, half, 0}, {half, -half, 0}, {-half, -half, 0}};
+
+  std::lock_guard<std::mutex> guard(lock);
+  ++frame;
+  bool added = false;
+  for (const auto &marker : markers) {
+    if (marker.size() != 4 || map.getIndexOfMarkerId(marker.id) != -1) {
+      continue;
+    }
+    double min_side_px = cv::norm(marker[0] - marker[3]);
+    for (size_t i = 0; i + 1 < 4; ++i) {
+      min_side_px = std::min(min_side_px, static_cast<double>(cv::norm(marker[i + 1] - marker[i])));
+    }
+    if (min_side_px < config.min_side_px) {
+      continue;
+    }
+
+    cv::Mat rvec, tvec;
+    const std::vector<cv::Point2f> &corners = marker;
+    if (!cv::solvePnP(object, corners, camera_params.CameraMatrix, camera_params.Distorsion, rvec, tvec)) {
+      continue;
+    }
+    cv::Mat camera_R_marker;
+    cv::Rodrigues(rvec, camera_R_marker);
+    candidate_t::Corners observed;
+    for (int c = 0; c < 4; ++c) {
+      Eigen::Vector3d in_camera;
+      for (int i = 0; i < 3; ++i) {
+        in_camera(i) = camera_R_marker.at<double>(i, 0) * object[c].x + camera_R_marker.at<double>(i, 1) * object[c].y
+            + tvec.at<double>(i);
+      }
+      observed.col(c) = map_R_camera * in_camera + map_t_camera;
+    }
+
+    candidate_t &candidate = candidates[marker.id];
+    candidate.last_seen = frame;
+    if (candidate.n >= 3) {
+      const Eigen::Vector3d center_offset = observed.rowwise().mean() - candidate.mean.rowwise().mean();
+      if (center_offset.norm() > config.outlier_distance_m) {
+        continue;
+      }
+    }
+    ++candidate.n;
+    for (int c = 0; c < 4; ++c) {
+      const Eigen::Vector3d delta = observed.col(c) - candidate.mean.col(c);
+      candidate.mean.col(c) += delta / candidate.n;
+      candidate.scatter[c] += delta * (observed.col(c) - candidate.mean.col(c)).transpose();
+    }
+
+    if (Converged(candidate)) {
+      aruco::Marker3DInfo info(marker.id);
+      for (int c = 0; c < 4; ++c) {
+        info.points.emplace_back(candidate.mean(0, c), candidate.mean(1, c), candidate.mean(2, c));
+      }
+      map.push_back(info);
+      candidates.erase(marker.id);
+      added = true;
+    }
+  }
+
+  EvictCandidates();
+
+  if (added) {
+    ++version;
+    save_pending = !filename.empty();
+    save_requested.notify_all();
+  }
+  return added;
+}
+
+bool MapExpander::Converged(const candidate_t &candidate) const {
+  if (candidate.n < config.min_observations || candidate.n < 2) {
+    return false;
+  }
+
+  // gate on the spread of the observations rather than the error of the mean, which shrinks with n however biased the
+  // observations are, so a marker whose pose jumps around is never added
+  const double max_variance = config.max_corner_std_m * config.max_corner_std_m;
+  for (const auto &scatter : candidate.scatter) {
+    if (scatter.trace() / (candidate.n - 1) > max_variance) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void MapExpander::EvictCandidates() {
+  while (candidates.size() > config.max_candidates) {
+    auto oldest = std::min_element(candidates.begin(), candidates.end(), [](const auto &a, const auto &b) {
+      return a.second.last_seen < b.second.last_seen;
+    });
+    candidates.erase(oldest);
+  }
+}
+
+uint64_t MapExpander::Version() const {
+  std::lock_guard<std::mutex> guard(lock);
+  return version;
+}
+
+aruco::MarkerMap MapExpander::Map(uint64_t *version) const {
+  std::lock_guard<std::mutex> guard(lock);
+  if (version) {
+    *version = this->version;
+  }
+  return map;
+}
+
+void MapExpander::Save(aruco::MarkerMap snapshot) const {
+  // the extension decides whether the map is written as yaml or xml, and AtomicFile keeps it
+  AtomicFile file(filename);
+  try {
+    snapshot.saveToFile(file.TmpFilename());
+  }
+  catch (cv::Exception &e) {
+    std::cerr << "failed to save the expanded map to [" << file.TmpFilename() << "]: " << e.what() << "\n";
+    return;
+  }
+  file.Commit();
+}
+
+} // end namespace
@@ -0,0 +1,239 @@
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <phil/common/mjpeg_stream.h>
+
+namespace phil {
+
+constexpr size_t kReadSize = 64 * 1024;
+
+// JPEGs never contain an unstuffed 0xFF 0xD9 before their end, so this finds the end without a Content-Length
+constexpr uint8_t kEndOfImage[2] = {0xFF, 0xD9};
+
+MjpegStreamReader::MjpegStreamReader(const std::string &url) : port("80"), path("/"), fd(-1), buffer_begin(0) {
+  std::string rest = url;
+  const std::string scheme = "http://";
+  if (rest.compare(0, scheme.size(), scheme) == 0) {
+    rest = rest.substr(scheme.size());
+  }
+  const size_t slash = rest.find('/');
+  if (slash != std::string::npos) {
+    path = rest.substr(slash);
+    rest = rest.substr(0, slash);
+  }
+  const size_t colon = rest.find(':');
+  if (colon != std::string::npos) {
+    port = rest.substr(colon + 1);
+    rest = rest.substr(0, colon);
+  }
+  host = rest;
+}
+
+MjpegStreamReader::~MjpegStreamReader() {
+  Disconnect();
+}
+
+void MjpegStreamReader::Disconnect() {
+  if (fd >= 0) {
+    close(fd);
+    fd = -1;
+  }
+  buffer.clear();
+  buffer_begin = 0;
+}
+
+/**
+ * Connects without waiting longer than the timeout, which a blocking connect would for an unreachable host
+ * @return false with errno set if the connection failed or timed out
+ */
+static bool connect_with_timeout(int fd, const sockaddr *address, socklen_t address_size, double timeout_s) {
+  const int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    return false;
+  }
+  if (connect(fd, address, address_size) != 0) {
+    if (errno != EINPROGRESS) {
+      return false;
+    }
+    pollfd poll_fd{fd, POLLOUT, 0};
+    const int ready = poll(&poll_fd, 1, static_cast<int>(timeout_s * 1000));
+    if (ready <= 0) {
+      errno = ready == 0 ? ETIMEDOUT : errno;
+      return false;
+    }
+    int error = 0;
+    socklen_t error_size = sizeof(error);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_size) != 0) {
+      return false;
+    }
+    if (error != 0) {
+      errno = error;
+      return false;
+    }
+  }
+  // reads poll before they recv, so the socket goes back to blocking
+  return fcntl(fd, F_SETFL, flags) == 0;
+}
+
+bool MjpegStreamReader::Connect(double timeout_s) {
+  addrinfo hints{};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo *addresses = nullptr;
+  const int error = getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses);
+  if (error != 0) {
+    std::cerr << "failed to resolve [" << host << "]: [" << gai_strerror(error) << "]\n";
+    return false;
+  }
+
+  for (addrinfo *address = addresses; address != nullptr; address = address->ai_next) {
+    fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    if (connect_with_timeout(fd, address->ai_addr, address->ai_addrlen, timeout_s)) {
+      break;
+    }
+    const int connect_error = errno;
+    close(fd);
+    errno = connect_error;
+    fd = -1;
+  }
+  freeaddrinfo(addresses);
+  if (fd < 0) {
+    std::cerr << "failed to connect to [" << host << ":" << port << "]: [" << strerror(errno) << "]\n";
+    return false;
+  }
+
+  const std::string request = "GET " + path + " HTTP/1.0\r\nHost: " + host + "\r\n\r\n";
+  if (send(fd, request.data(), request.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(request.size())) {
+    std::cerr << "failed to send request to [" << host << "]: [" << strerror(errno) << "]\n";
+    Disconnect();
+    return false;
+  }
+
+  // skip the response headers, the boundary isn't needed since each part has its own headers
+  std::string line;
+  if (!ReadLine(&line, timeout_s) || line.find(" 200") == std::string::npos) {
+    std::cerr << "bad response from [" << host << ":" << port << path << "]: [" << line << "]\n";
+    Disconnect();
+    return false;
+  }
+  while (ReadLine(&line, timeout_s)) {
+    if (line.empty()) {
+      return true;
+    }
+  }
+  Disconnect();
+  return false;
+}
+
+bool MjpegStreamReader::Fill(double timeout_s) {
+  pollfd poll_fd{fd, POLLIN, 0};
+  const int ready = poll(&poll_fd, 1, static_cast<int>(timeout_s * 1000));
+  if (ready <= 0) {
+    return false;
+  }
+
+  // drop what's been consumed once it's most of the buffer, so it doesn't grow forever
+  if (buffer_begin > buffer.size() / 2) {
+    buffer.erase(buffer.begin(), buffer.begin() + buffer_begin);
+    buffer_begin = 0;
+  }
+  const size_t old_size = buffer.size();
+  buffer.resize(old_size + kReadSize);
+  const ssize_t bytes_read = recv(fd, buffer.data() + old_size, kReadSize, 0);
+  buffer.resize(old_size + std::max<ssize_t>(bytes_read, 0));
+  return bytes_read > 0;
+}
+
+bool MjpegStreamReader::ReadLine(std::string *line, double timeout_s) {
+  while (true) {
+    const auto begin = buffer.begin() + buffer_begin;
+    const auto newline = std::find(begin, buffer.end(), '\n');
+    if (newline != buffer.end()) {
+      line->assign(begin, newline);
+      if (!line->empty() && line->back() == '\r') {
+        line->pop_back();
+      }
+      buffer_begin = newline + 1 - buffer.begin();
+      return true;
+    }
+    if (!Fill(timeout_s)) {
+      return false;
+    }
+  }
+}
+
+bool MjpegStreamReader::Next(std::vector<uint8_t> *jpeg, double timeout_s) {
+  if (fd < 0 && !Connect(timeout_s)) {
+    return false;
+  }
+
+  // part headers, which end with an empty line. There may be empty lines before the boundary too.
+  long content_length = -1;
+  bool in_headers = false;
+  std::string line;
+  while (true) {
+    if (!ReadLine(&line, timeout_s)) {
+      Disconnect();
+      return false;
+    }
+    if (line.empty()) {
+      if (in_headers) {
+        break;
+      }
+      continue;
+    }
+    in_headers = true;
+    std::string lower = line;
+    std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+    const std::string length_header = "content-length:";
+    if (lower.compare(0, length_header.size(), length_header) == 0) {
+      content_length = std::strtol(line.c_str() + length_header.size(), nullptr, 10);
+    }
+  }
+
+  size_t end = 0;
+  if (content_length >= 0) {
+    while (buffer.size() - buffer_begin < static_cast<size_t>(content_length)) {
+      if (!Fill(timeout_s)) {
+        Disconnect();
+        return false;
+      }
+    }
+    end = buffer_begin + content_length;
+  } else {
+    // relative to buffer_begin, since Fill can move the unread data to the front of the buffer
+    size_t searched = 0;
+    while (true) {
+      const auto begin = buffer.begin() + buffer_begin;
+      const auto found = std::search(begin + searched, buffer.end(), kEndOfImage, kEndOfImage + 2);
+      if (found != buffer.end()) {
+        end = found + 2 - buffer.begin();
+        break;
+      }
+      // the marker could straddle the end of what's been read so far
+      searched = std::max<size_t>(buffer.size() - buffer_begin, 1) - 1;
+      if (!Fill(timeout_s)) {
+        Disconnect();
+        return false;
+      }
+    }
+  }
+
+  jpeg->assign(buffer.begin() + buffer_begin, buffer.begin() + end);
+  buffer_begin = end;
+  return true;
+}
+
+} // end namespace
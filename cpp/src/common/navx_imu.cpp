@@ -0,0 +1,65 @@
+#include <phil/common/imu.h>
+
+#ifdef PHIL_HAVE_NAVX
+#include <chrono>
+#include <AHRS.h>
+#endif
+
+namespace phil {
+
+#ifdef PHIL_HAVE_NAVX
+
+/**
+ * Polls the linux_navx_driver, which parses the serial stream on its own thread, and emits a sample every time the
+ * sensor timestamp changes. Polling at a few times the update rate means no sample is missed or duplicated.
+ */
+class NavxImuSource : public ImuSource {
+ public:
+  NavxImuSource(const std::string &device, unsigned int rate_hz)
+      : navx(device, AHRS::SerialDataType::kRawData, static_cast<uint8_t>(rate_hz)),
+        poll_period(std::chrono::microseconds(1000000 / (4 * rate_hz))),
+        last_timestamp(0) {}
+
+  ~NavxImuSource() override {
+    Stop();
+  }
+
+ protected:
+  bool Next(imu_sample_t *sample) override {
+    while (running) {
+      const long timestamp = navx.GetLastSensorTimestamp();
+      if (timestamp != last_timestamp) {
+        last_timestamp = timestamp;
+        sample->raw_acc_x = navx.GetRawAccelX();
+        sample->raw_acc_y = navx.GetRawAccelY();
+        sample->raw_acc_z = navx.GetRawAccelZ();
+        sample->raw_gyro_x = navx.GetRawGyroX();
+        sample->raw_gyro_y = navx.GetRawGyroY();
+        sample->raw_gyro_z = navx.GetRawGyroZ();
+        sample->sensor_time_s = timestamp / 1e3;
+        return true;
+      }
+      std::this_thread::sleep_for(poll_period);
+    }
+    return false;
+  }
+
+ private:
+  AHRS navx;
+  std::chrono::microseconds poll_period;
+  long last_timestamp;
+};
+
+std::unique_ptr<ImuSource> MakeNavxImuSource(const std::string &device, unsigned int rate_hz) {
+  return std::make_unique<NavxImuSource>(device, rate_hz);
+}
+
+#else
+
+std::unique_ptr<ImuSource> MakeNavxImuSource(const std::string &, unsigned int) {
+  return nullptr;
+}
+
+#endif
+
+} // end namespace
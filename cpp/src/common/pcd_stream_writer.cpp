@@ -0,0 +1,303 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#include <phil/common/pcd_stream_writer.h>
+#include <phil/common/pcdwriter.h>
+
+namespace phil {
+
+namespace {
+
+constexpr size_t kPointSize = sizeof(cv::Vec4f);
+constexpr size_t kNumFields = 4;
+constexpr size_t kPointsPerChunk = 4096;
+
+// the point counts in the header are padded to this width so they can be patched in place
+constexpr int kCountWidth = 10;
+
+constexpr int kLzfHashLog = 14;
+constexpr uint64_t kLzfMaxOffset = 1 << 13;
+constexpr uint64_t kLzfMaxMatch = 264; // the length of a back reference is stored as up to 7 + 255, less 2
+constexpr size_t kLzfMaxLiterals = 32;
+
+std::string PcdHeader(uint64_t num_points, const char *data) {
+  std::ostringstream header;
+  header << "# .PCD v0.7 - Point Cloud Data file format\n"
+            "VERSION 0.7\n"
+            "FIELDS x y z rgb\n"
+            "SIZE 4 4 4 4\n"
+            "TYPE F F F F\n"
+            "COUNT 1 1 1 1\n"
+         << "WIDTH " << std::left << std::setw(kCountWidth) << num_points << "\n"
+         << "HEIGHT 1\n"
+            "VIEWPOINT 0 0 0 1 0 0 0\n"
+         << "POINTS " << std::left << std::setw(kCountWidth) << num_points << "\n"
+         << "DATA " << data << "\n";
+  return header.str();
+}
+
+/**
+ * LZF compresses a stream of any length in constant memory, since back references reach at most 8KB back. The output
+ * is the format of liblzf, which pcl decompresses binary_compressed data with.
+ */
+class LzfWriter {
+ public:
+  explicit LzfWriter(std::ostream *out) : out(out), base(0), position(0), written(0), table(1 << kLzfHashLog, -1) {}
+
+  void Write(const char *data, size_t size) {
+    buffer.insert(buffer.end(), data, data + size);
+    Compress(false);
+  }
+
+  /**
+   * Compresses whatever is left
+   * @return the size of the compressed stream
+   */
+  uint64_t Finish() {
+    Compress(true);
+    FlushLiterals();
+    Flush();
+    return written;
+  }
+
+ private:
+  static uint32_t Hash(const uint8_t *p) {
+    const uint32_t v = (static_cast<uint32_t>(p[0]) << 16) | (static_cast<uint32_t>(p[1]) << 8) | p[2];
+    return (v * 2654435761u) >> (32 - kLzfHashLog);
+  }
+
+  void Compress(bool finish) {
+    const uint64_t end = base + buffer.size();
+    // until the end of the stream, keep enough input ahead that a match is never cut short
+    while (position < end && (finish || end - position >= kLzfMaxMatch)) {
+      const uint8_t *p = &buffer[position - base];
+      if (end - position < 3) {
+        AddLiteral(*p);
+        ++position;
+        continue;
+      }
+
+      const uint32_t h = Hash(p);
+      const int64_t ref = table[h];
+      table[h] = static_cast<int64_t>(position);
+      if (ref < static_cast<int64_t>(base) || position - ref > kLzfMaxOffset
+          || std::memcmp(&buffer[ref - base], p, 3) != 0) {
+        AddLiteral(*p);
+        ++position;
+        continue;
+      }
+
+      const uint8_t *r = &buffer[ref - base];
+      const size_t max_length = static_cast<size_t>(std::min(end - position, kLzfMaxMatch));
+      size_t length = 3;
+      while (length < max_length && r[length] == p[length]) {
+        ++length;
+      }
+
+      FlushLiterals();
+      const uint64_t offset = position - ref - 1;
+      const size_t encoded_length = length - 2;
+      if (encoded_length < 7) {
+        output.push_back(static_cast<uint8_t>((offset >> 8) | (encoded_length << 5)));
+      } else {
+        output.push_back(static_cast<uint8_t>((offset >> 8) | (7 << 5)));
+        output.push_back(static_cast<uint8_t>(encoded_length - 7));
+      }
+      output.push_back(static_cast<uint8_t>(offset & 0xff));
+
+      // so later matches can start inside this one
+      for (uint64_t i = position + 1; i < position + length && i + 3 <= end; ++i) {
+        table[Hash(&buffer[i - base])] = static_cast<int64_t>(i);
+      }
+      position += length;
+    }
+
+    // input further back than a reference can reach isn't needed any more
+    if (position - base > 2 * kLzfMaxOffset) {
+      const size_t drop = static_cast<size_t>(position - kLzfMaxOffset - base);
+      buffer.erase(buffer.begin(), buffer.begin() + drop);
+      base += drop;
+    }
+    Flush();
+  }
+
+  void AddLiteral(uint8_t byte) {
+    literals.push_back(byte);
+    if (literals.size() == kLzfMaxLiterals) {
+      FlushLiterals();
+    }
+  }
+
+  void FlushLiterals() {
+    if (literals.empty()) {
+      return;
+    }
+    output.push_back(static_cast<uint8_t>(literals.size() - 1));
+    output.insert(output.end(), literals.begin(), literals.end());
+    literals.clear();
+  }
+
+  void Flush() {
+    out->write(reinterpret_cast<const char *>(output.data()), output.size());
+    written += output.size();
+    output.clear();
+  }
+
+  std::ostream *out;
+  std::vector<uint8_t> buffer; // input from base on
+  uint64_t base;               // stream offset of buffer[0]
+  uint64_t position;           // stream offset of the next byte to compress
+  uint64_t written;
+  std::vector<int64_t> table;  // stream offset of the last 3 bytes with each hash
+  std::vector<uint8_t> literals;
+  std::vector<uint8_t> output;
+};
+
+} // end namespace
+
+PcdStreamWriter::PcdStreamWriter() : format(PcdFormat::BINARY), num_points(0) {}
+
+PcdStreamWriter::~PcdStreamWriter() {
+  if (file.is_open()) {
+    Close();
+  }
+}
+
+bool PcdStreamWriter::Open(const std::string &filename, PcdFormat format) {
+  if (file.is_open()) {
+    std::cerr << "[" << this->filename << "] is still open" << std::endl;
+    return false;
+  }
+  this->filename = filename;
+  this->format = format;
+  output = std::make_unique<AtomicFile>(filename);
+  spill_filename = filename + ".points.tmp";
+  num_points = 0;
+
+  file.open(output->TmpFilename(), std::ios::binary | std::ios::trunc);
+  if (!file.good()) {
+    std::cerr << "failed to open [" << output->TmpFilename() << "]: [" << strerror(errno) << "]" << std::endl;
+    return Abort();
+  }
+  if (format == PcdFormat::BINARY) {
+    file << PcdHeader(0, "binary");
+    return true;
+  }
+  spill.open(spill_filename, std::ios::binary | std::ios::trunc);
+  if (!spill.good()) {
+    std::cerr << "failed to open [" << spill_filename << "]: [" << strerror(errno) << "]" << std::endl;
+    return Abort();
+  }
+  return true;
+}
+
+void PcdStreamWriter::AddPoints(const std::vector<cv::Vec4f> &points) {
+  if (!file.is_open() || points.empty()) {
+    return;
+  }
+  std::ofstream &out = format == PcdFormat::BINARY ? file : spill;
+  out.write(reinterpret_cast<const char *>(points.data()), points.size() * kPointSize);
+  num_points += points.size();
+}
+
+void PcdStreamWriter::AddMarkerMap(const aruco::MarkerMap &map) {
+  const cv::Scalar red(255, 0, 0);
+  for (auto info : map) {
+    AddPoints(getPcdPoints(info.points, red));
+    AddPoints(getMarkerIdPcd(info, red));
+  }
+}
+
+void PcdStreamWriter::AddCameraPose(const cv::Mat &rt, float size) {
+  if (rt.empty()) {
+    return;
+  }
+  cv::Mat map_T_camera;
+  rt.convertTo(map_T_camera, CV_32F);
+  map_T_camera = map_T_camera.inv();
+  auto corners = aruco::Marker::get3DPoints(size);
+  for (auto &corner : corners) {
+    corner = mult(map_T_camera, corner);
+  }
+  AddPoints(getPcdPoints(corners, cv::Scalar(0, 255, 0), 25));
+}
+
+uint64_t PcdStreamWriter::NumPoints() const {
+  return num_points;
+}
+
+bool PcdStreamWriter::Close() {
+  if (!file.is_open()) {
+    return false;
+  }
+  // pcl reads the width, and the size of compressed data, as 32 bits
+  if (num_points * kPointSize > UINT32_MAX) {
+    std::cerr << "too many points for [" << filename << "]: [" << num_points << "]" << std::endl;
+    return Abort();
+  }
+
+  if (format == PcdFormat::BINARY) {
+    file.seekp(0);
+    file << PcdHeader(num_points, "binary");
+  } else {
+    spill.close();
+    if (!spill.good()) {
+      std::cerr << "failed to write [" << spill_filename << "]" << std::endl;
+      return Abort();
+    }
+    file << PcdHeader(num_points, "binary_compressed");
+    const std::streampos sizes_position = file.tellp();
+    uint32_t sizes[2] = {0, static_cast<uint32_t>(num_points * kPointSize)};
+    file.write(reinterpret_cast<const char *>(sizes), sizeof(sizes));
+
+    // one pass over the spilled points per field, each pass streaming only that field into the compressor
+    LzfWriter compressor(&file);
+    std::vector<cv::Vec4f> points(kPointsPerChunk);
+    std::vector<float> field(kPointsPerChunk);
+    for (size_t f = 0; f < kNumFields; ++f) {
+      std::ifstream in(spill_filename, std::ios::binary);
+      uint64_t remaining = num_points;
+      while (remaining > 0 && in.good()) {
+        const size_t n = static_cast<size_t>(std::min<uint64_t>(remaining, kPointsPerChunk));
+        in.read(reinterpret_cast<char *>(points.data()), n * kPointSize);
+        for (size_t i = 0; i < n; ++i) {
+          field[i] = points[i][f];
+        }
+        compressor.Write(reinterpret_cast<const char *>(field.data()), n * sizeof(float));
+        remaining -= n;
+      }
+      if (remaining > 0) {
+        std::cerr << "failed to read [" << spill_filename << "]" << std::endl;
+        return Abort();
+      }
+    }
+    sizes[0] = static_cast<uint32_t>(compressor.Finish());
+    file.seekp(sizes_position);
+    file.write(reinterpret_cast<const char *>(sizes), sizeof(sizes[0]));
+    std::remove(spill_filename.c_str());
+  }
+
+  file.close();
+  if (!file.good()) {
+    std::cerr << "failed to write [" << output->TmpFilename() << "]" << std::endl;
+    return Abort();
+  }
+  const bool committed = output->Commit();
+  output.reset();
+  return committed;
+}
+
+bool PcdStreamWriter::Abort() {
+  file.close();
+  spill.close();
+  output.reset();
+  std::remove(spill_filename.c_str());
+  return false;
+}
+
+} // end namespace
@@ -31,6 +31,8 @@ or implied, of Rafael Muñoz Salinas.
 #include <map>
 #include <opencv2/calib3d.hpp>
 #include <opencv2/imgproc.hpp>
+#include <phil/common/pcd_stream_writer.h>
+#include <phil/common/pcdwriter.h>
 using namespace std;
 
 void getRTfromMatrix44(const cv::Mat& M, cv::Mat& R, cv::Mat& T)
@@ -298,7 +300,7 @@ cv::Point3f mult(const cv::Mat& m, cv::Point3f p)
     return res;
 }
 
-std::vector<cv::Vec4f> getPcdPoints(const vector<cv::Point3f>& mpoints, cv::Scalar color, int npoints = 100)
+std::vector<cv::Vec4f> getPcdPoints(const vector<cv::Point3f>& mpoints, cv::Scalar color, int npoints)
 {
     vector<cv::Vec4f> points;
     double msize = cv::norm(mpoints[0] - mpoints[1]);
@@ -389,36 +391,11 @@ vector<cv::Vec4f> getMarkerIdPcd(aruco::Marker3DInfo& minfo, cv::Scalar color)
 void savePCDFile(string fpath, const aruco::MarkerMap& ms,
                  const std::map<int, cv::Mat> frame_pose_map)
 {
-    std::vector<cv::Vec4f> points2write;
-    for (auto m : ms)
-    {
-        cv::Scalar color;
-        color = cv::Scalar(255, 0, 0);
-        auto points4 = getPcdPoints(m.points, color);
-        points2write.insert(points2write.end(), points4.begin(), points4.end());
-        auto points_id = getMarkerIdPcd(m, color);
-        points2write.insert(points2write.end(), points_id.begin(), points_id.end());
-        // max_msize=std::max(max_msize,m.second.markerSize);
-    }
+    phil::PcdStreamWriter writer;
+    if (!writer.Open(fpath, phil::PcdFormat::BINARY))
+        return;
+    writer.AddMarkerMap(ms);
     for (auto frame_pose : frame_pose_map)
-    {
-        if (!frame_pose.second.empty())
-        {
-            cv::Mat g2c = frame_pose.second.inv();
-            auto mpoints = aruco::Marker::get3DPoints(ms[0].getMarkerSize() / 2);
-            for (auto& p : mpoints)
-                p = mult(g2c, p);
-            auto pcam = getPcdPoints(mpoints, cv::Scalar(0, 255, 0), 25);
-            points2write.insert(points2write.end(), pcam.begin(), pcam.end());
-        }
-    }
-    // now, the 3d points
-
-    std::ofstream filePCD(fpath, std::ios::binary);
-
-    filePCD << "# .PCD v.7 - Point Cloud Data file format\nVERSION .7\nFIELDS x y z rgb\nSIZE 4 4 4 4\nTYPE F F F "
-               "F\nCOUNT 1 1 1 1\nVIEWPOINT 0 0 0 1 0 0 0\nWIDTH "
-            << points2write.size() << "\nHEIGHT 1\nPOINTS " << points2write.size() << "\nDATA binary\n";
-
-    filePCD.write((char*)&points2write[0], points2write.size() * sizeof(points2write[0]));
+        writer.AddCameraPose(frame_pose.second, ms[0].getMarkerSize() / 2);
+    writer.Close();
 }
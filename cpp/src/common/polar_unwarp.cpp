@@ -0,0 +1,145 @@
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include <phil/common/polar_unwarp.h>
+
+namespace phil {
+
+// interpolation weights are fixed point with this many fractional bits. 7 keeps every intermediate within 16 bits.
+constexpr int kWeightBits = 7;
+constexpr int kWeightOne = 1 << kWeightBits;
+
+PolarUnwarper::PolarUnwarper(const polar_unwarp_config_t &config) : config(config) {
+  const size_t size = static_cast<size_t>(config.out_width) * config.out_height;
+  offsets.resize(size);
+  weights_x.resize(size);
+  weights_y.resize(size);
+
+  // the trig only depends on the column, so compute it once per column rather than once per pixel
+  std::vector<float> cos_angle(config.out_width);
+  std::vector<float> sin_angle(config.out_width);
+  for (int col = 0; col < config.out_width; ++col) {
+    const double angle = config.min_angle_rad + (config.max_angle_rad - config.min_angle_rad) * col / config.out_width;
+    cos_angle[col] = static_cast<float>(std::cos(angle));
+    sin_angle[col] = static_cast<float>(std::sin(angle));
+  }
+
+  for (int row = 0; row < config.out_height; ++row) {
+    const float radius = config.max_radius - (config.max_radius - config.min_radius) * row / config.out_height;
+    for (int col = 0; col < config.out_width; ++col) {
+      const size_t i = static_cast<size_t>(row) * config.out_width + col;
+      const float x = config.center_x + radius * cos_angle[col];
+      const float y = config.center_y + radius * sin_angle[col];
+      const long fixed_x = std::lround(x * kWeightOne);
+      const long fixed_y = std::lround(y * kWeightOne);
+      const long x0 = fixed_x >> kWeightBits;
+      const long y0 = fixed_y >> kWeightBits;
+
+      // the bottom right neighbor must also be in the source
+      if (x0 < 0 || y0 < 0 || x0 + 1 >= config.src_width || y0 + 1 >= config.src_height) {
+        offsets[i] = 0;
+        weights_x[i] = 0;
+        weights_y[i] = 0;
+        outside.push_back(static_cast<uint32_t>(i));
+        continue;
+      }
+      offsets[i] = static_cast<uint32_t>(y0 * config.src_stride + x0 * config.src_step);
+      weights_x[i] = static_cast<uint8_t>(fixed_x & (kWeightOne - 1));
+      weights_y[i] = static_cast<uint8_t>(fixed_y & (kWeightOne - 1));
+    }
+  }
+}
+
+void PolarUnwarper::Interpolate(const uint8_t *src, size_t begin, size_t end, uint8_t *dst) const {
+  const size_t step = config.src_step;
+  const size_t stride = config.src_stride;
+  for (size_t i = begin; i < end; ++i) {
+    const uint8_t *p = src + offsets[i];
+    const int fx = weights_x[i];
+    const int fy = weights_y[i];
+    const int top = (p[0] * (kWeightOne - fx) + p[step] * fx + kWeightOne / 2) >> kWeightBits;
+    const int bottom = (p[stride] * (kWeightOne - fx) + p[stride + step] * fx + kWeightOne / 2) >> kWeightBits;
+    dst[i] = static_cast<uint8_t>((top * (kWeightOne - fy) + bottom * fy + kWeightOne / 2) >> kWeightBits);
+  }
+}
+
+void PolarUnwarper::Unwarp(const uint8_t *src, uint8_t *dst) const {
+  const size_t size = offsets.size();
+  size_t i = 0;
+#if defined(__SSE2__) || defined(__ARM_NEON__) || defined(__ARM_NEON)
+  const size_t step = config.src_step;
+  const size_t stride = config.src_stride;
+  for (; i + 8 <= size; i += 8) {
+    // there's no gather, so collect the four neighbors of 8 pixels and interpolate them all at once
+    alignas(16) uint8_t top_left[8], top_right[8], bottom_left[8], bottom_right[8];
+    for (size_t j = 0; j < 8; ++j) {
+      const uint8_t *p = src + offsets[i + j];
+      top_left[j] = p[0];
+      top_right[j] = p[step];
+      bottom_left[j] = p[stride];
+      bottom_right[j] = p[stride + step];
+    }
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi16(kWeightOne);
+    const __m128i half = _mm_set1_epi16(kWeightOne / 2);
+    const __m128i fx = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(&weights_x[i])), zero);
+    const __m128i fy = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(&weights_y[i])), zero);
+    const __m128i inv_fx = _mm_sub_epi16(one, fx);
+    const __m128i inv_fy = _mm_sub_epi16(one, fy);
+    const __m128i tl = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(top_left)), zero);
+    const __m128i tr = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(top_right)), zero);
+    const __m128i bl = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(bottom_left)), zero);
+    const __m128i br = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(bottom_right)), zero);
+    // 255 * 128 + 64 fits in 16 bits, so none of these overflow
+    const __m128i top = _mm_srli_epi16(
+        _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(tl, inv_fx), _mm_mullo_epi16(tr, fx)), half), kWeightBits);
+    const __m128i bottom = _mm_srli_epi16(
+        _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(bl, inv_fx), _mm_mullo_epi16(br, fx)), half), kWeightBits);
+    const __m128i result = _mm_srli_epi16(
+        _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(top, inv_fy), _mm_mullo_epi16(bottom, fy)), half), kWeightBits);
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(dst + i), _mm_packus_epi16(result, zero));
+#else
+    const uint8x8_t one = vdup_n_u8(kWeightOne);
+    const uint8x8_t fx = vld1_u8(&weights_x[i]);
+    const uint8x8_t fy = vld1_u8(&weights_y[i]);
+    const uint8x8_t inv_fx = vsub_u8(one, fx);
+    const uint8x8_t inv_fy = vsub_u8(one, fy);
+    // the rounding shifts add half before shifting, the same as the scalar path
+    const uint8x8_t top = vrshrn_n_u16(vmlal_u8(vmull_u8(vld1_u8(top_left), inv_fx), vld1_u8(top_right), fx),
+                                       kWeightBits);
+    const uint8x8_t bottom = vrshrn_n_u16(vmlal_u8(vmull_u8(vld1_u8(bottom_left), inv_fx), vld1_u8(bottom_right), fx),
+                                          kWeightBits);
+    vst1_u8(dst + i, vrshrn_n_u16(vmlal_u8(vmull_u8(top, inv_fy), bottom, fy), kWeightBits));
+#endif
+  }
+#endif
+  Interpolate(src, i, size, dst);
+
+  for (const auto index : outside) {
+    dst[index] = 0;
+  }
+}
+
+void PolarUnwarper::UnwarpScalar(const uint8_t *src, uint8_t *dst) const {
+  Interpolate(src, 0, offsets.size(), dst);
+  for (const auto index : outside) {
+    dst[index] = 0;
+  }
+}
+
+int PolarUnwarper::Width() const {
+  return config.out_width;
+}
+
+int PolarUnwarper::Height() const {
+  return config.out_height;
+}
+
+} // end namespace
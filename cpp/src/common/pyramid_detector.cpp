@@ -0,0 +1,98 @@
+#include <algorithm>
+#include <cmath>
+
+#include <opencv2/imgproc.hpp>
+
+#include <phil/common/pyramid_detector.h>
+
+namespace phil {
+
+PyramidMarkerDetector::PyramidMarkerDetector(const std::string &dictionary, double min_side_px, int max_level)
+    : min_side_px(min_side_px), max_level(max_level), level(0) {
+  detector.setDictionary(dictionary);
+}
+
+int PyramidMarkerDetector::ChooseLevel(double expected_min_side_px) const {
+  int chosen = 0;
+  while (chosen < max_level && expected_min_side_px / (1 << (chosen + 1)) >= min_side_px) {
+    ++chosen;
+  }
+  return chosen;
+}
+
+std::vector<aruco::Marker> PyramidMarkerDetector::Detect(const cv::Mat &frame, double expected_min_side_px) {
+  if (frame.channels() == 1) {
+    gray = frame;
+  } else {
+    cv::cvtColor(frame, gray, cv::COLOR_BGR2GRAY);
+  }
+
+  level = ChooseLevel(expected_min_side_px);
+  if (level == 0) {
+    return detector.detect(gray);
+  }
+
+  // INTER_AREA averages the pixels being combined, so thin marker borders don't alias away
+  const double scale = 1.0 / (1 << level);
+  cv::resize(gray, scaled, cv::Size(), scale, scale, cv::INTER_AREA);
+  std::vector<aruco::Marker> markers = detector.detect(scaled);
+  if (markers.empty()) {
+    return markers;
+  }
+
+  // scale every corner back up, then refine them all in one call. The search window covers the error introduced by
+  // downscaling, which is at most a pixel at the coarse level.
+  std::vector<cv::Point2f> corners;
+  corners.reserve(markers.size() * 4);
+  const float upscale = 1 << level;
+  for (const auto &marker : markers) {
+    for (const auto &corner : marker) {
+      // pixel centers don't line up between levels, (0, 0) at the coarse level covers [0, 2^level) at full resolution
+      corners.emplace_back((corner.x + 0.5f) * upscale - 0.5f, (corner.y + 0.5f) * upscale - 0.5f);
+    }
+  }
+
+  const int half_window = (1 << level) + 1;
+  cv::cornerSubPix(gray,
+                   corners,
+                   cv::Size(half_window, half_window),
+                   cv::Size(-1, -1),
+                   cv::TermCriteria(cv::TermCriteria::MAX_ITER | cv::TermCriteria::EPS, 12, 0.01));
+
+  auto corner = corners.begin();
+  for (auto &marker : markers) {
+    for (auto &c : marker) {
+      c = *corner++;
+    }
+  }
+  return markers;
+}
+
+int PyramidMarkerDetector::Level() const {
+  return level;
+}
+
+double PyramidMarkerDetector::ExpectedMinSidePx(const std::vector<std::vector<cv::Point2f>> &projected_markers,
+                                                const cv::Size &frame_size) {
+  const cv::Rect_<float> frame_rect(0, 0, frame_size.width, frame_size.height);
+  double min_side_px = 0;
+  for (const auto &corners : projected_markers) {
+    const bool in_view = std::any_of(corners.begin(), corners.end(), [&](const cv::Point2f &c) {
+      return frame_rect.contains(c);
+    });
+    if (!in_view) {
+      continue;
+    }
+
+    for (size_t i = 0; i < corners.size(); ++i) {
+      const cv::Point2f side = corners[(i + 1) % corners.size()] - corners[i];
+      const double length = std::hypot(side.x, side.y);
+      if (min_side_px == 0 || length < min_side_px) {
+        min_side_px = length;
+      }
+    }
+  }
+  return min_side_px;
+}
+
+} // end namespace
@@ -0,0 +1,136 @@
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include <opencv2/calib3d.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include <phil/common/atomic_file.h>
+#include <phil/common/common.h>
+#include <phil/common/rectifier.h>
+
+namespace phil {
+
+constexpr char kRemapCacheMagic[8] = {'P', 'H', 'I', 'L', 'R', 'M', 'A', 'P'};
+constexpr uint32_t kRemapCacheVersion = 1;
+
+struct remap_cache_header_t {
+  char magic[8];
+  uint32_t version;
+  int32_t map1_type;
+  int32_t map2_type;
+  int32_t rows;
+  int32_t cols;
+  uint32_t padding;
+  uint64_t key;
+};
+
+bool SaveRemapCache(const std::string &filename, uint64_t key, const cv::Mat &map1, const cv::Mat &map2) {
+  if (map1.size() != map2.size() || !map1.isContinuous() || !map2.isContinuous()) {
+    std::cerr << "remap tables must be the same size and continuous" << std::endl;
+    return false;
+  }
+
+  remap_cache_header_t header{};
+  std::memcpy(header.magic, kRemapCacheMagic, sizeof(header.magic));
+  header.version = kRemapCacheVersion;
+  header.map1_type = map1.type();
+  header.map2_type = map2.type();
+  header.rows = map1.rows;
+  header.cols = map1.cols;
+  header.key = key;
+  return WriteFileAtomically(filename, [&](std::ostream &file) {
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char *>(map1.data), map1.total() * map1.elemSize());
+    file.write(reinterpret_cast<const char *>(map2.data), map2.total() * map2.elemSize());
+    return true;
+  });
+}
+
+bool LoadRemapCache(const std::string &filename, uint64_t key, cv::Mat *map1, cv::Mat *map2) {
+  std::ifstream file(filename, std::ios::binary);
+  if (!file.good()) {
+    return false;
+  }
+
+  remap_cache_header_t header{};
+  file.read(reinterpret_cast<char *>(&header), sizeof(header));
+  if (!file.good() || std::memcmp(header.magic, kRemapCacheMagic, sizeof(header.magic)) != 0
+      || header.version != kRemapCacheVersion || header.key != key || header.rows <= 0 || header.cols <= 0) {
+    return false;
+  }
+
+  map1->create(header.rows, header.cols, header.map1_type);
+  map2->create(header.rows, header.cols, header.map2_type);
+  file.read(reinterpret_cast<char *>(map1->data), map1->total() * map1->elemSize());
+  file.read(reinterpret_cast<char *>(map2->data), map2->total() * map2->elemSize());
+  return file.good();
+}
+
+/**
+ * Every input to the remap tables, so the cache is invalidated when the calibration or resolution changes
+ */
+static uint64_t rectification_key(const aruco::CameraParameters &camera_params) {
+  cv::Mat camera_matrix, distortion;
+  camera_params.CameraMatrix.convertTo(camera_matrix, CV_64F);
+  camera_params.Distorsion.convertTo(distortion, CV_64F);
+  uint64_t key = fnv1a(camera_matrix.data, camera_matrix.total() * camera_matrix.elemSize());
+  key = fnv1a(distortion.data, distortion.total() * distortion.elemSize(), key);
+  const int32_t size[2] = {camera_params.CamSize.width, camera_params.CamSize.height};
+  return fnv1a(size, sizeof(size), key);
+}
+
+Rectifier::Rectifier(const aruco::CameraParameters &camera_params, const std::string &cache_dir)
+    : camera_params(camera_params), loaded_from_cache(false) {
+  const cv::Size size = camera_params.CamSize;
+
+  // alpha = 0 crops to the pixels that are valid everywhere, so there are no black borders for the detector to find
+  rectified_camera_matrix =
+      cv::getOptimalNewCameraMatrix(camera_params.CameraMatrix, camera_params.Distorsion, size, 0, size);
+
+  const uint64_t key = rectification_key(camera_params);
+  std::string cache_filename;
+  if (!cache_dir.empty()) {
+    std::stringstream ss;
+    ss << cache_dir << "/rectify_" << std::hex << key << std::dec << "_" << size.width << "x" << size.height << ".bin";
+    cache_filename = ss.str();
+    loaded_from_cache = LoadRemapCache(cache_filename, key, &map1, &map2);
+  }
+
+  if (!loaded_from_cache) {
+    cv::initUndistortRectifyMap(camera_params.CameraMatrix,
+                                camera_params.Distorsion,
+                                cv::Mat(),
+                                rectified_camera_matrix,
+                                size,
+                                CV_16SC2,
+                                map1,
+                                map2);
+    if (!cache_filename.empty()) {
+      SaveRemapCache(cache_filename, key, map1, map2);
+    }
+  }
+}
+
+aruco::CameraParameters Rectifier::RectifiedParameters() const {
+  cv::Mat camera_matrix;
+  rectified_camera_matrix.convertTo(camera_matrix, CV_32F);
+  return aruco::CameraParameters(camera_matrix, cv::Mat::zeros(4, 1, CV_32F), camera_params.CamSize);
+}
+
+void Rectifier::Rectify(const cv::Mat &frame, cv::Mat *rectified) const {
+  cv::remap(frame, *rectified, map1, map2, cv::INTER_LINEAR);
+}
+
+void Rectifier::RectifyRoi(const cv::Mat &frame, const cv::Rect &roi, cv::Mat *rectified) const {
+  // sub-tables still point into the whole distorted frame, so only the pixels of roi get computed
+  const cv::Rect clipped = roi & cv::Rect(cv::Point(0, 0), map1.size());
+  cv::remap(frame, *rectified, map1(clipped), map2(clipped), cv::INTER_LINEAR);
+}
+
+bool Rectifier::LoadedFromCache() const {
+  return loaded_from_cache;
+}
+
+} // end namespace
@@ -0,0 +1,169 @@
+#include <algorithm>
+
+#include <opencv2/calib3d.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include <phil/common/roi_detector.h>
+
+namespace phil {
+
+// markers closer than this to the camera plane, or behind it, aren't projected
+constexpr double kMinDepthM = 0.05;
+
+cv::Mat PredictRT(const cv::Mat &last_rt, const pose_t &last_pose, const pose_t &pose) {
+  cv::Mat rt;
+  last_rt.convertTo(rt, CV_64F);
+
+  // the robot's motion in the map frame: rotate about its old position, then move it to the new one
+  const double d_theta = yaw_diff_rad(pose.theta, last_pose.theta);
+  const double c = std::cos(d_theta);
+  const double s = std::sin(d_theta);
+  cv::Mat motion = (cv::Mat_<double>(4, 4) <<
+      c, -s, 0, pose.x - (c * last_pose.x - s * last_pose.y),
+      s, c, 0, pose.y - (s * last_pose.x + c * last_pose.y),
+      0, 0, 1, 0,
+      0, 0, 0, 1);
+
+  // the camera moved by motion in the map frame, so the map moved by its inverse in the camera frame
+  return rt * motion.inv();
+}
+
+std::vector<std::vector<cv::Point2f>> ProjectMarkers(const aruco::MarkerMap &map,
+                                                     const aruco::CameraParameters &camera_params,
+                                                     const cv::Mat &predicted_rt) {
+  cv::Mat rt;
+  predicted_rt.convertTo(rt, CV_64F);
+  const cv::Mat R = rt(cv::Rect(0, 0, 3, 3));
+  const cv::Mat t = rt(cv::Rect(3, 0, 1, 3)).clone();
+  cv::Mat rvec;
+  cv::Rodrigues(R, rvec);
+
+  std::vector<std::vector<cv::Point2f>> projected;
+  for (const auto &info : map) {
+    // projectPoints happily projects points behind the camera, so skip those markers
+    const bool in_front = std::all_of(info.points.begin(), info.points.end(), [&](const cv::Point3f &p) {
+      const double z = R.at<double>(2, 0) * p.x + R.at<double>(2, 1) * p.y + R.at<double>(2, 2) * p.z + t.at<double>(2);
+      return z > kMinDepthM;
+    });
+    if (!in_front) {
+      continue;
+    }
+
+    projected.emplace_back();
+    cv::projectPoints(info.points, rvec, t, camera_params.CameraMatrix, camera_params.Distorsion, projected.back());
+  }
+  return projected;
+}
+
+RoiMarkerDetector::RoiMarkerDetector(const aruco::MarkerMap &map,
+                                     const aruco::CameraParameters &camera_params,
+                                     const std::string &dictionary,
+                                     FullFrameDetector full_frame_detector,
+                                     unsigned int full_frame_period,
+                                     int padding_px)
+    : map(map),
+      camera_params(camera_params),
+      full_frame_detector(std::move(full_frame_detector)),
+      full_frame_period(full_frame_period),
+      padding_px(padding_px),
+      frames_since_full_frame(0),
+      full_frame_count(0),
+      roi_count(0) {
+  roi_detector.setDictionary(dictionary);
+}
+
+std::vector<aruco::Marker> RoiMarkerDetector::Detect(const cv::Mat &frame, const cv::Mat &predicted_rt) {
+  ++frames_since_full_frame;
+  if (predicted_rt.empty() || frames_since_full_frame >= full_frame_period) {
+    return DetectFullFrame(frame);
+  }
+
+  rois = PredictRois(predicted_rt, frame.size());
+  if (rois.empty()) {
+    return DetectFullFrame(frame);
+  }
+
+  std::vector<aruco::Marker> markers;
+  for (const auto &roi : rois) {
+    const cv::Point2f offset(roi.x, roi.y);
+    const cv::Mat region = region_extractor ? region_extractor(frame, roi) : frame(roi);
+    for (auto &marker : roi_detector.detect(region)) {
+      for (auto &corner : marker) {
+        corner += offset;
+      }
+      markers.push_back(marker);
+    }
+  }
+
+  // tracking is lost, maybe the prediction was bad
+  if (markers.empty()) {
+    return DetectFullFrame(frame);
+  }
+
+  ++roi_count;
+  return markers;
+}
+
+void RoiMarkerDetector::SetRegionExtractor(RegionExtractor extractor) {
+  region_extractor = std::move(extractor);
+}
+
+void RoiMarkerDetector::SetMap(const aruco::MarkerMap &map) {
+  this->map = map;
+}
+
+std::vector<aruco::Marker> RoiMarkerDetector::DetectFullFrame(const cv::Mat &frame) {
+  frames_since_full_frame = 0;
+  ++full_frame_count;
+  rois.clear();
+  return full_frame_detector(frame);
+}
+
+std::vector<cv::Rect> RoiMarkerDetector::PredictRois(const cv::Mat &predicted_rt, const cv::Size &frame_size) const {
+  const cv::Rect frame_rect(cv::Point(0, 0), frame_size);
+  std::vector<cv::Rect> boxes;
+  for (const auto &corners : ProjectMarkers(map, camera_params, predicted_rt)) {
+    cv::Rect box = cv::boundingRect(corners);
+
+    // the further off the prediction is, the bigger the marker tends to be, so scale the margin with it
+    const int margin = padding_px + std::max(box.width, box.height) / 2;
+    box -= cv::Point(margin, margin);
+    box += cv::Size(2 * margin, 2 * margin);
+    box &= frame_rect;
+    if (box.area() > 0) {
+      boxes.push_back(box);
+    }
+  }
+
+  // merge overlapping boxes so no marker is detected twice
+  bool merged = true;
+  while (merged) {
+    merged = false;
+    for (size_t i = 0; i < boxes.size() && !merged; ++i) {
+      for (size_t j = i + 1; j < boxes.size(); ++j) {
+        if ((boxes[i] & boxes[j]).area() > 0) {
+          boxes[i] |= boxes[j];
+          boxes.erase(boxes.begin() + j);
+          merged = true;
+          break;
+        }
+      }
+    }
+  }
+
+  return boxes;
+}
+
+const std::vector<cv::Rect> &RoiMarkerDetector::Rois() const {
+  return rois;
+}
+
+size_t RoiMarkerDetector::FullFrameCount() const {
+  return full_frame_count;
+}
+
+size_t RoiMarkerDetector::RoiCount() const {
+  return roi_count;
+}
+
+} // end namespace
@@ -0,0 +1,201 @@
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <phil/common/shm.h>
+
+namespace phil {
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "atomics must be usable as futex words");
+static_assert((kShmRingSize & (kShmRingSize - 1)) == 0, "ring size must be a power of two");
+
+constexpr uint32_t kShmRingMask = kShmRingSize - 1;
+
+/**
+ * Sleeps as long as *word == expected, or until the timeout expires. A zero timeout means wait forever,
+ * which matches the semantics of SO_RCVTIMEO.
+ * @return false if the timeout expired
+ */
+static bool futex_wait(std::atomic<uint32_t> *word, uint32_t expected, timeval timeout) {
+  struct timespec ts{};
+  ts.tv_sec = timeout.tv_sec;
+  ts.tv_nsec = timeout.tv_usec * 1000;
+  const bool forever = timeout.tv_sec == 0 && timeout.tv_usec == 0;
+  auto rc = syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAIT, expected, forever ? nullptr : &ts,
+                    nullptr, 0);
+  return !(rc < 0 && errno == ETIMEDOUT);
+}
+
+static void futex_wake(std::atomic<uint32_t> *word) {
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+static shm_ring_t *map_ring(const std::string &name, int flags) {
+  int fd = shm_open(name.c_str(), flags, 0666);
+  if (fd < 0) {
+    std::cerr << "shm_open of [" << name << "] failed: [" << strerror(errno) << "]" << std::endl;
+    return nullptr;
+  }
+
+  if ((flags & O_CREAT) && ftruncate(fd, sizeof(shm_ring_t)) < 0) {
+    std::cerr << "ftruncate failed: [" << strerror(errno) << "]" << std::endl;
+    close(fd);
+    return nullptr;
+  }
+
+  void *addr = mmap(nullptr, sizeof(shm_ring_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    std::cerr << "mmap failed: [" << strerror(errno) << "]" << std::endl;
+    return nullptr;
+  }
+
+  return static_cast<shm_ring_t *>(addr);
+}
+
+ShmServer::ShmServer(const std::string &name) : name(name), ring(nullptr), last_read_seq(0), timeout{0, 0} {
+  ring = map_ring(name, O_CREAT | O_RDWR);
+  if (ring == nullptr) {
+    return;
+  }
+
+  ring->head.store(0);
+  ring->tail.store(0);
+  ring->replied.store(0);
+}
+
+ShmServer::~ShmServer() {
+  if (ring != nullptr) {
+    munmap(ring, sizeof(shm_ring_t));
+    shm_unlink(name.c_str());
+  }
+}
+
+bool ShmServer::WaitForRequest() {
+  while (true) {
+    const uint32_t head = ring->head.load(std::memory_order_acquire);
+    if (head != ring->tail.load(std::memory_order_relaxed)) {
+      return true;
+    }
+    if (!futex_wait(&ring->head, head, timeout)) {
+      return false;
+    }
+  }
+}
+
+std::pair<ssize_t, struct sockaddr_in> ShmServer::Read(data_t *result) {
+  if (ring == nullptr || !WaitForRequest()) {
+    errno = EAGAIN;
+    return {-1, {}};
+  }
+
+  const uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+  *result = ring->requests[tail & kShmRingMask];
+  last_read_seq = tail;
+  ring->tail.store(tail + 1, std::memory_order_release);
+  return {data_t_size, {}};
+}
+
+ssize_t ShmServer::Read() {
+  data_t scrap{};
+  return Read(&scrap).first;
+}
+
+ssize_t ShmServer::Reply(struct sockaddr_in, data_t reply) {
+  if (ring == nullptr) {
+    return -1;
+  }
+
+  reply.version = kDataVersion;
+  ring->replies[last_read_seq & kShmRingMask] = reply;
+  ring->replied.store(last_read_seq + 1, std::memory_order_release);
+  futex_wake(&ring->replied);
+  return data_t_size;
+}
+
+void ShmServer::SetTimeout(timeval timeout) {
+  this->timeout = timeout;
+}
+
+ShmClient::ShmClient(const std::string &name) : ring(nullptr), replies_read(0), timeout{0, 0} {
+  ring = map_ring(name, O_RDWR);
+  if (ring == nullptr) {
+    std::cerr << "Is phil_main running with shared memory enabled?" << std::endl;
+  }
+}
+
+ShmClient::~ShmClient() {
+  if (ring != nullptr) {
+    munmap(ring, sizeof(shm_ring_t));
+  }
+}
+
+data_t *ShmClient::Claim() {
+  if (ring == nullptr) {
+    return nullptr;
+  }
+
+  // the server may have consumed a request long before the client reads its reply, which would be overwritten by the
+  // reply to a request claimed a whole ring later
+  const uint32_t head = ring->head.load(std::memory_order_relaxed);
+  if (head - ring->tail.load(std::memory_order_acquire) >= kShmRingSize || head - replies_read >= kShmRingSize) {
+    return nullptr;
+  }
+  return &ring->requests[head & kShmRingMask];
+}
+
+uint32_t ShmClient::Publish() {
+  const uint32_t head = ring->head.load(std::memory_order_relaxed);
+  ring->requests[head & kShmRingMask].version = kDataVersion;
+  ring->head.store(head + 1, std::memory_order_release);
+  futex_wake(&ring->head);
+  return head;
+}
+
+bool ShmClient::WaitForReply(uint32_t seq, data_t *reply) {
+  while (true) {
+    const uint32_t replied = ring->replied.load(std::memory_order_acquire);
+    if (static_cast<int32_t>(replied - seq) > 0) {
+      *reply = ring->replies[seq & kShmRingMask];
+      if (static_cast<int32_t>(seq + 1 - replies_read) > 0) {
+        replies_read = seq + 1;
+      }
+      return true;
+    }
+    if (!futex_wait(&ring->replied, replied, timeout)) {
+      return false;
+    }
+  }
+}
+
+data_t ShmClient::Transaction(data_t data) {
+  data_t *slot = Claim();
+  if (slot == nullptr) {
+    std::cerr << "shared memory ring is full or not open" << std::endl;
+    return data_t{};
+  }
+
+  *slot = data;
+  const uint32_t seq = Publish();
+
+  if (!WaitForReply(seq, &data)) {
+    std::cerr << "timed out waiting for reply to request [" << seq << "]" << std::endl;
+    return data_t{};
+  } else if (data.version != kDataVersion) {
+    std::cerr << "received data_t version " << data.version << ", expected version " << kDataVersion << std::endl;
+    return data_t{};
+  }
+  return data;
+}
+
+void ShmClient::SetTimeout(timeval timeout) {
+  this->timeout = timeout;
+}
+
+} // end namespace
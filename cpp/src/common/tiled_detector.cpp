@@ -0,0 +1,104 @@
+#include <algorithm>
+#include <cmath>
+
+#include <opencv2/core/utility.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include <phil/common/tiled_detector.h>
+
+namespace phil {
+
+/**
+ * A functor rather than a lambda, because parallel_for_ only accepts lambdas in OpenCV 3.3 and later
+ */
+class DetectTiles : public cv::ParallelLoopBody {
+ public:
+  DetectTiles(const cv::Mat &gray,
+              const std::vector<cv::Rect> &tiles,
+              std::vector<std::unique_ptr<aruco::MarkerDetector>> *detectors,
+              std::vector<std::vector<aruco::Marker>> *tile_markers)
+      : gray(gray), tiles(tiles), detectors(detectors), tile_markers(tile_markers) {}
+
+  void operator()(const cv::Range &range) const override {
+    for (int i = range.start; i < range.end; ++i) {
+      auto &found = (*tile_markers)[i];
+      found = (*detectors)[i]->detect(gray(tiles[i]));
+      const cv::Point2f offset(tiles[i].x, tiles[i].y);
+      for (auto &marker : found) {
+        for (auto &corner : marker) {
+          corner += offset;
+        }
+      }
+    }
+  }
+
+ private:
+  const cv::Mat &gray;
+  const std::vector<cv::Rect> &tiles;
+  std::vector<std::unique_ptr<aruco::MarkerDetector>> *detectors;
+  std::vector<std::vector<aruco::Marker>> *tile_markers;
+};
+
+TiledMarkerDetector::TiledMarkerDetector(const std::string &dictionary, int cols, int rows, int overlap_px)
+    : cols(cols), rows(rows), overlap_px(overlap_px), tile_markers(cols * rows) {
+  for (int i = 0; i < cols * rows; ++i) {
+    detectors.push_back(std::make_unique<aruco::MarkerDetector>());
+    detectors.back()->setDictionary(dictionary);
+  }
+}
+
+std::vector<cv::Rect> TiledMarkerDetector::Tiles(const cv::Size &frame_size) const {
+  const cv::Rect frame_rect(cv::Point(0, 0), frame_size);
+  const int tile_w = (frame_size.width + cols - 1) / cols;
+  const int tile_h = (frame_size.height + rows - 1) / rows;
+
+  std::vector<cv::Rect> tiles;
+  for (int r = 0; r < rows; ++r) {
+    for (int c = 0; c < cols; ++c) {
+      cv::Rect tile(c * tile_w - overlap_px, r * tile_h - overlap_px, tile_w + 2 * overlap_px, tile_h + 2 * overlap_px);
+      tiles.push_back(tile & frame_rect);
+    }
+  }
+  return tiles;
+}
+
+std::vector<aruco::Marker> TiledMarkerDetector::Detect(const cv::Mat &frame) {
+  // convert once up front rather than once per tile
+  if (frame.channels() == 1) {
+    gray = frame;
+  } else {
+    cv::cvtColor(frame, gray, cv::COLOR_BGR2GRAY);
+  }
+
+  const auto tiles = Tiles(gray.size());
+  cv::parallel_for_(cv::Range(0, static_cast<int>(tiles.size())), DetectTiles(gray, tiles, &detectors, &tile_markers));
+
+  std::vector<aruco::Marker> markers;
+  for (auto &found : tile_markers) {
+    markers.insert(markers.end(), found.begin(), found.end());
+    found.clear();
+  }
+  return Deduplicate(std::move(markers));
+}
+
+std::vector<aruco::Marker> TiledMarkerDetector::Deduplicate(std::vector<aruco::Marker> markers) {
+  // biggest first, so the first detection of each marker that we keep is the best one
+  std::sort(markers.begin(), markers.end(), [](const aruco::Marker &a, const aruco::Marker &b) {
+    return cv::contourArea(a) > cv::contourArea(b);
+  });
+
+  std::vector<aruco::Marker> unique;
+  for (const auto &marker : markers) {
+    const cv::Point2f center = marker.getCenter();
+    const double side = std::sqrt(cv::contourArea(marker));
+    const bool duplicate = std::any_of(unique.begin(), unique.end(), [&](const aruco::Marker &kept) {
+      return kept.id == marker.id && cv::norm(kept.getCenter() - center) < side;
+    });
+    if (!duplicate) {
+      unique.push_back(marker);
+    }
+  }
+  return unique;
+}
+
+} // end namespace
@@ -1,6 +1,7 @@
 #include <iostream>
 #include <cstring>
 #include <netdb.h>
+#include <poll.h>
 
 #include <phil/common/udp.h>
 
@@ -39,10 +40,22 @@ std::pair<ssize_t, struct sockaddr_in> UDPServer::Read(data_t *result) {
 }
 
 ssize_t UDPServer::Reply(struct sockaddr_in client, data_t reply) {
+  reply.version = kDataVersion;
   return sendto(socket_fd, reinterpret_cast<uint8_t *>(&reply), data_t_size, 0,
                 reinterpret_cast<const sockaddr *>(&client), sockaddr_size);
 }
 
+std::pair<ssize_t, struct sockaddr_in> UDPServer::RawRead(uint8_t *buffer, size_t buffer_size) {
+  struct sockaddr_in remote_addr{};
+  auto recvlen = recvfrom(socket_fd, buffer, buffer_size, 0, reinterpret_cast<sockaddr *>(&remote_addr),
+                          &sockaddr_size);
+  return {recvlen, remote_addr};
+}
+
+ssize_t UDPServer::RawReply(struct sockaddr_in client, const uint8_t *reply, size_t reply_size) {
+  return sendto(socket_fd, reply, reply_size, 0, reinterpret_cast<const sockaddr *>(&client), sockaddr_size);
+}
+
 void UDPServer::SetTimeout(struct timeval timeout) {
   if (setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
     std::cerr << "setting socket timeout failed : [" << strerror(errno) << "]" << std::endl;
@@ -101,6 +114,7 @@ void UDPClient::SetTimeout(struct timeval timeout) {
 
 data_t UDPClient::Transaction(data_t data) {
   struct sockaddr response_addr{};
+  data.version = kDataVersion;
 
   if (sendto(socket_fd,
              reinterpret_cast<uint8_t *>(&data),
@@ -116,6 +130,9 @@ data_t UDPClient::Transaction(data_t data) {
   if (recvlen != data_t_size) {
     fprintf(stderr, "received %zd bytes, expected %zu bytes\n", recvlen, data_t_size);
     return data_t{};
+  } else if (data.version != kDataVersion) {
+    fprintf(stderr, "received data_t version %u, expected version %u\n", data.version, kDataVersion);
+    return data_t{};
   } else {
     return data;
   }
@@ -127,7 +144,7 @@ ssize_t UDPClient::Read(uint8_t *response, size_t response_size) {
   return recvlen;
 }
 
-void UDPClient::RawTransaction(uint8_t *request, size_t request_size, uint8_t *response, size_t response_size) {
+ssize_t UDPClient::RawTransaction(uint8_t *request, size_t request_size, uint8_t *response, size_t response_size) {
   struct sockaddr_in response_addr{};
 
   if (sendto(socket_fd, request, request_size, 0, (struct sockaddr *) &server_addr, sockaddr_size) < 0) {
@@ -136,10 +153,35 @@ void UDPClient::RawTransaction(uint8_t *request, size_t request_size, uint8_t *r
 
   // user is not expecting a response, so don't bother.
   if (response == nullptr) {
-    return;
+    return 0;
   }
 
-  recvfrom(socket_fd, response, response_size, 0, reinterpret_cast<sockaddr *>(&response_addr), &sockaddr_size);
+  return recvfrom(socket_fd, response, response_size, 0, reinterpret_cast<sockaddr *>(&response_addr),
+                  &sockaddr_size);
+}
+
+ssize_t UDPClient::Send(data_t data) {
+  data.version = kDataVersion;
+  ssize_t sent = sendto(socket_fd,
+                        reinterpret_cast<uint8_t *>(&data),
+                        data_t_size,
+                        0,
+                        (struct sockaddr *) &server_addr,
+                        sockaddr_size);
+  if (sent < 0) {
+    std::cerr << "sendto failed: [" << strerror(errno) << "]" << std::endl;
+  }
+  return sent;
+}
+
+bool UDPClient::Poll(struct timeval timeout) {
+  struct pollfd fds{};
+  fds.fd = socket_fd;
+  fds.events = POLLIN;
+  struct timespec ts{};
+  ts.tv_sec = timeout.tv_sec;
+  ts.tv_nsec = timeout.tv_usec * 1000;
+  return ppoll(&fds, 1, &ts, nullptr) > 0;
 }
 
 void UDPClient::Reconnect() {
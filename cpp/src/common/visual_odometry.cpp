@@ -0,0 +1,212 @@
+#include <algorithm>
+#include <cmath>
+
+#include <opencv2/calib3d.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/video/tracking.hpp>
+
+#include <phil/common/visual_odometry.h>
+
+namespace phil {
+
+namespace {
+
+/**
+ * Where a corner at p before the camera rotated by angle about axis appears afterwards, and how that changes with angle
+ */
+cv::Point2d RotatedCorner(const cv::Matx33d &R, const cv::Vec3d &axis, const cv::Point2f &p, cv::Point2d *derivative) {
+  const cv::Vec3d q = R * cv::Vec3d(p.x, p.y, 1);
+  if (q[2] <= 1e-6) {
+    *derivative = cv::Point2d(0, 0);
+    return cv::Point2d(NAN, NAN);
+  }
+  // the world rotates the other way in the camera frame
+  const cv::Vec3d dq = -axis.cross(q);
+  const double q2_squared = q[2] * q[2];
+  *derivative = cv::Point2d((dq[0] * q[2] - q[0] * dq[2]) / q2_squared, (dq[1] * q[2] - q[1] * dq[2]) / q2_squared);
+  return cv::Point2d(q[0] / q[2], q[1] / q[2]);
+}
+
+double Median(std::vector<double> values) {
+  const auto middle = values.begin() + values.size() / 2;
+  std::nth_element(values.begin(), middle, values.end());
+  return *middle;
+}
+
+} // end namespace
+
+VisualOdometry::VisualOdometry(const aruco::CameraParameters &camera_params,
+                               const cv::Mat &camera_to_robot,
+                               const visual_odometry_config_t &config)
+    : config(config), camera_size(camera_params.CamSize), previous_stamp_s(0) {
+  camera_params.CameraMatrix.convertTo(camera_matrix, CV_64F);
+  camera_params.Distorsion.convertTo(distortion, CV_64F);
+
+  // the robot's z axis in the camera frame is the last row of the camera to robot rotation
+  cv::Mat rotation;
+  camera_to_robot(cv::Rect(0, 0, 3, 3)).convertTo(rotation, CV_64F);
+  yaw_axis = cv::Vec3d(rotation.at<double>(2, 0), rotation.at<double>(2, 1), rotation.at<double>(2, 2));
+  yaw_axis /= cv::norm(yaw_axis);
+}
+
+bool VisualOdometry::Track(const cv::Mat &gray, double stamp_s, double *yaw_rate, double *yaw_rate_var) {
+  if (gray.size() != camera_size) {
+    camera_matrix.row(0) *= static_cast<double>(gray.cols) / camera_size.width;
+    camera_matrix.row(1) *= static_cast<double>(gray.rows) / camera_size.height;
+    camera_size = gray.size();
+    previous_frame.release();
+  }
+
+  bool measured = false;
+  const double dt_s = stamp_s - previous_stamp_s;
+  if (!previous_frame.empty() && !corners.empty() && dt_s > 0 && dt_s <= config.max_dt_s) {
+    cv::calcOpticalFlowPyrLK(previous_frame,
+                             gray,
+                             corners,
+                             tracked,
+                             status,
+                             error,
+                             cv::Size(21, 21),
+                             3,
+                             cv::TermCriteria(cv::TermCriteria::MAX_ITER | cv::TermCriteria::EPS, 20, 0.03));
+    std::vector<cv::Point2f> before;
+    size_t k = 0;
+    for (size_t i = 0; i < corners.size(); ++i) {
+      if (status[i]) {
+        before.push_back(corners[i]);
+        tracked[k++] = tracked[i];
+      }
+    }
+    tracked.resize(k);
+
+    if (before.size() >= static_cast<size_t>(config.min_inliers)) {
+      std::vector<cv::Point2f> before_normalized, after_normalized;
+      cv::undistortPoints(before, before_normalized, camera_matrix, distortion);
+      cv::undistortPoints(tracked, after_normalized, camera_matrix, distortion);
+      double angle, angle_var;
+      if (FitRotation(before_normalized, after_normalized, yaw_axis, config.min_inliers, &angle, &angle_var)) {
+        *yaw_rate = angle / dt_s;
+        *yaw_rate_var = std::max(angle_var / (dt_s * dt_s), config.min_yaw_rate_std * config.min_yaw_rate_std);
+        measured = true;
+      }
+    }
+    corners.swap(tracked);
+  } else {
+    corners.clear();
+  }
+
+  if (corners.size() < static_cast<size_t>(config.min_features)) {
+    FindCorners(gray);
+  }
+  gray.copyTo(previous_frame);
+  previous_stamp_s = stamp_s;
+  return measured;
+}
+
+void VisualOdometry::FindCorners(const cv::Mat &gray) {
+  // keep the corners that are still tracked and fill in the space between them
+  cv::Mat mask(gray.size(), CV_8UC1, cv::Scalar(255));
+  for (const auto &corner : corners) {
+    cv::circle(mask, corner, static_cast<int>(config.min_feature_distance_px), cv::Scalar(0), -1);
+  }
+  std::vector<cv::Point2f> found;
+  cv::goodFeaturesToTrack(gray,
+                          found,
+                          config.max_features - static_cast<int>(corners.size()),
+                          0.01,
+                          config.min_feature_distance_px,
+                          mask,
+                          3,
+                          false,
+                          0.04);
+  corners.insert(corners.end(), found.begin(), found.end());
+}
+
+bool VisualOdometry::FitRotation(const std::vector<cv::Point2f> &before,
+                                 const std::vector<cv::Point2f> &after,
+                                 const cv::Vec3d &axis,
+                                 int min_inliers,
+                                 double *angle,
+                                 double *angle_var,
+                                 int *inliers) {
+  if (before.size() != after.size() || before.size() < static_cast<size_t>(std::max(min_inliers, 1))) {
+    return false;
+  }
+
+  // start from the median of the angle each corner would give on its own, which ignores up to half being outliers
+  const cv::Matx33d identity = cv::Matx33d::eye();
+  std::vector<double> angles;
+  cv::Point2d J;
+  for (size_t i = 0; i < before.size(); ++i) {
+    const cv::Point2d r = RotatedCorner(identity, axis, before[i], &J) - cv::Point2d(after[i]);
+    if (J.dot(J) > 1e-12 && !std::isnan(r.x)) {
+      angles.push_back(-J.dot(r) / J.dot(J));
+    }
+  }
+  if (angles.size() < static_cast<size_t>(std::max(min_inliers, 1))) {
+    return false;
+  }
+  double theta = Median(angles);
+
+  // then Gauss-Newton with Tukey weights, with the cutoff scaled to the spread of the residuals
+  std::vector<double> errors(before.size());
+  std::vector<cv::Point2d> residuals(before.size());
+  std::vector<cv::Point2d> jacobians(before.size());
+  double cutoff = 0;
+  for (int iteration = 0; iteration < 10; ++iteration) {
+    cv::Matx33d R;
+    cv::Rodrigues(cv::Vec3d(axis * -theta), R);
+    for (size_t i = 0; i < before.size(); ++i) {
+      residuals[i] = RotatedCorner(R, axis, before[i], &jacobians[i]) - cv::Point2d(after[i]);
+      errors[i] = std::isnan(residuals[i].x) ? INFINITY : cv::norm(residuals[i]);
+    }
+    cutoff = 4.685 * std::max(1.4826 * Median(errors), 1e-4);
+
+    double JtJ = 0;
+    double Jtr = 0;
+    for (size_t i = 0; i < before.size(); ++i) {
+      if (errors[i] >= cutoff) {
+        continue;
+      }
+      const double u = errors[i] / cutoff;
+      const double w = (1 - u * u) * (1 - u * u);
+      JtJ += w * jacobians[i].dot(jacobians[i]);
+      Jtr += w * jacobians[i].dot(residuals[i]);
+    }
+    if (JtJ <= 0) {
+      return false;
+    }
+    const double step = -Jtr / JtJ;
+    theta += step;
+    if (std::abs(step) < 1e-9) {
+      break;
+    }
+  }
+
+  // the variance of the fit comes from the residuals of the corners that agree with it
+  cv::Matx33d R;
+  cv::Rodrigues(cv::Vec3d(axis * -theta), R);
+  int count = 0;
+  double sum_squared_error = 0;
+  double information = 0;
+  for (size_t i = 0; i < before.size(); ++i) {
+    const cv::Point2d r = RotatedCorner(R, axis, before[i], &J) - cv::Point2d(after[i]);
+    if (std::isnan(r.x) || cv::norm(r) >= cutoff) {
+      continue;
+    }
+    ++count;
+    sum_squared_error += r.dot(r);
+    information += J.dot(J);
+  }
+  if (inliers) {
+    *inliers = count;
+  }
+  if (count < min_inliers || count < 2 || information <= 0) {
+    return false;
+  }
+  *angle = theta;
+  *angle_var = sum_squared_error / (2 * count - 1) / information;
+  return true;
+}
+
+} // end namespace
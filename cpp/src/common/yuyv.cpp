@@ -0,0 +1,213 @@
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <linux/videodev2.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include <opencv2/imgproc.hpp>
+
+#include <phil/common/yuyv.h>
+
+namespace phil {
+
+constexpr unsigned int kNumBuffers = 4;
+
+void ExtractLuma(const uint8_t *yuyv, size_t stride, int width, int height, cv::Mat *gray) {
+  gray->create(height, width, CV_8UC1);
+  for (int r = 0; r < height; ++r) {
+    const uint8_t *src = yuyv + r * stride;
+    uint8_t *dst = gray->ptr(r);
+    int x = 0;
+#if defined(__SSE2__)
+    // Y is the low byte of each 16 bit pair, so mask off the chroma and pack the rest down to bytes
+    const __m128i luma_mask = _mm_set1_epi16(0x00FF);
+    for (; x + 16 <= width; x += 16) {
+      const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 2 * x));
+      const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 2 * x + 16));
+      const __m128i luma = _mm_packus_epi16(_mm_and_si128(a, luma_mask), _mm_and_si128(b, luma_mask));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x), luma);
+    }
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+    for (; x + 16 <= width; x += 16) {
+      vst1q_u8(dst + x, vld2q_u8(src + 2 * x).val[0]);
+    }
+#endif
+    for (; x < width; ++x) {
+      dst[x] = src[2 * x];
+    }
+  }
+}
+
+void YuyvToBgr(const uint8_t *yuyv, int width, int height, cv::Mat *bgr) {
+  const cv::Mat wrapped(height, width, CV_8UC2, const_cast<uint8_t *>(yuyv));
+  cv::cvtColor(wrapped, *bgr, CV_YUV2BGR_YUYV);
+}
+
+/**
+ * ioctl, retried if a signal interrupts it
+ */
+static int xioctl(int fd, unsigned long request, void *arg) {
+  int result;
+  do {
+    result = ioctl(fd, request, arg);
+  } while (result == -1 && errno == EINTR);
+  return result;
+}
+
+V4l2YuyvCamera::V4l2YuyvCamera(const std::string &device, int width, int height, int fps)
+    : fd(-1), width(width), height(height), stride(0) {
+  if (!Open(device, fps)) {
+    Close();
+  }
+}
+
+V4l2YuyvCamera::~V4l2YuyvCamera() {
+  Close();
+}
+
+bool V4l2YuyvCamera::Open(const std::string &device, int fps) {
+  fd = open(device.c_str(), O_RDWR | O_NONBLOCK);
+  if (fd < 0) {
+    std::cerr << "failed to open [" << device << "]: [" << strerror(errno) << "]\n";
+    return false;
+  }
+
+  v4l2_format format{};
+  format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  format.fmt.pix.width = static_cast<uint32_t>(width);
+  format.fmt.pix.height = static_cast<uint32_t>(height);
+  format.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+  format.fmt.pix.field = V4L2_FIELD_NONE;
+  if (xioctl(fd, VIDIOC_S_FMT, &format) == -1 || format.fmt.pix.pixelformat != V4L2_PIX_FMT_YUYV) {
+    std::cerr << "[" << device << "] doesn't support YUYV\n";
+    return false;
+  }
+  if (static_cast<int>(format.fmt.pix.width) != width || static_cast<int>(format.fmt.pix.height) != height) {
+    // the intrinsics were calibrated at the requested size, so frames of any other size can't be used
+    std::cerr << "[" << device << "] can only capture at " << format.fmt.pix.width << "x" << format.fmt.pix.height
+              << " instead of " << width << "x" << height << "\n";
+    return false;
+  }
+  stride = format.fmt.pix.bytesperline;
+
+  // not every driver lets the frame rate be set, so a failure here isn't fatal
+  v4l2_streamparm parm{};
+  parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  parm.parm.capture.timeperframe.numerator = 1;
+  parm.parm.capture.timeperframe.denominator = static_cast<uint32_t>(fps);
+  if (xioctl(fd, VIDIOC_S_PARM, &parm) == -1) {
+    std::cerr << "failed to set the frame rate of [" << device << "]: [" << strerror(errno) << "]\n";
+  }
+
+  v4l2_requestbuffers request{};
+  request.count = kNumBuffers;
+  request.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  request.memory = V4L2_MEMORY_MMAP;
+  if (xioctl(fd, VIDIOC_REQBUFS, &request) == -1 || request.count < 2) {
+    std::cerr << "failed to get capture buffers from [" << device << "]: [" << strerror(errno) << "]\n";
+    return false;
+  }
+
+  for (unsigned int i = 0; i < request.count; ++i) {
+    v4l2_buffer buffer{};
+    buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buffer.memory = V4L2_MEMORY_MMAP;
+    buffer.index = i;
+    if (xioctl(fd, VIDIOC_QUERYBUF, &buffer) == -1) {
+      std::cerr << "failed to query buffer " << i << " of [" << device << "]: [" << strerror(errno) << "]\n";
+      return false;
+    }
+    void *start = mmap(nullptr, buffer.length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, buffer.m.offset);
+    if (start == MAP_FAILED) {
+      std::cerr << "failed to map buffer " << i << " of [" << device << "]: [" << strerror(errno) << "]\n";
+      return false;
+    }
+    buffers.push_back({start, buffer.length});
+    if (xioctl(fd, VIDIOC_QBUF, &buffer) == -1) {
+      std::cerr << "failed to queue buffer " << i << " of [" << device << "]: [" << strerror(errno) << "]\n";
+      return false;
+    }
+  }
+
+  v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  if (xioctl(fd, VIDIOC_STREAMON, &type) == -1) {
+    std::cerr << "failed to start streaming from [" << device << "]: [" << strerror(errno) << "]\n";
+    return false;
+  }
+  return true;
+}
+
+void V4l2YuyvCamera::Close() {
+  if (fd >= 0) {
+    v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    xioctl(fd, VIDIOC_STREAMOFF, &type);
+  }
+  for (const auto &buffer : buffers) {
+    munmap(buffer.start, buffer.length);
+  }
+  buffers.clear();
+  if (fd >= 0) {
+    close(fd);
+    fd = -1;
+  }
+}
+
+bool V4l2YuyvCamera::IsOpened() const {
+  return fd >= 0;
+}
+
+bool V4l2YuyvCamera::Read(const std::function<void(const uint8_t *yuyv)> &use, double timeout_s) {
+  if (fd < 0) {
+    return false;
+  }
+
+  pollfd poll_fd{fd, POLLIN, 0};
+  if (poll(&poll_fd, 1, static_cast<int>(timeout_s * 1000)) <= 0) {
+    return false;
+  }
+
+  v4l2_buffer buffer{};
+  buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  buffer.memory = V4L2_MEMORY_MMAP;
+  if (xioctl(fd, VIDIOC_DQBUF, &buffer) == -1) {
+    if (errno != EAGAIN) {
+      std::cerr << "failed to dequeue a frame: [" << strerror(errno) << "]\n";
+    }
+    return false;
+  }
+
+  // a frame that's shorter than expected was cut off, so it isn't worth detecting on
+  const bool complete = buffer.bytesused >= stride * height && !(buffer.flags & V4L2_BUF_FLAG_ERROR);
+  if (complete) {
+    use(static_cast<const uint8_t *>(buffers[buffer.index].start));
+  }
+
+  if (xioctl(fd, VIDIOC_QBUF, &buffer) == -1) {
+    std::cerr << "failed to requeue a frame: [" << strerror(errno) << "]\n";
+  }
+  return complete;
+}
+
+int V4l2YuyvCamera::Width() const {
+  return width;
+}
+
+int V4l2YuyvCamera::Height() const {
+  return height;
+}
+
+size_t V4l2YuyvCamera::Stride() const {
+  return stride;
+}
+
+} // end namespace
@@ -0,0 +1,241 @@
+#include <cmath>
+#include <iostream>
+#include <numeric>
+#include <vector>
+
+#include <phil/localization/corner_measurement_model.h>
+
+namespace phil {
+namespace localization {
+
+/**
+ * Wilson-Hilferty approximation of a chi-square quantile, which is within a few percent from 2 degrees of freedom up
+ * @param dof degrees of freedom
+ * @param z the standard normal quantile at the same probability
+ */
+static double chi_square_quantile(Eigen::Index dof, double z) {
+  const double a = 2.0 / (9.0 * dof);
+  const double cube_root = 1 - a + z * std::sqrt(a);
+  return dof * cube_root * cube_root * cube_root;
+}
+
+bool ProjectCorners(const corner_observation_t &observation,
+                    const pose_t &robot_pose,
+                    Eigen::Matrix2Xd *projected,
+                    Eigen::Matrix<double, Eigen::Dynamic, 3> *jacobian) {
+  const Eigen::Index n = observation.map_points.cols();
+  const double c = std::cos(robot_pose.theta);
+  const double s = std::sin(robot_pose.theta);
+
+  // corners in the robot frame, q = Rz(theta)^T (p - [x y 0])
+  Eigen::Matrix3Xd q(3, n);
+  const Eigen::RowVectorXd dx = observation.map_points.row(0).array() - robot_pose.x;
+  const Eigen::RowVectorXd dy = observation.map_points.row(1).array() - robot_pose.y;
+  q.row(0) = c * dx + s * dy;
+  q.row(1) = -s * dx + c * dy;
+  q.row(2) = observation.map_points.row(2);
+
+  const Eigen::Isometry3d camera_T_robot = Eigen::Isometry3d(observation.robot_T_camera).inverse();
+  const Eigen::Matrix3d R = camera_T_robot.linear();
+  const Eigen::Matrix3Xd p = (R * q).colwise() + camera_T_robot.translation();
+  if ((p.row(2).array() <= 1e-6).any()) {
+    return false;
+  }
+  const Eigen::ArrayXd z_inv = p.row(2).array().inverse().transpose();
+  const Eigen::ArrayXd u = p.row(0).array().transpose() * z_inv;
+  const Eigen::ArrayXd v = p.row(1).array().transpose() * z_inv;
+  projected->resize(2, n);
+  projected->row(0) = observation.fx * u.transpose();
+  projected->row(1) = observation.fy * v.transpose();
+  if (!jacobian) {
+    return true;
+  }
+
+  // dq/dx and dq/dy are the same for every corner, dq/dtheta = (q_y, -q_x, 0)
+  const Eigen::Vector3d dp_dx = R * Eigen::Vector3d(-c, s, 0);
+  const Eigen::Vector3d dp_dy = R * Eigen::Vector3d(-s, -c, 0);
+  const Eigen::Matrix3Xd dp_dtheta = R.col(0) * q.row(1) - R.col(1) * q.row(0);
+
+  // d(X/Z) = (dX - X/Z dZ) / Z, and likewise for Y
+  jacobian->resize(2 * n, 3);
+  auto du = [&](const Eigen::ArrayXd &dX, const Eigen::ArrayXd &dZ) { return (dX - u * dZ) * z_inv * observation.fx; };
+  auto dv = [&](const Eigen::ArrayXd &dY, const Eigen::ArrayXd &dZ) { return (dY - v * dZ) * z_inv * observation.fy; };
+  const Eigen::ArrayXd ones = Eigen::ArrayXd::Ones(n);
+  // u and v of each corner alternate down the rows
+  using Rows = Eigen::Map<Eigen::MatrixXd, 0, Eigen::Stride<Eigen::Dynamic, 2>>;
+  Rows u_rows(jacobian->data(), n, 3, Eigen::Stride<Eigen::Dynamic, 2>(2 * n, 2));
+  Rows v_rows(jacobian->data() + 1, n, 3, Eigen::Stride<Eigen::Dynamic, 2>(2 * n, 2));
+  u_rows.col(0) = du(dp_dx(0) * ones, dp_dx(2) * ones).matrix();
+  u_rows.col(1) = du(dp_dy(0) * ones, dp_dy(2) * ones).matrix();
+  u_rows.col(2) = du(dp_dtheta.row(0).transpose().array(), dp_dtheta.row(2).transpose().array()).matrix();
+  v_rows.col(0) = dv(dp_dx(1) * ones, dp_dx(2) * ones).matrix();
+  v_rows.col(1) = dv(dp_dy(1) * ones, dp_dy(2) * ones).matrix();
+  v_rows.col(2) = dv(dp_dtheta.row(1).transpose().array(), dp_dtheta.row(2).transpose().array()).matrix();
+  return true;
+}
+
+CornerMeasurementPdf::CornerMeasurementPdf(const BFL::Gaussian &additiveNoise)
+    : AnalyticConditionalGaussianAdditiveNoise(additiveNoise, 1),
+      observation(nullptr),
+      motion{0, 0, 0},
+      linearized(false),
+      linearized_pose{0, 0, 0} {}
+
+void CornerMeasurementPdf::SetObservation(const corner_observation_t *observation, const pose_t &motion) {
+  this->observation = observation;
+  this->motion = motion;
+  linearized = false;
+}
+
+void CornerMeasurementPdf::Linearize() const {
+  const MatrixWrapper::ColumnVector state = ConditionalArgumentGet(0);
+  const pose_t pose{state(1) - motion.x, state(2) - motion.y, state(3) - motion.theta};
+  if (linearized && pose.x == linearized_pose.x && pose.y == linearized_pose.y && pose.theta == linearized_pose.theta) {
+    return;
+  }
+  // CornerMeasurementModel checked that the corners are in front of the camera at this state
+  ProjectCorners(*observation, pose, &projected, &jacobian);
+  linearized = true;
+  linearized_pose = pose;
+}
+
+MatrixWrapper::ColumnVector CornerMeasurementPdf::ExpectedValueGet() const {
+  Linearize();
+  MatrixWrapper::ColumnVector measurement(static_cast<int>(2 * projected.cols()));
+  for (Eigen::Index i = 0; i < projected.cols(); ++i) {
+    measurement(2 * i + 1) = projected(0, i);
+    measurement(2 * i + 2) = projected(1, i);
+  }
+  return measurement + AdditiveNoiseMuGet();
+}
+
+MatrixWrapper::Matrix CornerMeasurementPdf::dfGet(unsigned int i) const {
+  if (i == 0)//derivative to the first conditional argument (x)
+  {
+    Linearize();
+    MatrixWrapper::Matrix df(static_cast<int>(jacobian.rows()), ConditionalArgumentGet(0).rows());
+    df = 0;
+    for (Eigen::Index r = 0; r < jacobian.rows(); ++r) {
+      for (int c = 0; c < 3; ++c) {
+        df(r + 1, c + 1) = jacobian(r, c);
+      }
+    }
+    return df;
+  } else {
+    if (i >= NumConditionalArgumentsGet()) {
+      std::cerr << "This pdf Only has " << NumConditionalArgumentsGet() << " conditional arguments\n";
+      exit(- BFL_ERRMISUSE);
+    } else {
+      std::cerr << "The df is not implemented for the" << i << "th conditional argument\n";
+      exit(- BFL_ERRMISUSE);
+    }
+  }
+}
+
+CornerMeasurementModel::CornerMeasurementModel(const corner_measurement_config_t &config) : config(config) {}
+
+bool CornerMeasurementModel::Update(BFL::ExtendedKalmanFilter *filter,
+                                    const corner_observation_t &observation,
+                                    const pose_t &motion) {
+  const auto num_corners = static_cast<size_t>(observation.map_points.cols());
+  if (num_corners == 0 || observation.normalized.cols() != observation.map_points.cols()) {
+    return false;
+  }
+
+  // the filter linearizes at its estimate, which only works if every corner is in front of the camera there
+  const MatrixWrapper::ColumnVector state = filter->PostGet()->ExpectedValueGet();
+  const pose_t pose{state(1) - motion.x, state(2) - motion.y, state(3) - motion.theta};
+  if (!ProjectCorners(observation, pose, &projected, &jacobian)) {
+    return false;
+  }
+
+  // the innovation of each corner has covariance H P H^T + R, with P the covariance of x, y and theta
+  const MatrixWrapper::SymmetricMatrix state_covariance = filter->PostGet()->CovarianceGet();
+  Eigen::Matrix3d P;
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      P(i, j) = state_covariance(i + 1, j + 1);
+    }
+  }
+  const double variance = config.corner_std_px * config.corner_std_px;
+  Eigen::Matrix2Xd measured(2, observation.normalized.cols());
+  measured.row(0) = observation.fx * observation.normalized.row(0);
+  measured.row(1) = observation.fy * observation.normalized.row(1);
+  const Eigen::Matrix2Xd innovation = measured - projected;
+
+  // drop the corner that contributes the most to the Mahalanobis distance of the innovation until the rest agree with
+  // the estimate, so a single misplaced corner doesn't throw out the others
+  std::vector<Eigen::Index> kept(static_cast<size_t>(innovation.cols()));
+  std::iota(kept.begin(), kept.end(), 0);
+  Eigen::MatrixXd H;
+  Eigen::VectorXd r;
+  while (true) {
+    const auto num_kept = static_cast<Eigen::Index>(kept.size());
+    H.resize(2 * num_kept, 3);
+    r.resize(2 * num_kept);
+    for (Eigen::Index k = 0; k < num_kept; ++k) {
+      H.middleRows<2>(2 * k) = jacobian.middleRows<2>(2 * kept[k]);
+      r.segment<2>(2 * k) = innovation.col(kept[k]);
+    }
+    const Eigen::MatrixXd S = H * P * H.transpose() + variance * Eigen::MatrixXd::Identity(2 * num_kept, 2 * num_kept);
+    const Eigen::MatrixXd S_inv = S.ldlt().solve(Eigen::MatrixXd::Identity(2 * num_kept, 2 * num_kept));
+    const Eigen::VectorXd w = S_inv * r;
+    if (r.dot(w) <= chi_square_quantile(2 * num_kept, config.gate_z)) {
+      break;
+    }
+    if (num_kept == 1) {
+      return false;
+    }
+
+    // leaving out corner k lowers the distance by w_k^T (S_inv_kk)^-1 w_k
+    Eigen::Index worst = 0;
+    double worst_reduction = -1;
+    for (Eigen::Index k = 0; k < num_kept; ++k) {
+      const Eigen::Vector2d w_k = w.segment<2>(2 * k);
+      const double reduction = w_k.dot(S_inv.block<2, 2>(2 * k, 2 * k).ldlt().solve(w_k));
+      if (reduction > worst_reduction) {
+        worst = k;
+        worst_reduction = reduction;
+      }
+    }
+    kept.erase(kept.begin() + worst);
+  }
+
+  const auto num_kept = static_cast<Eigen::Index>(kept.size());
+  inliers.map_points.resize(3, num_kept);
+  inliers.normalized.resize(2, num_kept);
+  inliers.robot_T_camera = observation.robot_T_camera;
+  inliers.fx = observation.fx;
+  inliers.fy = observation.fy;
+  for (Eigen::Index k = 0; k < num_kept; ++k) {
+    inliers.map_points.col(k) = observation.map_points.col(kept[k]);
+    inliers.normalized.col(k) = observation.normalized.col(kept[k]);
+  }
+
+  const int dim = static_cast<int>(2 * num_kept);
+  model_t &model = models[kept.size()];
+  if (!model.pdf) {
+    MatrixWrapper::ColumnVector noise_mean(dim);
+    noise_mean = 0;
+    MatrixWrapper::SymmetricMatrix noise_covariance(dim);
+    noise_covariance = 0;
+    for (int i = 1; i <= dim; ++i) {
+      noise_covariance(i, i) = variance;
+    }
+    model.pdf = std::make_unique<CornerMeasurementPdf>(BFL::Gaussian(noise_mean, noise_covariance));
+    model.model = std::make_unique<BFL::AnalyticMeasurementModelGaussianUncertainty>(model.pdf.get());
+  }
+
+  MatrixWrapper::ColumnVector measurement(dim);
+  for (Eigen::Index k = 0; k < num_kept; ++k) {
+    measurement(2 * k + 1) = measured(0, kept[k]);
+    measurement(2 * k + 2) = measured(1, kept[k]);
+  }
+  model.pdf->SetObservation(&inliers, motion);
+  filter->Update(model.model.get(), measurement);
+  model.pdf->SetObservation(nullptr, motion);
+  return true;
+}
+
+}
+}
@@ -105,6 +105,22 @@ EKF::EKF(double W, double alpha, double dt_s)
       std::make_unique<BFL::LinearAnalyticConditionalGaussian>(beacon_measurement_H, beacon_measurement_uncertainty);
   beacon_measurement_model =
       std::make_unique<BFL::LinearAnalyticMeasurementModelGaussianUncertainty>(beacon_measurement_pdf.get());
+
+  // heading change from visual odometry, whose variance comes with each measurement
+  constexpr int heading_change_dim = 1;
+  MatrixWrapper::Matrix heading_change_measurement_H(heading_change_dim, localization::N);
+  heading_change_measurement_H << 0, 0, 1, 0, 0, 0, 0, 0, 0;
+  MatrixWrapper::ColumnVector heading_change_measurement_mean(heading_change_dim);
+  heading_change_measurement_mean = 0;
+  MatrixWrapper::SymmetricMatrix heading_change_measurement_covariance(heading_change_dim);
+  heading_change_measurement_covariance = 0.001;
+  BFL::Gaussian heading_change_measurement_uncertainty(heading_change_measurement_mean,
+                                                       heading_change_measurement_covariance);
+  heading_change_measurement_pdf =
+      std::make_unique<BFL::LinearAnalyticConditionalGaussian>(heading_change_measurement_H,
+                                                               heading_change_measurement_uncertainty);
+  heading_change_measurement_model =
+      std::make_unique<BFL::LinearAnalyticMeasurementModelGaussianUncertainty>(heading_change_measurement_pdf.get());
 }
 
 void EKF::ZeroVelocityUpdate() {
@@ -115,4 +131,15 @@ void EKF::ZeroVelocityUpdate() {
   filter->PostGet()->ExpectedValueSet(state);
 }
 
+void EKF::HeadingChangeUpdate(double theta_before, double theta_after, double heading_change, double variance) {
+  // measured as a heading, so the innovation is how much further the robot turned than the filter thinks it did
+  const auto state = filter->PostGet()->ExpectedValueGet();
+  MatrixWrapper::ColumnVector measurement(1);
+  measurement(1) = state(3) + theta_before + heading_change - theta_after;
+  MatrixWrapper::SymmetricMatrix covariance(1);
+  covariance(1, 1) = variance;
+  heading_change_measurement_pdf->AdditiveNoiseSigmaSet(covariance);
+  filter->Update(heading_change_measurement_model.get(), measurement);
+}
+
 }
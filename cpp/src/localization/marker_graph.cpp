@@ -0,0 +1,280 @@
+#include <deque>
+
+#include <eigen3/Eigen/Sparse>
+#include <eigen3/Eigen/SparseCholesky>
+
+#include <phil/localization/marker_graph.h>
+
+namespace phil {
+namespace localization {
+
+namespace {
+
+// stop iterating once the largest update is smaller than this
+constexpr double kConvergedStep = 1e-9;
+
+Eigen::Matrix3d skew(const Eigen::Vector3d &v) {
+  Eigen::Matrix3d m;
+  m << 0, -v(2), v(1),
+      v(2), 0, -v(0),
+      -v(1), v(0), 0;
+  return m;
+}
+
+Eigen::Vector3d log_so3(const Eigen::Matrix3d &R) {
+  const Eigen::AngleAxisd aa(R);
+  return aa.angle() * aa.axis();
+}
+
+Eigen::Matrix3d exp_so3(const Eigen::Vector3d &w) {
+  const double theta = w.norm();
+  if (theta < 1e-12) {
+    return Eigen::Matrix3d::Identity();
+  }
+  return Eigen::AngleAxisd(theta, w / theta).toRotationMatrix();
+}
+
+}
+
+MarkerGraph::MarkerGraph(int origin_id) : origin_id(origin_id) {
+  if (origin_id >= 0) {
+    tree[origin_id] = {origin_id, 0};
+  }
+}
+
+uint64_t MarkerGraph::Key(int from, int to) {
+  return (static_cast<uint64_t>(static_cast<uint32_t>(from)) << 32) | static_cast<uint32_t>(to);
+}
+
+void MarkerGraph::AddFrame(const std::map<int, Pose3d> &camera_T_markers) {
+  for (auto a = camera_T_markers.begin(); a != camera_T_markers.end(); ++a) {
+    const Pose3d a_T_camera = a->second.inverse();
+    for (auto b = std::next(a); b != camera_T_markers.end(); ++b) {
+      AddEdge(a->first, b->first, a_T_camera * b->second);
+    }
+  }
+}
+
+void MarkerGraph::AddEdge(int from, int to, const Pose3d &from_T_to) {
+  if (from == to) {
+    return;
+  }
+  if (origin_id < 0) {
+    origin_id = from;
+    tree[origin_id] = {origin_id, 0};
+  }
+
+  // edges are stored once, from the lower id to the higher
+  Pose3d measurement = from_T_to;
+  if (from > to) {
+    std::swap(from, to);
+    measurement = measurement.inverse();
+  }
+
+  const uint64_t key = Key(from, to);
+  auto edge = edges.find(key);
+  if (edge != edges.end()) {
+    // running mean of the translation, and the matching slerp for the rotation
+    auto &e = edge->second;
+    ++e.count;
+    const double weight = 1.0 / e.count;
+    const Eigen::Quaterniond q(e.from_T_to.rotation());
+    const Eigen::Quaterniond q_new(measurement.rotation());
+    const Eigen::Vector3d t = e.from_T_to.translation() + (measurement.translation() - e.from_T_to.translation()) * weight;
+    e.from_T_to.linear() = q.slerp(weight, q_new).toRotationMatrix();
+    e.from_T_to.translation() = t;
+    return;
+  }
+
+  edges[key] = {from, to, measurement, 1};
+  adjacency[from].push_back(to);
+  adjacency[to].push_back(from);
+  Relax({from, to});
+}
+
+void MarkerGraph::Relax(const std::vector<int> &seeds) {
+  std::deque<int> queue;
+  for (const auto seed : seeds) {
+    if (tree.count(seed)) {
+      queue.push_back(seed);
+    }
+  }
+
+  while (!queue.empty()) {
+    const int id = queue.front();
+    queue.pop_front();
+    const unsigned int depth = tree[id].depth + 1;
+    for (const auto neighbor : adjacency[id]) {
+      auto node = tree.find(neighbor);
+      if (node == tree.end() || node->second.depth > depth) {
+        tree[neighbor] = {id, depth};
+        queue.push_back(neighbor);
+      }
+    }
+  }
+}
+
+const MarkerGraph::edge_t *MarkerGraph::FindEdge(int from, int to) const {
+  const auto edge = edges.find(from < to ? Key(from, to) : Key(to, from));
+  return edge == edges.end() ? nullptr : &edge->second;
+}
+
+Pose3d MarkerGraph::EdgeTransform(int from, int to) const {
+  const edge_t *edge = FindEdge(from, to);
+  return from < to ? edge->from_T_to : Pose3d(edge->from_T_to.inverse());
+}
+
+bool MarkerGraph::ChainPose(int id, Pose3d *pose) const {
+  if (!tree.count(id)) {
+    return false;
+  }
+
+  // walk up to the origin or the nearest optimized ancestor, then compose back down
+  std::vector<int> chain;
+  int current = id;
+  while (current != origin_id && !optimized.count(current)) {
+    chain.push_back(current);
+    current = tree.at(current).parent;
+  }
+
+  Pose3d origin_T_current = current == origin_id ? Pose3d::Identity() : optimized.at(current);
+  for (auto child = chain.rbegin(); child != chain.rend(); ++child) {
+    origin_T_current = origin_T_current * EdgeTransform(current, *child);
+    current = *child;
+  }
+  *pose = origin_T_current;
+  return true;
+}
+
+bool MarkerGraph::Pose(int id, Pose3d *pose) const {
+  return ChainPose(id, pose);
+}
+
+std::vector<int> MarkerGraph::Path(int id) const {
+  std::vector<int> path;
+  if (!tree.count(id)) {
+    return path;
+  }
+  path.push_back(id);
+  while (id != origin_id) {
+    id = tree.at(id).parent;
+    path.push_back(id);
+  }
+  return path;
+}
+
+double MarkerGraph::Optimize(int max_iterations) {
+  // every connected marker but the origin is a variable, starting from the current estimate
+  std::unordered_map<int, int> index;
+  std::vector<int> ids;
+  std::vector<Pose3d> poses;
+  for (const auto &node : tree) {
+    if (node.first == origin_id) {
+      continue;
+    }
+    index[node.first] = static_cast<int>(ids.size());
+    ids.push_back(node.first);
+    poses.emplace_back();
+    ChainPose(node.first, &poses.back());
+  }
+  if (ids.empty()) {
+    return 0;
+  }
+
+  const int n = static_cast<int>(ids.size()) * 6;
+  double cost = 0;
+  for (int iteration = 0; iteration < max_iterations; ++iteration) {
+    std::vector<Eigen::Triplet<double>> triplets;
+    triplets.reserve(edges.size() * 4 * 36);
+    Eigen::VectorXd gradient = Eigen::VectorXd::Zero(n);
+    cost = 0;
+
+    for (const auto &entry : edges) {
+      const edge_t &edge = entry.second;
+      const auto i = index.find(edge.from);
+      const auto j = index.find(edge.to);
+      const bool i_free = i != index.end();
+      const bool j_free = j != index.end();
+      if ((!i_free && edge.from != origin_id) || (!j_free && edge.to != origin_id)) {
+        continue;
+      }
+
+      // residual of E = Z^-1 Ti^-1 Tj, which is the identity when the poses agree with the measurement
+      const Pose3d Ti = i_free ? poses[i->second] : Pose3d::Identity();
+      const Pose3d Tj = j_free ? poses[j->second] : Pose3d::Identity();
+      const Pose3d A = Ti.inverse() * Tj;
+      const Pose3d E = edge.from_T_to.inverse() * A;
+      Eigen::Matrix<double, 6, 1> r;
+      r << log_so3(E.linear()), E.translation();
+      const double weight = edge.count;
+      cost += weight * r.squaredNorm();
+
+      // jacobians for a perturbation T * (exp(w), v) of each pose, with w first
+      const Eigen::Matrix3d Rz_t = edge.from_T_to.linear().transpose();
+      Eigen::Matrix<double, 6, 6> Ji = Eigen::Matrix<double, 6, 6>::Zero();
+      Ji.block<3, 3>(0, 0) = -A.linear().transpose();
+      Ji.block<3, 3>(3, 0) = Rz_t * skew(A.translation());
+      Ji.block<3, 3>(3, 3) = -Rz_t;
+      Eigen::Matrix<double, 6, 6> Jj = Eigen::Matrix<double, 6, 6>::Zero();
+      Jj.block<3, 3>(0, 0).setIdentity();
+      Jj.block<3, 3>(3, 3) = E.linear();
+
+      const int blocks[2] = {i_free ? i->second * 6 : -1, j_free ? j->second * 6 : -1};
+      const Eigen::Matrix<double, 6, 6> *jacobians[2] = {&Ji, &Jj};
+      for (int a = 0; a < 2; ++a) {
+        if (blocks[a] < 0) {
+          continue;
+        }
+        gradient.segment<6>(blocks[a]) += weight * jacobians[a]->transpose() * r;
+        for (int b = 0; b < 2; ++b) {
+          if (blocks[b] < 0) {
+            continue;
+          }
+          const Eigen::Matrix<double, 6, 6> H = weight * jacobians[a]->transpose() * *jacobians[b];
+          for (int row = 0; row < 6; ++row) {
+            for (int col = 0; col < 6; ++col) {
+              triplets.emplace_back(blocks[a] + row, blocks[b] + col, H(row, col));
+            }
+          }
+        }
+      }
+    }
+
+    Eigen::SparseMatrix<double> hessian(n, n);
+    hessian.setFromTriplets(triplets.begin(), triplets.end());
+    Eigen::SimplicialLDLT<Eigen::SparseMatrix<double>> solver(hessian);
+    if (solver.info() != Eigen::Success) {
+      break;
+    }
+    const Eigen::VectorXd step = solver.solve(-gradient);
+
+    for (size_t k = 0; k < poses.size(); ++k) {
+      const Eigen::Matrix<double, 6, 1> delta = step.segment<6>(k * 6);
+      poses[k].translation() += poses[k].linear() * delta.tail<3>();
+      poses[k].linear() = poses[k].linear() * exp_so3(delta.head<3>());
+    }
+    if (step.lpNorm<Eigen::Infinity>() < kConvergedStep) {
+      break;
+    }
+  }
+
+  for (size_t k = 0; k < ids.size(); ++k) {
+    optimized[ids[k]] = poses[k];
+  }
+  return cost;
+}
+
+int MarkerGraph::Origin() const {
+  return origin_id;
+}
+
+size_t MarkerGraph::NumMarkers() const {
+  return tree.size();
+}
+
+size_t MarkerGraph::NumEdges() const {
+  return edges.size();
+}
+
+}
+}
@@ -0,0 +1,291 @@
+#include <cmath>
+#include <limits>
+
+#include <eigen3/Eigen/Cholesky>
+#include <opencv2/calib3d.hpp>
+
+#include <phil/localization/marker_pose_solver.h>
+
+namespace phil {
+namespace localization {
+
+namespace {
+
+Eigen::Matrix3d skew(const Eigen::Vector3d &v) {
+  Eigen::Matrix3d m;
+  m << 0, -v(2), v(1),
+      v(2), 0, -v(0),
+      -v(1), v(0), 0;
+  return m;
+}
+
+Eigen::Matrix3d exp_so3(const Eigen::Vector3d &w) {
+  const double theta = w.norm();
+  if (theta < 1e-12) {
+    return Eigen::Matrix3d::Identity();
+  }
+  return Eigen::AngleAxisd(theta, w / theta).toRotationMatrix();
+}
+
+/**
+ * @param delta w, v
+ * @return the pose moved by delta, so that p' = exp(w) p + v
+ */
+Eigen::Isometry3d Perturb(const Eigen::Isometry3d &camera_T_map, const Eigen::Matrix<double, 6, 1> &delta) {
+  const Eigen::Matrix3d R = exp_so3(delta.head<3>());
+  Eigen::Isometry3d perturbed = Eigen::Isometry3d::Identity();
+  perturbed.linear() = R * camera_T_map.linear();
+  perturbed.translation() = R * camera_T_map.translation() + delta.tail<3>();
+  return perturbed;
+}
+
+/**
+ * @return the sum of squared reprojection errors in pixels, or infinity if a point is behind the camera
+ */
+double Cost(const std::vector<Eigen::Vector3d> &points,
+            const std::vector<Eigen::Vector2d> &normalized,
+            const Eigen::Vector2d &focal_px,
+            const Eigen::Isometry3d &camera_T_map) {
+  double cost = 0;
+  for (size_t i = 0; i < points.size(); ++i) {
+    const Eigen::Vector3d p = camera_T_map * points[i];
+    if (p(2) <= 1e-6) {
+      return std::numeric_limits<double>::infinity();
+    }
+    const Eigen::Vector2d r = (p.head<2>() / p(2) - normalized[i]).cwiseProduct(focal_px);
+    cost += r.squaredNorm();
+  }
+  return cost;
+}
+
+Eigen::Isometry3d ToIsometry(const cv::Mat &rt) {
+  cv::Mat rt64;
+  rt.convertTo(rt64, CV_64F);
+  Eigen::Isometry3d T = Eigen::Isometry3d::Identity();
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      T.linear()(i, j) = rt64.at<double>(i, j);
+    }
+    T.translation()(i) = rt64.at<double>(i, 3);
+  }
+  return T;
+}
+
+cv::Mat ToMat(const Eigen::Isometry3d &T) {
+  cv::Mat rt = cv::Mat::eye(4, 4, CV_64F);
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 4; ++j) {
+      rt.at<double>(i, j) = T.matrix()(i, j);
+    }
+  }
+  return rt;
+}
+
+}
+
+MarkerPoseSolver::MarkerPoseSolver(const aruco::CameraParameters &camera_params,
+                                   const aruco::MarkerMap &map,
+                                   const marker_pose_solver_config_t &config)
+    : config(config), map(map), used_fallback(false), error_px(0) {
+  camera_params.CameraMatrix.convertTo(camera_matrix, CV_64F);
+  camera_params.Distorsion.convertTo(distortion, CV_64F);
+  focal_px << camera_matrix.at<double>(0, 0), camera_matrix.at<double>(1, 1);
+}
+
+void MarkerPoseSolver::SetMap(const aruco::MarkerMap &map) {
+  this->map = map;
+}
+
+bool MarkerPoseSolver::UsedFallback() const {
+  return used_fallback;
+}
+
+double MarkerPoseSolver::ErrorPx() const {
+  return error_px;
+}
+
+bool MarkerPoseSolver::Solve(const std::vector<aruco::Marker> &markers,
+                             const cv::Mat &predicted_rt,
+                             cv::Mat *rt,
+                             Matrix6d *covariance) {
+  used_fallback = false;
+  object.clear();
+  image.clear();
+  for (const auto &marker : markers) {
+    const int idx = map.getIndexOfMarkerId(marker.id);
+    if (idx == -1 || marker.size() != 4 || map[idx].points.size() != 4) {
+      continue;
+    }
+    object.insert(object.end(), map[idx].points.begin(), map[idx].points.end());
+    image.insert(image.end(), marker.begin(), marker.end());
+  }
+  if (object.size() < 4) {
+    return false;
+  }
+
+  // undistorting once up front keeps the distortion model out of every iteration
+  cv::undistortPoints(image, undistorted, camera_matrix, distortion);
+  points.resize(object.size());
+  normalized.resize(object.size());
+  for (size_t i = 0; i < object.size(); ++i) {
+    points[i] << object[i].x, object[i].y, object[i].z;
+    normalized[i] << undistorted[i].x, undistorted[i].y;
+  }
+
+  Eigen::Isometry3d camera_T_map;
+  Matrix6d information;
+  error_px = std::numeric_limits<double>::infinity();
+  if (!predicted_rt.empty()) {
+    camera_T_map = ToIsometry(predicted_rt);
+    const double prior_error_px = std::sqrt(Cost(points, normalized, focal_px, camera_T_map) / points.size());
+    if (prior_error_px <= config.max_prior_error_px) {
+      error_px = Refine(points, normalized, focal_px, config.iterations, &camera_T_map, &information);
+    }
+  }
+
+  if (!(error_px <= config.max_error_px)) {
+    used_fallback = true;
+    cv::Mat rvec, tvec;
+    std::vector<int> inliers;
+    const bool found = cv::solvePnPRansac(object,
+                                          image,
+                                          camera_matrix,
+                                          distortion,
+                                          rvec,
+                                          tvec,
+                                          false,
+                                          100,
+                                          static_cast<float>(config.ransac_threshold_px),
+                                          0.99,
+                                          inliers,
+                                          cv::SOLVEPNP_EPNP);
+    if (!found || inliers.size() < 4) {
+      return false;
+    }
+    cv::Mat R;
+    cv::Rodrigues(rvec, R);
+    camera_T_map = Eigen::Isometry3d::Identity();
+    for (int i = 0; i < 3; ++i) {
+      for (int j = 0; j < 3; ++j) {
+        camera_T_map.linear()(i, j) = R.at<double>(i, j);
+      }
+      camera_T_map.translation()(i) = tvec.at<double>(i);
+    }
+
+    // corners RANSAC rejected would only pull the refinement away
+    size_t k = 0;
+    for (const int i : inliers) {
+      points[k] = points[i];
+      normalized[k] = normalized[i];
+      ++k;
+    }
+    points.resize(k);
+    normalized.resize(k);
+    error_px = Refine(points, normalized, focal_px, config.iterations, &camera_T_map, &information);
+    if (!(error_px <= config.max_error_px)) {
+      return false;
+    }
+  }
+
+  // the residuals say how noisy the corners are, but too few of them can't say they're better than detection allows
+  const double dof = std::max<double>(2 * points.size() - 6, 1);
+  const double variance = std::max(config.corner_std_px * config.corner_std_px,
+                                   error_px * error_px * points.size() / dof);
+  const Eigen::Matrix<double, 6, 6> H = information;
+  const Eigen::LDLT<Eigen::Matrix<double, 6, 6>> ldlt(H);
+  if (ldlt.info() != Eigen::Success || !ldlt.isPositive()) {
+    return false;
+  }
+  *covariance = variance * ldlt.solve(Eigen::Matrix<double, 6, 6>::Identity());
+  *rt = ToMat(camera_T_map);
+  return true;
+}
+
+double MarkerPoseSolver::Refine(const std::vector<Eigen::Vector3d> &points,
+                                const std::vector<Eigen::Vector2d> &normalized,
+                                const Eigen::Vector2d &focal_px,
+                                int iterations,
+                                Eigen::Isometry3d *camera_T_map,
+                                Matrix6d *information) {
+  double cost = Cost(points, normalized, focal_px, *camera_T_map);
+  if (!std::isfinite(cost)) {
+    return cost;
+  }
+
+  Eigen::Matrix<double, 6, 6> H;
+  Eigen::Matrix<double, 6, 1> g;
+  Eigen::Matrix<double, 2, 6> J;
+  auto linearize = [&]() {
+    H.setZero();
+    g.setZero();
+    for (size_t i = 0; i < points.size(); ++i) {
+      const Eigen::Vector3d p = *camera_T_map * points[i];
+      const double z_inv = 1 / p(2);
+      const Eigen::Vector2d r = (p.head<2>() * z_inv - normalized[i]).cwiseProduct(focal_px);
+      // d projection / d p, then d p / d (w, v) = [-[p]x, I]
+      Eigen::Matrix<double, 2, 3> dproj;
+      dproj << focal_px(0) * z_inv, 0, -focal_px(0) * p(0) * z_inv * z_inv,
+          0, focal_px(1) * z_inv, -focal_px(1) * p(1) * z_inv * z_inv;
+      J.leftCols<3>() = -dproj * skew(p);
+      J.rightCols<3>() = dproj;
+      H += J.transpose() * J;
+      g += J.transpose() * r;
+    }
+  };
+
+  double lambda = 1e-3;
+  linearize();
+  for (int iteration = 0; iteration < iterations; ++iteration) {
+    Eigen::Matrix<double, 6, 6> A = H;
+    A.diagonal() *= 1 + lambda;
+    const Eigen::Matrix<double, 6, 1> delta = -A.ldlt().solve(g);
+    const Eigen::Isometry3d candidate = Perturb(*camera_T_map, delta);
+    const double candidate_cost = Cost(points, normalized, focal_px, candidate);
+    if (candidate_cost < cost) {
+      *camera_T_map = candidate;
+      cost = candidate_cost;
+      lambda = std::max(lambda / 10, 1e-7);
+      linearize();
+      if (delta.norm() < 1e-10) {
+        break;
+      }
+    } else {
+      lambda *= 10;
+    }
+  }
+
+  *information = H;
+  return std::sqrt(cost / points.size());
+}
+
+pose_t RobotPose(const Eigen::Isometry3d &camera_T_map,
+                 const Matrix6d &covariance,
+                 const Eigen::Isometry3d &robot_T_camera,
+                 Eigen::Matrix3d *pose_covariance) {
+  auto planar_pose = [&](const Eigen::Isometry3d &T) -> Eigen::Vector3d {
+    const Eigen::Isometry3d map_T_robot = (robot_T_camera * T).inverse();
+    return Eigen::Vector3d(map_T_robot.translation()(0),
+                           map_T_robot.translation()(1),
+                           std::atan2(map_T_robot.linear()(1, 0), map_T_robot.linear()(0, 0)));
+  };
+  const Eigen::Vector3d pose = planar_pose(camera_T_map);
+
+  // the projection onto the floor is easier to differentiate numerically than by hand
+  pose_covariance->setZero();
+  if (!covariance.isZero()) {
+    constexpr double h = 1e-6;
+    Eigen::Matrix<double, 3, 6> J;
+    for (int i = 0; i < 6; ++i) {
+      Eigen::Matrix<double, 6, 1> delta = Eigen::Matrix<double, 6, 1>::Zero();
+      delta(i) = h;
+      Eigen::Vector3d diff = planar_pose(Perturb(camera_T_map, delta)) - planar_pose(Perturb(camera_T_map, -delta));
+      diff(2) = std::remainder(diff(2), 2 * M_PI);
+      J.col(i) = diff / (2 * h);
+    }
+    *pose_covariance = J * covariance * J.transpose();
+  }
+  return {pose(0), pose(1), pose(2)};
+}
+
+}
+}
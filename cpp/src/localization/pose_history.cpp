@@ -0,0 +1,154 @@
+#include <algorithm>
+#include <cmath>
+
+#include <phil/localization/pose_history.h>
+
+namespace phil {
+namespace localization {
+
+namespace {
+
+// predictions are integrated in steps no longer than this, which is about the rate the filter runs at
+constexpr double kMaxPredictionStepS = 0.02;
+
+BFL::Gaussian zero_noise() {
+  MatrixWrapper::ColumnVector mean(N);
+  mean = 0.0;
+  MatrixWrapper::SymmetricMatrix covariance(N);
+  covariance = 0.0;
+  return BFL::Gaussian(mean, covariance);
+}
+
+}
+
+PoseHistory::PoseHistory(size_t capacity, double W, double alpha, double max_prediction_s)
+    : entries(capacity),
+      head(0),
+      size(0),
+      seq(0),
+      max_prediction_s(max_prediction_s),
+      model(zero_noise(), W, alpha, kMaxPredictionStepS) {}
+
+void PoseHistory::Push(double stamp_s,
+                       const MatrixWrapper::ColumnVector &state,
+                       const MatrixWrapper::SymmetricMatrix &covariance,
+                       const MatrixWrapper::ColumnVector &control) {
+  std::lock_guard<std::mutex> guard(lock);
+
+  entry_t &entry = entries[head];
+  entry.stamp_s = stamp_s;
+  entry.seq = seq;
+  for (unsigned int i = 0; i < N; ++i) {
+    entry.state[i] = state(i + 1);
+  }
+  for (unsigned int i = 0; i < 3; ++i) {
+    entry.variance[i] = covariance(i + 1, i + 1);
+  }
+  for (unsigned int i = 0; i < M; ++i) {
+    entry.control[i] = control(i + 1);
+  }
+
+  head = (head + 1) % entries.size();
+  size = std::min(size + 1, entries.size());
+  ++seq;
+}
+
+bool PoseHistory::Query(double time_s, pose_record_t *record) {
+  std::lock_guard<std::mutex> guard(lock);
+
+  if (size == 0) {
+    return false;
+  }
+
+  const size_t capacity = entries.size();
+  const entry_t &newest = entries[(head + capacity - 1) % capacity];
+
+  if (time_s == 0) {
+    Fill(newest, record);
+    record->stamp_s = newest.stamp_s;
+    return true;
+  }
+
+  if (time_s >= newest.stamp_s) {
+    const double horizon_s = time_s - newest.stamp_s;
+    if (horizon_s > max_prediction_s) {
+      return false;
+    }
+    Predict(newest, horizon_s, record);
+    return true;
+  }
+
+  // most queries are for the recent past, so search backwards from the newest entry
+  for (size_t i = 1; i < size; ++i) {
+    const entry_t &older = entries[(head + capacity - 1 - i) % capacity];
+    const entry_t &newer = entries[(head + capacity - i) % capacity];
+    if (older.stamp_s > time_s) {
+      continue;
+    }
+
+    pose_record_t a{}, b{};
+    Fill(older, &a);
+    Fill(newer, &b);
+    const double dt_s = newer.stamp_s - older.stamp_s;
+    const double t = dt_s > 0 ? (time_s - older.stamp_s) / dt_s : 1.0;
+    record->x = a.x + t * (b.x - a.x);
+    record->y = a.y + t * (b.y - a.y);
+    record->theta = a.theta + t * yaw_diff_rad(b.theta, a.theta);
+    record->vx = a.vx + t * (b.vx - a.vx);
+    record->vy = a.vy + t * (b.vy - a.vy);
+    record->omega = a.omega + t * (b.omega - a.omega);
+    record->var_x = std::max(a.var_x, b.var_x);
+    record->var_y = std::max(a.var_y, b.var_y);
+    record->var_theta = std::max(a.var_theta, b.var_theta);
+    record->stamp_s = time_s;
+    record->seq = b.seq;
+    return true;
+  }
+
+  // older than anything we remember
+  return false;
+}
+
+void PoseHistory::Fill(const entry_t &entry, pose_record_t *record) {
+  record->x = entry.state[0];
+  record->y = entry.state[1];
+  record->theta = entry.state[2];
+  record->vx = entry.state[3];
+  record->vy = entry.state[4];
+  record->omega = entry.state[5];
+  record->var_x = entry.variance[0];
+  record->var_y = entry.variance[1];
+  record->var_theta = entry.variance[2];
+  record->seq = entry.seq;
+}
+
+void PoseHistory::Predict(const entry_t &from, double horizon_s, pose_record_t *record) {
+  MatrixWrapper::ColumnVector state(N);
+  for (unsigned int i = 0; i < N; ++i) {
+    state(i + 1) = from.state[i];
+  }
+  MatrixWrapper::ColumnVector control(M);
+  for (unsigned int i = 0; i < M; ++i) {
+    control(i + 1) = from.control[i];
+  }
+
+  const auto steps = static_cast<unsigned int>(std::ceil(horizon_s / kMaxPredictionStepS));
+  if (steps > 0) {
+    model.SetDt(horizon_s / steps);
+    model.ConditionalArgumentSet(1, control);
+    for (unsigned int i = 0; i < steps; ++i) {
+      model.ConditionalArgumentSet(0, state);
+      state = model.ExpectedValueGet();
+    }
+  }
+
+  entry_t predicted = from;
+  for (unsigned int i = 0; i < N; ++i) {
+    predicted.state[i] = state(i + 1);
+  }
+  Fill(predicted, record);
+  record->stamp_s = from.stamp_s + horizon_s;
+}
+
+}
+}
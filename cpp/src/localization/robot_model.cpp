@@ -59,6 +59,10 @@ MatrixWrapper::Matrix EncoderControlModel::dfGet(unsigned int i) const {
   }
 }
 
+void EncoderControlModel::SetDt(double dt_s) {
+  this->dt_s = dt_s;
+}
+
 AccMeasurementModel::AccMeasurementModel(const BFL::Gaussian &additiveNoise)
     : AnalyticConditionalGaussianAdditiveNoise(additiveNoise, 1) {}
 
@@ -0,0 +1,613 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+
+#include <eigen3/Eigen/Eigen>
+#include <opencv2/core/eigen.hpp>
+
+#include <phil/common/tiled_detector.h>
+#include <phil/main/camera_pipeline.h>
+
+namespace phil {
+
+cv::Mat ExtrinsicsMatrix(const std::vector<double> &extrinsics) {
+  cv::Mat camera_to_robot = cv::Mat::eye(4, 4, CV_64F);
+  if (extrinsics.size() != 6) {
+    return camera_to_robot;
+  }
+
+  const Eigen::Matrix3d R = (Eigen::AngleAxisd(extrinsics[5], Eigen::Vector3d::UnitZ())
+      * Eigen::AngleAxisd(extrinsics[4], Eigen::Vector3d::UnitY())
+      * Eigen::AngleAxisd(extrinsics[3], Eigen::Vector3d::UnitX())).toRotationMatrix();
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      camera_to_robot.at<double>(i, j) = R(i, j);
+    }
+    camera_to_robot.at<double>(i, 3) = extrinsics[i];
+  }
+  return camera_to_robot;
+}
+
+namespace {
+
+/**
+ * @return map to camera transform (4x4, CV_64F) for the robot at pose
+ */
+cv::Mat PoseRT(const pose_t &pose, const cv::Mat &camera_to_robot) {
+  const double c = std::cos(pose.theta);
+  const double s = std::sin(pose.theta);
+  const cv::Mat robot_to_map = (cv::Mat_<double>(4, 4) << c, -s, 0, pose.x, s, c, 0, pose.y, 0, 0, 1, 0, 0, 0, 0, 1);
+  return (robot_to_map * camera_to_robot).inv();
+}
+
+}
+
+CameraPipeline::CameraPipeline(size_t index,
+                               const camera_config_t &config,
+                               const aruco::CameraParameters &camera_params,
+                               const aruco::MarkerMap &map,
+                               const camera_options_t &options)
+    : index(index),
+      config(config),
+      options(options),
+      camera_params(camera_params),
+      map(map),
+      map_version(0),
+      camera_to_robot(ExtrinsicsMatrix(config.extrinsics)),
+      camera("phil/main/" + config.name + "/camera", config.source_url),
+      sink("phil/main/" + config.name + "/sink"),
+      annotated_source("phil/main/" + config.name + "/annotated_source",
+                       cs::VideoMode::kMJPEG,
+                       config.w,
+                       config.h,
+                       config.fps),
+      annotated_server("phil/main/" + config.name + "/annotated_mjpeg_server", options.annotated_stream_port),
+      frame_bus(7),
+      done(false) {
+  annotated_server.SetSource(annotated_source);
+
+  Eigen::Matrix4d camera_to_robot_matrix;
+  cv::cv2eigen(camera_to_robot, camera_to_robot_matrix);
+  robot_T_camera = localization::Pose3d(Eigen::Isometry3d(camera_to_robot_matrix));
+
+  // when reading the stream or device directly, the camera is left without a sink so cscore never connects to it
+  if (!config.device.empty()) {
+    yuyv_camera = std::make_unique<V4l2YuyvCamera>(config.device, config.w, config.h, config.fps);
+  } else if (options.mjpeg_scale > 0) {
+    mjpeg_reader = std::make_unique<MjpegStreamReader>(config.source_url);
+  } else {
+    sink.SetSource(camera);
+  }
+  detector.setDictionary(options.dictionary);
+
+  // detect on rectified frames, so everything downstream sees a camera without distortion
+  if (!options.rectify_dir.empty()) {
+    rectifier = std::make_unique<Rectifier>(this->camera_params, options.rectify_dir);
+    this->camera_params = rectifier->RectifiedParameters();
+    if (options.verbose && rectifier->LoadedFromCache()) {
+      std::cout << "[" << config.name << "] loaded rectification maps from [" << options.rectify_dir << "]\n";
+    }
+  }
+
+  full_frame_detector = [this](const cv::Mat &image) { return detector.detect(image); };
+  if (options.detector_mode == "roi") {
+    if (rectifier) {
+      // only rectify the regions that get searched, unless it falls back to the full frame
+      const Rectifier *r = rectifier.get();
+      const auto detect_whole_frame = full_frame_detector;
+      full_frame_detector = [r, detect_whole_frame](const cv::Mat &image) {
+        cv::Mat rectified;
+        r->Rectify(image, &rectified);
+        return detect_whole_frame(rectified);
+      };
+    }
+    roi_detector = std::make_unique<RoiMarkerDetector>(map,
+                                                       this->camera_params,
+                                                       options.dictionary,
+                                                       full_frame_detector);
+    if (rectifier) {
+      const Rectifier *r = rectifier.get();
+      roi_detector->SetRegionExtractor([r](const cv::Mat &image, const cv::Rect &roi) {
+        cv::Mat rectified;
+        r->RectifyRoi(image, roi, &rectified);
+        return rectified;
+      });
+    }
+  } else if (options.detector_mode == "pyramid") {
+    pyramid_detector = std::make_unique<PyramidMarkerDetector>(options.dictionary);
+  } else if (options.detector_mode == "tiled") {
+    auto tiled_detector = std::make_shared<TiledMarkerDetector>(options.dictionary);
+    full_frame_detector = [tiled_detector](const cv::Mat &image) { return tiled_detector->Detect(image); };
+  }
+
+  tracker.setParams(this->camera_params, map, options.marker_size);
+  if (options.pose_solver) {
+    pose_solver = std::make_unique<localization::MarkerPoseSolver>(this->camera_params,
+                                                                   map,
+                                                                   localization::kDefaultMarkerPoseSolverConfig);
+  }
+  if (options.track_corners) {
+    corner_tracker = std::make_unique<CornerTracker>(kDefaultCornerTrackerConfig);
+  }
+
+  // the optical flow is measured on the frames as captured, so it uses the intrinsics from before rectification
+  if (options.visual_odometry) {
+    visual_odometry = std::make_unique<VisualOdometry>(camera_params, camera_to_robot, kDefaultVisualOdometryConfig);
+    odometry_frames = frame_bus.Subscribe(1);
+  }
+
+  // one capture feeds every consumer of the camera without copying frames
+  detection_frames = frame_bus.Subscribe(1);
+  if (!options.video_filename.empty()) {
+    // the recording gets a deeper queue than detection, since it should keep every frame
+    recording_frames = frame_bus.Subscribe(3);
+    video = cv::VideoWriter(options.video_filename,
+                            CV_FOURCC('M', 'J', 'P', 'G'),
+                            config.fps,
+                            cv::Size(config.w, config.h));
+  }
+}
+
+CameraPipeline::~CameraPipeline() {
+  Stop();
+}
+
+void CameraPipeline::Start(PriorQuery prior) {
+  this->prior = std::move(prior);
+
+  // stamp frames with the co-processor clock when they arrive, so measurements can be lined up with the other sensors
+  const auto now_us = []() -> uint64_t {
+    const auto now = std::chrono::system_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::microseconds>(now).count();
+  };
+  if (mjpeg_reader) {
+    // only keep the JPEG, each consumer decodes as much of it as it needs
+    frame_bus.StartCapture([this, now_us](Frame &frame) -> uint64_t {
+      if (!mjpeg_reader->Next(&frame.encoded, 0.1)) {
+        // don't spin while the stream is down
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        return 0;
+      }
+      return now_us();
+    });
+  } else if (yuyv_camera) {
+    // detection only needs the luma, so the rest of the frame is only kept when something will show or record it
+    const bool keep_color = recording_frames || options.full_res_annotations;
+    frame_bus.StartCapture([this, now_us, keep_color](Frame &frame) -> uint64_t {
+      const int w = yuyv_camera->Width();
+      const int h = yuyv_camera->Height();
+      const size_t stride = yuyv_camera->Stride();
+      const bool read = yuyv_camera->Read([&](const uint8_t *yuyv) {
+        ExtractLuma(yuyv, stride, w, h, &frame.image);
+        if (keep_color) {
+          frame.encoded.resize(static_cast<size_t>(w) * h * 2);
+          for (int r = 0; r < h; ++r) {
+            std::memcpy(frame.encoded.data() + r * w * 2, yuyv + r * stride, w * 2);
+          }
+        }
+      }, 0.1);
+      if (!read) {
+        if (!yuyv_camera->IsOpened()) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        return 0;
+      }
+      return now_us();
+    });
+  } else {
+    frame_bus.StartCapture([this, now_us](cv::Mat &image) -> uint64_t {
+      return sink.GrabFrame(image, 0.1) == 0 ? 0 : now_us();
+    });
+  }
+
+  detection_thread = std::thread(&CameraPipeline::Run, this);
+  if (odometry_frames) {
+    odometry_thread = std::thread(&CameraPipeline::RunOdometry, this);
+  }
+  if (recording_frames) {
+    recording_thread = std::thread([this]() {
+      cv::Mat decoded;
+      while (!done) {
+        FramePtr recorded = recording_frames->Next(0.1);
+        if (!recorded) {
+          continue;
+        }
+        if (mjpeg_reader) {
+          decoded = cv::imdecode(recorded->encoded, cv::IMREAD_COLOR);
+          if (!decoded.empty()) {
+            video.write(decoded);
+          }
+        } else if (yuyv_camera) {
+          YuyvToBgr(recorded->encoded.data(), yuyv_camera->Width(), yuyv_camera->Height(), &decoded);
+          video.write(decoded);
+        } else {
+          video.write(recorded->image);
+        }
+      }
+    });
+  }
+}
+
+void CameraPipeline::Stop() {
+  done = true;
+  frame_bus.Stop();
+  if (detection_thread.joinable()) {
+    detection_thread.join();
+  }
+  if (recording_thread.joinable()) {
+    recording_thread.join();
+  }
+  if (odometry_thread.joinable()) {
+    odometry_thread.join();
+  }
+}
+
+void CameraPipeline::Drain(std::vector<camera_measurement_t> *out) {
+  std::lock_guard<std::mutex> guard(lock);
+  out->insert(out->end(), measurements.begin(), measurements.end());
+  measurements.clear();
+}
+
+void CameraPipeline::DrainOdometry(std::vector<odometry_measurement_t> *out) {
+  std::lock_guard<std::mutex> guard(lock);
+  out->insert(out->end(), odometry_measurements.begin(), odometry_measurements.end());
+  odometry_measurements.clear();
+}
+
+void CameraPipeline::DrainCorners(std::vector<corner_measurement_t> *out) {
+  std::lock_guard<std::mutex> guard(lock);
+  out->insert(out->end(), corner_measurements.begin(), corner_measurements.end());
+  corner_measurements.clear();
+}
+
+const std::string &CameraPipeline::Name() const {
+  return config.name;
+}
+
+std::vector<aruco::Marker> CameraPipeline::Detect(const cv::Mat &frame, const cv::Mat &predicted_rt) {
+  if (pyramid_detector) {
+    double expected_min_side_px = 0;
+    if (!predicted_rt.empty()) {
+      const auto projected = ProjectMarkers(map, camera_params, predicted_rt);
+      expected_min_side_px = PyramidMarkerDetector::ExpectedMinSidePx(projected, frame.size());
+    }
+    return pyramid_detector->Detect(frame, expected_min_side_px);
+  } else if (roi_detector) {
+    return roi_detector->Detect(frame, predicted_rt);
+  }
+  return full_frame_detector(frame);
+}
+
+bool CameraPipeline::EstimatePose(const std::vector<aruco::Marker> &markers, const cv::Mat &predicted_rt) {
+  if (pose_solver) {
+    return pose_solver->Solve(markers, predicted_rt, &solved_rt, &solved_covariance);
+  }
+  if (!tracker.estimatePose(markers)) {
+    return false;
+  }
+  tracker.getRTMatrix().convertTo(solved_rt, CV_64F);
+  solved_covariance.setZero();
+  return true;
+}
+
+bool CameraPipeline::TrackCorners(const cv::Mat &frame,
+                                  double yaw_rate,
+                                  const cv::Mat &predicted_rt,
+                                  std::vector<aruco::Marker> *markers) {
+  if (corner_tracker->NeedsDetection(yaw_rate) || !corner_tracker->Track(frame, markers)) {
+    return false;
+  }
+
+  // drifted or mismatched corners show up as a pose that doesn't explain where they are. They're checked against a
+  // pose fit from scratch first, since aruco's tracker starts from its last pose and would keep a bad one.
+  const double max_error_px = kDefaultCornerTrackerConfig.max_reprojection_error_px;
+  if (!SolveMapPose(*markers, map, camera_params, &fitted_rt)
+      || ReprojectionErrorPx(*markers, map, camera_params, fitted_rt) > max_error_px
+      || !tracker.isValid() || !EstimatePose(*markers, predicted_rt)
+      || ReprojectionErrorPx(*markers, map, camera_params, solved_rt) > max_error_px) {
+    if (options.verbose) {
+      std::cout << cyan << "[" << config.name << "] lost tracked markers, detecting again" << reset << "\n";
+    }
+    corner_tracker->Invalidate();
+    return false;
+  }
+  return true;
+}
+
+bool CameraPipeline::QueueCorners(const std::vector<aruco::Marker> &markers,
+                                  double stamp_s,
+                                  const pose_t &prior_pose,
+                                  const camera_measurement_t *pose) {
+  corner_object.clear();
+  corner_image.clear();
+  for (const auto &marker : markers) {
+    const int idx = map.getIndexOfMarkerId(marker.id);
+    if (idx == -1 || marker.size() != 4 || map[idx].points.size() != 4) {
+      continue;
+    }
+    corner_object.insert(corner_object.end(), map[idx].points.begin(), map[idx].points.end());
+    corner_image.insert(corner_image.end(), marker.begin(), marker.end());
+  }
+  if (corner_object.empty()) {
+    return false;
+  }
+
+  cv::undistortPoints(corner_image, corner_undistorted, camera_params.CameraMatrix, camera_params.Distorsion);
+  cv::Mat camera_matrix;
+  camera_params.CameraMatrix.convertTo(camera_matrix, CV_64F);
+  corner_measurement_t measurement{index, stamp_s};
+  localization::corner_observation_t &corners = measurement.corners;
+  corners.map_points.resize(3, corner_object.size());
+  corners.normalized.resize(2, corner_object.size());
+  for (size_t i = 0; i < corner_object.size(); ++i) {
+    corners.map_points.col(i) << corner_object[i].x, corner_object[i].y, corner_object[i].z;
+    corners.normalized.col(i) << corner_undistorted[i].x, corner_undistorted[i].y;
+  }
+  corners.robot_T_camera = robot_T_camera;
+  corners.fx = camera_matrix.at<double>(0, 0);
+  corners.fy = camera_matrix.at<double>(1, 1);
+
+  if (!localization::ProjectCorners(corners, prior_pose, &corner_projected, nullptr)) {
+    return false;
+  }
+  const Eigen::Matrix2Xd measured = Eigen::Vector2d(corners.fx, corners.fy).asDiagonal() * corners.normalized;
+  const double error_px = std::sqrt((corner_projected - measured).squaredNorm() / corner_object.size());
+  if (error_px > localization::kDefaultCornerMeasurementConfig.max_prior_error_px) {
+    return false;
+  }
+  if (pose) {
+    measurement.has_pose = true;
+    measurement.pose = *pose;
+  }
+
+  std::lock_guard<std::mutex> guard(lock);
+  corner_measurements.push_back(std::move(measurement));
+  return true;
+}
+
+void CameraPipeline::RefineScaledMarkers(const std::vector<uint8_t> &jpeg, std::vector<aruco::Marker> *markers) {
+  // pixel centers line up between the two sizes, not pixel corners
+  const float scale = options.mjpeg_scale;
+  std::vector<cv::Point2f> corners;
+  for (auto &marker : *markers) {
+    for (auto &corner : marker) {
+      corner = (corner + cv::Point2f(0.5f, 0.5f)) * scale - cv::Point2f(0.5f, 0.5f);
+      corners.push_back(corner);
+    }
+  }
+  if (options.mjpeg_scale == 1 || corners.empty()) {
+    return;
+  }
+
+  // one region around every marker, since each decode has to entropy decode everything above its region anyway
+  const int half_window = options.mjpeg_scale + 1;
+  const int margin = 2 * half_window;
+  const cv::Rect bounds = cv::boundingRect(corners);
+  const cv::Point top_left(std::max(0, bounds.x - margin), std::max(0, bounds.y - margin));
+  const cv::Rect roi(top_left, bounds.br() + cv::Point(margin, margin));
+  if (!jpeg_decoder.DecodeGrayRegion(jpeg.data(), jpeg.size(), roi, &refine_region)) {
+    return;
+  }
+
+  for (auto &corner : corners) {
+    corner -= cv::Point2f(top_left);
+  }
+  cv::cornerSubPix(refine_region,
+                   corners,
+                   cv::Size(half_window, half_window),
+                   cv::Size(-1, -1),
+                   cv::TermCriteria(cv::TermCriteria::MAX_ITER | cv::TermCriteria::EPS, 12, 0.01));
+  size_t i = 0;
+  for (auto &marker : *markers) {
+    for (auto &corner : marker) {
+      corner = corners[i++] + cv::Point2f(top_left);
+    }
+  }
+}
+
+void CameraPipeline::Run() {
+  // the last camera pose and the filter's pose at the same time, used to predict where markers will appear
+  cv::Mat last_rt;
+  pose_t last_rt_pose{0, 0, 0};
+
+  while (!done) {
+    FramePtr frame_ptr = detection_frames->Next(0.1);
+    if (!frame_ptr) {
+      continue;
+    }
+    const double stamp_s = frame_ptr->capture_time_us / 1e6;
+
+    // pick up markers added to the map by any camera
+    if (options.map_expander && options.map_expander->Version() != map_version) {
+      map = options.map_expander->Map(&map_version);
+      tracker.setParams(camera_params, map, options.marker_size);
+      if (pose_solver) {
+        pose_solver->SetMap(map);
+      }
+      if (roi_detector) {
+        roi_detector->SetMap(map);
+      }
+      if (options.verbose) {
+        std::cout << cyan << "[" << config.name << "] map now has " << map.size() << " markers" << reset << "\n";
+      }
+    }
+
+    // in roi mode the detector rectifies just the regions it searches
+    const bool rectify_whole_frame = rectifier && !roi_detector;
+    if (mjpeg_reader) {
+      const auto &jpeg = frame_ptr->encoded;
+      if (!jpeg_decoder.DecodeGray(jpeg.data(), jpeg.size(), options.mjpeg_scale, &scaled_frame)) {
+        continue;
+      }
+    } else if (frame_ptr->image.empty()) {
+      std::cerr << yellow << "[" << config.name << "] empty frame" << reset << "\n";
+      continue;
+    } else if (rectify_whole_frame) {
+      rectifier->Rectify(frame_ptr->image, &rectified_frame);
+    }
+    const cv::Mat &frame = mjpeg_reader ? scaled_frame : rectify_whole_frame ? rectified_frame : frame_ptr->image;
+
+    pose_t prior_pose{0, 0, 0};
+    double yaw_rate = 0;
+    const bool have_prior = prior && prior(stamp_s, &prior_pose, &yaw_rate);
+    cv::Mat predicted_rt;
+    if (have_prior && !last_rt.empty()) {
+      predicted_rt = PredictRT(last_rt, last_rt_pose, prior_pose);
+    }
+
+    // tracked markers already have a pose, which was used to check them
+    std::vector<aruco::Marker> detected_markers;
+    const bool tracked = corner_tracker && TrackCorners(frame, yaw_rate, predicted_rt, &detected_markers);
+    if (!tracked) {
+      detected_markers = Detect(frame, predicted_rt);
+      if (corner_tracker) {
+        // only mapped markers help the pose, so the rest aren't worth tracking
+        mapped_markers.clear();
+        for (const auto &marker : detected_markers) {
+          if (map.getIndexOfMarkerId(marker.id) != -1) {
+            mapped_markers.push_back(marker);
+          }
+        }
+        corner_tracker->Reset(frame, mapped_markers);
+      }
+    }
+
+    // the annotated stream shows the scaled luma, unless it's worth a full decode
+    const bool annotate_scaled = mjpeg_reader && !options.full_res_annotations;
+    if (detected_markers.empty()) {
+      if (options.verbose) {
+        std::cout << cyan << "[" << config.name << "] no tags detected" << reset << "\n";
+      }
+      cv::Mat unannotated_frame = frame; // PutFrame only reads the image, so this doesn't need to be a copy
+      if (frame.channels() == 1) {
+        cv::cvtColor(frame, unannotated_frame, CV_GRAY2BGR);
+      }
+      annotated_source.PutFrame(unannotated_frame);
+      continue;
+    }
+
+    std::vector<aruco::Marker> scaled_markers;
+    if (mjpeg_reader) {
+      if (annotate_scaled) {
+        scaled_markers = detected_markers;
+      }
+      RefineScaledMarkers(frame_ptr->encoded, &detected_markers);
+    }
+
+    // the frame is shared with the other consumers, so draw on a copy
+    cv::Mat annotated_frame;
+    if (annotate_scaled) {
+      cv::cvtColor(frame, annotated_frame, CV_GRAY2BGR);
+    } else if (mjpeg_reader) {
+      annotated_frame = cv::imdecode(frame_ptr->encoded, cv::IMREAD_COLOR);
+    } else if (yuyv_camera && options.full_res_annotations) {
+      YuyvToBgr(frame_ptr->encoded.data(), frame_ptr->image.cols, frame_ptr->image.rows, &annotated_frame);
+      if (rectify_whole_frame) {
+        cv::Mat rectified_color;
+        rectifier->Rectify(annotated_frame, &rectified_color);
+        annotated_frame = rectified_color;
+      }
+    } else if (frame.channels() == 1) {
+      cv::cvtColor(frame, annotated_frame, CV_GRAY2BGR);
+    } else {
+      annotated_frame = frame.clone();
+    }
+    if (roi_detector) {
+      for (const auto &roi : roi_detector->Rois()) {
+        cv::rectangle(annotated_frame, roi, cv::Scalar(255, 0, 0), 1);
+      }
+    }
+
+    if (tracker.isValid()) {
+      const bool solved = tracked || EstimatePose(detected_markers, predicted_rt);
+      camera_measurement_t measurement{index, stamp_s};
+      if (solved) {
+        if (options.map_expander) {
+          options.map_expander->Observe(detected_markers, solved_rt, camera_params);
+        }
+
+        // map to robot is map to camera followed by camera to robot
+        Eigen::Matrix4d camera_T_map, robot_T_camera;
+        cv::cv2eigen(solved_rt, camera_T_map);
+        cv::cv2eigen(camera_to_robot, robot_T_camera);
+        measurement.robot_pose = localization::RobotPose(Eigen::Isometry3d(camera_T_map),
+                                                         solved_covariance,
+                                                         Eigen::Isometry3d(robot_T_camera),
+                                                         &measurement.robot_pose_covariance);
+      }
+
+      // single markers can update the filter from their corners too, without a pose of their own
+      if (options.corner_measurements && have_prior &&
+          QueueCorners(detected_markers, stamp_s, prior_pose, solved ? &measurement : nullptr)) {
+        // the filter's pose explained the corners, so it predicts where markers will appear as well
+        last_rt = PoseRT(prior_pose, camera_to_robot);
+        last_rt_pose = prior_pose;
+      } else if (solved) {
+        if (have_prior) {
+          last_rt = solved_rt.clone();
+          last_rt_pose = prior_pose;
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        measurements.push_back(measurement);
+      } else {
+        if (options.verbose) {
+          std::cout << cyan << "[" << config.name << "] no pose estimate from marker mapper" << reset << "\n";
+        }
+        last_rt.release();
+      }
+
+      // annotate the video feed. The intrinsics are for full resolution, so the scaled luma only gets outlines.
+      if (annotate_scaled) {
+        for (auto &marker : scaled_markers) {
+          marker.draw(annotated_frame, cv::Scalar(0, 0, 255), 1);
+        }
+      } else {
+        for (auto &marker : detected_markers) {
+          marker.draw(annotated_frame, cv::Scalar(0, 0, 255), 2);
+          aruco::CvDrawingUtils::draw3dCube(annotated_frame, marker, camera_params);
+          aruco::CvDrawingUtils::draw3dAxis(annotated_frame, marker, camera_params);
+        }
+      }
+    } else {
+      std::cerr << "[" << config.name << "] invalid marker map pose tracker\n";
+    }
+
+    annotated_source.PutFrame(annotated_frame);
+  }
+}
+
+void CameraPipeline::RunOdometry() {
+  cv::Mat converted;
+  double previous_stamp_s = 0;
+  while (!done) {
+    FramePtr frame_ptr = odometry_frames->Next(0.1);
+    if (!frame_ptr) {
+      continue;
+    }
+
+    // the same luma detection uses, at the same scale when reading the MJPEG stream
+    if (mjpeg_reader) {
+      const auto &jpeg = frame_ptr->encoded;
+      if (!odometry_decoder.DecodeGray(jpeg.data(), jpeg.size(), options.mjpeg_scale, &converted)) {
+        continue;
+      }
+    } else if (frame_ptr->image.empty()) {
+      continue;
+    } else if (frame_ptr->image.channels() != 1) {
+      cv::cvtColor(frame_ptr->image, converted, cv::COLOR_BGR2GRAY);
+    }
+    const cv::Mat &gray = mjpeg_reader || frame_ptr->image.channels() != 1 ? converted : frame_ptr->image;
+
+    const double stamp_s = frame_ptr->capture_time_us / 1e6;
+    double yaw_rate, yaw_rate_var;
+    if (visual_odometry->Track(gray, stamp_s, &yaw_rate, &yaw_rate_var)) {
+      std::lock_guard<std::mutex> guard(lock);
+      odometry_measurements.push_back({index, stamp_s, previous_stamp_s, yaw_rate, yaw_rate_var});
+    }
+    previous_stamp_s = stamp_s;
+  }
+}
+
+} // end namespace
@@ -1,5 +1,9 @@
+#include <atomic>
 #include <cstring>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <thread>
 #include <unistd.h>
 #include <algorithm>
 
@@ -12,11 +16,16 @@
 #include <yaml-cpp/yaml.h>
 
 #include <phil/common/common.h>
+#include <phil/common/imu.h>
+#include <phil/common/shm.h>
 #include <phil/common/udp.h>
+#include <phil/localization/corner_measurement_model.h>
 #include <phil/localization/ekf.h>
 #include <phil/common/args.h>
 #include <phil/common/math.h>
 #include <phil/localization/particle_filter.h>
+#include <phil/localization/pose_history.h>
+#include <phil/main/camera_pipeline.h>
 
 template<typename T>
 T yaml_get(const YAML::Node &node, const std::vector<std::string> &keys) {
@@ -38,6 +47,62 @@ T yaml_get(const YAML::Node &node, const std::vector<std::string> &keys) {
   return {0};
 }
 
+/**
+ * Reads the optional device to capture from directly. Only YUYV is supported, since that's what lets detection skip
+ * converting frames to color.
+ */
+void read_camera_device(const YAML::Node &node, phil::camera_config_t *camera) {
+  if (!node["device"]) {
+    return;
+  }
+  camera->device = yaml_get<std::string>(node, {"device"});
+  if (node["encoding"] && yaml_get<std::string>(node, {"encoding"}) != "YUYV") {
+    std::cerr << phil::red << "camera [" << camera->name << "] can only capture YUYV from [" << camera->device << "]"
+              << phil::reset << "\n";
+    throw YAML::ParserException(node.Mark(), "bad encoding");
+  }
+}
+
+/**
+ * Reads the cameras list, or the single camera section of older configs
+ */
+std::vector<phil::camera_config_t> read_camera_configs(const YAML::Node &config) {
+  std::vector<phil::camera_config_t> cameras;
+  if (!config["cameras"]) {
+    phil::camera_config_t camera;
+    camera.w = yaml_get<int>(config, {"camera", "w"});
+    camera.h = yaml_get<int>(config, {"camera", "h"});
+    camera.fps = yaml_get<int>(config, {"camera", "fps"});
+    camera.source_url = yaml_get<std::string>(config, {"camera", "source_url"});
+    camera.params_filename = yaml_get<std::string>(config, {"camera", "params"});
+    camera.name = "camera";
+    read_camera_device(config["camera"], &camera);
+    cameras.push_back(camera);
+    return cameras;
+  }
+
+  for (const auto &node : config["cameras"]) {
+    phil::camera_config_t camera;
+    camera.name = yaml_get<std::string>(node, {"name"});
+    camera.w = yaml_get<int>(node, {"w"});
+    camera.h = yaml_get<int>(node, {"h"});
+    camera.fps = yaml_get<int>(node, {"fps"});
+    camera.source_url = yaml_get<std::string>(node, {"source_url"});
+    camera.params_filename = yaml_get<std::string>(node, {"params"});
+    if (node["extrinsics"]) {
+      camera.extrinsics = yaml_get<std::vector<double>>(node, {"extrinsics"});
+      if (camera.extrinsics.size() != 6) {
+        std::cerr << phil::red << "extrinsics of camera [" << camera.name << "] must be x, y, z, roll, pitch, yaw"
+                  << phil::reset << "\n";
+        throw YAML::ParserException(node.Mark(), "bad extrinsics");
+      }
+    }
+    read_camera_device(node, &camera);
+    cameras.push_back(camera);
+  }
+  return cameras;
+}
+
 /**
  * The main program that runs on the TK1. Receives sensor data from the camera and the RoboRIO and performs localization
  */
@@ -50,6 +115,67 @@ int main(int argc, const char **argv) {
   args::Flag print_estimate_flag
       (parser, "print_estimate", "print the current x/y/yaw and other information", {'p', "print-estimate"});
   args::Flag log_flag(parser, "log", "log RIO input to a file for playback later", {'l', "log"});
+  args::Flag shm_flag
+      (parser, "shm", "receive RIO data from a producer on this machine over shared memory instead of UDP", {"shm"});
+  args::ValueFlag<unsigned int> rio_timeout_flag
+      (parser, "ms", "how long to wait for RIO data before predicting without it, default 500", {"rio-timeout"});
+  args::ValueFlag<std::string> imu_flag
+      (parser, "device", "read accelerometer data at full rate from a NavX on this serial device", {"imu"});
+  args::ValueFlag<std::string> imu_replay_flag
+      (parser, "imu_csv", "replay accelerometer data from record_imu_calibration_data instead of a NavX",
+       {"imu-replay"});
+  args::ValueFlag<std::string> detector_flag
+      (parser,
+       "detector",
+       "how to search frames for markers: full (default), roi to only search where the filter expects them, or "
+       "pyramid to search a downscaled frame when the expected markers are big enough, or tiled to search "
+       "parts of the frame on separate cores",
+       {"detector"});
+  args::ValueFlag<std::string> rectify_flag
+      (parser, "cache_dir", "remove lens distortion before detection, caching the remap tables here", {"rectify"});
+  args::ValueFlag<int> mjpeg_scale_flag
+      (parser,
+       "scale",
+       "read the camera's MJPEG stream directly and detect on the luma decoded at 1/scale size (1, 2 or 4), only "
+       "decoding the area around the markers at full size",
+       {"mjpeg-scale"});
+  args::Flag full_res_annotations_flag
+      (parser,
+       "full_res_annotations",
+       "with --mjpeg-scale or a YUYV device, convert frames with markers to full color for the annotated stream "
+       "instead of drawing on the luma",
+       {"full-res-annotations"});
+  args::ValueFlag<std::string> expand_map_flag
+      (parser,
+       "map_filename",
+       "locate markers that aren't in the map from the mapped ones, add them once their position is certain, and save "
+       "the expanded map here",
+       {"expand-map"});
+  args::Flag visual_odometry_flag
+      (parser,
+       "visual_odometry",
+       "track corners between every pair of frames and give the filter the yaw rate they measure, even when no "
+       "markers are visible",
+       {"visual-odometry"});
+  args::Flag track_corners_flag
+      (parser,
+       "track_corners",
+       "between detections, track the corners of the detected markers with optical flow and estimate the pose from "
+       "them. Markers are detected again when the tracks stop agreeing with the map, and more often the faster the "
+       "robot turns.",
+       {"track-corners"});
+  args::Flag pose_solver_flag
+      (parser,
+       "pose_solver",
+       "estimate each camera's pose by refining where the filter predicts it is, falling back to EPnP when the "
+       "prediction is poor, and give the filter the covariance of that pose instead of a fixed one",
+       {"pose-solver"});
+  args::Flag corner_measurements_flag
+      (parser,
+       "corner_measurements",
+       "update the filter with where each marker corner was seen instead of with a camera pose, so a single marker "
+       "helps too. A camera pose is still measured whenever the filter's estimate doesn't explain the corners.",
+       {"corner-measurements"});
   args::Positional<std::string> config_filename(parser, "config_filename", "", args::Options::Required);
 
   try {
@@ -79,16 +205,30 @@ int main(int argc, const char **argv) {
   const bool print_current_estimate = args::get(print_estimate_flag);
   const bool log = args::get(log_flag);
 
+  // when reading the IMU directly, accelerometer data from the RIO is ignored but yaw and encoders are still used
+  std::unique_ptr<phil::ImuSource> imu_source;
+  if (imu_flag) {
+    imu_source = phil::MakeNavxImuSource(args::get(imu_flag));
+    if (!imu_source) {
+      std::cerr << phil::red << "this build doesn't support reading the NavX directly" << phil::reset << "\n";
+      return EXIT_FAILURE;
+    }
+  } else if (imu_replay_flag) {
+    imu_source = std::make_unique<phil::CsvImuSource>(args::get(imu_replay_flag));
+  }
+
   const auto threshold_power = yaml_get<double>(config, {"threshold_power"});
-  const auto w = yaml_get<int>(config, {"camera", "w"});
-  const auto h = yaml_get<int>(config, {"camera", "h"});
-  const auto fps = yaml_get<int>(config, {"camera", "fps"});
-  const auto encoding = yaml_get<std::string>(config, {"camera", "encoding"});
   const auto map_filename = yaml_get<std::string>(config, {"aruco", "map"});
-  const auto phil_source_url = yaml_get<std::string>(config, {"camera", "source_url"});
   const auto dictionary = yaml_get<std::string>(config, {"aruco", "dictionary"});
   const auto marker_size = yaml_get<double>(config, {"aruco", "marker_size"});
-  const auto cam_params_file = yaml_get<std::string>(config, {"camera", "params"});
+  std::vector<phil::camera_config_t> camera_configs;
+  try {
+    camera_configs = read_camera_configs(config);
+  }
+  catch (YAML::Exception &e) {
+    std::cerr << phil::red << "Failed to read cameras from config file." << phil::reset << "\n" << e.what() << "\n";
+    return EXIT_FAILURE;
+  }
 
   constexpr auto hostname_length = 100;
   char hostname[hostname_length] = "localhost";
@@ -97,21 +237,9 @@ int main(int argc, const char **argv) {
     std::cout << phil::yellow << "Failed to get hostname" << phil::reset << "\n";
   }
 
-  cs::HttpCamera camera("phil/main/camera", phil_source_url);
-  cs::CvSink sink("phil/main/sink");
-  sink.SetSource(camera);
-
+  // each camera streams its annotated frames on its own port, counting up from this one
   constexpr int annotated_stream_port = 8777;
 
-  cs::CvSource cvsource("phil/main/annotated_source", cs::VideoMode::kMJPEG, w, h, fps);
-  cs::MjpegServer cvMjpegServer{"phil/main/annotated_mjpeg_server", annotated_stream_port};
-  cvMjpegServer.SetSource(cvsource);
-
-  if (verbose) {
-    std::cout << phil::cyan << "See annotated camera stream at " << hostname << ":" << annotated_stream_port
-              << phil::reset << "\n";
-  }
-
   // read in the markermapper config yaml file
   aruco::MarkerMap mmap;
   try {
@@ -128,30 +256,54 @@ int main(int argc, const char **argv) {
     mmap = mmap.convertToMeters(0.02);
   }
 
-  // marker detector is needed for passing detected markers to the tracker
-  aruco::MarkerDetector detector;
-  detector.setDictionary(dictionary);
+  // every camera adds to and picks up markers from the same expanded map
+  std::shared_ptr<phil::MapExpander> map_expander;
+  if (expand_map_flag) {
+    auto expander_config = phil::kDefaultMapExpanderConfig;
+    expander_config.marker_size = marker_size;
+    map_expander = std::make_shared<phil::MapExpander>(mmap, args::get(expand_map_flag), expander_config);
+  }
 
-  // load camera params
-  aruco::CameraParameters camera_params;
-  try {
-    camera_params.readFromXMLFile(cam_params_file);
+  const std::string detector_mode = detector_flag ? args::get(detector_flag) : "full";
+  if (detector_mode != "full" && detector_mode != "roi" && detector_mode != "pyramid" && detector_mode != "tiled") {
+    std::cerr << phil::red << "Unknown detector [" << detector_mode << "]" << phil::reset << "\n";
+    return EXIT_FAILURE;
   }
-  catch (cv::Exception &e) {
-    std::cerr << phil::red << "Failed to open [" << cam_params_file << "]" << phil::reset << "\n" << e.what() << "\n";
+
+  // the scaled luma skips the capture's decode, so it can't be combined with detectors that work on the full frame
+  const int mjpeg_scale = mjpeg_scale_flag ? args::get(mjpeg_scale_flag) : 0;
+  if (mjpeg_scale_flag) {
+    if (mjpeg_scale != 1 && mjpeg_scale != 2 && mjpeg_scale != 4) {
+      std::cerr << phil::red << "--mjpeg-scale must be 1, 2 or 4" << phil::reset << "\n";
+      return EXIT_FAILURE;
+    }
+    const bool any_device = std::any_of(camera_configs.begin(),
+                                        camera_configs.end(),
+                                        [](const phil::camera_config_t &camera) { return !camera.device.empty(); });
+    if (rectify_flag || detector_mode == "roi" || detector_mode == "pyramid" || any_device) {
+      std::cerr << phil::red << "--mjpeg-scale only works with the full or tiled detector, without --rectify and "
+                << "without cameras read from a device" << phil::reset << "\n";
+      return EXIT_FAILURE;
+    }
+  }
+
+  // tracked corners would have to be checked against the map at full resolution, which means a full decode anyway
+  if (mjpeg_scale > 1 && args::get(track_corners_flag)) {
+    std::cerr << phil::red << "--track-corners only works with --mjpeg-scale 1" << phil::reset << "\n";
     return EXIT_FAILURE;
   }
-  if (!camera_params.isValid()) {
-    std::cout << phil::red << "Invalid camera parameters" << phil::reset << "\n";
+
+  // the roi detector only rectifies the regions it searches, so tracked corners would be in the distorted frame
+  if (args::get(track_corners_flag) && rectify_flag && detector_mode == "roi") {
+    std::cerr << phil::red << "--track-corners doesn't work with --rectify and the roi detector" << phil::reset << "\n";
     return EXIT_FAILURE;
   }
-  camera_params.resize(cv::Size(w, h));
 
   const auto acc_calib_params = yaml_get<std::vector<double>>(config, {"imu_calibration", "accelerometer"});
 
   // Create the log file for rio data
   std::ofstream log_file;
-  cv::VideoWriter video;
+  std::vector<std::string> video_filenames(camera_configs.size());
   if (log) {
     char log_filename[100];
     time_t now = time(nullptr);
@@ -165,10 +317,54 @@ int main(int argc, const char **argv) {
     }
     log_file << phil::data_t::header() << "\n";
 
-    char video_filename[100];
-    std::string vid_fmt("video-%m_%d_%H-%M-%S.avi");
-    strftime(video_filename, 100, vid_fmt.c_str(), ltm);
-    video = cv::VideoWriter(video_filename, CV_FOURCC('M', 'J', 'P', 'G'), fps, cv::Size(w, h));
+    for (size_t i = 0; i < camera_configs.size(); ++i) {
+      char video_filename[100];
+      std::string vid_fmt("video-" + camera_configs[i].name + "-%m_%d_%H-%M-%S.avi");
+      strftime(video_filename, 100, vid_fmt.c_str(), ltm);
+      video_filenames[i] = video_filename;
+    }
+  }
+
+  // one pipeline per camera, each detecting on its own thread
+  std::vector<std::unique_ptr<phil::CameraPipeline>> cameras;
+  for (size_t i = 0; i < camera_configs.size(); ++i) {
+    const auto &camera_config = camera_configs[i];
+    aruco::CameraParameters camera_params;
+    try {
+      camera_params.readFromXMLFile(camera_config.params_filename);
+    }
+    catch (cv::Exception &e) {
+      std::cerr << phil::red << "Failed to open [" << camera_config.params_filename << "]" << phil::reset << "\n"
+                << e.what() << "\n";
+      return EXIT_FAILURE;
+    }
+    if (!camera_params.isValid()) {
+      std::cout << phil::red << "Invalid camera parameters for [" << camera_config.name << "]" << phil::reset << "\n";
+      return EXIT_FAILURE;
+    }
+    camera_params.resize(cv::Size(camera_config.w, camera_config.h));
+
+    phil::camera_options_t options;
+    options.dictionary = dictionary;
+    options.marker_size = marker_size;
+    options.detector_mode = detector_mode;
+    options.rectify_dir = rectify_flag ? args::get(rectify_flag) : "";
+    options.annotated_stream_port = annotated_stream_port + static_cast<int>(i);
+    options.video_filename = video_filenames[i];
+    options.mjpeg_scale = mjpeg_scale;
+    options.full_res_annotations = args::get(full_res_annotations_flag);
+    options.map_expander = map_expander;
+    options.visual_odometry = args::get(visual_odometry_flag);
+    options.track_corners = args::get(track_corners_flag);
+    options.pose_solver = args::get(pose_solver_flag);
+    options.corner_measurements = args::get(corner_measurements_flag);
+    options.verbose = verbose;
+    cameras.push_back(std::make_unique<phil::CameraPipeline>(i, camera_config, camera_params, mmap, options));
+
+    if (verbose) {
+      std::cout << phil::cyan << "See annotated stream of [" << camera_config.name << "] at " << hostname << ":"
+                << options.annotated_stream_port << phil::reset << "\n";
+    }
   }
 
   // Create calibration matrices
@@ -183,10 +379,6 @@ int main(int argc, const char **argv) {
   Eigen::Vector3d ba;
   ba << acc_calib_params[6], acc_calib_params[7], acc_calib_params[8];
 
-  // create pose tracker
-  aruco::MarkerMapPoseTracker tracker;
-  tracker.setParams(camera_params, mmap, marker_size);
-
   // network tables
   auto inst = nt::NetworkTableInstance::GetDefault();
   const auto servername = yaml_get<std::string>(config, {"nt", "server"});
@@ -198,12 +390,15 @@ int main(int argc, const char **argv) {
   // set the .type entry to ensure the shuffleboard integration works
   auto type_entry = phil_table->GetEntry(".type");
   type_entry.SetString("Phil");
-  auto x_entry = phil_table->GetEntry("x");
-  auto y_entry = phil_table->GetEntry("y");
-  auto yaw_entry = phil_table->GetEntry("yaw");
-
-  // Setup communication with the roborio
-  phil::UDPServer server(phil::kPort);
+  auto pose_entry = phil_table->GetEntry(phil::kPoseKey);
+
+  // Setup communication with the roborio, or with a local producer such as publish_rio_data
+  std::unique_ptr<phil::Server> server;
+  if (args::get(shm_flag)) {
+    server = std::make_unique<phil::ShmServer>(phil::kShmName);
+  } else {
+    server = std::make_unique<phil::UDPServer>(phil::kPort);
+  }
 
   {
     phil::data_t first_rio_data;
@@ -213,7 +408,7 @@ int main(int argc, const char **argv) {
     ssize_t bytes_received = 0;
     do {
       struct sockaddr_in client = {0};
-      std::tie(bytes_received, client) = server.Read(&first_rio_data);
+      std::tie(bytes_received, client) = server->Read(&first_rio_data);
     } while (bytes_received < 0);
     if (log) {
       log_file << first_rio_data.to_string() << "\n";
@@ -229,6 +424,11 @@ int main(int argc, const char **argv) {
     std::cout << phil::green << "Collecting Initial Stationary Sample" << phil::reset << "\n";
   }
 
+  // the IMU samples the same stationary period, so the static detector can be calibrated on the data it runs on
+  if (imu_source) {
+    imu_source->Start();
+  }
+
   constexpr size_t num_initial_samples = 60;
   Eigen::MatrixX3d initial_samples(num_initial_samples, 3);
   for (size_t i = 0; i < num_initial_samples; ++i) {
@@ -236,11 +436,12 @@ int main(int argc, const char **argv) {
     phil::data_t rio_data = {0};
     ssize_t bytes_received = 0;
     struct sockaddr_in client = {0};
-    std::tie(bytes_received, client) = server.Read(&rio_data);
+    std::tie(bytes_received, client) = server->Read(&rio_data);
     phil::data_t reply = {0};
     reply.rio_send_time_s = rio_data.rio_send_time_s;
+    reply.seq = rio_data.seq;
     reply.received_time_s = std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
-    server.Reply(client, reply);
+    server->Reply(client, reply);
 
     if (log) {
       log_file << rio_data.to_string() << "\n";
@@ -250,6 +451,10 @@ int main(int argc, const char **argv) {
       std::cerr << phil::red << "bytes received [" << bytes_received << "] doesn't match data_t size: ["
                 << strerror(errno) << "]" << phil::reset << "\n";
       return EXIT_FAILURE;
+    } else if (rio_data.version != phil::kDataVersion) {
+      std::cerr << phil::red << "received data_t version [" << rio_data.version << "], expected ["
+                << phil::kDataVersion << "]. Rebuild the sender." << phil::reset << "\n";
+      return EXIT_FAILURE;
     } else {
       // the correct amount of data was received so we store it
       initial_samples(i, 0) = rio_data.raw_acc_x;
@@ -259,10 +464,43 @@ int main(int argc, const char **argv) {
   }
 
   // Now that we've collected our initial sample, set a timeout so we can be robust to dropped RoboRIO data
+  const unsigned int rio_timeout_ms = rio_timeout_flag ? args::get(rio_timeout_flag) : 500;
   struct timeval timeout{0};
-  timeout.tv_sec = 0;
-  timeout.tv_usec = 500000;
-  server.SetTimeout(timeout);
+  timeout.tv_sec = rio_timeout_ms / 1000;
+  timeout.tv_usec = (rio_timeout_ms % 1000) * 1000;
+  server->SetTimeout(timeout);
+
+  // the static detector looks at the same span of time whether it runs on the RIO's or the IMU's samples
+  constexpr double static_window_s = 0.4;
+  constexpr double rio_rate_hz = 50;
+  double static_window_rate_hz = rio_rate_hz;
+  if (imu_source) {
+    std::vector<phil::imu_sample_t> initial_imu_samples;
+    imu_source->Drain(&initial_imu_samples);
+    if (initial_imu_samples.size() < num_initial_samples) {
+      std::cerr << phil::red << "only [" << initial_imu_samples.size() << "] IMU samples arrived while stationary"
+                << phil::reset << "\n";
+      return EXIT_FAILURE;
+    }
+    initial_samples.resize(initial_imu_samples.size(), 3);
+    for (size_t i = 0; i < initial_imu_samples.size(); ++i) {
+      initial_samples(i, 0) = initial_imu_samples[i].raw_acc_x;
+      initial_samples(i, 1) = initial_imu_samples[i].raw_acc_y;
+      initial_samples(i, 2) = initial_imu_samples[i].raw_acc_z;
+    }
+    // a replay without sensor times has nothing to measure the rate from
+    const double span_s = initial_imu_samples.back().sensor_time_s - initial_imu_samples.front().sensor_time_s;
+    if (span_s > 0) {
+      static_window_rate_hz = (initial_imu_samples.size() - 1) / span_s;
+      if (verbose) {
+        std::cout << "IMU rate is [" << static_window_rate_hz << "] Hz\n";
+      }
+    } else {
+      std::cerr << phil::yellow << "IMU samples all have the same sensor time, assuming [" << static_window_rate_hz
+                << "] Hz" << phil::reset << "\n";
+    }
+  }
+  const auto static_window_size = std::max<Eigen::Index>(2, std::lround(static_window_s * static_window_rate_hz));
 
   // compute the variance of our initial sample
   Eigen::Matrix<double, 1, 3> initial_static_means = initial_samples.colwise().mean();
@@ -300,18 +538,159 @@ int main(int argc, const char **argv) {
   ////////////////////////////////
 
   constexpr double meters_per_tick = 0.000357; // FIXME: where did this number come from?!
-  phil::EKF filter(0.9, 1.6, 0.05); // for mocap bot
+  constexpr double track_width_m = 0.9; // for mocap bot
+  constexpr double alpha = 1.6;
+  phil::EKF filter(track_width_m, alpha, 0.05);
   // phil::EKF filter(0.23, 1, 0.05); // for turtlebot--not sure about that last number (dt_s)
 
-  cv::Mat frame;
+  // Answer pose-at-time queries on their own thread so the robot program can compensate for our latency
+  constexpr size_t pose_history_size = 200;
+  phil::localization::PoseHistory pose_history(pose_history_size, track_width_m, alpha);
+  std::thread pose_query_thread([&pose_history]() {
+    phil::UDPServer query_server(phil::kPoseQueryPort);
+    while (true) {
+      phil::pose_query_t query{};
+      ssize_t bytes_received = 0;
+      sockaddr_in client = {0};
+      std::tie(bytes_received, client) = query_server.RawRead(reinterpret_cast<uint8_t *>(&query), sizeof(query));
+      if (bytes_received != sizeof(query)) {
+        continue;
+      }
+
+      phil::pose_record_t record{};
+      if (!pose_history.Query(query.time_s, &record)) {
+        record.seq = -1;
+      }
+      record.query_id = query.query_id;
+      query_server.RawReply(client, reinterpret_cast<uint8_t *>(&record), sizeof(record));
+    }
+  });
+  pose_query_thread.detach();
+
+  // cameras predict where markers will appear from the filter's estimate at the time of their frame
+  if (!no_camera) {
+    for (auto &camera : cameras) {
+      camera->Start([&pose_history](double stamp_s, phil::pose_t *pose, double *yaw_rate) {
+        phil::pose_record_t record{};
+        if (!pose_history.Query(stamp_s, &record)) {
+          return false;
+        }
+        *pose = {record.x, record.y, record.theta};
+        *yaw_rate = record.omega;
+        return true;
+      });
+    }
+  }
+
   bool done = false;
   static double accumulated_yaw_rad = 0;
   static double last_yaw_rad = 0;
-  constexpr size_t window_size = 20;
-  phil::math::Window<window_size, 3> window;
+  phil::math::Window<Eigen::Dynamic, 3> window(static_window_size);
   Eigen::Vector3d &latest_static_bias_estimate = calibrated_mean;
   const static Eigen::IOFormat csv_format(3, Eigen::DontAlignCols, ", ", "\n");
   size_t main_loop_idx = 0;
+  // the filter has been predicted up to this time, and every measurement is applied at its own time
+  double latest_measurement_time_s =
+      std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+  MatrixWrapper::ColumnVector latest_encoder_input(2);
+  latest_encoder_input = 0;
+  std::vector<phil::imu_sample_t> imu_samples;
+  std::vector<phil::camera_measurement_t> camera_measurements;
+  std::vector<phil::odometry_measurement_t> odometry_measurements;
+  const MatrixWrapper::SymmetricMatrix default_camera_covariance =
+      filter.camera_measurement_pdf->AdditiveNoiseSigmaGet();
+  MatrixWrapper::SymmetricMatrix camera_covariance(3);
+  std::vector<phil::corner_measurement_t> corner_measurements;
+  phil::localization::CornerMeasurementModel corner_measurement_model(
+      phil::localization::kDefaultCornerMeasurementConfig);
+
+  auto predict_to = [&](double stamp_s) {
+    if (stamp_s <= latest_measurement_time_s) {
+      return;
+    }
+    filter.system_pdf->SetDt(stamp_s - latest_measurement_time_s);
+    filter.filter->Update(filter.system_model.get(), latest_encoder_input);
+    latest_measurement_time_s = stamp_s;
+  };
+
+  auto camera_update = [&](const phil::camera_measurement_t &measurement) {
+    // the robot kept moving while the frame was processed, so add the motion the filter has seen since then
+    phil::pose_record_t then{};
+    if (!pose_history.Query(measurement.stamp_s, &then)) {
+      if (verbose) {
+        std::cout << phil::yellow << "dropping stale measurement from [" << cameras[measurement.camera]->Name()
+                  << "]" << phil::reset << "\n";
+      }
+      return;
+    }
+    const auto now = filter.filter->PostGet()->ExpectedValueGet();
+    MatrixWrapper::ColumnVector camera_measurement(3);
+    camera_measurement << measurement.robot_pose.x + now(1) - then.x,
+        measurement.robot_pose.y + now(2) - then.y,
+        measurement.robot_pose.theta + phil::yaw_diff_rad(now(3), then.theta);
+    if (measurement.robot_pose_covariance.isZero()) {
+      filter.camera_measurement_pdf->AdditiveNoiseSigmaSet(default_camera_covariance);
+    } else {
+      for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j <= i; ++j) {
+          camera_covariance(i + 1, j + 1) = measurement.robot_pose_covariance(i, j);
+        }
+      }
+      filter.camera_measurement_pdf->AdditiveNoiseSigmaSet(camera_covariance);
+    }
+    filter.filter->Update(filter.camera_measurement_model.get(), camera_measurement);
+  };
+
+  auto accelerometer_update = [&](const Eigen::Vector3d &raw_acc) {
+    window.push(raw_acc);
+
+    if (window.isFull()) {
+      const auto window_mean = window.colwise().mean();
+      const auto error = window.rowwise() - window_mean;
+      const double window_variance_norm = std::pow(error.array().square().matrix().colwise().mean().norm(), 2);
+      if (window_variance_norm < static_threshold) {
+        if (show_static) {
+          std::cout << "static at idx [" << main_loop_idx << "]\n";
+        }
+        // set the bias in each axis to the current mean of the window
+        latest_static_bias_estimate = window_mean;
+
+        // set the current velocity estimate to be 0
+        filter.ZeroVelocityUpdate();
+      }
+    }
+
+    // apply calibration
+    const auto calibrated_acc = Ta * Ka * (raw_acc + ba);
+
+    // apply current bias estimate
+    const auto adjusted_acc = calibrated_acc - latest_static_bias_estimate;
+
+    // rotate into base frame
+    const auto base_frame_acc = base_rotation * adjusted_acc;
+
+    // convert from Gs to m/s^2
+    const auto mpss_acc = base_frame_acc * 9.8;
+
+    // rotate acc into world frame
+    constexpr double navx_yaw_offset = M_PI / 2;
+    const Eigen::AngleAxisd world_frame_rotation(accumulated_yaw_rad + navx_yaw_offset, Eigen::Vector3d::UnitZ());
+    const Eigen::Vector3d world_frame_acc = world_frame_rotation * mpss_acc;
+
+    MatrixWrapper::ColumnVector acc_measurement(2);
+    acc_measurement << world_frame_acc(0), world_frame_acc(1);
+    filter.filter->Update(filter.acc_measurement_model.get(), acc_measurement);
+  };
+
+  size_t next_imu_sample = 0;
+  auto imu_update_until = [&](double stamp_s) {
+    for (; next_imu_sample < imu_samples.size() && imu_samples[next_imu_sample].stamp_s <= stamp_s; ++next_imu_sample) {
+      const auto &sample = imu_samples[next_imu_sample];
+      predict_to(sample.stamp_s);
+      accelerometer_update({sample.raw_acc_x, sample.raw_acc_y, sample.raw_acc_z});
+    }
+  };
+
   if (verbose) {
     std::cout << phil::green << "Beginning Localization loop" << phil::reset << "\n";
   }
@@ -321,16 +700,25 @@ int main(int argc, const char **argv) {
     // FIXME: respond with time stamp or rio time sync won't work and error messages will print in publish_rio_data
     ssize_t bytes_received = 0;
     sockaddr_in client = {0};
-    std::tie(bytes_received, client) = server.Read(&rio_data);
+    std::tie(bytes_received, client) = server->Read(&rio_data);
     phil::data_t reply = {0};
     reply.rio_send_time_s = rio_data.rio_send_time_s;
+    reply.seq = rio_data.seq;
     reply.received_time_s = std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
-    server.Reply(client, reply);
+    server->Reply(client, reply);
 
-    MatrixWrapper::ColumnVector acc_measurement(2);
+    // every IMU sample that arrived since the last cycle, at the IMU's full rate
+    imu_samples.clear();
+    next_imu_sample = 0;
+    if (imu_source) {
+      imu_source->Drain(&imu_samples);
+    }
 
     if (bytes_received != -1 && bytes_received != phil::data_t_size) {
       std::cerr << phil::red << "bytes does not match data_t_size: [" << strerror(errno) << "]" << phil::reset << "\n";
+    } else if (bytes_received != -1 && rio_data.version != phil::kDataVersion) {
+      std::cerr << phil::red << "received data_t version [" << rio_data.version << "], expected ["
+                << phil::kDataVersion << "]" << phil::reset << "\n";
     } else {
       if (log) {
         log_file << rio_data.to_string() << "\n";
@@ -349,48 +737,6 @@ int main(int argc, const char **argv) {
       MatrixWrapper::ColumnVector yaw_measurement(1);
       yaw_measurement << accumulated_yaw_rad;
 
-      /////////////////////////////////////////////////
-      // ACCELEROMETER MEASUREMENT
-      /////////////////////////////////////////////////
-
-      Eigen::Vector3d raw_acc{rio_data.raw_acc_x, rio_data.raw_acc_y, rio_data.raw_acc_z};
-      window.push(raw_acc);
-
-      if (window.isFull()) {
-        const auto window_mean = window.colwise().mean();
-        const auto error = window.rowwise() - window_mean;
-        const double window_variance_norm = std::pow(error.array().square().matrix().colwise().mean().norm(), 2);
-        if (window_variance_norm < static_threshold) {
-          if (show_static) {
-            std::cout << "static at idx [" << main_loop_idx << "]\n";
-          }
-          // set the bias in each axis to the current mean of the window
-          latest_static_bias_estimate = window_mean;
-
-          // set the current velocity estimate to be 0
-          filter.ZeroVelocityUpdate();
-        }
-      }
-
-      // apply calibration
-      const auto calibrated_acc = Ta * Ka * (raw_acc + ba);
-
-      // apply current bias estimate
-      const auto adjusted_acc = calibrated_acc - latest_static_bias_estimate;
-
-      // rotate into base frame
-      const auto base_frame_acc = base_rotation * adjusted_acc;
-
-      // convert from Gs to m/s^2
-      const auto mpss_acc = base_frame_acc * 9.8;
-
-      // rotate acc into world frame
-      constexpr double navx_yaw_offset = M_PI / 2;
-      const Eigen::AngleAxisd world_frame_rotation(accumulated_yaw_rad + navx_yaw_offset, Eigen::Vector3d::UnitZ());
-      const Eigen::Vector3d world_frame_acc = world_frame_rotation * mpss_acc;
-
-      acc_measurement << world_frame_acc(0), world_frame_acc(1);
-
       /////////////////////////////////////////////////
       // ENCODER CONTROL
       /////////////////////////////////////////////////
@@ -402,96 +748,142 @@ int main(int argc, const char **argv) {
       MatrixWrapper::ColumnVector encoder_input(2);
       encoder_input(1) = v_l;
       encoder_input(2) = v_r;
+      latest_encoder_input = encoder_input;
 
-      filter.filter->Update(filter.system_model.get(), encoder_input);
+      // the wheel speeds were measured up to when the packet arrived, so they carry the filter through the IMU
+      // samples from before then
+      imu_update_until(reply.received_time_s);
+      predict_to(reply.received_time_s);
       filter.filter->Update(filter.yaw_measurement_model.get(), yaw_measurement);
-      filter.filter->Update(filter.acc_measurement_model.get(), acc_measurement);
-    }
 
-    // only wait briefly for camera frame.
-    // if it's not available that's fine, we'll just not call the EKF update for camera data
-    uint64_t time = 0;
-    if (!no_camera) {
-      time = sink.GrabFrame(frame, 0.005);
-    }
+      /////////////////////////////////////////////////
+      // ACCELEROMETER MEASUREMENT
+      /////////////////////////////////////////////////
 
-    if (time > 0) {
-      if (frame.empty()) {
-        std::cerr << phil::yellow << "empty frame" << "\n";
-        break;
+      if (!imu_source) {
+        accelerometer_update({rio_data.raw_acc_x, rio_data.raw_acc_y, rio_data.raw_acc_z});
       }
+    }
 
-      if (log) {
-        video.write(frame);
-      }
+    imu_update_until(std::numeric_limits<double>::infinity());
 
-      cv::Mat annotated_frame;
-      frame.copyTo(annotated_frame);
+    /////////////////////////////////////////////////
+    // CAMERA MEASUREMENT
+    /////////////////////////////////////////////////
 
-      // update step for camera measurement
-      std::vector<aruco::Marker> detected_markers = detector.detect(frame);
+    // every camera's measurements since the last cycle, applied in the order their frames arrived
+    camera_measurements.clear();
+    for (auto &camera : cameras) {
+      camera->Drain(&camera_measurements);
+    }
+    std::sort(camera_measurements.begin(),
+              camera_measurements.end(),
+              [](const phil::camera_measurement_t &a, const phil::camera_measurement_t &b) {
+                return a.stamp_s < b.stamp_s;
+              });
+    for (const auto &measurement : camera_measurements) {
+      camera_update(measurement);
+    }
 
-      // show annotated frame. It's useful to debugging/visualizing
-      if (detected_markers.empty()) {
+    /////////////////////////////////////////////////
+    // CORNER MEASUREMENT
+    /////////////////////////////////////////////////
+
+    corner_measurements.clear();
+    for (auto &camera : cameras) {
+      camera->DrainCorners(&corner_measurements);
+    }
+    std::sort(corner_measurements.begin(),
+              corner_measurements.end(),
+              [](const phil::corner_measurement_t &a, const phil::corner_measurement_t &b) {
+                return a.stamp_s < b.stamp_s;
+              });
+    for (const auto &measurement : corner_measurements) {
+      // the corners are projected from where the robot was when the frame arrived
+      phil::pose_record_t then{};
+      if (!pose_history.Query(measurement.stamp_s, &then)) {
         if (verbose) {
-          std::cout << phil::cyan << "no tags detected" << phil::reset << "\n";
+          std::cout << phil::yellow << "dropping stale corners from [" << cameras[measurement.camera]->Name() << "]"
+                    << phil::reset << "\n";
         }
-        cvsource.PutFrame(annotated_frame); // put in the unannotated frame
         continue;
       }
+      const auto now = filter.filter->PostGet()->ExpectedValueGet();
+      const phil::pose_t motion{now(1) - then.x, now(2) - then.y, phil::yaw_diff_rad(now(3), then.theta)};
+      if (corner_measurement_model.Update(filter.filter.get(), measurement.corners, motion)) {
+        continue;
+      }
+      if (verbose) {
+        std::cout << phil::yellow << "corners from [" << cameras[measurement.camera]->Name()
+                  << "] are behind the camera or too far from the filter's estimate" << phil::reset << "\n";
+      }
+      // the camera only checked the corners against the filter's pose, not its covariance, so a filter that is sure
+      // of the wrong pose can reject every frame. The pose solved from the same markers gets it unstuck.
+      if (measurement.has_pose) {
+        camera_update(measurement.pose);
+      }
+    }
 
-      // estimate 3d camera pose if possible
-      if (tracker.isValid()) {
-        // estimate the pose of the camera with respect to the detected markers
-        if (tracker.estimatePose(detected_markers)) {
-          cv::Mat rt_matrix = tracker.getRTMatrix();
-          // We got a fully valid pose estimate from our camera frame
-          MatrixWrapper::ColumnVector camera_measurement(3);
-          const auto camera_pose = phil::MatrixTo3Pose(rt_matrix);
-          camera_measurement << camera_pose.x, camera_pose.y, camera_pose.theta;
-          std::cout << phil::green << camera_pose.x << phil::reset << "\n";
-
-          /////////////////////////////////////////////////
-          // CAMERA MEASUREMENT
-          /////////////////////////////////////////////////
-
-          filter.filter->Update(filter.camera_measurement_model.get(), camera_measurement);
-        } else {
-          std::cout << phil::cyan << "no pose estimate from marker mapper" << phil::reset << "\n";
-        }
+    /////////////////////////////////////////////////
+    // VISUAL ODOMETRY MEASUREMENT
+    /////////////////////////////////////////////////
 
-        // annotate the video feed
-        for (auto &marker : detected_markers) {
-          marker.draw(annotated_frame, cv::Scalar(0, 0, 255), 2);
-          aruco::CvDrawingUtils::draw3dCube(annotated_frame, marker, camera_params);
-          aruco::CvDrawingUtils::draw3dAxis(annotated_frame, marker, camera_params);
-        }
-      } else {
-        std::cerr << "Invalid marker map pose tracker\n";
+    // each yaw rate is the turn between two frames, so it corrects how far the filter thinks it turned between them
+    odometry_measurements.clear();
+    for (auto &camera : cameras) {
+      camera->DrainOdometry(&odometry_measurements);
+    }
+    std::sort(odometry_measurements.begin(),
+              odometry_measurements.end(),
+              [](const phil::odometry_measurement_t &a, const phil::odometry_measurement_t &b) {
+                return a.stamp_s < b.stamp_s;
+              });
+    for (const auto &measurement : odometry_measurements) {
+      phil::pose_record_t before{}, after{};
+      if (!pose_history.Query(measurement.previous_stamp_s, &before) ||
+          !pose_history.Query(measurement.stamp_s, &after)) {
+        continue;
       }
-
-      // show annotated frame. It's useful to debugging/visualizing
-      cvsource.PutFrame(annotated_frame);
+      const double dt_s = measurement.stamp_s - measurement.previous_stamp_s;
+      filter.HeadingChangeUpdate(before.theta,
+                                 after.theta,
+                                 measurement.yaw_rate * dt_s,
+                                 measurement.yaw_rate_var * dt_s * dt_s);
     }
 
-    // Fill our pose struct from the belief state of the EKF
-    phil::pose_t pose{};
+    // Fill our pose record from the belief state of the EKF
     const auto estimate = filter.filter->PostGet()->ExpectedValueGet();
-    const auto cov = filter.filter->PostGet()->CovarianceGet().diagonal();
+    const auto covariance = filter.filter->PostGet()->CovarianceGet();
+    const auto cov = covariance.diagonal();
+    phil::pose_record_t pose{};
     pose.x = estimate(1);
     pose.y = estimate(2);
     pose.theta = estimate(3);
+    pose.vx = estimate(4);
+    pose.vy = estimate(5);
+    pose.omega = estimate(6);
+    pose.var_x = covariance(1, 1);
+    pose.var_y = covariance(2, 2);
+    pose.var_theta = covariance(3, 3);
+    pose.stamp_s = latest_measurement_time_s;
+    pose.seq = main_loop_idx;
+    pose_history.Push(latest_measurement_time_s, estimate, covariance, latest_encoder_input);
 
     if (print_current_estimate) {
       std::cout << estimate.transpose().format(csv_format) << ", " << cov.transpose().format(csv_format) << std::endl;
     }
 
-    x_entry.SetDouble(pose.x);
-    y_entry.SetDouble(pose.y);
-    yaw_entry.SetDouble(pose.theta);
+    // publish the whole record as one entry and send it right away rather than on the next periodic NT update
+    const auto packed_pose = phil::PackPoseRecord(pose);
+    pose_entry.SetDoubleArray(llvm::ArrayRef<double>(packed_pose.data(), packed_pose.size()));
+    inst.Flush();
 
     ++main_loop_idx;
   }
 
+  for (auto &camera : cameras) {
+    camera->Stop();
+  }
+
   return EXIT_FAILURE;
 }
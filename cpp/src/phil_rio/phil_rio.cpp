@@ -11,14 +11,21 @@ Phil *Phil::instance = nullptr;
 
 // TODO: don't hard code main hostname
 Phil::Phil() :
-    left_encoder(nullptr), right_encoder(nullptr), ahrs(nullptr), udp_client("raspberrypi.local", phil::kPort), tk1_time_offset(0) {
+    left_encoder(nullptr), right_encoder(nullptr), ahrs(nullptr), udp_client("raspberrypi.local", phil::kPort),
+    pose_query_client("raspberrypi.local", phil::kPoseQueryPort), tk1_time_offset(0), last_query_id(0) {
   auto inst = nt::NetworkTableInstance::GetDefault();
   table = inst.GetTable(phil::kTableName);
+  pose_entry = table->GetEntry(phil::kPoseKey);
 
   struct timeval timeout;
   timeout.tv_sec = 0;
   timeout.tv_usec = 100000;
   udp_client.SetTimeout(timeout);
+
+  struct timeval query_timeout;
+  query_timeout.tv_sec = 0;
+  query_timeout.tv_usec = 20000;
+  pose_query_client.SetTimeout(query_timeout);
 }
 
 Phil *Phil::GetInstance() {
@@ -61,19 +68,52 @@ void Phil::ReadSensorsAndProcessRemotely() {
 }
 
 phil::pose_t Phil::GetPosition() {
-  pose_t pose = {0};
-
-  std::vector<double> defult_value = {999, 999, 999,};
-  std::vector<double> pose_ref = table->GetNumberArray(phil::kPoseKey,
-                                                       llvm::ArrayRef<double>(defult_value));
+  pose_t pose = {999, 999, 999};
 
-  pose.x = pose_ref.at(0);
-  pose.y = pose_ref.at(1);
-  pose.theta = pose_ref.at(2);
+  pose_record_t record{};
+  if (GetPoseRecord(&record)) {
+    pose.x = record.x;
+    pose.y = record.y;
+    pose.theta = record.theta;
+  }
 
   return pose;
 }
 
+bool Phil::GetPoseRecord(pose_record_t *record) {
+  // the value is shared with ntcore, so this only bumps a reference count
+  auto value = pose_entry.GetValue();
+  if (!value || !value->IsDoubleArray()) {
+    return false;
+  }
+
+  auto array = value->GetDoubleArray();
+  return UnpackPoseRecord(array.data(), array.size(), record);
+}
+
+bool Phil::GetPoseAt(double rio_time_s, pose_record_t *record) {
+  // tk1_time_offset is the RoboRIO clock minus the co-processor clock
+  pose_query_t query{};
+  query.time_s = rio_time_s - tk1_time_offset;
+  query.query_id = ++last_query_id;
+
+  pose_record_t response{};
+  ssize_t bytes_received = pose_query_client.RawTransaction(reinterpret_cast<uint8_t *>(&query),
+                                                            sizeof(query),
+                                                            reinterpret_cast<uint8_t *>(&response),
+                                                            sizeof(response));
+  // late answers to earlier queries that timed out are for the wrong time
+  while (bytes_received == sizeof(response) && response.query_id != query.query_id) {
+    bytes_received = pose_query_client.Read(reinterpret_cast<uint8_t *>(&response), sizeof(response));
+  }
+  if (bytes_received != sizeof(response) || response.seq < 0) {
+    return false;
+  }
+
+  *record = response;
+  return true;
+}
+
 void Phil::SendUDPTo(std::string hostname,
                      uint8_t *request,
                      size_t request_size,
@@ -90,6 +130,7 @@ void Phil::SendUDPToPI(uint8_t *request, size_t request_size, uint8_t *response,
 
 void Phil::Reconnect() {
   udp_client.Reconnect();
+  pose_query_client.Reconnect();
 }
 
 } // end namespace
@@ -1,7 +1,37 @@
 #include<iostream>
+#include <cassert>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <vector>
 
+#include <opencv2/opencv.hpp>
+
+#include <phil/common/atomic_file.h>
 #include <phil/common/common.h>
+#include <phil/common/corner_tracker.h>
+#include <phil/common/detection_cache.h>
+#include <phil/common/frame_bus.h>
+#include <phil/common/imu.h>
+#include <phil/common/impairment.h>
+#include <phil/common/jpeg.h>
+#include <phil/common/map_expander.h>
+#include <phil/common/pcd_stream_writer.h>
+#include <phil/common/polar_unwarp.h>
+#include <phil/common/pyramid_detector.h>
+#include <phil/common/rectifier.h>
+#include <phil/common/roi_detector.h>
+#include <phil/common/tiled_detector.h>
+#include <phil/common/video_segments.h>
+#include <phil/common/visual_odometry.h>
+#include <phil/common/yuyv.h>
+#include <phil/common/shm.h>
+#include <phil/localization/corner_measurement_model.h>
+#include <phil/localization/ekf.h>
+#include <phil/localization/marker_graph.h>
+#include <phil/localization/marker_pose_solver.h>
+#include <phil/localization/pose_history.h>
 
 int main(int argc, const char **argv) {
 
@@ -16,5 +46,796 @@ int main(int argc, const char **argv) {
   assert(phil::yaw_diff_deg(1, 359) == 2);
   assert(phil::yaw_diff_deg(359, 1) == -2);
 
+  {
+    phil::pose_record_t record{};
+    record.x = 1;
+    record.theta = 3;
+    record.seq = 7;
+    record.query_id = 8;
+    const auto packed = phil::PackPoseRecord(record);
+    assert(packed[0] == 1 && packed[2] == 3 && packed[phil::kPoseRecordLength - 2] == 7);
+    assert(packed[phil::kPoseRecordLength - 1] == 8);
+    phil::pose_record_t unpacked{};
+    const bool unpacked_ok = phil::UnpackPoseRecord(packed.data(), packed.size(), &unpacked);
+    assert(unpacked_ok && unpacked.theta == 3 && unpacked.seq == 7);
+    const bool truncated_ok = phil::UnpackPoseRecord(packed.data(), 3, &unpacked);
+    assert(!truncated_ok);
+  }
+
+  {
+    // requests written in place by the client come out of the server in order
+    phil::ShmServer server("/phil_unit_tests");
+    phil::ShmClient client("/phil_unit_tests");
+    server.SetTimeout({0, 1000});
+    for (int i = 0; i < 3; ++i) {
+      phil::data_t *slot = client.Claim();
+      assert(slot != nullptr);
+      slot->yaw = i;
+      client.Publish();
+    }
+    for (int i = 0; i < 3; ++i) {
+      phil::data_t request{};
+      const ssize_t read = server.Read(&request).first;
+      assert(read == phil::data_t_size);
+      assert(request.yaw == i && request.version == phil::kDataVersion);
+      server.Reply({}, request);
+    }
+    phil::data_t reply{};
+    const bool replied_in_order = client.WaitForReply(2, &reply);
+    assert(replied_in_order && reply.yaw == 2);
+    const ssize_t read_empty = server.Read();
+    assert(read_empty == -1);
+
+    // a whole ring of requests the server has answered still can't be claimed past until their replies are read
+    for (uint32_t i = 0; i < phil::kShmRingSize; ++i) {
+      phil::data_t *slot = client.Claim();
+      assert(slot != nullptr);
+      slot->yaw = i;
+      client.Publish();
+      phil::data_t request{};
+      const ssize_t read = server.Read(&request).first;
+      assert(read == phil::data_t_size);
+      server.Reply({}, request);
+    }
+    assert(client.Claim() == nullptr);
+    const bool replied = client.WaitForReply(3, &reply);
+    assert(replied && reply.yaw == 0);
+    assert(client.Claim() != nullptr);
+  }
+
+  {
+    // a perfect network passes everything straight through
+    phil::Impairment perfect(phil::impairment_config_t{});
+    for (size_t i = 0; i < 10; ++i) {
+      auto out = perfect.Push(phil::data_t{});
+      assert(out.size() == 1 && out[0].index == i && out[0].delay_ms == 0);
+    }
+
+    // a held packet comes out after exactly reorder_window later packets
+    phil::impairment_config_t reorder_config;
+    reorder_config.reorder_rate = 1;
+    reorder_config.reorder_window = 2;
+    phil::Impairment reorder(reorder_config);
+    const auto held = reorder.Push(phil::data_t{});
+    const auto also_held = reorder.Push(phil::data_t{});
+    assert(held.empty() && also_held.empty());
+    auto out = reorder.Push(phil::data_t{});
+    assert(out.size() == 1 && out[0].index == 0);
+    const auto flushed = reorder.Flush();
+    assert(flushed.size() == 2);
+
+    // the same seed gives the same losses
+    phil::impairment_config_t lossy_config;
+    lossy_config.loss_rate = 0.3;
+    lossy_config.burst_enter_rate = 0.1;
+    lossy_config.burst_exit_rate = 0.5;
+    lossy_config.seed = 42;
+    phil::Impairment a(lossy_config), b(lossy_config);
+    for (int i = 0; i < 100; ++i) {
+      const size_t a_out = a.Push(phil::data_t{}).size();
+      const size_t b_out = b.Push(phil::data_t{}).size();
+      assert(a_out == b_out);
+    }
+    assert(a.Stats().lost > 0 && a.Stats().lost == b.Stats().lost);
+    assert(a.Stats().lost + a.Stats().delivered == 100);
+  }
+
+  {
+    // a recorded IMU log replays every sample in order, stamped on our clock
+    const char *imu_csv = "/tmp/phil_unit_tests_imu.csv";
+    std::ofstream imu_log(imu_csv);
+    imu_log << "accl_x,accel_y,accel_z,gyro_x,gyro_y,gyro_z,time\n";
+    for (int i = 0; i < 50; ++i) {
+      imu_log << "0,0," << i << ",0,0,0," << 1000 + 5 * i << "\n";
+    }
+    imu_log.close();
+
+    phil::CsvImuSource source(imu_csv, 0);
+    source.Start();
+    std::vector<phil::imu_sample_t> samples;
+    while (samples.size() < 50) {
+      source.Drain(&samples);
+    }
+    source.Stop();
+    assert(samples[49].raw_acc_z == 49);
+    assert(fabs(samples[1].sensor_time_s - samples[0].sensor_time_s - 0.005) < 1e-9);
+    for (size_t i = 1; i < samples.size(); ++i) {
+      assert(samples[i].stamp_s > samples[i - 1].stamp_s);
+    }
+    std::remove(imu_csv);
+  }
+
+  {
+    // driving forward 1m moves the map 1m backwards in the camera frame
+    const cv::Mat identity = cv::Mat::eye(4, 4, CV_32F);
+    cv::Mat rt = phil::PredictRT(identity, {0, 0, 0}, {1, 0, 0});
+    assert(fabs(rt.at<double>(0, 3) + 1) < 1e-9 && fabs(rt.at<double>(1, 3)) < 1e-9);
+
+    // turning in place about a point other than the origin also moves the map
+    rt = phil::PredictRT(identity, {1, 0, 0}, {1, 0, M_PI / 2});
+    assert(fabs(rt.at<double>(0, 3) - 1) < 1e-9 && fabs(rt.at<double>(1, 3) - 1) < 1e-9);
+    assert(fabs(rt.at<double>(0, 1) - 1) < 1e-9);
+
+    // the smallest marker in view decides the pyramid level, markers out of view don't count
+    const std::vector<std::vector<cv::Point2f>> projected{
+        {{10, 10}, {50, 10}, {50, 50}, {10, 50}},
+        {{100, 100}, {200, 100}, {200, 200}, {100, 200}},
+        {{-30, -30}, {-20, -30}, {-20, -20}, {-30, -20}}};
+    assert(phil::PyramidMarkerDetector::ExpectedMinSidePx(projected, cv::Size(640, 480)) == 40);
+  }
+
+  {
+    // tiles overlap their neighbors and are clipped to the frame
+    phil::TiledMarkerDetector tiled("ARUCO_MIP_16h3", 2, 2, 96);
+    const auto tiles = tiled.Tiles(cv::Size(640, 480));
+    assert(tiles.size() == 4);
+    assert(tiles[0] == cv::Rect(0, 0, 416, 336));
+    assert(tiles[3] == cv::Rect(224, 144, 416, 336));
+  }
+
+  {
+    // buffers go back to the pool once every subscriber has let go of them
+    phil::FrameBus bus(2);
+    auto subscription = bus.Subscribe(1);
+    auto a = bus.Acquire();
+    auto b = bus.Acquire();
+    auto none = bus.Acquire();
+    assert(a && b && !none);
+    a->image = cv::Mat::zeros(4, 4, CV_8UC1);
+    bus.Publish(std::move(a));
+    b.reset();
+    phil::FramePtr received = subscription->Next(0);
+    assert(received && received->seq == 0 && received->image.rows == 4);
+    const phil::FramePtr nothing_new = subscription->Next(0);
+    assert(!nothing_new);
+    auto c = bus.Acquire();
+    none = bus.Acquire();
+    assert(c && !none);
+    received.reset();
+    auto returned = bus.Acquire();
+    assert(returned);
+  }
+
+  {
+    // remap tables round trip through the cache, and a different key is a miss
+    cv::Mat map1(3, 5, CV_16SC2, cv::Scalar(7, -2));
+    cv::Mat map2(3, 5, CV_16UC1, cv::Scalar(300));
+    const std::string filename = "/tmp/phil_test_remap_cache.bin";
+    const bool saved = phil::SaveRemapCache(filename, 42, map1, map2);
+    assert(saved);
+    cv::Mat loaded1, loaded2;
+    const bool loaded_other_key = phil::LoadRemapCache(filename, 43, &loaded1, &loaded2);
+    assert(!loaded_other_key);
+    const bool loaded = phil::LoadRemapCache(filename, 42, &loaded1, &loaded2);
+    assert(loaded);
+    assert(loaded1.type() == CV_16SC2 && loaded2.type() == CV_16UC1);
+    assert(cv::countNonZero(loaded2 != map2) == 0);
+    assert(loaded1.at<cv::Vec2s>(2, 4) == cv::Vec2s(7, -2));
+    std::remove(filename.c_str());
+  }
+
+  {
+    // the old file stays in place until the new one is committed, and nothing is left behind by a write given up on
+    const std::string filename = "/tmp/phil_unit_tests_atomic.txt";
+    const bool written = phil::WriteFileAtomically(filename, [](std::ostream &out) {
+      out << "old";
+      return true;
+    });
+    assert(written);
+    std::string tmp_filename;
+    {
+      phil::AtomicFile file(filename);
+      tmp_filename = file.TmpFilename();
+      std::ofstream(tmp_filename) << "new";
+    }
+    assert(tmp_filename == "/tmp/phil_unit_tests_atomic.tmp.txt");
+    const bool gave_up = phil::WriteFileAtomically(filename, [](std::ostream &out) {
+      out << "partial";
+      return false;
+    });
+    assert(!gave_up);
+    std::string contents;
+    std::ifstream(filename) >> contents;
+    assert(contents == "old" && !std::ifstream(tmp_filename).good());
+    std::remove(filename.c_str());
+  }
+
+  {
+    // scaled decodes come out at the reduced size, and a region decode matches the same pixels of a full decode
+    cv::Mat color(120, 160, CV_8UC3);
+    cv::randu(color, cv::Scalar::all(0), cv::Scalar::all(255));
+    std::vector<uint8_t> jpeg;
+    cv::imencode(".jpg", color, jpeg);
+    phil::JpegDecoder decoder;
+    cv::Mat full, quarter, region;
+    const bool decoded_full = decoder.DecodeGray(jpeg.data(), jpeg.size(), 1, &full);
+    assert(decoded_full && full.size() == cv::Size(160, 120));
+    const bool decoded_quarter = decoder.DecodeGray(jpeg.data(), jpeg.size(), 4, &quarter);
+    assert(decoded_quarter && quarter.size() == cv::Size(40, 30));
+    const cv::Rect roi(37, 21, 50, 200);
+    const bool decoded_region = decoder.DecodeGrayRegion(jpeg.data(), jpeg.size(), roi, &region);
+    assert(decoded_region && region.size() == cv::Size(50, 99));
+    assert(cv::countNonZero(region != full(cv::Rect(37, 21, 50, 99))) == 0);
+    const bool decoded_outside = decoder.DecodeGrayRegion(jpeg.data(), jpeg.size(), cv::Rect(200, 0, 5, 5), &region);
+    assert(!decoded_outside);
+    const std::vector<uint8_t> garbage(100, 7);
+    const bool decoded_garbage = decoder.DecodeGray(garbage.data(), garbage.size(), 1, &full);
+    assert(!decoded_garbage);
+  }
+
+  {
+    // a marker that isn't in the map is added where it was seen once enough frames agree, and the map is saved
+    const cv::Mat K = (cv::Mat_<double>(3, 3) << 500, 0, 320, 0, 500, 240, 0, 0, 1);
+    const aruco::CameraParameters camera_params(K, cv::Mat::zeros(1, 5, CV_64F), cv::Size(640, 480));
+    aruco::MarkerMap map;
+    map.mInfoType = aruco::MarkerMap::METERS;
+    auto config = phil::kDefaultMapExpanderConfig;
+    config.marker_size = 0.2;
+    config.min_observations = 5;
+    const std::string filename = "/tmp/phil_unit_tests_map.yml";
+
+    // facing the camera, 2m in front of it, with the camera at the map origin
+    const std::vector<cv::Point3f> truth{{0, -0.1f, 2}, {0.2f, -0.1f, 2}, {0.2f, 0.1f, 2}, {0, 0.1f, 2}};
+    std::vector<cv::Point2f> corners;
+    cv::projectPoints(truth, cv::Mat::zeros(3, 1, CV_64F), cv::Mat::zeros(3, 1, CV_64F), K, cv::noArray(), corners);
+    {
+      phil::MapExpander expander(map, filename, config);
+      for (int i = 0; i < 5; ++i) {
+        auto noisy = corners;
+        noisy[i % 4].x += (i % 2 ? 0.2f : -0.2f);
+        const bool added = expander.Observe({aruco::Marker(noisy, 7)}, cv::Mat::eye(4, 4, CV_64F), camera_params);
+        assert(added == (i == 4));
+      }
+      const aruco::MarkerMap expanded = expander.Map();
+      assert(expander.Version() == 1 && expanded.size() == 1 && expanded[0].id == 7);
+      for (int c = 0; c < 4; ++c) {
+        assert(cv::norm(expanded[0].points[c] - truth[c]) < 0.01);
+      }
+    }
+    aruco::MarkerMap saved;
+    saved.readFromFile(filename);
+    assert(saved.getIndexOfMarkerId(7) != -1);
+    std::remove(filename.c_str());
+
+    // a marker crowded out of the candidates starts averaging over again
+    config.min_observations = 3;
+    config.max_candidates = 1;
+    phil::MapExpander expander(map, "", config);
+    const std::vector<int> ids{7, 7, 8, 7, 7, 7};
+    for (size_t i = 0; i < ids.size(); ++i) {
+      const bool added = expander.Observe({aruco::Marker(corners, ids[i])}, cv::Mat::eye(4, 4, CV_64F), camera_params);
+      assert(added == (i + 1 == ids.size()));
+    }
+  }
+
+  {
+    // luma comes out of padded rows whose width isn't a multiple of the SIMD width
+    const int w = 37;
+    const int h = 5;
+    const size_t stride = w * 2 + 6;
+    cv::Mat yuyv(h, static_cast<int>(stride / 2), CV_8UC2);
+    cv::randu(yuyv, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::Mat luma, expected;
+    phil::ExtractLuma(yuyv.data, yuyv.step, w, h, &luma);
+    cv::extractChannel(yuyv(cv::Rect(0, 0, w, h)), expected, 0);
+    assert(luma.size() == cv::Size(w, h) && cv::countNonZero(luma != expected) == 0);
+  }
+
+  {
+    // the SIMD path matches the scalar one, reading luma out of YUYV, and samples outside the source are 0
+    const int w = 64;
+    const int h = 48;
+    std::vector<uint8_t> yuyv(w * h * 2);
+    for (size_t i = 0; i < yuyv.size(); ++i) {
+      yuyv[i] = static_cast<uint8_t>(i * 37 + (i >> 7));
+    }
+    phil::polar_unwarp_config_t config{w, h, w * 2, 2, 32, 24, 4, 34, 0, static_cast<float>(2 * M_PI), 101, 26};
+    phil::PolarUnwarper unwarper(config);
+    std::vector<uint8_t> simd(unwarper.Width() * unwarper.Height());
+    std::vector<uint8_t> scalar(simd.size());
+    unwarper.Unwarp(yuyv.data(), simd.data());
+    unwarper.UnwarpScalar(yuyv.data(), scalar.data());
+    assert(simd == scalar);
+    assert(simd[0] == 0); // radius 34 at angle 0 is past the right edge
+
+    std::vector<uint8_t> flat(w * h * 2, 90);
+    unwarper.Unwarp(flat.data(), simd.data());
+    assert(simd[unwarper.Width() * (unwarper.Height() - 1)] == 90);
+  }
+
+  {
+    // paths follow the fewest edges to the origin, and a loop closure pulls markers back from the drift of the chain
+    using phil::localization::Pose3d;
+    std::vector<Pose3d> truth;
+    for (int i = 0; i < 4; ++i) {
+      Pose3d pose = Pose3d::Identity();
+      pose.linear() = Eigen::AngleAxisd(0.3 * i, Eigen::Vector3d::UnitZ()).toRotationMatrix();
+      pose.translation() << i, 0.5 * i, 0;
+      truth.push_back(pose);
+    }
+    // every edge along the chain overestimates the distance by 5% and the turn by 0.02 rad
+    auto drifted = [&truth](int from, int to) {
+      Pose3d measured = truth[from].inverse() * truth[to];
+      measured.translation() *= 1.05;
+      measured.linear() = measured.linear() * Eigen::AngleAxisd(0.02, Eigen::Vector3d::UnitZ()).toRotationMatrix();
+      return measured;
+    };
+    phil::localization::MarkerGraph graph(0);
+    graph.AddEdge(0, 1, drifted(0, 1));
+    graph.AddEdge(2, 1, drifted(2, 1));
+    graph.AddEdge(3, 2, drifted(3, 2));
+    assert(graph.Path(3).size() == 4);
+    // the loop closure is exact and seen more often than any one edge of the chain
+    for (int k = 0; k < 4; ++k) {
+      graph.AddEdge(0, 3, truth[3]);
+    }
+    assert(graph.Path(3).size() == 2);
+    assert(graph.Path(7).empty());
+    auto worst_error = [&graph, &truth]() {
+      double worst = 0;
+      for (int id = 1; id < 4; ++id) {
+        Pose3d pose;
+        const bool connected = graph.Pose(id, &pose);
+        assert(connected);
+        worst = std::max(worst, (pose.translation() - truth[id].translation()).norm());
+      }
+      return worst;
+    };
+    const double chained_error = worst_error();
+    const double cost = graph.Optimize();
+    const double optimized_error = worst_error();
+    assert(cost > 0 && chained_error > 0.1 && optimized_error < 0.02);
+  }
+
+  {
+    // detections come back per frame, with their pose only if it was estimated, and only for the same key
+    const std::string filename = phil::DetectionCacheFilename("/tmp", 1, 2);
+    std::vector<cv::Point2f> corners{{10, 10}, {30, 10}, {30, 30}, {10, 30}};
+    aruco::Marker with_pose(corners, 3);
+    with_pose.Rvec = (cv::Mat_<float>(3, 1) << 0.1f, 0.2f, 0.3f);
+    with_pose.Tvec = (cv::Mat_<float>(3, 1) << 1, 2, 3);
+    phil::DetectionCacheWriter writer(1, 2, cv::Size(640, 480));
+    writer.AddFrame({});
+    writer.AddFrame({with_pose, aruco::Marker(corners, 5)});
+    const bool saved = writer.Save(filename);
+    assert(saved);
+
+    assert(!phil::DetectionCache(filename, 1, 3).IsOpen());
+    phil::DetectionCache cache(filename, 1, 2);
+    assert(cache.IsOpen() && cache.NumFrames() == 2 && cache.FrameSize() == cv::Size(640, 480));
+    assert(cache.Markers(0, 0.1f).empty() && cache.Markers(2, 0.1f).empty());
+    const std::vector<aruco::Marker> markers = cache.Markers(1, 0.1f);
+    assert(markers.size() == 2 && markers[0].id == 3 && markers[1].id == 5 && markers[1].ssize == 0.1f);
+    assert(markers[0][2] == corners[2] && markers[0].Tvec.at<float>(2) == 3);
+    assert(cv::countNonZero(markers[1].Tvec != aruco::Marker().Tvec) == 0);
+
+    // a frame that starts past the last marker is corrupt, so the whole cache is ignored
+    {
+      std::fstream file(filename, std::ios::binary | std::ios::in | std::ios::out);
+      const uint32_t past_end = 3;
+      file.seekp(48 + sizeof(uint32_t)); // the second frame offset, after the 48 byte header
+      file.write(reinterpret_cast<const char *>(&past_end), sizeof(past_end));
+    }
+    assert(!phil::DetectionCache(filename, 1, 2).IsOpen());
+    std::remove(filename.c_str());
+  }
+
+  {
+    // a video processed in segments on several threads gives every frame the same pose, in the same order, as one
+    // thread does
+    const std::string filename = "/tmp/phil_unit_tests_segments.avi";
+    const cv::Size size(160, 120);
+    cv::VideoWriter video(filename, CV_FOURCC('M', 'J', 'P', 'G'), 30, size);
+    for (int i = 0; i < 50; ++i) {
+      cv::Mat frame(size, CV_8UC3, cv::Scalar::all(0));
+      cv::rectangle(frame, cv::Rect(10 + i, 20 + i / 2, 40 + i / 3, 40), cv::Scalar::all(255), -1);
+      video.write(frame);
+    }
+    video.release();
+
+    // the pose of a 10cm square from the corners of the bright region
+    const cv::Mat K = (cv::Mat_<double>(3, 3) << 200, 0, 80, 0, 200, 60, 0, 0, 1);
+    const std::vector<cv::Point3f> square{{0, 0, 0}, {0.1f, 0, 0}, {0.1f, 0.1f, 0}, {0, 0.1f, 0}};
+    struct frame_pose_t {
+      size_t video_frame;
+      cv::Vec3d rvec;
+      cv::Vec3d tvec;
+    };
+    auto poses = [&](unsigned int jobs) {
+      auto make_processor = [&]() {
+        return std::function<frame_pose_t(const cv::Mat &, size_t)>([&](const cv::Mat &frame, size_t video_frame) {
+          cv::Mat gray;
+          std::vector<cv::Point> bright;
+          cv::cvtColor(frame, gray, cv::COLOR_BGR2GRAY);
+          cv::findNonZero(gray > 128, bright);
+          const cv::Rect box = cv::boundingRect(bright);
+          const std::vector<cv::Point2f> corners{cv::Point2f(box.x, box.y),
+                                                 cv::Point2f(box.x + box.width, box.y),
+                                                 cv::Point2f(box.x + box.width, box.y + box.height),
+                                                 cv::Point2f(box.x, box.y + box.height)};
+          frame_pose_t pose{video_frame, {}, {}};
+          cv::solvePnP(square, corners, K, cv::noArray(), pose.rvec, pose.tvec);
+          return pose;
+        });
+      };
+      std::vector<frame_pose_t> results;
+      auto consume = [&results](size_t, frame_pose_t &pose) {
+        results.push_back(pose);
+      };
+      phil::ProcessVideoSegments<frame_pose_t>(filename, jobs, 7, make_processor, consume);
+      return results;
+    };
+    const std::vector<frame_pose_t> serial = poses(1);
+    const std::vector<frame_pose_t> parallel = poses(3);
+    assert(serial.size() == 50 && parallel.size() == serial.size());
+    for (size_t i = 0; i < serial.size(); ++i) {
+      assert(serial[i].video_frame == i && parallel[i].video_frame == i);
+      assert(serial[i].rvec == parallel[i].rvec && serial[i].tvec == parallel[i].tvec);
+    }
+    std::remove(filename.c_str());
+  }
+
+  {
+    // the yaw of a forward facing camera comes out of corners at any depth, even with some of them on moving objects
+    const cv::Vec3d up(0, -1, 0);
+    const double yaw = 0.05;
+    cv::Matx33d R;
+    cv::Rodrigues(up * -yaw, R);
+    cv::RNG rng(4);
+    std::vector<cv::Point2f> before, after;
+    for (int i = 0; i < 100; ++i) {
+      const cv::Vec3d p = cv::Vec3d(rng.uniform(-0.5, 0.5), rng.uniform(-0.5, 0.5), 1) * rng.uniform(1.0, 10.0);
+      const cv::Vec3d q = R * p;
+      before.emplace_back(p[0] / p[2], p[1] / p[2]);
+      after.emplace_back(q[0] / q[2], q[1] / q[2]);
+      if (i < 20) {
+        after.back() += cv::Point2f(rng.uniform(-0.1f, 0.1f), rng.uniform(-0.1f, 0.1f));
+      }
+    }
+    assert(after[50].x > before[50].x); // turning left moves the scene right
+    double angle, angle_var;
+    int inliers;
+    const bool fit = phil::VisualOdometry::FitRotation(before, after, up, 20, &angle, &angle_var, &inliers);
+    assert(fit && std::abs(angle - yaw) < 1e-6 && inliers >= 80 && angle_var < 1e-9);
+    const bool fit_too_few = phil::VisualOdometry::FitRotation(before, after, up, 101, &angle, &angle_var);
+    assert(!fit_too_few);
+  }
+
+  {
+    // marker corners follow the image as it moves, and are detected again sooner while turning
+    cv::Mat frame(200, 200, CV_8UC1);
+    cv::randu(frame, cv::Scalar(0), cv::Scalar(60));
+    cv::GaussianBlur(frame, frame, cv::Size(5, 5), 0);
+    cv::rectangle(frame, cv::Rect(60, 60, 60, 60), cv::Scalar(255), -1);
+    const std::vector<cv::Point2f> corners{{60, 60}, {119, 60}, {119, 119}, {60, 119}};
+    cv::Mat moved;
+    cv::warpAffine(frame, moved, (cv::Mat_<double>(2, 3) << 1, 0, 3, 0, 1, 2), frame.size());
+
+    phil::CornerTracker corner_tracker(phil::kDefaultCornerTrackerConfig);
+    assert(corner_tracker.NeedsDetection(0));
+    corner_tracker.Reset(frame, {aruco::Marker(corners, 9)});
+    assert(!corner_tracker.NeedsDetection(0));
+    std::vector<aruco::Marker> tracked;
+    const bool tracked_ok = corner_tracker.Track(moved, &tracked);
+    assert(tracked_ok && tracked.size() == 1 && tracked[0].id == 9);
+    for (int c = 0; c < 4; ++c) {
+      assert(cv::norm(tracked[0][c] - corners[c] - cv::Point2f(3, 2)) < 0.3);
+    }
+    assert(corner_tracker.TrackedFrames(0) == 8 && corner_tracker.TrackedFrames(-0.5) == 4);
+    assert(corner_tracker.TrackedFrames(1) == 2 && corner_tracker.TrackedFrames(1.5) == 1);
+    assert(corner_tracker.TrackedFrames(10) == 0 && corner_tracker.NeedsDetection(10));
+    corner_tracker.Invalidate();
+    assert(corner_tracker.NeedsDetection(0));
+
+    // corners where the map projects them have no reprojection error
+    const cv::Mat K = (cv::Mat_<double>(3, 3) << 500, 0, 320, 0, 500, 240, 0, 0, 1);
+    const aruco::CameraParameters camera_params(K, cv::Mat::zeros(1, 5, CV_64F), cv::Size(640, 480));
+    aruco::MarkerMap map;
+    map.mInfoType = aruco::MarkerMap::METERS;
+    aruco::Marker3DInfo info(9);
+    info.points = {{0, -0.1f, 2}, {0.2f, -0.1f, 2}, {0.2f, 0.1f, 2}, {0, 0.1f, 2}};
+    map.push_back(info);
+    std::vector<cv::Point2f> projected;
+    cv::projectPoints(info.points, cv::Mat::zeros(3, 1, CV_64F), cv::Mat::zeros(3, 1, CV_64F), K, cv::noArray(),
+                      projected);
+    const cv::Mat rt = cv::Mat::eye(4, 4, CV_32F);
+    assert(phil::ReprojectionErrorPx({aruco::Marker(projected, 9)}, map, camera_params, rt) < 1e-3);
+    for (auto &corner : projected) {
+      corner.x += 1;
+    }
+    assert(std::abs(phil::ReprojectionErrorPx({aruco::Marker(projected, 9)}, map, camera_params, rt) - 1) < 1e-3);
+    assert(phil::ReprojectionErrorPx({aruco::Marker(projected, 4)}, map, camera_params, rt) == 0);
+
+    // a pose fit to the shifted corners alone explains them again
+    cv::Mat fitted_rt;
+    const bool fitted = phil::SolveMapPose({aruco::Marker(projected, 9)}, map, camera_params, &fitted_rt);
+    assert(fitted && phil::ReprojectionErrorPx({aruco::Marker(projected, 9)}, map, camera_params, fitted_rt) < 0.1);
+    const bool fitted_unmapped = phil::SolveMapPose({aruco::Marker(projected, 4)}, map, camera_params, &fitted_rt);
+    assert(!fitted_unmapped);
+  }
+
+  {
+    // a rough prediction is refined to the pose the corners were projected from, without a prediction EPnP finds it,
+    // and the robot's pose on the floor comes out of the camera's
+    const cv::Mat K = (cv::Mat_<double>(3, 3) << 600, 0, 320, 0, 600, 240, 0, 0, 1);
+    const aruco::CameraParameters camera_params(K, cv::Mat::zeros(1, 5, CV_64F), cv::Size(640, 480));
+    aruco::MarkerMap map;
+    map.mInfoType = aruco::MarkerMap::METERS;
+    for (int id = 0; id < 2; ++id) {
+      aruco::Marker3DInfo info(id);
+      const float x = 0.8f * id;
+      info.points = {{x - 0.1f, 0.1f, 0}, {x + 0.1f, 0.1f, 0}, {x + 0.1f, -0.1f, 0}, {x - 0.1f, -0.1f, 0}};
+      map.push_back(info);
+    }
+    const cv::Vec3d rvec(0.1, -0.3, 0.05);
+    const cv::Vec3d tvec(-0.3, 0.1, 3);
+    std::vector<aruco::Marker> markers;
+    for (const auto &info : map) {
+      std::vector<cv::Point2f> projected;
+      cv::projectPoints(info.points, rvec, tvec, K, cv::noArray(), projected);
+      markers.emplace_back(projected, info.id);
+    }
+    cv::Matx33d R;
+    cv::Rodrigues(rvec, R);
+
+    phil::localization::MarkerPoseSolver solver(camera_params, map, phil::localization::kDefaultMarkerPoseSolverConfig);
+    cv::Mat predicted_rt = cv::Mat::eye(4, 4, CV_64F);
+    cv::Mat(R).copyTo(predicted_rt(cv::Rect(0, 0, 3, 3)));
+    cv::Mat(tvec + cv::Vec3d(0.05, -0.05, 0.1)).copyTo(predicted_rt(cv::Rect(3, 0, 1, 3)));
+    cv::Mat rt;
+    phil::localization::Matrix6d covariance;
+    bool solved = solver.Solve(markers, predicted_rt, &rt, &covariance);
+    assert(solved && !solver.UsedFallback());
+    assert(solver.ErrorPx() < 1e-3 && cv::norm(rt(cv::Rect(3, 0, 1, 3)), cv::Mat(tvec)) < 1e-4);
+    assert(covariance.diagonal().minCoeff() > 0);
+
+    solved = solver.Solve(markers, cv::Mat(), &rt, &covariance);
+    assert(solved && solver.UsedFallback());
+    assert(cv::norm(rt(cv::Rect(0, 0, 3, 3)), cv::Mat(R)) < 1e-4);
+    assert(cv::norm(rt(cv::Rect(3, 0, 1, 3)), cv::Mat(tvec)) < 1e-4);
+    solved = solver.Solve({aruco::Marker(markers[0], 7)}, cv::Mat(), &rt, &covariance);
+    assert(!solved);
+
+    // a camera facing along the robot's x axis, with the robot at (1, 2) facing along the map's y axis
+    Eigen::Isometry3d robot_T_camera = Eigen::Isometry3d::Identity();
+    robot_T_camera.linear() << 0, 0, 1, -1, 0, 0, 0, -1, 0;
+    Eigen::Isometry3d map_T_robot = Eigen::Isometry3d::Identity();
+    map_T_robot.linear() = Eigen::AngleAxisd(M_PI / 2, Eigen::Vector3d::UnitZ()).toRotationMatrix();
+    map_T_robot.translation() << 1, 2, 0;
+    const Eigen::Isometry3d camera_T_map = (map_T_robot * robot_T_camera).inverse();
+    Eigen::Matrix3d pose_covariance;
+    phil::localization::Matrix6d camera_covariance = phil::localization::Matrix6d::Zero();
+    const phil::pose_t pose =
+        phil::localization::RobotPose(camera_T_map, camera_covariance, robot_T_camera, &pose_covariance);
+    assert(std::abs(pose.x - 1) < 1e-9 && std::abs(pose.y - 2) < 1e-9 && std::abs(pose.theta - M_PI / 2) < 1e-9);
+    assert(pose_covariance.isZero());
+    // turning the camera about its y axis, which is the robot's vertical, only makes the heading uncertain
+    camera_covariance(1, 1) = 1e-4;
+    phil::localization::RobotPose(camera_T_map, camera_covariance, robot_T_camera, &pose_covariance);
+    assert(std::abs(pose_covariance(2, 2) - 1e-4) < 1e-8 && std::abs(pose_covariance(0, 0)) < 1e-8);
+  }
+
+  {
+    // the corners of a single marker move the filter toward the pose they were seen from, and their Jacobian matches
+    // finite differences
+    phil::localization::corner_observation_t observation;
+    observation.map_points.resize(3, 4);
+    observation.map_points << 3, 3, 3, 3, 0.1, -0.1, -0.1, 0.1, 0.4, 0.4, 0.2, 0.2;
+    Eigen::Isometry3d robot_T_camera = Eigen::Isometry3d::Identity();
+    robot_T_camera.linear() << 0, 0, 1, -1, 0, 0, 0, -1, 0;
+    robot_T_camera.translation() << 0.2, 0, 0.3;
+    observation.robot_T_camera = robot_T_camera;
+    observation.fx = 600;
+    observation.fy = 600;
+    const phil::pose_t truth{0.1, -0.05, 0.03};
+    Eigen::Matrix2Xd projected;
+    bool in_front = phil::localization::ProjectCorners(observation, truth, &projected, nullptr);
+    assert(in_front);
+    observation.normalized = projected / 600;
+
+    Eigen::Matrix<double, Eigen::Dynamic, 3> jacobian;
+    in_front = phil::localization::ProjectCorners(observation, {0, 0, 0}, &projected, &jacobian);
+    assert(in_front);
+    for (int k = 0; k < 3; ++k) {
+      phil::pose_t ahead{0, 0, 0}, behind{0, 0, 0};
+      (k == 0 ? ahead.x : k == 1 ? ahead.y : ahead.theta) = 1e-6;
+      (k == 0 ? behind.x : k == 1 ? behind.y : behind.theta) = -1e-6;
+      Eigen::Matrix2Xd projected_ahead, projected_behind;
+      phil::localization::ProjectCorners(observation, ahead, &projected_ahead, nullptr);
+      phil::localization::ProjectCorners(observation, behind, &projected_behind, nullptr);
+      const Eigen::Matrix2Xd difference = (projected_ahead - projected_behind) / 2e-6;
+      assert((jacobian.col(k) - Eigen::Map<const Eigen::VectorXd>(difference.data(), 8)).cwiseAbs().maxCoeff() < 1e-4);
+    }
+
+    MatrixWrapper::ColumnVector prior_mean(9);
+    prior_mean = 0;
+    MatrixWrapper::SymmetricMatrix prior_covariance(9);
+    prior_covariance = 0;
+    for (int i = 1; i <= 9; ++i) {
+      prior_covariance(i, i) = 0.01;
+    }
+    BFL::Gaussian prior(prior_mean, prior_covariance);
+    BFL::ExtendedKalmanFilter filter(&prior);
+    phil::localization::CornerMeasurementModel model(phil::localization::kDefaultCornerMeasurementConfig);
+    bool updated = model.Update(&filter, observation, {0, 0, 0});
+    assert(updated);
+    const auto estimate = filter.PostGet()->ExpectedValueGet();
+    const Eigen::Vector3d error(estimate(1) - truth.x, estimate(2) - truth.y, estimate(3) - truth.theta);
+    // depth is what a single marker pins down best
+    assert(std::abs(error(0)) < 0.02 && error.norm() < 0.08);
+
+    // facing away from the marker
+    updated = model.Update(&filter, observation, {0, 0, -M_PI});
+    assert(!updated);
+
+    // a misplaced corner is left out and the rest still correct the estimate, but corners seen from somewhere the
+    // filter is sure the robot isn't are ignored altogether
+    auto misplaced = observation;
+    misplaced.normalized(0, 2) += 40.0 / 600;
+    BFL::ExtendedKalmanFilter outlier_filter(&prior);
+    updated = model.Update(&outlier_filter, misplaced, {0, 0, 0});
+    assert(updated);
+    const auto outlier_estimate = outlier_filter.PostGet()->ExpectedValueGet();
+    assert(std::abs(outlier_estimate(1) - truth.x) < 0.03);
+    auto elsewhere = observation;
+    in_front = phil::localization::ProjectCorners(observation, {1.0, 0.6, 0.3}, &projected, nullptr);
+    assert(in_front);
+    elsewhere.normalized = projected / 600;
+    BFL::ExtendedKalmanFilter unchanged_filter(&prior);
+    updated = model.Update(&unchanged_filter, elsewhere, {0, 0, 0});
+    assert(!updated && unchanged_filter.PostGet()->ExpectedValueGet()(1) == 0);
+  }
+
+  {
+    // visual odometry that saw no turn pulls back the heading the encoders turned through, and the correction lasts
+    // past the next prediction
+    phil::EKF ekf(0.5, 1, 0.02);
+    MatrixWrapper::ColumnVector turning(phil::localization::M);
+    turning(1) = -0.1;
+    turning(2) = 0.1;
+    const double theta_before = ekf.filter->PostGet()->ExpectedValueGet()(3);
+    for (int i = 0; i < 25; ++i) {
+      ekf.filter->Update(ekf.system_model.get(), turning);
+    }
+    const double theta_after = ekf.filter->PostGet()->ExpectedValueGet()(3);
+    assert(theta_after - theta_before > 0.15);
+    ekf.HeadingChangeUpdate(theta_before, theta_after, 0, 1e-4);
+    assert(std::abs(ekf.filter->PostGet()->ExpectedValueGet()(3) - theta_before) < 0.02);
+
+    MatrixWrapper::ColumnVector stopped(phil::localization::M);
+    stopped = 0;
+    ekf.filter->Update(ekf.system_model.get(), stopped);
+    assert(std::abs(ekf.filter->PostGet()->ExpectedValueGet()(3) - theta_before) < 0.02);
+  }
+
+  {
+    // poses between two posteriors are interpolated the short way around, and later ones are predicted from the
+    // encoders up to the prediction limit
+    phil::localization::PoseHistory history(10, 0.5, 1, 0.5);
+    phil::pose_record_t record{};
+    const bool empty_found = history.Query(1, &record);
+    assert(!empty_found);
+
+    MatrixWrapper::ColumnVector state(phil::localization::N);
+    state = 0;
+    MatrixWrapper::SymmetricMatrix covariance(phil::localization::N);
+    covariance = 0;
+    MatrixWrapper::ColumnVector control(phil::localization::M);
+    control = 1;
+    state(3) = M_PI - 0.1;
+    history.Push(10, state, covariance, control);
+    state(1) = 1;
+    state(3) = -M_PI + 0.1;
+    state(4) = std::cos(state(3));
+    state(5) = std::sin(state(3));
+    history.Push(11, state, covariance, control);
+
+    const bool interpolated = history.Query(10.5, &record);
+    assert(interpolated && std::abs(record.x - 0.5) < 1e-9 && record.stamp_s == 10.5);
+    assert(std::abs(phil::yaw_diff_rad(record.theta, M_PI)) < 1e-9);
+
+    const bool too_old = history.Query(9.9, &record);
+    assert(!too_old);
+
+    // driving straight along the heading of the newest posterior at 1 m/s
+    const bool predicted = history.Query(11.1, &record);
+    assert(predicted && std::abs(record.stamp_s - 11.1) < 1e-9);
+    assert(std::abs(record.x - (1 + 0.1 * std::cos(-M_PI + 0.1))) < 1e-3);
+    assert(std::abs(record.y - 0.1 * std::sin(-M_PI + 0.1)) < 1e-3);
+    const bool too_far = history.Query(11.6, &record);
+    assert(!too_far);
+  }
+
+  {
+    // points stream into both formats, the header is patched with their number, and compressed fields decompress
+    std::vector<cv::Vec4f> points;
+    for (int i = 0; i < 20000; ++i) {
+      points.emplace_back(0.001f * (i % 500), 0.002f * (i / 500), 1.5f, 42.f);
+    }
+    const std::string binary_filename = "/tmp/phil_unit_tests_binary.pcd";
+    const std::string compressed_filename = "/tmp/phil_unit_tests_compressed.pcd";
+    for (const auto &filename : {binary_filename, compressed_filename}) {
+      phil::PcdStreamWriter writer;
+      const bool compressed = filename == compressed_filename;
+      const auto format = compressed ? phil::PcdFormat::BINARY_COMPRESSED : phil::PcdFormat::BINARY;
+      const bool opened = writer.Open(filename, format);
+      assert(opened);
+      for (size_t i = 0; i < points.size(); i += 3000) {
+        const size_t end = std::min(i + 3000, points.size());
+        writer.AddPoints(std::vector<cv::Vec4f>(points.begin() + i, points.begin() + end));
+      }
+      assert(writer.NumPoints() == points.size());
+      const bool closed = writer.Close();
+      assert(closed);
+    }
+
+    auto read_data = [](const std::string &filename, std::string *header) {
+      std::ifstream file(filename, std::ios::binary);
+      const std::string contents((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+      const size_t data_begin = contents.find('\n', contents.find("DATA ")) + 1;
+      *header = contents.substr(0, data_begin);
+      return contents.substr(data_begin);
+    };
+    std::string header;
+    const std::string binary = read_data(binary_filename, &header);
+    assert(header.find("WIDTH 20000 ") != std::string::npos && header.find("POINTS 20000 ") != std::string::npos);
+    assert(binary.size() == points.size() * sizeof(cv::Vec4f));
+    assert(std::memcmp(binary.data(), points.data(), binary.size()) == 0);
+
+    const std::string compressed = read_data(compressed_filename, &header);
+    assert(header.find("DATA binary_compressed") != std::string::npos);
+    uint32_t sizes[2];
+    std::memcpy(sizes, compressed.data(), sizeof(sizes));
+    assert(sizes[0] == compressed.size() - sizeof(sizes) && sizes[1] == binary.size());
+    assert(compressed.size() < binary.size() / 2);
+    // LZF as liblzf decompresses it: literal runs, and back references that may overlap what they copy
+    std::vector<uint8_t> fields;
+    for (size_t i = sizeof(sizes); i < compressed.size();) {
+      const uint8_t ctrl = compressed[i++];
+      if (ctrl < 32) {
+        fields.insert(fields.end(), compressed.begin() + i, compressed.begin() + i + ctrl + 1);
+        i += ctrl + 1;
+        continue;
+      }
+      size_t length = ctrl >> 5;
+      if (length == 7) {
+        length += static_cast<uint8_t>(compressed[i++]);
+      }
+      const size_t ref = fields.size() - ((ctrl & 0x1f) << 8) - 1 - static_cast<uint8_t>(compressed[i++]);
+      for (size_t k = 0; k < length + 2; ++k) {
+        fields.push_back(fields[ref + k]);
+      }
+    }
+    assert(fields.size() == binary.size());
+    const auto *values = reinterpret_cast<const float *>(fields.data());
+    for (size_t i = 0; i < points.size(); i += 997) {
+      for (int f = 0; f < 4; ++f) {
+        assert(values[f * points.size() + i] == points[i][f]);
+      }
+    }
+    std::remove(binary_filename.c_str());
+    std::remove(compressed_filename.c_str());
+  }
+
   return EXIT_SUCCESS;
 }
@@ -1,7 +1,11 @@
+#include <iostream>
+#include <memory>
+
 #include <opencv2/opencv.hpp>
 #include <aruco/aruco.h>
 
 #include <phil/common/args.h>
+#include <phil/common/video_segments.h>
 
 void annotate_video(cv::VideoCapture capture, aruco::CameraParameters CamParam, cv::VideoWriter &out_video, bool step, bool quiet) {
   cv::Mat frame;
@@ -65,6 +69,63 @@ void annotate_video(cv::VideoCapture capture, aruco::CameraParameters CamParam,
   }
 }
 
+/**
+ * Annotates on several threads at once. Every frame is processed independently, with DM_NORMAL and a fresh pose
+ * tracker, so the output is the same for any number of jobs.
+ */
+void annotate_video_in_parallel(const std::string &in_video_filename,
+                                const aruco::CameraParameters &CamParam,
+                                const cv::Size &frame_size,
+                                cv::VideoWriter &out_video,
+                                bool quiet,
+                                unsigned int jobs) {
+  const float MarkerSize = 0.175; // meters
+
+  // resize a deep copy once, since resize scales the matrices in place and every thread reads them
+  aruco::CameraParameters params(CamParam.CameraMatrix.clone(), CamParam.Distorsion.clone(), CamParam.CamSize);
+  params.resize(frame_size);
+
+  auto make_processor = [&params, MarkerSize]() {
+    auto detector = std::make_shared<aruco::MarkerDetector>();
+    detector->setDetectionMode(aruco::DetectionMode::DM_NORMAL);
+    return std::function<cv::Mat(const cv::Mat &, size_t)>([detector, &params, MarkerSize](const cv::Mat &frame,
+                                                                                          size_t) {
+      cv::Mat annotated_frame = frame.clone();
+      std::vector<aruco::Marker> markers = detector->detect(frame);
+      for (auto &marker : markers) {
+        aruco::MarkerPoseTracker tracker;
+        tracker.estimatePose(marker, params, MarkerSize);
+        marker.draw(annotated_frame, cv::Scalar(0, 0, 255), 2);
+      }
+      if (params.isValid()) {
+        for (auto &marker : markers) {
+          aruco::CvDrawingUtils::draw3dCube(annotated_frame, marker, params);
+          aruco::CvDrawingUtils::draw3dAxis(annotated_frame, marker, params);
+        }
+      }
+      return annotated_frame;
+    });
+  };
+
+  auto consume = [&](size_t video_frame, cv::Mat &annotated_frame) {
+    // like annotate_video, the first frame isn't written
+    if (video_frame == 0) {
+      return;
+    }
+    if (!quiet) {
+      cv::imshow("annotated", annotated_frame);
+      cv::waitKey(1);
+    }
+    out_video.write(annotated_frame);
+  };
+
+  // annotated frames are big, so keep the segments short to bound how many are held at once
+  constexpr size_t segment_frames = 30;
+  if (phil::ProcessVideoSegments<cv::Mat>(in_video_filename, jobs, segment_frames, make_processor, consume) == 0) {
+    std::cout << "Can not load video";
+  }
+}
+
 int main(int argc, const char **argv) {
   args::ArgumentParser parser("Read a video and write a new video with all the frames annotated\n");
   args::HelpFlag help(parser, "help", "Display this help menu", {'h', "help"});
@@ -73,6 +134,8 @@ int main(int argc, const char **argv) {
   args::Positional<std::string> camera_config_param(parser, "params_filename", "camera parameters yaml file", args::Options::Required);
   args::Flag quiet_flag(parser, "quiet", "don't show the video frames", {'q', "quiet"});
   args::Flag step_flag(parser, "step", "step the video frame-by-frame", {'s', "step"});
+  args::ValueFlag<unsigned int> jobs_flag
+      (parser, "jobs", "annotate on this many threads. Can't be combined with step.", {'j', "jobs"});
 
   try {
     parser.ParseCLI(argc, argv);
@@ -86,6 +149,12 @@ int main(int argc, const char **argv) {
     return 0;
   }
 
+  // batch mode's workers keep annotating while a frame is on screen, so they can't wait for a key press
+  if (jobs_flag && step_flag) {
+    std::cerr << "--jobs can't be combined with --step\n";
+    return EXIT_FAILURE;
+  }
+
   cv::VideoCapture cap(args::get(in_video_param));
   auto w = static_cast<const unsigned int>(cap.get(CV_CAP_PROP_FRAME_WIDTH));
   auto h = static_cast<const unsigned int>(cap.get(CV_CAP_PROP_FRAME_HEIGHT));
@@ -111,5 +180,9 @@ int main(int argc, const char **argv) {
   aruco::CameraParameters params;
   params.readFromXMLFile(args::get(camera_config_param));
 
-  annotate_video(cap, params, out_video, step, quiet);
+  if (jobs_flag) {
+    annotate_video_in_parallel(args::get(in_video_param), params, input_size, out_video, quiet, args::get(jobs_flag));
+  } else {
+    annotate_video(cap, params, out_video, step, quiet);
+  }
 }
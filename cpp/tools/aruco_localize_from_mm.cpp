@@ -10,10 +10,7 @@
 #include <stdexcept>
 
 #include <phil/common/args.h>
-#include <phil/common/pcdwriter.h>
-
-// set of poses and the frames they were detected
-std::map<int, cv::Mat> frame_pose_map;
+#include <phil/common/pcd_stream_writer.h>
 
 void getQuaternionAndTranslationfromMatrix44(const cv::Mat &M_in,
                                              float &qx,
@@ -41,6 +38,10 @@ int main(int argc, const char **argv) {
   args::ValueFlag<float> marker_size_flag(parser, "marker_size", "size of the marker in meters", {'s', "size"});
   args::ValueFlag<std::string>
       dict_param(parser, "dictionary", "a dictionary name or dictionary file. Defaults to ARUCO", {'d', "dict"});
+  args::Flag compressed_flag(parser,
+                             "compressed",
+                             "write the point cloud as binary_compressed, which is much smaller for long videos",
+                             {'c', "compressed"});
 
   try {
     parser.ParseCLI(argc, argv);
@@ -107,8 +108,17 @@ int main(int argc, const char **argv) {
     pose_tracker.setParams(cam_params, marker_map);
   }
 
-  char key = 0;
+  // poses are written out as each frame is processed, so memory doesn't grow with the length of the video
+  phil::PcdStreamWriter pcd_writer;
+  const phil::PcdFormat pcd_format = args::get(compressed_flag) ? phil::PcdFormat::BINARY_COMPRESSED
+                                                                : phil::PcdFormat::BINARY;
+  if (!pcd_writer.Open(args::get(out_pcd_param), pcd_format)) {
+    return EXIT_FAILURE;
+  }
+  pcd_writer.AddMarkerMap(marker_map);
+
   int index = 0;
+  float qx, qy, qz, qw, tx, ty, tz;
 
   do {
     video_capture.retrieve(frame);
@@ -116,23 +126,19 @@ int main(int argc, const char **argv) {
     std::vector<aruco::Marker> detected_markers = detector.detect(frame);
     if (pose_tracker.isValid()) {
       if (pose_tracker.estimatePose(detected_markers)) {
-        frame_pose_map.insert({index, pose_tracker.getRTMatrix()});
+        const cv::Mat rt = pose_tracker.getRTMatrix();
+        if (!rt.empty()) {
+          pcd_writer.AddCameraPose(rt, marker_map[0].getMarkerSize() / 2);
+          getQuaternionAndTranslationfromMatrix44(rt, qx, qy, qz, qw, tx, ty, tz);
+          std::cout << index << " " << tx << " " << ty << " " << tz << " " << qx << " " << qy << " " << qz << " "
+                    << qw << "\n";
+        }
       }
     }
   } while (video_capture.grab());
 
-  std::string out_pcd_filname = args::get(out_pcd_param);
-  savePCDFile(out_pcd_filname, marker_map, frame_pose_map);
-
-  float qx, qy, qz, qw, tx, ty, tz;
-  for (auto frame_pose_pair : frame_pose_map) {
-    if (!frame_pose_pair.second.empty()) {
-      getQuaternionAndTranslationfromMatrix44(frame_pose_pair.second, qx, qy, qz, qw, tx, ty, tz);
-      std::cout << frame_pose_pair.first << " " << tx << " " << ty << " " << tz << " " << qx << " " << qy << " " << qz
-                << " "
-                << qw
-                << "\n";
-    }
+  if (!pcd_writer.Close()) {
+    return EXIT_FAILURE;
   }
 }
 
@@ -0,0 +1,500 @@
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <numeric>
+
+#include <aruco/aruco.h>
+#include <opencv2/opencv.hpp>
+
+#include <phil/common/args.h>
+#include <phil/common/common.h>
+#include <phil/common/csv.h>
+
+using benchmark_clock = std::chrono::steady_clock;
+
+/**
+ * One recorded video, and optionally when each frame was captured and where the camera really was
+ */
+struct dataset_t {
+  std::string video;
+  std::vector<unsigned long> timestamps; // us, one per frame after the first, like timestamps.csv
+  std::vector<unsigned long> truth_times; // us, on the same clock as timestamps
+  std::vector<cv::Point3d> truth_positions; // camera position in the map, in meters
+};
+
+struct detector_config_t {
+  std::string dictionary;
+  std::string mode_name;
+  aruco::DetectionMode mode;
+  double scale; // detection runs on frames resized by this much
+};
+
+struct marker_stats_t {
+  unsigned long frames_detected = 0;
+  double side_px_sum = 0; // in full resolution pixels
+};
+
+struct benchmark_result_t {
+  unsigned long frames = 0;
+  double total_s = 0;
+  double read_ms = 0;
+  double preprocess_ms = 0;
+  double detect_ms = 0;
+  double pose_ms = 0;
+  unsigned long pose_frames = 0;
+  std::vector<double> pose_errors_m;
+  std::map<int, marker_stats_t> markers;
+};
+
+double elapsedMs(benchmark_clock::time_point begin, benchmark_clock::time_point end) {
+  return std::chrono::duration<double, std::milli>(end - begin).count();
+}
+
+/**
+ * @return filename relative to the directory of list_filename, unless it's absolute or empty
+ */
+std::string resolvePath(const std::string &list_filename, const std::string &filename) {
+  const size_t slash = list_filename.find_last_of('/');
+  if (filename.empty() || filename[0] == '/' || slash == std::string::npos) {
+    return filename;
+  }
+  return list_filename.substr(0, slash + 1) + filename;
+}
+
+bool readTimestamps(const std::string &filename, std::vector<unsigned long> *timestamps) {
+  std::ifstream file(filename);
+  if (!file.good()) {
+    std::cerr << "Bad file: [" << filename << "]. " << std::strerror(errno) << "\n";
+    return false;
+  }
+  std::string line;
+  while (file >> line) {
+    try {
+      timestamps->push_back(std::stoul(line));
+    }
+    catch (std::invalid_argument &e) {
+      std::cerr << "Error parsing: [" << line << "] in [" << filename << "]\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Reads a csv with the columns time_us, x, y and z, sorted by time
+ */
+bool readGroundTruth(const std::string &filename, dataset_t *dataset) {
+  try {
+    io::CSVReader<4> reader(filename);
+    reader.read_header(io::ignore_extra_column, "time_us", "x", "y", "z");
+    unsigned long time_us;
+    double x, y, z;
+    while (reader.read_row(time_us, x, y, z)) {
+      dataset->truth_times.push_back(time_us);
+      dataset->truth_positions.emplace_back(x, y, z);
+    }
+  }
+  catch (io::error::base &e) {
+    std::cerr << "failed to read ground truth [" << filename << "]: " << e.what() << "\n";
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Reads the csv listing the datasets, with the columns video, timestamps and ground_truth. Only video is required.
+ */
+bool readDatasets(const std::string &filename, std::vector<dataset_t> *datasets) {
+  std::vector<std::array<std::string, 3>> rows;
+  try {
+    io::CSVReader<3> reader(filename);
+    reader.read_header(io::ignore_extra_column | io::ignore_missing_column, "video", "timestamps", "ground_truth");
+    std::string video, timestamps, ground_truth;
+    while (reader.read_row(video, timestamps, ground_truth)) {
+      rows.push_back({video, timestamps, ground_truth});
+      timestamps.clear();
+      ground_truth.clear();
+    }
+  }
+  catch (io::error::base &e) {
+    std::cerr << "failed to read datasets [" << filename << "]: " << e.what() << "\n";
+    return false;
+  }
+
+  for (const auto &row : rows) {
+    dataset_t dataset;
+    dataset.video = resolvePath(filename, row[0]);
+    if (!row[1].empty() && !readTimestamps(resolvePath(filename, row[1]), &dataset.timestamps)) {
+      return false;
+    }
+    if (!row[2].empty()) {
+      if (dataset.timestamps.empty()) {
+        std::cerr << "ground truth for [" << dataset.video << "] needs timestamps to be matched to frames\n";
+        return false;
+      }
+      if (!readGroundTruth(resolvePath(filename, row[2]), &dataset)) {
+        return false;
+      }
+    }
+    datasets->push_back(dataset);
+  }
+  return true;
+}
+
+/**
+ * Reads a file of marker ids like the ones in recorded_sensor_data/id_filters, one per line
+ */
+bool readIdSet(const std::string &filename, std::vector<int> *ids) {
+  std::ifstream file(filename);
+  if (!file.good()) {
+    std::cerr << "Bad file: [" << filename << "]. " << std::strerror(errno) << "\n";
+    return false;
+  }
+  int id;
+  while (file >> id) {
+    ids->push_back(id);
+  }
+  return true;
+}
+
+/**
+ * @return false if time is outside of the ground truth
+ */
+bool interpolateTruth(const dataset_t &dataset, unsigned long time, cv::Point3d *position) {
+  const auto &times = dataset.truth_times;
+  const auto after = std::lower_bound(times.begin(), times.end(), time);
+  if (after == times.end() || (*after != time && after == times.begin())) {
+    return false;
+  }
+  const auto i = static_cast<size_t>(after - times.begin());
+  if (*after == time) {
+    *position = dataset.truth_positions[i];
+    return true;
+  }
+  const double alpha = static_cast<double>(time - times[i - 1]) / (times[i] - times[i - 1]);
+  *position = dataset.truth_positions[i - 1] + alpha * (dataset.truth_positions[i] - dataset.truth_positions[i - 1]);
+  return true;
+}
+
+/**
+ * Runs one detector configuration over a whole video, the same way the tools do: one detector for every frame, so
+ * DM_VIDEO_FAST carries its thresholds between frames, and the first frame is skipped.
+ * @param mmap in meters. If it's empty, poses aren't estimated.
+ * @param max_frames stop after this many frames, or 0 for the whole video
+ */
+bool benchmark(const dataset_t &dataset,
+               const detector_config_t &config,
+               const aruco::CameraParameters &cam_params,
+               aruco::MarkerMap mmap,
+               unsigned long max_frames,
+               benchmark_result_t *result) {
+  cv::VideoCapture capture(dataset.video);
+  cv::Mat frame;
+  capture >> frame;
+  if (frame.empty()) {
+    std::cerr << "failed to read [" << dataset.video << "]\n";
+    return false;
+  }
+
+  const cv::Size detect_size(static_cast<int>(std::lround(frame.cols * config.scale)),
+                             static_cast<int>(std::lround(frame.rows * config.scale)));
+  aruco::CameraParameters resized(cam_params.CameraMatrix.clone(), cam_params.Distorsion.clone(), cam_params.CamSize);
+  resized.resize(detect_size);
+
+  aruco::MarkerDetector detector;
+  detector.setDictionary(config.dictionary);
+  detector.setDetectionMode(config.mode);
+  aruco::MarkerMapPoseTracker tracker;
+  if (!mmap.empty()) {
+    mmap.setDictionary(config.dictionary);
+    tracker.setParams(resized, mmap);
+  }
+
+  cv::Mat gray, small;
+  const auto begin = benchmark_clock::now();
+  while (max_frames == 0 || result->frames < max_frames) {
+    const auto t0 = benchmark_clock::now();
+    capture >> frame;
+    if (frame.empty()) {
+      break;
+    }
+    const auto t1 = benchmark_clock::now();
+    cv::cvtColor(frame, gray, cv::COLOR_BGR2GRAY);
+    if (detect_size != gray.size()) {
+      cv::resize(gray, small, detect_size, 0, 0, config.scale < 1 ? cv::INTER_AREA : cv::INTER_LINEAR);
+    } else {
+      small = gray;
+    }
+    const auto t2 = benchmark_clock::now();
+    std::vector<aruco::Marker> markers = detector.detect(small);
+    const auto t3 = benchmark_clock::now();
+    const bool has_pose = tracker.isValid() && tracker.estimatePose(markers);
+    const auto t4 = benchmark_clock::now();
+
+    result->read_ms += elapsedMs(t0, t1);
+    result->preprocess_ms += elapsedMs(t1, t2);
+    result->detect_ms += elapsedMs(t2, t3);
+    result->pose_ms += elapsedMs(t3, t4);
+
+    for (const auto &marker : markers) {
+      marker_stats_t &stats = result->markers[marker.id];
+      ++stats.frames_detected;
+      stats.side_px_sum += marker.getPerimeter() / 4 / config.scale;
+    }
+
+    const size_t frame_idx = result->frames;
+    ++result->frames;
+    if (!has_pose) {
+      continue;
+    }
+    ++result->pose_frames;
+    cv::Point3d truth;
+    if (frame_idx < dataset.timestamps.size() && interpolateTruth(dataset, dataset.timestamps[frame_idx], &truth)) {
+      // the tracker gives the map to camera transform, so the camera is at -R^T t in the map
+      cv::Mat rt;
+      tracker.getRTMatrix().convertTo(rt, CV_64F);
+      const cv::Mat position = -rt(cv::Rect(0, 0, 3, 3)).t() * rt(cv::Rect(3, 0, 1, 3));
+      const cv::Point3d estimate(position.at<double>(0), position.at<double>(1), position.at<double>(2));
+      result->pose_errors_m.push_back(cv::norm(estimate - truth));
+    }
+  }
+  result->total_s = std::chrono::duration<double>(benchmark_clock::now() - begin).count();
+  return true;
+}
+
+void printConfig(std::ostream &out, const dataset_t &dataset, const detector_config_t &config) {
+  out << dataset.video << "," << config.dictionary << "," << config.mode_name << "," << config.scale << ",";
+}
+
+void printResult(const dataset_t &dataset, const detector_config_t &config, benchmark_result_t result) {
+  const double frames = std::max<unsigned long>(result.frames, 1);
+  double mean_error = NAN;
+  double median_error = NAN;
+  if (!result.pose_errors_m.empty()) {
+    auto &errors = result.pose_errors_m;
+    mean_error = std::accumulate(errors.begin(), errors.end(), 0.0) / errors.size();
+    std::nth_element(errors.begin(), errors.begin() + errors.size() / 2, errors.end());
+    median_error = errors[errors.size() / 2];
+  }
+  printConfig(std::cout, dataset, config);
+  std::cout << result.frames << ","
+            << result.frames / std::max(result.total_s, 1e-9) << ","
+            << result.read_ms / frames << ","
+            << result.preprocess_ms / frames << ","
+            << result.detect_ms / frames << ","
+            << result.pose_ms / frames << ","
+            << result.pose_frames / frames << ","
+            << result.pose_errors_m.size() << ","
+            << mean_error << ","
+            << median_error << std::endl;
+}
+
+/**
+ * @param id_sets name of each set of ids, which is usually the distance of those markers
+ * @param only_id_sets skip markers that aren't in any set, which are most likely false positives
+ */
+void printMarkers(std::ostream &out,
+                  const dataset_t &dataset,
+                  const detector_config_t &config,
+                  const benchmark_result_t &result,
+                  const std::map<int, std::string> &id_sets,
+                  bool only_id_sets) {
+  std::map<int, marker_stats_t> markers = result.markers;
+  // markers in a set that were never detected still get a row
+  for (const auto &id_set : id_sets) {
+    markers[id_set.first];
+  }
+  for (const auto &marker : markers) {
+    const auto id_set = id_sets.find(marker.first);
+    if (only_id_sets && id_set == id_sets.end()) {
+      continue;
+    }
+    const marker_stats_t &stats = marker.second;
+    printConfig(out, dataset, config);
+    out << (id_set == id_sets.end() ? "" : id_set->second) << ","
+        << marker.first << ","
+        << stats.frames_detected << ","
+        << static_cast<double>(stats.frames_detected) / std::max<unsigned long>(result.frames, 1) << ","
+        << (stats.frames_detected ? stats.side_px_sum / stats.frames_detected : NAN) << "\n";
+  }
+  out.flush();
+}
+
+bool parseMode(const std::string &name, aruco::DetectionMode *mode) {
+  if (name == "DM_NORMAL") {
+    *mode = aruco::DM_NORMAL;
+  } else if (name == "DM_FAST") {
+    *mode = aruco::DM_FAST;
+  } else if (name == "DM_VIDEO_FAST") {
+    *mode = aruco::DM_VIDEO_FAST;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, const char **argv) {
+  args::ArgumentParser parser("Runs every combination of detector settings over recorded videos and prints one csv "
+                              "row per video and combination to standard out, with frames per second, the mean time "
+                              "of each stage per frame, and the error of the estimated camera position against ground "
+                              "truth where there is some.\n\n"
+                              "The datasets file is a csv with the columns video, timestamps and ground_truth. Paths "
+                              "are relative to the datasets file. timestamps is a timestamps.csv from the recording, "
+                              "and ground_truth is a csv with the columns time_us, x, y and z giving the camera "
+                              "position in the marker map, in meters, on the same clock. Motion capture exports have "
+                              "to be moved into the map frame first.");
+  args::HelpFlag help(parser, "help", "Display this help menu", {'h', "help"});
+  args::Positional<std::string>
+      datasets_param(parser, "datasets_filename", "csv file of the videos to run on", args::Options::Required);
+  args::Positional<std::string>
+      params_param(parser, "params_filename", "camera parameters yaml file", args::Options::Required);
+  args::ValueFlag<std::string> map_flag
+      (parser, "map_filename", "marker map yaml file, needed to estimate poses and their error", {'m', "map"});
+  args::ValueFlagList<std::string> dictionary_flag
+      (parser,
+       "dictionary",
+       "dictionary name or yml file to try. Defaults to ARUCO_MIP_16h3.",
+       {'d', "dictionary"});
+  args::ValueFlagList<std::string> mode_flag
+      (parser, "mode", "DM_NORMAL, DM_FAST or DM_VIDEO_FAST to try. Defaults to all of them.", {"mode"});
+  args::ValueFlagList<double> scale_flag
+      (parser, "scale", "resize frames by this much before detecting. Defaults to 1.", {"scale"});
+  args::ValueFlagList<std::string> ids_flag
+      (parser,
+       "ids_filename",
+       "set of marker ids, like the ones in recorded_sensor_data/id_filters. The detection rate of each marker is "
+       "labeled with the name of its set.",
+       {"ids"});
+  args::Flag only_ids_flag
+      (parser, "only_ids", "leave markers that aren't in any set out of the marker table", {"only-ids"});
+  args::ValueFlag<std::string> markers_flag
+      (parser, "markers_csv", "write the detection rate and size of each marker to this csv", {"markers"});
+  args::ValueFlag<double> marker_size_flag
+      (parser, "marker_size", "side of the markers in the map if it's in pixels, in meters", {"marker-size"});
+  args::ValueFlag<unsigned long> max_frames_flag
+      (parser, "max_frames", "only run on this many frames of each video", {"max-frames"});
+
+  try {
+    parser.ParseCLI(argc, argv);
+  }
+  catch (args::Help &e) {
+    std::cout << parser;
+    return EXIT_SUCCESS;
+  }
+  catch (args::Error &e) {
+    std::cerr << e.what() << "\n" << parser;
+    return EXIT_FAILURE;
+  }
+
+  std::vector<dataset_t> datasets;
+  if (!readDatasets(args::get(datasets_param), &datasets)) {
+    return EXIT_FAILURE;
+  }
+
+  aruco::CameraParameters params;
+  try {
+    params.readFromXMLFile(args::get(params_param));
+    if (!params.isValid()) {
+      std::cerr << "Camera parameters are invalid.\n";
+      return EXIT_FAILURE;
+    }
+  }
+  catch (cv::Exception &e) {
+    std::cerr << "Camera parameters are invalid.\n";
+    return EXIT_FAILURE;
+  }
+
+  aruco::MarkerMap mmap;
+  if (map_flag) {
+    try {
+      mmap.readFromFile(args::get(map_flag));
+    }
+    catch (cv::Exception &e) {
+      std::cerr << phil::red << "Failed to open [" << args::get(map_flag) << "]" << phil::reset << "\n" << e.what()
+                << "\n";
+      return EXIT_FAILURE;
+    }
+    if (mmap.isExpressedInPixels()) {
+      mmap = mmap.convertToMeters(marker_size_flag ? static_cast<float>(args::get(marker_size_flag)) : 0.02f);
+    }
+  }
+
+  std::map<int, std::string> id_sets;
+  for (const auto &ids_filename : args::get(ids_flag)) {
+    std::vector<int> ids;
+    if (!readIdSet(ids_filename, &ids)) {
+      return EXIT_FAILURE;
+    }
+    const std::string name = ids_filename.substr(ids_filename.find_last_of('/') + 1);
+    for (int id : ids) {
+      id_sets.emplace(id, name);
+    }
+  }
+
+  std::vector<std::string> dictionaries = args::get(dictionary_flag);
+  if (dictionaries.empty()) {
+    dictionaries.emplace_back("ARUCO_MIP_16h3");
+  }
+  std::vector<std::string> modes = args::get(mode_flag);
+  if (modes.empty()) {
+    modes = {"DM_NORMAL", "DM_FAST", "DM_VIDEO_FAST"};
+  }
+  std::vector<double> scales = args::get(scale_flag);
+  if (scales.empty()) {
+    scales.push_back(1);
+  }
+
+  std::vector<detector_config_t> configs;
+  for (const auto &dictionary : dictionaries) {
+    for (const auto &mode_name : modes) {
+      aruco::DetectionMode mode;
+      if (!parseMode(mode_name, &mode)) {
+        std::cerr << "unknown detection mode [" << mode_name << "]\n";
+        return EXIT_FAILURE;
+      }
+      for (double scale : scales) {
+        if (scale <= 0) {
+          std::cerr << "scale must be positive, not [" << scale << "]\n";
+          return EXIT_FAILURE;
+        }
+        configs.push_back({dictionary, mode_name, mode, scale});
+      }
+    }
+  }
+
+  std::unique_ptr<std::ofstream> markers_file;
+  if (markers_flag) {
+    markers_file = std::make_unique<std::ofstream>(args::get(markers_flag));
+    if (!markers_file->good()) {
+      std::cerr << "Bad file: [" << args::get(markers_flag) << "]. " << std::strerror(errno) << "\n";
+      return EXIT_FAILURE;
+    }
+    *markers_file << "video,dictionary,mode,scale,id_set,marker_id,frames_detected,detection_rate,mean_side_px\n";
+  }
+
+  std::cout << std::setprecision(6)
+            << "video,dictionary,mode,scale,frames,fps,read_ms,preprocess_ms,detect_ms,pose_ms,pose_rate,"
+               "pose_error_frames,mean_pose_error_m,median_pose_error_m" << std::endl;
+  const unsigned long max_frames = max_frames_flag ? args::get(max_frames_flag) : 0;
+  for (const auto &dataset : datasets) {
+    for (const auto &config : configs) {
+      benchmark_result_t result;
+      if (!benchmark(dataset, config, params, mmap, max_frames, &result)) {
+        return EXIT_FAILURE;
+      }
+      printResult(dataset, config, result);
+      if (markers_file) {
+        printMarkers(*markers_file, dataset, config, result, id_sets, args::get(only_ids_flag));
+      }
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
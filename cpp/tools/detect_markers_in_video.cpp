@@ -1,3 +1,4 @@
+#include <memory>
 #include <unordered_set>
 
 #include <aruco/aruco.h>
@@ -5,18 +6,60 @@
 
 #include <phil/common/args.h>
 #include <phil/common/common.h>
+#include <phil/common/detection_cache.h>
+#include <phil/common/video_segments.h>
+
+constexpr float marker_size = 0.0892; // meters
+
+/**
+ * Output to std out so one can redirect to any file they want
+ */
+void printMarker(unsigned long timestamp, const aruco::Marker &marker) {
+  std::cout << timestamp << ","
+            << marker.id << ","
+            << marker.Tvec.at<float>(0) << ","
+            << marker.Tvec.at<float>(1) << ","
+            << marker.Tvec.at<float>(2) << ","
+            << marker.Rvec.at<float>(0) << ","
+            << marker.Rvec.at<float>(1) << ","
+            << marker.Rvec.at<float>(2) << std::endl;
+}
 
+/**
+ * Prints the detections of a previous run instead of detecting again
+ */
+int printCachedMarkers(const phil::DetectionCache &cache,
+                       const std::vector<unsigned long> &timestamps,
+                       bool no_timestamps) {
+  // like detectMarkers, the first frame is skipped
+  for (size_t video_frame = 1; video_frame < cache.NumFrames(); ++video_frame) {
+    const size_t frame_idx = video_frame - 1;
+    if (frame_idx >= timestamps.size() && !no_timestamps) {
+      std::cerr << phil::red
+                << "There are more frames in the video than timestamps. This is very suspicious! Exiting now."
+                << phil::reset << "\n";
+      return EXIT_FAILURE;
+    }
+    for (const auto &marker : cache.Markers(video_frame, marker_size)) {
+      printMarker(no_timestamps ? 0 : timestamps[frame_idx], marker);
+    }
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ * @param cache_writer if not null, gets the detections of every frame
+ */
 int detectMarkers(cv::VideoCapture capture,
                   const std::vector<unsigned long> &timestamps,
                   aruco::CameraParameters cam_params,
                   bool step,
                   bool show,
-                  bool no_timestamps) {
+                  bool no_timestamps,
+                  phil::DetectionCacheWriter *cache_writer) {
   cv::Mat frame;
   cv::Mat annotated_frame;
 
-  float marker_size = 0.0892; // meters
-
   //Create the detector
   aruco::MarkerDetector MDetector;
   MDetector.setDetectionMode(aruco::DetectionMode::DM_VIDEO_FAST);
@@ -26,6 +69,9 @@ int detectMarkers(cv::VideoCapture capture,
     std::cout << "Can not load video";
   } else {
     capture >> frame;
+    if (cache_writer) {
+      cache_writer->AddFrame({});
+    }
 
     cam_params.resize(frame.size());
 
@@ -58,26 +104,10 @@ int detectMarkers(cv::VideoCapture capture,
         aruco::CvDrawingUtils::draw3dCube(annotated_frame, marker, cam_params);
         aruco::CvDrawingUtils::draw3dAxis(annotated_frame, marker, cam_params);
 
-        // output to std out so one can redirect to any file they want
-        if (no_timestamps) {
-          std::cout << 0 << ","
-                    << marker.id << ","
-                    << marker.Tvec.at<float>(0) << ","
-                    << marker.Tvec.at<float>(1) << ","
-                    << marker.Tvec.at<float>(2) << ","
-                    << marker.Rvec.at<float>(0) << ","
-                    << marker.Rvec.at<float>(1) << ","
-                    << marker.Rvec.at<float>(2) << std::endl;
-        } else {
-          std::cout << timestamps[frame_idx] << ","
-                    << marker.id << ","
-                    << marker.Tvec.at<float>(0) << ","
-                    << marker.Tvec.at<float>(1) << ","
-                    << marker.Tvec.at<float>(2) << ","
-                    << marker.Rvec.at<float>(0) << ","
-                    << marker.Rvec.at<float>(1) << ","
-                    << marker.Rvec.at<float>(2) << std::endl;
-        }
+        printMarker(no_timestamps ? 0 : timestamps[frame_idx], marker);
+      }
+      if (cache_writer) {
+        cache_writer->AddFrame(markers);
       }
 
       if (show) {
@@ -96,6 +126,69 @@ int detectMarkers(cv::VideoCapture capture,
   return EXIT_SUCCESS;
 }
 
+/**
+ * Detects on several threads at once. Every frame is processed independently, with DM_NORMAL and a fresh pose tracker,
+ * so the output is the same for any number of jobs, but can differ slightly from detectMarkers, which carries
+ * thresholds and pose guesses from one frame to the next.
+ */
+int detectMarkersInParallel(const std::string &video_filename,
+                            const std::vector<unsigned long> &timestamps,
+                            const aruco::CameraParameters &cam_params,
+                            const cv::Size &frame_size,
+                            bool no_timestamps,
+                            unsigned int jobs,
+                            phil::DetectionCacheWriter *cache_writer) {
+  // resize a deep copy once, since resize scales the matrices in place and every thread reads them
+  aruco::CameraParameters params(cam_params.CameraMatrix.clone(), cam_params.Distorsion.clone(), cam_params.CamSize);
+  params.resize(frame_size);
+
+  using markers_t = std::vector<aruco::Marker>;
+  auto make_processor = [&params]() {
+    auto detector = std::make_shared<aruco::MarkerDetector>();
+    detector->setDetectionMode(aruco::DetectionMode::DM_NORMAL);
+    return std::function<markers_t(const cv::Mat &, size_t)>([detector, &params](const cv::Mat &frame,
+                                                                                 size_t video_frame) {
+      // like detectMarkers, the first frame is skipped
+      if (video_frame == 0) {
+        return markers_t();
+      }
+      markers_t markers = detector->detect(frame);
+      for (auto &marker : markers) {
+        aruco::MarkerPoseTracker tracker;
+        tracker.estimatePose(marker, params, marker_size);
+      }
+      return markers;
+    });
+  };
+
+  bool too_many_frames = false;
+  auto consume = [&](size_t video_frame, markers_t &markers) {
+    if (cache_writer && !too_many_frames) {
+      cache_writer->AddFrame(markers);
+    }
+    if (video_frame == 0 || too_many_frames) {
+      return;
+    }
+    const size_t frame_idx = video_frame - 1;
+    if (frame_idx >= timestamps.size() && !no_timestamps) {
+      std::cerr << phil::red
+                << "There are more frames in the video than timestamps. This is very suspicious! Exiting now."
+                << phil::reset << "\n";
+      too_many_frames = true;
+      return;
+    }
+    for (const auto &marker : markers) {
+      printMarker(no_timestamps ? 0 : timestamps[frame_idx], marker);
+    }
+  };
+
+  constexpr size_t segment_frames = 60;
+  if (phil::ProcessVideoSegments<markers_t>(video_filename, jobs, segment_frames, make_processor, consume) == 0) {
+    std::cout << "Can not load video";
+  }
+  return too_many_frames ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
 int main(int argc, const char **argv) {
   args::ArgumentParser parser("Prints time-stamps of detected tags and their poses to standard out."
                               "It is recommended you redirect this to a file called detected_markers.csv.\n"
@@ -109,6 +202,14 @@ int main(int argc, const char **argv) {
   args::Positional<std::string> timestamps_param(parser, "timestamps_filename", "timestamps.csv file");
   args::Flag show_flag(parser, "show", "show the video", {'s', "show"});
   args::Flag step_flag(parser, "step", "step the video frame-by-frame", {'p', "step"});
+  args::ValueFlag<unsigned int> jobs_flag
+      (parser, "jobs", "detect on this many threads. Can't be combined with show or step.", {'j', "jobs"});
+  args::ValueFlag<std::string> cache_flag
+      (parser,
+       "cache_dir",
+       "reuse the detections of an earlier run on the same video with the same settings, or save them here for the "
+       "next run. Not used when showing the video.",
+       {"cache"});
 
   try {
     parser.ParseCLI(argc, argv);
@@ -122,6 +223,12 @@ int main(int argc, const char **argv) {
     return 0;
   }
 
+  // batch mode processes segments on worker threads well ahead of the frame being printed, so it has no frame to show
+  if (jobs_flag && (show_flag || step_flag)) {
+    std::cerr << phil::red << "--jobs can't be combined with --show or --step" << phil::reset << "\n";
+    return EXIT_FAILURE;
+  }
+
   std::string video_filename = args::get(video_param);
   std::string timestamps_filename = args::get(timestamps_param);
   bool no_timestamps = false;
@@ -198,5 +305,38 @@ int main(int argc, const char **argv) {
     }
   }
 
-  return detectMarkers(cap, timestamps, params, step, show, no_timestamps);
+  // the serial path carries thresholds and poses between frames, so it's cached separately from the parallel one
+  std::unique_ptr<phil::DetectionCacheWriter> cache_writer;
+  std::string cache_filename;
+  if (cache_flag && !show) {
+    aruco::CameraParameters resized(params.CameraMatrix.clone(), params.Distorsion.clone(), params.CamSize);
+    resized.resize(input_size);
+    const std::string settings = std::string("detect_markers_in_video ")
+        + (jobs_flag ? "DM_NORMAL " : "DM_VIDEO_FAST ") + std::to_string(marker_size);
+    const uint64_t fingerprint = phil::VideoFingerprint(video_filename);
+    const uint64_t params_key = phil::DetectionParamsKey(settings, resized);
+    cache_filename = phil::DetectionCacheFilename(args::get(cache_flag), fingerprint, params_key);
+    phil::DetectionCache cache(cache_filename, fingerprint, params_key);
+    if (cache.IsOpen()) {
+      return printCachedMarkers(cache, timestamps, no_timestamps);
+    }
+    cache_writer = std::make_unique<phil::DetectionCacheWriter>(fingerprint, params_key, input_size);
+  }
+
+  int result;
+  if (jobs_flag) {
+    result = detectMarkersInParallel(video_filename,
+                                     timestamps,
+                                     params,
+                                     input_size,
+                                     no_timestamps,
+                                     args::get(jobs_flag),
+                                     cache_writer.get());
+  } else {
+    result = detectMarkers(cap, timestamps, params, step, show, no_timestamps, cache_writer.get());
+  }
+  if (cache_writer && result == EXIT_SUCCESS && cache_writer->NumFrames() > 0) {
+    cache_writer->Save(cache_filename);
+  }
+  return result;
 }
@@ -7,6 +7,8 @@
 #include <opencv2/aruco.hpp>
 #include <aruco/aruco.h>
 
+#include <phil/localization/marker_graph.h>
+
 #include "localize.h"
 
 void localize(cv::VideoCapture cap, aruco::CameraParameters camParam);
@@ -56,63 +58,20 @@ int main(int argc, char *argv[]) {
   return 0;
 }
 
-std::vector<Trans> globalTrans;
-std::vector<int> globalIds;
-int orig;
-
-cv::Mat cameraT;
-cv::Mat cameraR;
-
-//check if some ID pairs are in the transforms
-int inTransforms(int toId, int fromId) {
-  for (int i = 0; i < globalTrans.size(); i++) {
-    if (toId == globalTrans[i].toId && fromId == globalTrans[i].fromId) {
-      return 1;
+/**
+ * @return the pose of the marker in the camera frame, from the Rvec and Tvec set by MarkerPoseTracker
+ */
+phil::localization::Pose3d markerPose(const aruco::Marker &marker) {
+  cv::Mat R;
+  cv::Rodrigues(marker.Rvec, R);
+  phil::localization::Pose3d pose = phil::localization::Pose3d::Identity();
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      pose.linear()(i, j) = R.at<float>(i, j);
     }
+    pose.translation()(i) = marker.Tvec.at<float>(i, 0);
   }
-  return 0;
-}
-
-int inIds(int id) {
-  // for(int i = 0; i < globalIds.size(); i++){
-  // 	std::cout << globalIds[i] << std::endl;
-  // }
-  if (std::find(globalIds.begin(), globalIds.end(), id) != globalIds.end()) {
-    return 1;
-  }
-  return 0;
-}
-
-cv::Mat computeTransform(int idTo, int idFrom) {
-  if (!inTransforms(idTo, idFrom)) {
-    long m[6] = {-999999, -999999, -999999, -999999, -999999, -999999};
-    return cv::Mat(2, 3, CV_32F, m);
-  }
-  cv::Mat m;
-  std::vector<Trans>::iterator trans;
-
-  const int n[2] = {idTo, idFrom};
-  trans = std::find_if(globalTrans.begin(), globalTrans.end(),
-                       [n](const Trans &m) -> bool { return m.toId == n[0] && m.fromId == n[1]; });
-
-  m.push_back(globalTrans[trans - globalTrans.begin()].t.t());
-  m.push_back(globalTrans[trans - globalTrans.begin()].r.t());
-  return m;
-}
-
-std::vector<int> getAdjacentNodes(int id) {
-  std::vector<int> ret;
-  for (int i = 0; i < globalTrans.size(); i++) {
-    if (globalTrans[i].toId == id) {
-      ret.push_back(globalTrans[i].fromId);
-    }
-    if (globalTrans[i].fromId == id) {
-      ret.push_back(globalTrans[i].toId);
-    }
-  }
-
-  return ret;
-
+  return pose;
 }
 
 void localize(cv::VideoCapture capture, aruco::CameraParameters CamParam) {
@@ -121,12 +80,18 @@ void localize(cv::VideoCapture capture, aruco::CameraParameters CamParam) {
 
   float MarkerSize = 0.200; // meters
 
+  // refine every marker pose jointly this often, if anything new has been seen
+  constexpr unsigned int optimize_period = 30;
+
   //Create the detector
   aruco::MarkerDetector MDetector;
   MDetector.setDetectionMode(aruco::DetectionMode::DM_VIDEO_FAST);
   std::map<uint32_t, aruco::MarkerPoseTracker> tracker;//use a map so that for each id, we use a different pose tracker
   cv::namedWindow("in", 1);
 
+  // the origin is the first tag seen
+  phil::localization::MarkerGraph graph;
+
   if (!capture.isOpened()) {
     std::cout << "Can not load video";
   } else {
@@ -135,6 +100,7 @@ void localize(cv::VideoCapture capture, aruco::CameraParameters CamParam) {
     CamParam.resize(frame.size());
 
     unsigned int frame_idx = 0;
+    size_t optimized_edges = 0;
     while (capture.isOpened()) {
       capture.grab();
       capture.retrieve(frame);
@@ -149,178 +115,38 @@ void localize(cv::VideoCapture capture, aruco::CameraParameters CamParam) {
 
       /*detect markers in frame*/
       std::vector<aruco::Marker> markers = MDetector.detect(frame);
-      if (markers.size() > 0) {
-        // std::cout << "frame: " << frame_idx << std::endl;
-
-        // set the origin to be the first seen tag
-        if (globalIds.size() < 1) {
-          orig = markers[0].id;
-          std::cout << "origin added" << std::endl;
-          std::cout << markers[0].id << std::endl;
-        }
-        //markers loop
-        for (int i = 0; i < markers.size(); i++) {
-          //estimate pose and draw frame
-          tracker[markers[i].id].estimatePose(markers[i], CamParam, MarkerSize);
-
-          if (!inIds(markers[i].id)) {
-            globalIds.push_back(markers[i].id);
-            std::cout << "added marker\t" << markers[i].id << std::endl;
-          }
-
-          markers[i].draw(annotated_frame, cv::Scalar(0, 0, 255), 2);
-          if (markers[i].Tvec.at<float>(0, 0) < -999998) continue;
-          // std::cout << markers[i].Tvec << '\t';
-
-          if (markers.size() > 1) {
-
-            //transforms loop
-            for (int j = 0; j < markers.size(); j++) {
-
-              //add transforms to vector
-              //only allow for toID < fromID
-              //this way, it avoids duplicates
-              if (markers[j].id != markers[i].id && markers[i].id < markers[j].id) {
-                // std::cout << markers[i] << std::endl;
-                tracker[markers[j].id].estimatePose(markers[j], CamParam, MarkerSize);
-                if (markers[j].Tvec.at<float>(0, 0) < -999998) continue;
-                //check for transforms
-                if (!inTransforms(markers[i].id, markers[j].id)) {
-                  Trans t;
-                  t.toId = markers[i].id;
-                  t.fromId = markers[j].id;
-                  t.t = (markers[i].Tvec - markers[j].Tvec);
-                  t.r = (markers[i].Rvec - markers[j].Rvec);
-                  globalTrans.push_back(t);
-                  std::cout << "added transforms" << std::endl;
-                  std::cout << t.toId << '\t' << t.fromId << std::endl;
-                }
-              }
-            }
-          }
-
-          //if the marker is our origin, just report position away
-          if (markers[i].id == orig) {
-            cv::Mat pose;
-//            std::cout << markers[i].Tvec << std::endl;
-//            std::cout << markers[i].Rvec << std::endl;
-            continue;
-          }
-            // cv::Mat m;
-            // if(orig < markers[i].id){
-            // 	m = computeTransform(orig, markers[i].id);
-            // } else {
-            // 	m = computeTransform(markers[i].id, orig);
-            // }
-            // if(m.at<float>(0,0) > -9999.){
-            // 	cv::Mat out = (m.row(0).t() + markers[i].Tvec);
-            // 	// std::cout << m.row(0).t() << '\n';
-            // 	// std::cout << out << endl;
-            // }
-          else {
-            // search though through the transforms
-            int pathFound = 0;
-            int pathIdx = -1;
-            int startId = markers[i].id;
-            int goalId = orig;
-            std::vector<int> foundPath;
-            std::vector<int> start;
-            start.push_back(startId);
-
-            std::vector<std::vector<int> > paths;
-            paths.push_back(start);
-
-            while (!pathFound) {
-
-              int deadEnds = 0;
-              for (int k = 0; k < paths.size(); k++) {
-                std::vector<int> allTrans = getAdjacentNodes(paths[k].back());
-                if (allTrans.size() == 0) {
-                  // std::cout << "rouge tag " << paths[i].back() << std::endl;
-                  pathFound = 1;
-                  break;
-                }
-                // build paths from transforms
-                std::vector<std::vector<int> > toAppend;
-                for (int j = 0; j < allTrans.size(); j++) {
-
-                  //no cyclic paths
-                  if (std::find(paths[k].begin(), paths[k].end(), allTrans[j]) == paths[k].end()) {
-
-                    //add to paths
-                    std::vector<int> pathCopy(paths[k]);
-                    pathCopy.push_back(allTrans[j]);
-                    toAppend.push_back(pathCopy);
-
-                    //check if a path from start to goal has been found
-                    if ((std::find(pathCopy.begin(), pathCopy.end(), startId) != pathCopy.end())
-                        && (std::find(pathCopy.begin(), pathCopy.end(), goalId) != pathCopy.end())) {
-
-                      // foundPath.reserve(pathCopy.size());
-                      foundPath.insert(foundPath.end(), pathCopy.begin(), pathCopy.end());
-                      pathFound = 1;
-                      break;
-                    }
-                  } else {
-                    deadEnds++;
-                  }
-                }
-
-                if (pathFound) {
-                  break;
-                }
-                paths[k].pop_back();
-                // paths.reserve( paths.size() + toAppend.size());
-                paths.insert(paths.end(), toAppend.begin(), toAppend.end());
-
-              }
-              // if(deadEnds == paths.size()) {
-              // 	std::cout << "no transforms" << std::endl;
-              // 	break;
-              // }
-            }
-            if (foundPath.size() > 0) {
-              std::cout << "using transforms" << std::endl;
-              for (int j = 0; j < foundPath.size(); j++) {
-                std::cout << foundPath[j] << '\t';
-              }
-              std::cout << std::endl;
-              float a[6] = {0., 0., 0., 0., 0., 0.};
-              cv::Mat pose;
-              std::cout << markers[i].Tvec << std::endl;
-              std::cout << markers[i].Rvec << std::endl;
-              cv::vconcat(markers[i].Tvec.t(), markers[i].Rvec.t(), pose);
-              cv::Mat r(2, 3, CV_32F, a);
-              cv::Mat m;
-              for (int j = 0; j < foundPath.size() - 1; j++) {
-                if (foundPath[j] < foundPath[j + 1]) {
-                  m = computeTransform(foundPath[j], foundPath[j + 1]);
-
-                } else {
-                  m = computeTransform(foundPath[j + 1], foundPath[j]);
-                  m = -1 * m;
-                }
-                // std::cout << m << std::endl;
-
-                if (m.at<float>(0, 0) > -99999.f) {
-                  pose = pose + m;
-                  // std::cout << m.row(0).t() << '\n';
-                  // std::cout << out << endl;
-                } else {
-                  std::cout << "error computing transform \t";
-                  pose.at<float>(0, 0) = -99999.f;
-                  break;
-                }
+      std::map<int, phil::localization::Pose3d> camera_T_markers;
+      for (auto &marker : markers) {
+        //estimate pose and draw frame
+        tracker[marker.id].estimatePose(marker, CamParam, MarkerSize);
+        marker.draw(annotated_frame, cv::Scalar(0, 0, 255), 2);
+        if (marker.Tvec.empty() || marker.Tvec.at<float>(0, 0) < -999998) continue;
+        camera_T_markers[marker.id] = markerPose(marker);
+      }
 
-              }
-              std::cout << pose << std::endl;
+      const size_t known_markers = graph.NumMarkers();
+      graph.AddFrame(camera_T_markers);
+      if (graph.NumMarkers() != known_markers) {
+        std::cout << "markers connected to origin " << graph.Origin() << ": " << graph.NumMarkers() << std::endl;
+      }
 
-            }
-          }
+      if (frame_idx % optimize_period == 0 && graph.NumEdges() != optimized_edges) {
+        optimized_edges = graph.NumEdges();
+        const double cost = graph.Optimize();
+        std::cout << "optimized " << graph.NumMarkers() << " markers, " << optimized_edges << " edges, cost " << cost
+                  << std::endl;
+      }
 
+      // camera pose in the frame of the origin tag, through the first visible tag connected to it
+      for (const auto &seen : camera_T_markers) {
+        phil::localization::Pose3d origin_T_marker;
+        if (graph.Pose(seen.first, &origin_T_marker)) {
+          const phil::localization::Pose3d origin_T_camera = origin_T_marker * seen.second.inverse();
+          std::cout << "camera " << origin_T_camera.translation().transpose() << " via " << seen.first << std::endl;
+          break;
         }
-        // std::cout << endl;
       }
+
       if (CamParam.isValid() && MarkerSize != -1) {
         for (auto &marker:markers) {
           aruco::CvDrawingUtils::draw3dCube(annotated_frame, marker, CamParam);
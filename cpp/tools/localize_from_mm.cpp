@@ -1,9 +1,12 @@
+#include <atomic>
 #include <iostream>
 #include <cstring>
 #include <fstream>
 #include <cscore.h>
 #include <opencv2/opencv.hpp>
+#include <thread>
 
+#include <phil/common/frame_bus.h>
 #include <phil/common/udp.h>
 #include <phil/common/args.h>
 #include <marker_mapper/markermapper.h>
@@ -30,8 +33,6 @@ int main(int argc, const char **argv) {
   sink.SetSource(camera);
 
   std::cout << "Go to localhost:8082 to see annotated camera stream" << std::endl;
-  cs::CvSink cvsink{"cvsink"};
-  cvsink.SetSource(camera);
   cs::CvSource cvsource{"cvsource", cs::VideoMode::kYUYV, w, h ,fps};
   cs::MjpegServer cvMjpegServer{"cvhttpserver", 8082};
   cvMjpegServer.SetSource(cvsource);
@@ -65,15 +66,28 @@ int main(int argc, const char **argv) {
   aruco::MarkerMapPoseTracker tracker;
   tracker.setParams(camera_params, mmap);
 
-  bool done = false;
-  cv::Mat frame;
+  // decode each frame once and share it between detection and recording
+  phil::FrameBus frame_bus(6);
+  auto detection_frames = frame_bus.Subscribe(1);
+  auto recording_frames = frame_bus.Subscribe(3);
+  frame_bus.StartCapture([&sink](cv::Mat &image) { return sink.GrabFrame(image, 0.1); });
+
+  std::atomic<bool> done{false};
+  std::thread recording_thread([&]() {
+    while (!done) {
+      phil::FramePtr recorded = recording_frames->Next(0.1);
+      if (recorded) {
+        output_cap.write(recorded->image);
+      }
+    }
+  });
 
   while (!done) {
-		uint64_t time = sink.GrabFrame(frame, 0.010);
-    if (time > 0) {
-    	// double time_s = time / 1e6; // convert micoseconds to seconds
-      cv::Mat annotated_frame;
-      frame.copyTo(annotated_frame);
+    phil::FramePtr frame_ptr = detection_frames->Next(0.010);
+    if (frame_ptr) {
+      const cv::Mat &frame = frame_ptr->image;
+      const uint64_t time = frame_ptr->capture_time_us;
+      cv::Mat annotated_frame = frame.clone();
 
       // update step for camera measurement
       std::vector<aruco::Marker> detected_markers = detector.detect(frame);
@@ -94,10 +108,10 @@ int main(int argc, const char **argv) {
 
       // show annotated frame. It's useful to debugging/visualizing
       cvsource.PutFrame(annotated_frame);
-      output_cap.write(frame);
-      
     }
 
   }
+  frame_bus.Stop();
+  recording_thread.join();
   output_cap.release();
 }
\ No newline at end of file
@@ -1,3 +1,4 @@
+#include <memory>
 #include <unordered_set>
 
 #include <marker_mapper/markermapper.h>
@@ -6,13 +7,64 @@
 
 #include <phil/common/args.h>
 #include <phil/common/common.h>
+#include <phil/common/detection_cache.h>
+#include <phil/common/video_segments.h>
+
+void printPose(const cv::Mat &rt_matrix, unsigned long timestamp) {
+  std::cout << rt_matrix.col(3).row(0).at<float>(0) << ", "
+            << rt_matrix.col(3).row(1).at<float>(0) << ", "
+            << rt_matrix.col(3).row(2).at<float>(0) << ", "
+            << timestamp << std::endl;
+}
+
+/**
+ * Estimates poses from the detections of a previous run instead of detecting again. Pose estimation is cheap, so only
+ * detection is cached, and the map can change between runs.
+ * @param fresh_tracker_per_frame true to match detectMarkersInParallel, false to match detectMarkers
+ */
+int estimateCachedPoses(const phil::DetectionCache &cache,
+                        const std::vector<unsigned long> &timestamps,
+                        aruco::CameraParameters cam_params,
+                        const aruco::MarkerMap &mmap,
+                        bool fresh_tracker_per_frame) {
+  // configured the same way as the run that filled the cache
+  aruco::MarkerMapPoseTracker tracker;
+  tracker.setParams(cam_params, mmap);
+  if (!fresh_tracker_per_frame) {
+    cam_params.resize(cache.FrameSize());
+  }
+
+  // like detectMarkers, the first frame is skipped
+  for (size_t video_frame = 1; video_frame < cache.NumFrames(); ++video_frame) {
+    const size_t frame_idx = video_frame - 1;
+    if (frame_idx >= timestamps.size()) {
+      std::cerr << phil::red
+                << "There are more frames in the video than timestamps. This is very suspicious! Exiting now."
+                << phil::reset << "\n";
+      return EXIT_FAILURE;
+    }
+    if (fresh_tracker_per_frame) {
+      tracker = aruco::MarkerMapPoseTracker();
+      tracker.setParams(cam_params, mmap);
+    }
+    std::vector<aruco::Marker> markers = cache.Markers(video_frame, 0);
+    if (tracker.isValid() && tracker.estimatePose(markers)) {
+      printPose(tracker.getRTMatrix(), timestamps[frame_idx]);
+    }
+  }
+  return EXIT_SUCCESS;
+}
 
+/**
+ * @param cache_writer if not null, gets the detections of every frame
+ */
 int detectMarkers(cv::VideoCapture capture,
                   const std::vector<unsigned long> &timestamps,
                   aruco::CameraParameters cam_params,
                   aruco::MarkerMap mmap,
                   bool step,
-                  bool show) {
+                  bool show,
+                  phil::DetectionCacheWriter *cache_writer) {
   cv::Mat frame;
   cv::Mat annotated_frame;
 
@@ -29,6 +81,9 @@ int detectMarkers(cv::VideoCapture capture,
     std::cout << "Can not load video";
   } else {
     capture >> frame;
+    if (cache_writer) {
+      cache_writer->AddFrame({});
+    }
 
     cam_params.resize(frame.size());
 
@@ -52,17 +107,16 @@ int detectMarkers(cv::VideoCapture capture,
 
       // detect markers in frame
       std::vector<aruco::Marker> markers = MDetector.detect(frame);
+      if (cache_writer) {
+        cache_writer->AddFrame(markers);
+      }
 
       // estimate 3d camera pose if possible
       if (tracker.isValid()) {
         // estimate the pose of the camera with respect to the detected markers
         // print only translation for now
         if (tracker.estimatePose(markers)) {
-          cv::Mat rt_matrix = tracker.getRTMatrix();
-          std::cout << rt_matrix.col(3).row(0).at<float>(0) << ", "
-                    << rt_matrix.col(3).row(1).at<float>(0) << ", "
-                    << rt_matrix.col(3).row(2).at<float>(0) << ", "
-                    << timestamps[frame_idx] << std::endl;
+          printPose(tracker.getRTMatrix(), timestamps[frame_idx]);
         }
 
         // annotate the video feed
@@ -107,6 +161,75 @@ int detectMarkers(cv::VideoCapture capture,
   return EXIT_SUCCESS;
 }
 
+/**
+ * Estimates poses on several threads at once. Every frame is processed independently, with DM_NORMAL and a new
+ * tracker, so the output is the same for any number of jobs.
+ */
+int detectMarkersInParallel(const std::string &video_filename,
+                            const std::vector<unsigned long> &timestamps,
+                            const aruco::CameraParameters &cam_params,
+                            const aruco::MarkerMap &mmap,
+                            unsigned int jobs,
+                            phil::DetectionCacheWriter *cache_writer) {
+  struct pose_t {
+    bool valid;
+    cv::Mat rt_matrix;
+    std::vector<aruco::Marker> markers; // only kept for the cache
+  };
+  auto make_processor = [&cam_params, &mmap, cache_writer]() {
+    auto detector = std::make_shared<aruco::MarkerDetector>();
+    detector->setDetectionMode(aruco::DetectionMode::DM_NORMAL);
+    return std::function<pose_t(const cv::Mat &, size_t)>([detector, &cam_params, &mmap, cache_writer](
+        const cv::Mat &frame,
+        size_t video_frame) {
+      // like detectMarkers, the first frame is skipped
+      if (video_frame == 0) {
+        return pose_t{false, cv::Mat(), {}};
+      }
+      std::vector<aruco::Marker> markers = detector->detect(frame);
+      // configured the same way as detectMarkers, with the camera parameters before they are resized
+      aruco::MarkerMapPoseTracker tracker;
+      tracker.setParams(cam_params, mmap);
+      pose_t pose{false, cv::Mat(), {}};
+      if (cache_writer) {
+        pose.markers = markers;
+      }
+      if (tracker.isValid() && tracker.estimatePose(markers)) {
+        pose.valid = true;
+        pose.rt_matrix = tracker.getRTMatrix().clone();
+      }
+      return pose;
+    });
+  };
+
+  bool too_many_frames = false;
+  auto consume = [&](size_t video_frame, pose_t &pose) {
+    if (cache_writer && !too_many_frames) {
+      cache_writer->AddFrame(pose.markers);
+    }
+    if (video_frame == 0 || too_many_frames) {
+      return;
+    }
+    const size_t frame_idx = video_frame - 1;
+    if (frame_idx >= timestamps.size()) {
+      std::cerr << phil::red
+                << "There are more frames in the video than timestamps. This is very suspicious! Exiting now."
+                << phil::reset << "\n";
+      too_many_frames = true;
+      return;
+    }
+    if (pose.valid) {
+      printPose(pose.rt_matrix, timestamps[frame_idx]);
+    }
+  };
+
+  constexpr size_t segment_frames = 60;
+  if (phil::ProcessVideoSegments<pose_t>(video_filename, jobs, segment_frames, make_processor, consume) == 0) {
+    std::cout << "Can not load video";
+  }
+  return too_many_frames ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
 int main(int argc, const char **argv) {
   args::ArgumentParser parser("Prints time-stamps of detected tags and their poses to standard out."
                                   "It is recommended you redirect this to a file called detected_markers.csv.\n"
@@ -125,6 +248,14 @@ int main(int argc, const char **argv) {
       dict_param(parser, "dict_filename", "dictionary yml file", args::Options::Required);
   args::Flag show_flag(parser, "show", "show the video", {'s', "show"});
   args::Flag step_flag(parser, "step", "step the video frame-by-frame", {'p', "step"});
+  args::ValueFlag<unsigned int> jobs_flag
+      (parser, "jobs", "estimate poses on this many threads. Can't be combined with show or step.", {'j', "jobs"});
+  args::ValueFlag<std::string> cache_flag
+      (parser,
+       "cache_dir",
+       "reuse the detections of an earlier run on the same video with the same settings, or save them here for the "
+       "next run. Poses are always estimated again, so the map can change. Not used when showing the video.",
+       {"cache"});
 
   try {
     parser.ParseCLI(argc, argv);
@@ -138,6 +269,12 @@ int main(int argc, const char **argv) {
     return 0;
   }
 
+  // batch mode processes segments on worker threads well ahead of the frame being printed, so it has no frame to show
+  if (jobs_flag && (show_flag || step_flag)) {
+    std::cerr << phil::red << "--jobs can't be combined with --show or --step" << phil::reset << "\n";
+    return EXIT_FAILURE;
+  }
+
   std::string video_filename = args::get(video_param);
   std::string timestamps_filename = args::get(timestamps_param);
   std::string params_filename = args::get(params_param);
@@ -221,5 +358,31 @@ int main(int argc, const char **argv) {
     }
   }
 
-  return detectMarkers(cap, timestamps, params, mmap, step, show);
+  // the serial path carries thresholds between frames, so it's cached separately from the parallel one
+  std::unique_ptr<phil::DetectionCacheWriter> cache_writer;
+  std::string cache_filename;
+  if (cache_flag && !show) {
+    const std::string settings =
+        std::string("marker_mapper_timestamped ") + (jobs_flag ? "DM_NORMAL" : "DM_VIDEO_FAST");
+    const uint64_t fingerprint = phil::VideoFingerprint(video_filename);
+    const uint64_t params_key = phil::DetectionParamsKey(settings, params);
+    cache_filename = phil::DetectionCacheFilename(args::get(cache_flag), fingerprint, params_key);
+    phil::DetectionCache cache(cache_filename, fingerprint, params_key);
+    if (cache.IsOpen()) {
+      return estimateCachedPoses(cache, timestamps, params, mmap, jobs_flag);
+    }
+    cache_writer = std::make_unique<phil::DetectionCacheWriter>(fingerprint, params_key, input_size);
+  }
+
+  int result;
+  if (jobs_flag) {
+    result =
+        detectMarkersInParallel(video_filename, timestamps, params, mmap, args::get(jobs_flag), cache_writer.get());
+  } else {
+    result = detectMarkers(cap, timestamps, params, mmap, step, show, cache_writer.get());
+  }
+  if (cache_writer && result == EXIT_SUCCESS && cache_writer->NumFrames() > 0) {
+    cache_writer->Save(cache_filename);
+  }
+  return result;
 }
@@ -1,12 +1,268 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <cstdio>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <queue>
+#include <thread>
+#include <vector>
 #include <time.h>
 #include <unistd.h>
 
 #include <phil/common/args.h>
 #include <phil/common/common.h>
+#include <phil/common/impairment.h>
+#include <phil/common/shm.h>
 #include <phil/common/udp.h>
 #include <phil/common/csv.h>
 
+using RioReader = io::CSVReader<8>;
+
+/**
+ * @return false at the end of the file
+ */
+bool read_data(RioReader *rio_reader, phil::data_t *data) {
+  double ax, ay, az, yaw, encoder_l, encoder_r, fpga_t;
+  long navx_t;
+  if (!rio_reader->read_row(ax, ay, az, yaw, encoder_l, encoder_r, fpga_t, navx_t)) {
+    return false;
+  }
+  *data = {};
+  data->raw_acc_x = ax;
+  data->raw_acc_y = ay;
+  data->raw_acc_z = az;
+  data->yaw = yaw;
+  data->left_encoder_rate = encoder_l;
+  data->right_encoder_rate = encoder_r;
+  data->fpga_t = fpga_t;
+  data->navx_t = navx_t;
+  return true;
+}
+
+/**
+ * Sends requests without waiting for their replies, over either transport
+ */
+class AsyncClient {
+ public:
+  virtual ~AsyncClient() = default;
+
+  /**
+   * @return false if the request couldn't be sent right now
+   */
+  virtual bool Send(const phil::data_t &data) = 0;
+
+  /**
+   * Waits for the next reply, in whatever order the server sends them
+   * @return false if the timeout expired first
+   */
+  virtual bool Receive(timeval timeout, phil::data_t *reply) = 0;
+};
+
+class AsyncUDPClient : public AsyncClient {
+ public:
+  AsyncUDPClient() : client("localhost") {}
+
+  bool Send(const phil::data_t &data) override {
+    return client.Send(data) == phil::data_t_size;
+  }
+
+  bool Receive(timeval timeout, phil::data_t *reply) override {
+    if (!client.Poll(timeout)) {
+      return false;
+    }
+    return client.Read(reinterpret_cast<uint8_t *>(reply), phil::data_t_size) == phil::data_t_size;
+  }
+
+ private:
+  phil::UDPClient client;
+};
+
+class AsyncShmClient : public AsyncClient {
+ public:
+  AsyncShmClient() : client(phil::kShmName), next_reply(0), published(0) {}
+
+  bool Send(const phil::data_t &data) override {
+    phil::data_t *slot = client.Claim();
+    if (slot == nullptr) {
+      return false;
+    }
+    *slot = data;
+    const uint32_t seq = client.Publish();
+    if (published == 0) {
+      next_reply = seq;
+    }
+    ++published;
+    return true;
+  }
+
+  bool Receive(timeval timeout, phil::data_t *reply) override {
+    // the server answers in order, so the next reply is always for the oldest unanswered request
+    if (published == 0) {
+      return false;
+    }
+    client.SetTimeout(timeout.tv_sec == 0 && timeout.tv_usec == 0 ? timeval{0, 1} : timeout);
+    if (!client.WaitForReply(next_reply, reply)) {
+      return false;
+    }
+    ++next_reply;
+    --published;
+    return true;
+  }
+
+ private:
+  phil::ShmClient client;
+  uint32_t next_reply;
+  uint32_t published;
+};
+
+/**
+ * Replays with up to window requests in flight and reports how fast phil_main keeps up.
+ * @param speed 1 replays at the pace the data was recorded, 2 twice as fast, and 0 as fast as the server accepts
+ * @param reply_timeout_s requests without a reply after this long are counted as lost
+ */
+void replay_pipelined(const std::vector<phil::data_t> &rows,
+                      AsyncClient *client,
+                      size_t window,
+                      double speed,
+                      double reply_timeout_s) {
+  using clock = std::chrono::steady_clock;
+  enum class State { kUnsent, kInFlight, kReplied, kLost };
+
+  if (rows.empty()) {
+    return;
+  }
+
+  std::vector<double> sent_s(rows.size());
+  std::vector<State> states(rows.size(), State::kUnsent);
+  std::vector<double> rtts_ms;
+  rtts_ms.reserve(rows.size());
+  std::deque<uint32_t> in_flight; // in send order, may contain requests already replied to
+  size_t in_flight_count = 0, next = 0, lost = 0, late = 0, duplicates = 0;
+
+  const auto start = clock::now();
+  auto elapsed_s = [&]() { return std::chrono::duration<double>(clock::now() - start).count(); };
+  auto to_timeval = [](double s) {
+    s = std::max(0.0, s);
+    return timeval{static_cast<time_t>(s), static_cast<suseconds_t>(std::fmod(s, 1.0) * 1e6)};
+  };
+
+  while (next < rows.size() || in_flight_count > 0) {
+    double now_s = elapsed_s();
+
+    // give up on the oldest requests
+    while (!in_flight.empty()) {
+      const uint32_t oldest = in_flight.front();
+      if (states[oldest] == State::kInFlight) {
+        if (now_s - sent_s[oldest] < reply_timeout_s) {
+          break;
+        }
+        states[oldest] = State::kLost;
+        ++lost;
+        --in_flight_count;
+      }
+      in_flight.pop_front();
+    }
+
+    double wait_s = in_flight.empty() ? reply_timeout_s : sent_s[in_flight.front()] + reply_timeout_s - now_s;
+    if (next < rows.size() && in_flight_count < window) {
+      const double due_s = speed > 0 ? (rows[next].fpga_t - rows[0].fpga_t) / speed : 0;
+      if (now_s >= due_s) {
+        phil::data_t data = rows[next];
+        data.seq = static_cast<uint32_t>(next);
+        if (client->Send(data)) {
+          sent_s[next] = now_s;
+          states[next] = State::kInFlight;
+          in_flight.push_back(data.seq);
+          ++in_flight_count;
+          ++next;
+          continue;
+        }
+      } else {
+        wait_s = std::min(wait_s, due_s - now_s);
+      }
+    }
+
+    if (in_flight_count == 0) {
+      std::this_thread::sleep_for(std::chrono::duration<double>(std::max(0.0, wait_s)));
+      continue;
+    }
+
+    phil::data_t reply{};
+    if (!client->Receive(to_timeval(wait_s), &reply)) {
+      continue;
+    }
+    if (reply.seq >= rows.size()) {
+      continue;
+    }
+    switch (states[reply.seq]) {
+      case State::kInFlight:
+        states[reply.seq] = State::kReplied;
+        rtts_ms.push_back((elapsed_s() - sent_s[reply.seq]) * 1e3);
+        --in_flight_count;
+        break;
+      case State::kLost:
+        ++late;
+        break;
+      default:
+        ++duplicates;
+        break;
+    }
+  }
+
+  const double total_s = elapsed_s();
+  std::cout << "sent " << next << " packets in " << total_s << "s (" << next / total_s << " packets/s), "
+            << rtts_ms.size() << " replies (" << rtts_ms.size() / total_s << " replies/s)\n"
+            << "lost " << lost << " (" << late << " replies came after the timeout), "
+            << duplicates << " duplicate replies\n";
+
+  if (!rtts_ms.empty()) {
+    std::sort(rtts_ms.begin(), rtts_ms.end());
+    auto percentile = [&](double p) { return rtts_ms[static_cast<size_t>(p * (rtts_ms.size() - 1))]; };
+    std::cout << "rtt ms: p50 " << percentile(0.5)
+              << ", p90 " << percentile(0.9)
+              << ", p99 " << percentile(0.99)
+              << ", max " << rtts_ms.back() << "\n";
+  }
+}
+
+/**
+ * Compares a pose log against one recorded without impairment and prints how far the estimate drifted.
+ * Rows are matched by their index in the replayed CSV.
+ */
+void report_degradation(const std::string &reference_filename, const std::vector<phil::pose_record_t> &poses) {
+  io::CSVReader<4> reference_reader(reference_filename);
+  reference_reader.read_header(io::ignore_extra_column, "row", "x", "y", "theta");
+
+  size_t row, compared = 0;
+  double x, y, theta;
+  double sum_sq_position = 0, sum_sq_theta = 0, max_position = 0, final_position = 0;
+  while (reference_reader.read_row(row, x, y, theta)) {
+    if (row >= poses.size() || poses[row].seq < 0) {
+      continue;
+    }
+    const double position_error = std::hypot(poses[row].x - x, poses[row].y - y);
+    const double theta_error = phil::yaw_diff_rad(poses[row].theta, theta);
+    sum_sq_position += position_error * position_error;
+    sum_sq_theta += theta_error * theta_error;
+    max_position = std::max(max_position, position_error);
+    final_position = position_error;
+    ++compared;
+  }
+
+  if (compared == 0) {
+    std::cerr << "no rows in common with the reference pose log\n";
+    return;
+  }
+
+  std::cout << "compared " << compared << " poses against the reference\n"
+            << "position error rms " << std::sqrt(sum_sq_position / compared) << "m"
+            << ", max " << max_position << "m"
+            << ", final " << final_position << "m\n"
+            << "yaw error rms " << std::sqrt(sum_sq_theta / compared) << "rad\n";
+}
+
 int main(int argc, const char **argv) {
   args::ArgumentParser parser("re-published a CSV file so the phil_main server to run without a real RoboRIO");
   args::HelpFlag help(parser, "help", "Display this help menu", {'h', "help"});
@@ -15,6 +271,46 @@ int main(int argc, const char **argv) {
   args::Flag step_flag(parser, "step", "press enter to publish each line/packet of the data", {'s', "step"});
   args::ValueFlag<unsigned int>
       period_flag(parser, "period", "publish a new packet of data every [period] milliseconds", {'p', "period"});
+  args::Flag shm_flag(parser, "shm", "publish over shared memory to a phil_main started with --shm", {"shm"});
+
+  args::Group pipeline_group(parser, "pipelined replay:");
+  args::ValueFlag<size_t> window_flag
+      (pipeline_group, "window", "keep up to [window] packets in flight instead of waiting for each reply", {"window"});
+  args::ValueFlag<double> speed_flag
+      (pipeline_group,
+       "speed",
+       "replay at [speed] times the recorded pace, or 0 (default) for as fast as phil_main accepts",
+       {"speed"});
+  args::ValueFlag<unsigned int> reply_timeout_flag
+      (pipeline_group, "ms", "count a packet as lost after this long without a reply, default 50", {"reply-timeout"});
+
+  args::Group impairment_group(parser, "network impairment:");
+  args::ValueFlag<unsigned int> seed_flag(impairment_group, "seed", "seed for the impairment, default 0", {"seed"});
+  args::ValueFlag<double> loss_flag(impairment_group, "rate", "probability of losing a packet", {"loss"});
+  args::ValueFlag<double> burst_enter_flag
+      (impairment_group, "rate", "probability per packet of entering a loss burst", {"burst-enter"});
+  args::ValueFlag<double> burst_exit_flag
+      (impairment_group, "rate", "probability per packet of leaving a loss burst, default 1", {"burst-exit"});
+  args::ValueFlag<double> burst_loss_flag
+      (impairment_group, "rate", "probability of losing a packet during a burst, default 1", {"burst-loss"});
+  args::ValueFlag<double> delay_flag(impairment_group, "ms", "mean delay added to each packet", {"delay"});
+  args::ValueFlag<double> jitter_flag(impairment_group, "ms", "spread of the delay", {"jitter"});
+  args::ValueFlag<std::string> jitter_dist_flag
+      (impairment_group, "dist", "distribution of the jitter, normal (default) or exponential", {"jitter-dist"});
+  args::ValueFlag<double> reorder_flag
+      (impairment_group, "rate", "probability of holding a packet back behind later ones", {"reorder"});
+  args::ValueFlag<unsigned int> reorder_window_flag
+      (impairment_group, "packets", "how many later packets overtake a held one, default 3", {"reorder-window"});
+  args::ValueFlag<double> duplicate_flag(impairment_group, "rate", "probability of sending a packet twice", {"dup"});
+
+  args::Group report_group(parser, "estimator degradation:");
+  args::ValueFlag<std::string> pose_log_flag
+      (report_group, "pose_log", "after each row, query phil_main for its latest pose and save it here", {"pose-log"});
+  args::ValueFlag<std::string> reference_flag
+      (report_group,
+       "reference",
+       "pose log of an unimpaired run to compare against, requires --pose-log",
+       {"reference"});
 
   try {
     parser.ParseCLI(argc, argv);
@@ -30,7 +326,30 @@ int main(int argc, const char **argv) {
 
   unsigned int rate = args::get(period_flag);
 
-  io::CSVReader<8> rio_reader(args::get(rio_csv));
+  phil::impairment_config_t impairment_config;
+  impairment_config.seed = args::get(seed_flag);
+  impairment_config.loss_rate = args::get(loss_flag);
+  impairment_config.burst_enter_rate = args::get(burst_enter_flag);
+  impairment_config.burst_exit_rate = burst_exit_flag ? args::get(burst_exit_flag) : 1.0;
+  impairment_config.burst_loss_rate = burst_loss_flag ? args::get(burst_loss_flag) : 1.0;
+  impairment_config.delay_mean_ms = args::get(delay_flag);
+  impairment_config.delay_jitter_ms = args::get(jitter_flag);
+  impairment_config.reorder_rate = args::get(reorder_flag);
+  impairment_config.reorder_window = reorder_window_flag ? args::get(reorder_window_flag) : 3;
+  impairment_config.duplicate_rate = args::get(duplicate_flag);
+  if (jitter_dist_flag
+      && !phil::ParseDelayDistribution(args::get(jitter_dist_flag), &impairment_config.delay_distribution)) {
+    std::cerr << "unknown jitter distribution [" << args::get(jitter_dist_flag) << "]\n";
+    return EXIT_FAILURE;
+  }
+  phil::Impairment impairment(impairment_config);
+
+  if (reference_flag && !pose_log_flag) {
+    std::cerr << "--reference requires --pose-log\n";
+    return EXIT_FAILURE;
+  }
+
+  RioReader rio_reader(args::get(rio_csv));
   rio_reader.read_header(io::ignore_extra_column,
                      "raw_accel_x",
                      "raw_accel_y",
@@ -41,34 +360,157 @@ int main(int argc, const char **argv) {
                      "fpga time",
                      "navx time");
 
-  phil::UDPClient client("localhost");
-  client.SetTimeout({0, 50000});
+  if (window_flag) {
+    const bool impaired = loss_flag || burst_enter_flag || delay_flag || jitter_flag || reorder_flag || duplicate_flag;
+    if (args::get(step_flag) || pose_log_flag || impaired) {
+      std::cerr << "--window can't be combined with --step, --pose-log, or impairments\n";
+      return EXIT_FAILURE;
+    }
 
-  double ax, ay, az, yaw, encoder_l, encoder_r, fpga_t;
-  long navx_t;
-  while (rio_reader.read_row(ax, ay, az, yaw, encoder_l, encoder_r, fpga_t, navx_t)) {
+    std::vector<phil::data_t> rows;
     phil::data_t data{};
-    data.raw_acc_x = ax;
-    data.raw_acc_y = ay;
-    data.raw_acc_z = az;
-    data.yaw = yaw;
-    data.left_encoder_rate = encoder_l;
-    data.right_encoder_rate = encoder_r;
-    data.fpga_t = fpga_t;
-    data.navx_t = navx_t;
-
-    phil::data_t response = client.Transaction(data);
-    phil::print_data_t(response);
+    while (read_data(&rio_reader, &data)) {
+      rows.push_back(data);
+    }
+
+    std::unique_ptr<AsyncClient> async_client;
+    size_t window = std::max<size_t>(1, args::get(window_flag));
+    if (args::get(shm_flag)) {
+      // a request's slot is only free again once its reply has been read, so the ring bounds what can be in flight
+      async_client = std::make_unique<AsyncShmClient>();
+      if (window > phil::kShmRingSize) {
+        std::cerr << "--window is limited to " << phil::kShmRingSize << " over shared memory\n";
+        window = phil::kShmRingSize;
+      }
+    } else {
+      async_client = std::make_unique<AsyncUDPClient>();
+    }
+    const double reply_timeout_s = (reply_timeout_flag ? args::get(reply_timeout_flag) : 50) / 1e3;
+    replay_pipelined(rows, async_client.get(), window, args::get(speed_flag), reply_timeout_s);
+    return EXIT_SUCCESS;
+  }
+
+  // packets go out without waiting for their replies, so delayed packets overlap the way they would on the network
+  std::unique_ptr<AsyncClient> client;
+  if (args::get(shm_flag)) {
+    client = std::make_unique<AsyncShmClient>();
+  } else {
+    client = std::make_unique<AsyncUDPClient>();
+  }
+  const timeval reply_timeout{0, 50000};
+  auto print_replies = [&](timeval timeout) {
+    phil::data_t reply{};
+    while (client->Receive(timeout, &reply)) {
+      phil::print_data_t(reply);
+    }
+  };
+
+  std::ofstream pose_log;
+  std::unique_ptr<phil::UDPClient> pose_query_client;
+  std::vector<phil::pose_record_t> poses;
+  if (pose_log_flag) {
+    pose_log.open(args::get(pose_log_flag));
+    pose_log << "row,x,y,theta,var_x,var_y,var_theta,seq\n";
+    pose_query_client = std::make_unique<phil::UDPClient>("localhost", phil::kPoseQueryPort);
+    pose_query_client->SetTimeout({0, 20000});
+  }
+
+  // each packet is due its delay after it leaves the impairment, so delays overlap instead of adding up, and a packet
+  // with more jitter than the ones behind it gets overtaken
+  using clock = std::chrono::steady_clock;
+  struct pending_packet_t {
+    clock::time_point due;
+    size_t order; // keeps packets that are due at the same time in the order the impairment released them
+    phil::data_t data;
+  };
+  auto later = [](const pending_packet_t &a, const pending_packet_t &b) {
+    return a.due != b.due ? a.due > b.due : a.order > b.order;
+  };
+  std::priority_queue<pending_packet_t, std::vector<pending_packet_t>, decltype(later)> pending(later);
+  size_t pending_order = 0;
+
+  auto deliver = [&](const std::vector<phil::impaired_packet_t> &packets) {
+    const auto now = clock::now();
+    for (const auto &packet : packets) {
+      const auto delay = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double, std::milli>(
+          std::max(0.0, packet.delay_ms)));
+      pending.push({now + delay, pending_order++, packet.data});
+    }
+  };
+
+  // sends every packet due before the deadline as it comes due, printing replies as they arrive, then waits out the
+  // rest of it
+  auto send_until = [&](clock::time_point deadline) {
+    while (!pending.empty() && pending.top().due <= deadline) {
+      std::this_thread::sleep_until(pending.top().due);
+      const phil::data_t data = pending.top().data;
+      pending.pop();
+      // the shm ring only holds so many unanswered requests
+      while (!client->Send(data)) {
+        phil::data_t reply{};
+        if (!client->Receive(reply_timeout, &reply)) {
+          std::cerr << "phil_main isn't replying, dropping a packet\n";
+          break;
+        }
+        phil::print_data_t(reply);
+      }
+      print_replies({0, 0});
+    }
+    std::this_thread::sleep_until(deadline);
+    print_replies({0, 0});
+  };
+  auto send_all = [&]() {
+    while (!pending.empty()) {
+      send_until(pending.top().due);
+    }
+  };
+
+  size_t row = 0;
+  phil::data_t data{};
+  while (read_data(&rio_reader, &data)) {
+    deliver(impairment.Push(data));
+    send_until(clock::now());
+
+    if (pose_query_client) {
+      phil::pose_query_t query{};
+      query.query_id = static_cast<double>(row + 1);
+      phil::pose_record_t pose{};
+      ssize_t bytes_received = pose_query_client->RawTransaction(reinterpret_cast<uint8_t *>(&query),
+                                                                 sizeof(query),
+                                                                 reinterpret_cast<uint8_t *>(&pose),
+                                                                 sizeof(pose));
+      // late answers to earlier queries that timed out are for the wrong row
+      while (bytes_received == sizeof(pose) && pose.query_id != query.query_id) {
+        bytes_received = pose_query_client->Read(reinterpret_cast<uint8_t *>(&pose), sizeof(pose));
+      }
+      if (bytes_received != sizeof(pose)) {
+        pose.seq = -1;
+      }
+      pose_log << row << "," << pose.x << "," << pose.y << "," << pose.theta << "," << pose.var_x << ","
+               << pose.var_y << "," << pose.var_theta << "," << pose.seq << "\n";
+      poses.push_back(pose);
+    }
+    ++row;
 
     if (args::get(step_flag)) {
+      send_all();
       std::cin.get();
     } else if (rate == 0) {
       // do nothing
       continue;
     } else {
-      usleep(rate * 1000);
+      send_until(clock::now() + std::chrono::milliseconds(rate));
     }
   }
 
+  deliver(impairment.Flush());
+  send_all();
+  print_replies(reply_timeout);
+  std::cout << impairment.Summary() << "\n";
+
+  if (reference_flag) {
+    report_degradation(args::get(reference_flag), poses);
+  }
+
   return EXIT_SUCCESS;
 }
@@ -1,7 +1,10 @@
+#include <cmath>
 #include <iostream>
 #include <fstream>
-#include <AHRS.h>
 #include <thread>
+#include <vector>
+
+#include <phil/common/imu.h>
 
 void show_help() {
   std::cout << "USAGE: ./tools/record_imu_calibration_data device number_of_seconds"
@@ -22,10 +25,12 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
-  AHRS navx = AHRS(argv[1], AHRS::SerialDataType::kRawData, 60);
+  auto navx = phil::MakeNavxImuSource(argv[1]);
+  if (!navx) {
+    std::cout << "this build doesn't have the NavX driver." << std::endl;
+    return 1;
+  }
   double num_seconds = std::stof(argv[2]);
-  unsigned int ms_per_sample = 10;
-  auto total_samples = static_cast<unsigned int>(num_seconds * (1000.0 / ms_per_sample));
 
   time_t now = time(0);
   tm *ltm = localtime(&now);
@@ -40,20 +45,27 @@ int main(int argc, char *argv[]) {
 
   log << "accl_x,accel_y,accel_z,gyro_x,gyro_y,gyro_z,time" << std::endl;
 
-  for (unsigned int i = 0; i < total_samples; i++) {
-    // make a reading
-    log << navx.GetRawAccelX() << ","
-        << navx.GetRawAccelY() << ","
-        << navx.GetRawAccelZ() << ","
-        << navx.GetRawGyroX() << ","
-        << navx.GetRawGyroY() << ","
-        << navx.GetRawGyroZ() << ","
-        << navx.GetLastSensorTimestamp()
-        << std::endl;
-
-    // sleep
-    std::this_thread::sleep_for(std::chrono::milliseconds(ms_per_sample));
+  // record every sample the NavX produces, not just whatever is current when we happen to look
+  navx->Start();
+  const auto end = std::chrono::steady_clock::now() + std::chrono::duration<double>(num_seconds);
+  std::vector<phil::imu_sample_t> samples;
+  while (std::chrono::steady_clock::now() < end) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    samples.clear();
+    navx->Drain(&samples);
+    for (const auto &sample : samples) {
+      log << sample.raw_acc_x << ","
+          << sample.raw_acc_y << ","
+          << sample.raw_acc_z << ","
+          << sample.raw_gyro_x << ","
+          << sample.raw_gyro_y << ","
+          << sample.raw_gyro_z << ","
+          << std::lround(sample.sensor_time_s * 1e3)
+          << "\n";
+    }
   }
+  navx->Stop();
 
   return 0;
 }
@@ -1,18 +1,23 @@
+#include <chrono>
+#include <cmath>
 #include <iostream>
-#define M_PI 3.1415926535
-
+#include <memory>
 
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
 
-static constexpr unsigned short maxR = 400, maxT = 2250;
-static constexpr unsigned short midX = 320, midY = 240;
+#include <phil/common/polar_unwarp.h>
 
 int main(int argc, const char **argv) {
   cv::VideoCapture capture;
-  cv::Mat log_polar_img;
 
-  cv::CommandLineParser parser(argc, argv, "{@input|0|}");
+  cv::CommandLineParser parser(argc, argv,
+                               "{@input|0|}"
+                               "{cx|320|center of the image circle}"
+                               "{cy|240|center of the image circle}"
+                               "{min-radius|0|inner edge of the band to unwarp}"
+                               "{max-radius|400|outer edge of the band to unwarp}"
+                               "{width|2250|samples along the angle}");
   std::string arg = parser.get<std::string>("@input");
 
   if (arg.size() == 1 && isdigit(arg[0]))
@@ -20,34 +25,48 @@ int main(int argc, const char **argv) {
   else
     capture.open(arg.c_str());
 
-  bool done = false;
+  cv::Mat frame;
+  capture >> frame;
+  if (frame.empty()) {
+    std::cerr << "failed to read from [" << arg << "]\n";
+    return EXIT_FAILURE;
+  }
 
-  cv::Mat map_x;
-  cv::Mat map_y;
+  phil::polar_unwarp_config_t config{};
+  config.src_width = frame.cols;
+  config.src_height = frame.rows;
+  config.src_step = 1;
+  config.center_x = parser.get<float>("cx");
+  config.center_y = parser.get<float>("cy");
+  config.min_radius = parser.get<float>("min-radius");
+  config.max_radius = parser.get<float>("max-radius");
+  config.min_angle_rad = 0;
+  config.max_angle_rad = static_cast<float>(2 * M_PI);
+  config.out_width = parser.get<int>("width");
+  config.out_height = static_cast<int>(config.max_radius - config.min_radius);
 
-  map_x.create(maxR, maxT, CV_32FC1);
-  map_y.create(maxR, maxT, CV_32FC1);
+  cv::Mat gray;
+  cv::Mat unwarped_frame(config.out_height, config.out_width, CV_8UC1);
+  std::unique_ptr<phil::PolarUnwarper> unwarper;
 
-  for (int x = 0; x < maxT; x++) {
-    const double radians = static_cast<float>(x) / maxT * 2 * M_PI;
-    for (int y = 0; y < maxR; y++) {
-      map_y.at<float>(maxR - y - 1, x) = midY + y * static_cast<float>(sin(radians));
-      map_x.at<float>(maxR - y - 1, x) = midX + y * static_cast<float>(cos(radians));
+  while (!frame.empty()) {
+    cv::cvtColor(frame, gray, cv::COLOR_BGR2GRAY);
+    if (!unwarper) {
+      config.src_stride = gray.step;
+      unwarper = std::make_unique<phil::PolarUnwarper>(config);
     }
-  }
 
-  while (!done) {
-    cv::Mat frame;
-    capture >> frame;
-
-    cv::Mat unwarped_frame;
-    cv::remap(frame, unwarped_frame, map_x, map_y, CV_INTER_LINEAR);
+    const auto t0 = std::chrono::steady_clock::now();
+    unwarper->Unwarp(gray.data, unwarped_frame.data);
+    const auto t1 = std::chrono::steady_clock::now();
+    std::cout << "unwarp took " << std::chrono::duration<double, std::milli>(t1 - t0).count() << " ms\n";
 
     cv::imshow("unwarped image", unwarped_frame);
     cv::imshow("raw image", frame);
     if (cv::waitKey(10) == 'q') {
       break;
     }
+    capture >> frame;
   }
 
   return EXIT_SUCCESS;